@@ -0,0 +1,618 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../common/network_node.h"
+#include "../common/packet.h"
+#include "../common/ring.h"
+#include "../common/trace.h"
+#include "../server_code/clients.h"
+#include "../server_code/resource.h"
+#include "microbench.h"
+
+// packet.h
+extern struct PacketDelimiters packetDelimiters;
+
+// Allocator functions, wrapped at link time so allocations can be counted
+void* __real_malloc(size_t);
+void* __real_calloc(size_t, size_t);
+void* __real_realloc(void*, size_t);
+
+// Only allocations made while the timer is running are counted
+bool benchTimerRunning;
+unsigned long benchTimerStart;
+struct BenchResult currentResult;
+
+// Results from a previous run to compare against
+FILE* baselineFile;
+
+// Main function
+int main(int argc, char* argv[]) {
+  char* filter = "";
+  int option;
+  while ((option = getopt(argc, argv, "b:f:")) != -1) {
+    switch (option) {
+    case 'b':
+      baselineFile = fopen(optarg, "r");
+      if (baselineFile == NULL) {
+        perror("Error opening baseline");
+      }
+      break;
+    case 'f':
+      filter = optarg;
+      break;
+    default:
+      printf("Usage: %s [-b baseline file] [-f name filter]\n", argv[0]);
+      exit(1);
+    }
+  }
+
+  // Some of the code being measured prints to stdout. Keep the results on the real
+  // stdout and send everything else to /dev/null so printing isn't measured.
+  FILE* resultStream = fdopen(dup(STDOUT_FILENO), "w");
+  if (resultStream == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+    perror("Error redirecting stdout");
+    exit(1);
+  }
+  // Give this thread its trace ring now so allocating it isn't counted
+  TRACE(TRACE_PACKET_BUILT, 0, 0);
+
+  fprintf(resultStream, "# %-50s %10s %10s %10s %10s\n", "benchmark", "iterations",
+          "ns/op", "allocs/op", "bytes/op");
+
+  const char* packetTypeNames[] = {"connection", "status", "lookup", "invalid"};
+  int fieldCounts[]             = {1, 4, 8};
+  int filenameLengths[]         = {8, 20};
+  int directorySizes[]          = {10, 1000, 100000};
+  char name[128];
+  int i;
+  int j;
+
+  for (i = 0; i < 4; i++) {
+    snprintf(name, sizeof(name), "getPacketType/type=%s", packetTypeNames[i]);
+    struct BenchParameters parameters = {0, 0, 0};
+    // Type is passed through the filename length so it can be looked up by index
+    parameters.filenameLength = i;
+    if (strstr(name, filter) != NULL) {
+      runBenchmark(name, benchGetPacketType, parameters);
+      printBenchResult(&currentResult, resultStream);
+    }
+  }
+
+  BenchFunction codecFunctions[] = {benchBuildPacket, benchReadPacket,
+                                    benchReadPacketSubfield};
+  const char* codecNames[]       = {"buildPacket", "readPacket", "readPacketSubfield"};
+  int function;
+  for (function = 0; function < 3; function++) {
+    for (i = 0; i < 3; i++) {
+      for (j = 0; j < 2; j++) {
+        snprintf(name, sizeof(name), "%s/fields=%d/filename=%d", codecNames[function],
+                 fieldCounts[i], filenameLengths[j]);
+        struct BenchParameters parameters = {fieldCounts[i], filenameLengths[j], 0};
+        if (strstr(name, filter) != NULL) {
+          runBenchmark(name, codecFunctions[function], parameters);
+          printBenchResult(&currentResult, resultStream);
+        }
+      }
+    }
+  }
+
+  BenchFunction directoryFunctions[] = {
+      benchAddResource,         benchMakeResourceString, benchMakeCompressedResourceString,
+      benchRemoveUserResources, benchFindResourceOwners, benchMakeSubstringSearchString};
+  const char* directoryNames[] = {"addResource",         "makeResourceString",
+                                  "makeCompressedResourceString",
+                                  "removeUserResources", "findResourceOwners",
+                                  "makeSubstringSearchString"};
+  for (function = 0; function < 6; function++) {
+    for (i = 0; i < 3; i++) {
+      for (j = 0; j < 2; j++) {
+        snprintf(name, sizeof(name), "%s/directory=%d/filename=%d",
+                 directoryNames[function], directorySizes[i], filenameLengths[j]);
+        struct BenchParameters parameters = {0, filenameLengths[j], directorySizes[i]};
+        if (strstr(name, filter) != NULL) {
+          runBenchmark(name, directoryFunctions[function], parameters);
+          printBenchResult(&currentResult, resultStream);
+        }
+      }
+    }
+  }
+
+  int summaryCounts[] = {10, 1000};
+  for (i = 0; i < 2; i++) {
+    snprintf(name, sizeof(name), "nextPossibleOwner/summaries=%d", summaryCounts[i]);
+    struct BenchParameters parameters = {0, 20, summaryCounts[i]};
+    if (strstr(name, filter) != NULL) {
+      runBenchmark(name, benchNextPossibleOwner, parameters);
+      printBenchResult(&currentResult, resultStream);
+    }
+  }
+
+  int clientCounts[] = {1000, MAX_CONNECTED_CLIENTS};
+  for (i = 0; i < 2; i++) {
+    snprintf(name, sizeof(name), "heartbeatSweep/clients=%d", clientCounts[i]);
+    struct BenchParameters parameters = {0, 0, clientCounts[i]};
+    if (strstr(name, filter) != NULL) {
+      runBenchmark(name, benchHeartbeatSweep, parameters);
+      printBenchResult(&currentResult, resultStream);
+    }
+  }
+
+  const char* ringTypes[] = {"spsc", "mpmc"};
+  for (i = 0; i < 2; i++) {
+    snprintf(name, sizeof(name), "ringHandoff/type=%s", ringTypes[i]);
+    // Type is passed through the directory size, 0 for SPSC and 1 for MPMC
+    struct BenchParameters parameters = {0, 0, i};
+    if (strstr(name, filter) != NULL) {
+      runBenchmark(name, benchRingHandoff, parameters);
+      printBenchResult(&currentResult, resultStream);
+    }
+  }
+
+  fclose(resultStream);
+  if (baselineFile != NULL) {
+    fclose(baselineFile);
+  }
+  return 0;
+}
+
+void* __wrap_malloc(size_t size) {
+  if (benchTimerRunning) {
+    currentResult.allocations++;
+    currentResult.bytes += size;
+  }
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+  if (benchTimerRunning) {
+    currentResult.allocations++;
+    currentResult.bytes += count * size;
+  }
+  return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* pointer, size_t size) {
+  if (benchTimerRunning) {
+    currentResult.allocations++;
+    currentResult.bytes += size;
+  }
+  return __real_realloc(pointer, size);
+}
+
+/*
+ * Purpose: Start, or resume, timing the current benchmark. Work done while the timer
+ * is stopped, like setting up inputs, isn't counted.
+ * Input: None
+ * Output: None
+ */
+void startBenchTimer() {
+  benchTimerStart   = getNanoseconds();
+  benchTimerRunning = true;
+}
+
+/*
+ * Purpose: Stop timing the current benchmark
+ * Input: None
+ * Output: None
+ */
+void stopBenchTimer() {
+  benchTimerRunning = false;
+  currentResult.nanoseconds += getNanoseconds() - benchTimerStart;
+}
+
+/*
+ * Purpose: Run a benchmark with more and more iterations until it runs long enough
+ * to give a stable time per operation. The result is left in currentResult.
+ * Input:
+ * - Name of the benchmark
+ * - Function that runs the benchmark a number of times
+ * - Parameters to run it with
+ * Output: None
+ */
+void runBenchmark(char* name, BenchFunction benchFunction, struct BenchParameters parameters) {
+  unsigned long iterations = 1;
+  while (1) {
+    memset(&currentResult, 0, sizeof(currentResult));
+    strncpy(currentResult.name, name, sizeof(currentResult.name) - 1);
+    currentResult.iterations = iterations;
+    benchFunction(&parameters, iterations);
+
+    if (currentResult.nanoseconds >= BENCH_TARGET_TIME ||
+        iterations >= BENCH_MAX_ITERATIONS) {
+      return;
+    }
+
+    // Aim a bit past the target, grow by at most 100x at a time
+    unsigned long nextIterations = iterations * 100;
+    if (currentResult.nanoseconds > 0) {
+      unsigned long predicted =
+          BENCH_TARGET_TIME / currentResult.nanoseconds * iterations * 6 / 5 + 1;
+      if (predicted < nextIterations) {
+        nextIterations = predicted;
+      }
+    }
+    if (nextIterations <= iterations) {
+      nextIterations = iterations + 1;
+    }
+    if (nextIterations > BENCH_MAX_ITERATIONS) {
+      nextIterations = BENCH_MAX_ITERATIONS;
+    }
+    iterations = nextIterations;
+  }
+}
+
+/*
+ * Purpose: Print the result of a benchmark, compared to the baseline if there is one
+ * Input:
+ * - The result
+ * - Where to print it
+ * Output: None
+ */
+void printBenchResult(struct BenchResult* result, FILE* resultStream) {
+  double iterations = (double)result->iterations;
+  fprintf(resultStream, "%-52s %10lu %10.1f %10.2f %10.1f", result->name,
+          result->iterations, (double)result->nanoseconds / iterations,
+          (double)result->allocations / iterations, (double)result->bytes / iterations);
+  compareToBaseline(result, resultStream);
+  fprintf(resultStream, "\n");
+  fflush(resultStream);
+}
+
+/*
+ * Purpose: Find a benchmark in the baseline results and print how its time and
+ * allocations per operation changed since then
+ * Input:
+ * - The result
+ * - Where to print the comparison
+ * Output: None
+ */
+void compareToBaseline(struct BenchResult* result, FILE* resultStream) {
+  if (baselineFile == NULL) {
+    return;
+  }
+  rewind(baselineFile);
+  char line[256];
+  while (fgets(line, sizeof(line), baselineFile) != NULL) {
+    char baselineName[128];
+    unsigned long baselineIterations;
+    double baselineTime;
+    double baselineAllocations;
+    double baselineBytes;
+    if (line[0] == '#' || sscanf(line, "%127s %lu %lf %lf %lf", baselineName,
+                                 &baselineIterations, &baselineTime,
+                                 &baselineAllocations, &baselineBytes) != 5) {
+      continue;
+    }
+    if (strcmp(baselineName, result->name) != 0) {
+      continue;
+    }
+    double iterations = (double)result->iterations;
+    double time       = (double)result->nanoseconds / iterations;
+    if (baselineTime > 0) {
+      fprintf(resultStream, "  time %+6.1f%%", (time - baselineTime) / baselineTime * 100);
+    }
+    fprintf(resultStream, "  allocs %+.2f",
+            (double)result->allocations / iterations - baselineAllocations);
+    return;
+  }
+}
+
+/*
+ * Purpose: Make a packet data field out of subfields that look like filenames
+ * Input:
+ * - Where to put the data field, MAX_DATA bytes
+ * - Number of subfields
+ * - Length of each subfield
+ * Output: None
+ */
+static void makeDataField(char* data, int fieldCount, int filenameLength) {
+  memset(data, 0, MAX_DATA);
+  int i;
+  for (i = 0; i < fieldCount; i++) {
+    size_t dataLength = strlen(data);
+    if (dataLength + (size_t)filenameLength + 1 >= MAX_DATA) {
+      break;
+    }
+    memset(data + dataLength, 'a' + i % 26, (size_t)filenameLength);
+    data[dataLength + (size_t)filenameLength] = packetDelimiters.subfield[0];
+  }
+}
+
+/*
+ * Purpose: Build a resource directory the way the server does. Resources are spread
+ * evenly over BENCH_USERS users.
+ * Input:
+ * - Directory to fill, initialized here
+ * - Number of resources
+ * - Length of each filename
+ * Output: None
+ */
+static void makeDirectory(struct ResourceDirectory* directory,
+                          int directorySize,
+                          int filenameLength) {
+  initResourceDirectory(directory);
+  char username[MAX_USERNAME];
+  char filename[MAX_FILENAME];
+  int i;
+  for (i = 0; i < directorySize; i++) {
+    snprintf(username, sizeof(username), "user%d", i % BENCH_USERS);
+    snprintf(filename, sizeof(filename), "%0*d", filenameLength, i);
+    addResource(directory, username, filename);
+  }
+}
+
+void benchGetPacketType(struct BenchParameters* parameters, unsigned long iterations) {
+  const char* packetTypeNames[] = {"connection", "status", "lookup", "invalid"};
+  char packetType[MAX_PACKET_TYPE];
+  strcpy(packetType, packetTypeNames[parameters->filenameLength]);
+
+  volatile int result = 0;
+  unsigned long i;
+  startBenchTimer();
+  for (i = 0; i < iterations; i++) {
+    result += getPacketType(packetType, false);
+  }
+  stopBenchTimer();
+}
+
+void benchBuildPacket(struct BenchParameters* parameters, unsigned long iterations) {
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "connection");
+  makeDataField(packetFields.data, parameters->fieldCount, parameters->filenameLength);
+  char* packet = calloc(1, MAX_PACKET + MAX_PACKET_TYPE);
+
+  unsigned long i;
+  startBenchTimer();
+  for (i = 0; i < iterations; i++) {
+    buildPacket(packet, packetFields, false);
+  }
+  stopBenchTimer();
+  free(packet);
+}
+
+void benchReadPacket(struct BenchParameters* parameters, unsigned long iterations) {
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "connection");
+  makeDataField(packetFields.data, parameters->fieldCount, parameters->filenameLength);
+  char* packet = calloc(1, MAX_PACKET + MAX_PACKET_TYPE);
+  buildPacket(packet, packetFields, false);
+
+  unsigned long i;
+  startBenchTimer();
+  for (i = 0; i < iterations; i++) {
+    memset(&packetFields, 0, sizeof(packetFields));
+    readPacket(packet, &packetFields, false);
+  }
+  stopBenchTimer();
+  free(packet);
+}
+
+void benchReadPacketSubfield(struct BenchParameters* parameters,
+                             unsigned long iterations) {
+  char data[MAX_DATA];
+  makeDataField(data, parameters->fieldCount, parameters->filenameLength);
+  char subfield[MAX_DATA];
+
+  unsigned long i;
+  startBenchTimer();
+  for (i = 0; i < iterations; i++) {
+    char* field = data;
+    while (*field != '\0') {
+      memset(subfield, 0, strlen(subfield));
+      field = readPacketSubfield(field, subfield, sizeof(subfield), false);
+    }
+  }
+  stopBenchTimer();
+}
+
+void benchAddResource(struct BenchParameters* parameters, unsigned long iterations) {
+  struct ResourceDirectory directory;
+  makeDirectory(&directory, parameters->directorySize, parameters->filenameLength);
+  char username[MAX_USERNAME];
+  char filename[MAX_FILENAME];
+
+  unsigned long i;
+  startBenchTimer();
+  for (i = 0; i < iterations; i++) {
+    unsigned long resource = (unsigned long)parameters->directorySize + i;
+    snprintf(username, sizeof(username), "user%lu", resource % BENCH_USERS);
+    snprintf(filename, sizeof(filename), "%0*lu", parameters->filenameLength, resource);
+    addResource(&directory, username, filename);
+  }
+  stopBenchTimer();
+  freeResourceDirectory(&directory);
+}
+
+void benchMakeResourceString(struct BenchParameters* parameters,
+                             unsigned long iterations) {
+  struct ResourceDirectory directory;
+  makeDirectory(&directory, parameters->directorySize, parameters->filenameLength);
+
+  unsigned long i;
+  startBenchTimer();
+  for (i = 0; i < iterations; i++) {
+    char* resourceString = calloc(1, MAX_DATA);
+    makeResourceString(resourceString, &directory, packetDelimiters.subfield);
+    free(resourceString);
+  }
+  stopBenchTimer();
+  freeResourceDirectory(&directory);
+}
+
+void benchMakeCompressedResourceString(struct BenchParameters* parameters,
+                                       unsigned long iterations) {
+  struct ResourceDirectory directory;
+  makeDirectory(&directory, parameters->directorySize, parameters->filenameLength);
+
+  // Page through the directory over and over. Only the first page sorts it.
+  unsigned long i;
+  unsigned long startIndex = 0;
+  startBenchTimer();
+  for (i = 0; i < iterations; i++) {
+    char* resourceString = calloc(1, MAX_DATA);
+    startIndex           = makeCompressedResourceString(
+        resourceString, &directory, startIndex, packetDelimiters.subfield[0]);
+    if (startIndex >= (unsigned long)parameters->directorySize) {
+      startIndex = 0;
+    }
+    free(resourceString);
+  }
+  stopBenchTimer();
+  freeResourceDirectory(&directory);
+}
+
+void benchRemoveUserResources(struct BenchParameters* parameters,
+                              unsigned long iterations) {
+  unsigned long i;
+  for (i = 0; i < iterations; i++) {
+    struct ResourceDirectory directory;
+    makeDirectory(&directory, parameters->directorySize, parameters->filenameLength);
+    startBenchTimer();
+    removeUserResources(&directory, "user0", false);
+    stopBenchTimer();
+    freeResourceDirectory(&directory);
+  }
+}
+
+void benchFindResourceOwners(struct BenchParameters* parameters,
+                             unsigned long iterations) {
+  struct ResourceDirectory directory;
+  makeDirectory(&directory, parameters->directorySize, parameters->filenameLength);
+  char filename[MAX_FILENAME];
+
+  volatile int ownerCount = 0;
+  int found;
+  unsigned long i;
+  startBenchTimer();
+  for (i = 0; i < iterations; i++) {
+    snprintf(filename, sizeof(filename), "%0*lu", parameters->filenameLength,
+             i % (unsigned long)parameters->directorySize);
+    findResourceOwners(&directory, filename, &found);
+    ownerCount = found;
+  }
+  stopBenchTimer();
+  (void)ownerCount;
+  freeResourceDirectory(&directory);
+}
+
+// Filenames are all digits, so the few trigrams there are each have long posting
+// lists, the hard case for the index. The substring is the last four digits of one.
+void benchMakeSubstringSearchString(struct BenchParameters* parameters,
+                                    unsigned long iterations) {
+  struct ResourceDirectory directory;
+  makeDirectory(&directory, parameters->directorySize, parameters->filenameLength);
+  char filename[MAX_FILENAME];
+  char* searchString = calloc(1, MAX_DATA);
+
+  unsigned long i;
+  startBenchTimer();
+  for (i = 0; i < iterations; i++) {
+    snprintf(filename, sizeof(filename), "%0*lu", parameters->filenameLength,
+             i % (unsigned long)parameters->directorySize);
+    makeSubstringSearchString(searchString, &directory,
+                              filename + parameters->filenameLength - 4, '&');
+  }
+  stopBenchTimer();
+  free(searchString);
+  freeResourceDirectory(&directory);
+}
+
+// Each user registered a summary of BENCH_SUMMARY_FILES files. Every filter is
+// checked for each lookup, most of them without finding the file.
+void benchNextPossibleOwner(struct BenchParameters* parameters,
+                            unsigned long iterations) {
+  struct ResourceDirectory directory;
+  initResourceDirectory(&directory);
+  char username[MAX_USERNAME];
+  char filename[MAX_FILENAME];
+  int i;
+  int j;
+  for (i = 0; i < parameters->directorySize; i++) {
+    snprintf(username, sizeof(username), "user%d", i);
+    addResourceSummary(&directory, username, BLOOM_MIN_CELLS * 16);
+    struct ResourceSummary* summary = findResourceSummary(&directory, username);
+    for (j = 0; j < BENCH_SUMMARY_FILES; j++) {
+      snprintf(filename, sizeof(filename), "%0*d", parameters->filenameLength,
+               i * BENCH_SUMMARY_FILES + j);
+      addBloomKey(&summary->filter, filename);
+    }
+  }
+
+  volatile int ownerCount = 0;
+  unsigned long k;
+  startBenchTimer();
+  for (k = 0; k < iterations; k++) {
+    snprintf(filename, sizeof(filename), "%0*lu", parameters->filenameLength,
+             k % ((unsigned long)parameters->directorySize * BENCH_SUMMARY_FILES));
+    unsigned int index = 0;
+    while (nextPossibleOwner(&directory, filename, &index) != NULL) {
+      ownerCount++;
+    }
+  }
+  stopBenchTimer();
+  (void)ownerCount;
+  freeResourceDirectory(&directory);
+}
+
+// The client table is global, so it is filled and emptied again on every run. The
+// clients never answer, so after the first round nothing is probed, but the sweep
+// reads every word of the bitsets either way.
+void benchHeartbeatSweep(struct BenchParameters* parameters, unsigned long iterations) {
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  char username[MAX_USERNAME];
+  int i;
+  for (i = 0; i < parameters->directorySize; i++) {
+    address.sin_addr.s_addr = (unsigned int)i;
+    address.sin_port        = (unsigned short)(i % 50000 + 1);
+    snprintf(username, sizeof(username), "user%d", i);
+    addConnectedClient(address, username);
+  }
+
+  volatile unsigned long expired = 0;
+  unsigned long j;
+  startBenchTimer();
+  for (j = 0; j < iterations; j++) {
+    startHeartbeatRound();
+    expired = findExpiredClients();
+  }
+  stopBenchTimer();
+  (void)expired;
+
+  int clientIndex;
+  for (clientIndex = nextConnectedClient(0); clientIndex != -1;
+       clientIndex = nextConnectedClient(clientIndex + 1)) {
+    removeConnectedClient(clientIndex);
+  }
+}
+
+// A packet is pushed and popped on the same thread, so this is the cost of the
+// handoff between pipeline stages without any contention on the ring
+void benchRingHandoff(struct BenchParameters* parameters, unsigned long iterations) {
+  struct SpscRing spscRing;
+  struct MpmcRing mpmcRing;
+  initSpscRing(&spscRing, 1024, MAX_PACKET);
+  initMpmcRing(&mpmcRing, 1024, MAX_PACKET);
+  char packet[MAX_PACKET];
+  memset(packet, 'x', sizeof(packet));
+
+  unsigned long i;
+  startBenchTimer();
+  for (i = 0; i < iterations; i++) {
+    if (parameters->directorySize == 0) {
+      pushSpscRing(&spscRing, packet);
+      popSpscRing(&spscRing, packet);
+    } else {
+      pushMpmcRing(&mpmcRing, packet);
+      popMpmcRing(&mpmcRing, packet);
+    }
+  }
+  stopBenchTimer();
+
+  freeSpscRing(&spscRing);
+  freeMpmcRing(&mpmcRing);
+}
@@ -0,0 +1,58 @@
+#ifndef MICROBENCH_H
+#define MICROBENCH_H
+
+// Nanoseconds each benchmark is run for, at least
+#define BENCH_TARGET_TIME 200000000UL
+
+// Most iterations a single benchmark is run for. Keeps the directory benchmarks from
+// growing the directory without bound.
+#define BENCH_MAX_ITERATIONS 2000000UL
+
+// Number of users the resources are spread over in the directory benchmarks
+#define BENCH_USERS 10
+
+// Files in each summary in the summary benchmarks
+#define BENCH_SUMMARY_FILES 1000
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// Parameters a benchmark is run with. Not every benchmark uses every parameter.
+struct BenchParameters {
+  int fieldCount;
+  int filenameLength;
+  int directorySize;
+};
+
+// Measurements of a single benchmark
+struct BenchResult {
+  char name[128];
+  unsigned long iterations;
+  unsigned long nanoseconds;
+  unsigned long allocations;
+  unsigned long bytes;
+};
+
+typedef void (*BenchFunction)(struct BenchParameters*, unsigned long);
+
+void startBenchTimer();
+void stopBenchTimer();
+void runBenchmark(char*, BenchFunction, struct BenchParameters);
+void printBenchResult(struct BenchResult*, FILE*);
+void compareToBaseline(struct BenchResult*, FILE*);
+
+void benchGetPacketType(struct BenchParameters*, unsigned long);
+void benchBuildPacket(struct BenchParameters*, unsigned long);
+void benchReadPacket(struct BenchParameters*, unsigned long);
+void benchReadPacketSubfield(struct BenchParameters*, unsigned long);
+void benchAddResource(struct BenchParameters*, unsigned long);
+void benchMakeResourceString(struct BenchParameters*, unsigned long);
+void benchMakeCompressedResourceString(struct BenchParameters*, unsigned long);
+void benchRemoveUserResources(struct BenchParameters*, unsigned long);
+void benchFindResourceOwners(struct BenchParameters*, unsigned long);
+void benchMakeSubstringSearchString(struct BenchParameters*, unsigned long);
+void benchNextPossibleOwner(struct BenchParameters*, unsigned long);
+void benchHeartbeatSweep(struct BenchParameters*, unsigned long);
+void benchRingHandoff(struct BenchParameters*, unsigned long);
+
+#endif
@@ -1,34 +1,31 @@
-#include <dirent.h>
+#include <arpa/inet.h>
 #include <errno.h>
-#include <fcntl.h>
-#include <netdb.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <sys/stat.h>
-#include <sys/types.h>
+#include <sys/select.h>
 #include <unistd.h>
 
 #include "../common/network_node.h"
-#include "../common/packet.h"
+#include "../common/stats.h"
+#include "../common/trace.h"
 #include "client.h"
+#include "client_library.h"
 
 // Global so that signal handler can free resources
-int udpSocketDescriptor;
-int tcpSocketDescriptor;
-char* packet;
+struct ClientContext clientContext;
+int statsSocketDescriptor;
 
-// Packet delimiters that are constant for all packets
-// See packet.h & packet.c
-extern struct PacketDelimiters packetDelimiters;
+// User of the last resource printed, each user is only printed before their first file
+char listedUsername[MAX_USERNAME];
 
 // Main
 int main(int argc, char* argv[]) {
   // Assign callback function to handle ctrl-c
   signal(SIGINT, shutdownClient);
+  installTraceHandlers("client");
 
   // Address of server (UDP)
   struct sockaddr_in serverAddress;
@@ -37,288 +34,309 @@ int main(int argc, char* argv[]) {
   serverAddress.sin_port        = htons(PORT);
   serverAddress.sin_addr.s_addr = INADDR_ANY;
 
-  // Local UDP port
-  struct sockaddr_in hostUdpAddress;
-  memset(&hostUdpAddress, 0, sizeof(hostUdpAddress));
-  bool bindFlag       = false;
-  udpSocketDescriptor = setupUdpSocket(hostUdpAddress, bindFlag);
+  bool debugFlag           = false;
+  unsigned long totalRate  = 0;
+  unsigned long uploadRate = 0;
+  unsigned long seedQuota  = 0;
+  bool summaryMode         = false;
+  bool uringFlag           = false;
+  argc = checkSharingArguments(argc, argv, &totalRate, &uploadRate, &seedQuota,
+                               &summaryMode);
+  checkCommandLineArguments(argc, argv, &debugFlag, &uringFlag);
 
-  // Local TCP port
-  struct sockaddr_in hostTcpAddress;
-  memset(&hostTcpAddress, 0, sizeof(hostTcpAddress));
-  hostTcpAddress.sin_port = 0; // Wildcard
-  tcpSocketDescriptor     = setupTcpSocket(hostTcpAddress);
-
-  hostTcpAddress = getTcpSocketInfo();
+  char* username = calloc(1, MAX_USERNAME);
+  setUsername(username);
+  initClientContext(&clientContext, username, serverAddress, NULL, NULL, debugFlag);
+  setUploadRates(&clientContext, totalRate, uploadRate);
+  setSeedQuota(&clientContext, seedQuota);
+  setSummaryMode(&clientContext, summaryMode);
+  if (uringFlag) {
+    if (useFileUring(&clientContext) == 0) {
+      printf("Using io_uring for uploaded file reads\n");
+    } else {
+      printf("io_uring not available, reading files with read()\n");
+    }
+  }
+  free(username);
 
-  bool debugFlag = false;
-  checkCommandLineArguments(argc, argv, &debugFlag);
+  // Everything the client hears back about is printed
+  clientContext.callbacks.onResource   = printResource;
+  clientContext.callbacks.onListingEnd = printListingEnd;
+  clientContext.callbacks.onLookup     = printLookup;
+  clientContext.callbacks.onSearch     = printSearch;
+  clientContext.callbacks.onFind       = printFind;
+  clientContext.callbacks.onDownload   = printDownload;
 
-  if (sendConnectionPacket(hostTcpAddress, serverAddress, debugFlag) == -1) {
+  if (connectClient(&clientContext) == -1) {
     printf("Error sending connection packet\n");
   }
 
-  fd_set read_fds;
-  packet = calloc(1, MAX_PACKET);
+  statsSocketDescriptor = setupStatsSocket(CLIENT_STATS_PATH);
+
+  fd_set readSet;
+  fd_set writeSet;
 
   // Loop to handle user input and incoming packets
   while (1) {
-    // Use select to handle user input and server messages simultaneously
-    FD_ZERO(&read_fds);
-    FD_SET(0, &read_fds);                   // 0 is stdin (for user input)
-    FD_SET(udpSocketDescriptor, &read_fds); // The socket for receiving server messages
+    // Use select to handle user input, packets and transfers simultaneously
+    FD_ZERO(&readSet);
+    FD_ZERO(&writeSet);
+    FD_SET(0, &readSet); // 0 is stdin (for user input)
+    int maxDescriptor = 0;
+    if (statsSocketDescriptor != -1) {
+      FD_SET(statsSocketDescriptor, &readSet); // Someone wants to read the stats
+      maxDescriptor = statsSocketDescriptor;
+    }
+    maxDescriptor =
+        addClientDescriptors(&clientContext, &readSet, &writeSet, maxDescriptor);
+
+    // Wake up in time for the next gossip round, retransmission or transfer check
+    struct timeval timeout;
+    unsigned long waitTime = getClientTimeout(&clientContext);
+    timeout.tv_sec         = (long)(waitTime / 1000000);
+    timeout.tv_usec        = (long)(waitTime % 1000000);
+
+    int activity = select(maxDescriptor + 1, &readSet, &writeSet, NULL, &timeout);
 
-    int activity = select(udpSocketDescriptor + 1, &read_fds, NULL, NULL, NULL);
+    if (activity < 0) {
+      if (errno != EINTR) {
+        perror("select error");
+      }
+      FD_ZERO(&readSet);
+      FD_ZERO(&writeSet);
+    }
+
+    processClient(&clientContext, &readSet, &writeSet);
+
+    if (activity <= 0) {
+      continue;
+    }
 
-    if (activity < 0 && errno != EINTR) {
-      perror("select error");
+    if (statsSocketDescriptor != -1 && FD_ISSET(statsSocketDescriptor, &readSet)) {
+      checkStatsSocket(statsSocketDescriptor);
     }
 
     // User input
-    if (FD_ISSET(0, &read_fds)) {
+    if (FD_ISSET(0, &readSet)) {
       char* userInput = calloc(1, MAX_USER_INPUT);
       getUserInput(userInput);
 
       if (strcmp(userInput, "resources") == 0) {
-        sendResourcePacket(serverAddress, debugFlag);
+        requestResources(&clientContext);
       }
 
-      // User just pressed return
-      if (strlen(userInput) == 0) {
-        free(userInput);
-        continue;
+      if (strcmp(userInput, "directory") == 0) {
+        printGossipDirectory(&clientContext.gossipState);
       }
-      free(userInput);
-    }
 
-    // No message in UDP queue
-    if (!(FD_ISSET(udpSocketDescriptor, &read_fds))) {
-      continue;
-    }
+      if (strncmp(userInput, "lookup ", 7) == 0 &&
+          requestLookup(&clientContext, userInput + 7) == -1) {
+        printf("Invalid filename\n");
+      }
+
+      if (strncmp(userInput, "search ", 7) == 0 &&
+          requestSearch(&clientContext, userInput + 7) == -1) {
+        printf("Invalid prefix\n");
+      }
+
+      if (strncmp(userInput, "find ", 5) == 0 &&
+          requestFind(&clientContext, userInput + 5) == -1) {
+        printf("Invalid substring, it needs at least %d characters\n", TRIGRAM_LENGTH);
+      }
 
-    // Message in UDP queue
-    if (debugFlag) {
-      printf("Packet received\n");
+      if (strncmp(userInput, "download ", 9) == 0 &&
+          downloadResource(&clientContext, userInput + 9) == -1) {
+        printf("Can't download %s\n", userInput + 9);
+      }
+      free(userInput);
     }
-    recvfrom(udpSocketDescriptor, packet, MAX_PACKET, 0, NULL, NULL);
-    handlePacket(serverAddress, debugFlag);
   }
   return 0;
 }
 
+/*
+ * Purpose: Take the options that say what the client shares and how it uploads out of
+ * the command line arguments. The rest are left for checkCommandLineArguments().
+ * -r <KB/s> caps every upload together, -p <KB/s> caps each upload on its own. Both
+ * are unlimited by default.
+ * -s <MB> seeds downloaded files, keeping at most that much of them. Off by default.
+ * -b registers a summary of the shared files instead of their names, see
+ * setSummaryMode().
+ * Input:
+ * - Number of command line arguments
+ * - The command line arguments
+ * - Where to put the total rate in bytes per second
+ * - Where to put the per upload rate in bytes per second
+ * - Where to put the seed quota in bytes
+ * - Where to put whether to register a summary
+ * Output: Number of command line arguments left
+ */
+int checkSharingArguments(int argc,
+                          char** argv,
+                          unsigned long* totalRate,
+                          unsigned long* uploadRate,
+                          unsigned long* seedQuota,
+                          bool* summaryMode) {
+  int remaining = 1;
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      *totalRate = strtoul(argv[++i], NULL, 10) * 1024;
+    } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      *uploadRate = strtoul(argv[++i], NULL, 10) * 1024;
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      *seedQuota = strtoul(argv[++i], NULL, 10) * 1024 * 1024;
+    } else if (strcmp(argv[i], "-b") == 0) {
+      *summaryMode = true;
+    } else {
+      argv[remaining++] = argv[i];
+    }
+  }
+  return remaining;
+}
+
 /*
  * Purpose: Free all resources associated with the client
  * Input: Signal received
  * Output: None
  */
 void shutdownClient() {
-  free(packet);
-  close(udpSocketDescriptor);
-  close(tcpSocketDescriptor);
+  freeClientContext(&clientContext);
+  closeStatsSocket(statsSocketDescriptor, CLIENT_STATS_PATH);
   printf("\n");
   exit(0);
 }
 
 /*
- * Purpose: Get the available resources on the client and add them to the available
- * resources string.
+ * Purpose: Print a resource from a listing. The username is printed before the first
+ * of each user's files.
  * Input:
- * - String to store the available resources in
- * - Path to the directory where the available resources are located
- * Output:
- * - -1: Error
- * - 0: Success
+ * - Unused
+ * - Username of the owner
+ * - Filename of the resource
+ * Output: None
  */
-int getAvailableResources(char* availableResources, const char* directoryName) {
-  DIR* directoryStream = opendir(directoryName);
-  if (directoryStream == NULL) {
-    return -1;
-    perror("Error opening resource directory");
-  }
-
-  // Loop through entire directory
-  struct dirent* directoryEntry;
-  while ((directoryEntry = readdir(directoryStream)) != NULL) {
-    const char* entryName = directoryEntry->d_name;
-    // Ignore current directory
-    if (strcmp(entryName, ".") == 0) {
-      continue;
-    }
-    // Ignore parent directory
-    if (strcmp(entryName, "..") == 0) {
-      continue;
-    }
-    strcat(availableResources, entryName);
-    strcat(availableResources, packetDelimiters.subfield);
+void printResource(void* data, char* username, char* filename) {
+  (void)data;
+  if (strcmp(username, listedUsername) != 0) {
+    printf("Username: %s\n", username);
+    strncpy(listedUsername, username, MAX_USERNAME - 1);
   }
-  return 0;
+  printf("Filename: %s\n", filename);
 }
 
 /*
- * Purpose: Send a connection packet to the specified server.
+ * Purpose: Get ready for the next listing once a listing has been printed
  * Input:
- * - Socket address structure of the server to send the connection packet to
- * - Debug flag
- * Output:
- * -1: Error constructing or sending the connection packet, the packet was not sent
- * 0: Packet successfully sent
+ * - Unused
+ * - Whether the listing was complete
+ * Output: None
  */
-int sendConnectionPacket(struct sockaddr_in hostTcpAddress,
-                         struct sockaddr_in serverAddress,
-                         bool debugFlag) {
-  struct PacketFields packetFields;
-
-  // Type
-  strcpy(packetFields.type, "connection");
-
-  // Username
-  char* username = calloc(1, MAX_USERNAME);
-  setUsername(username);
-  strcpy(packetFields.data, username);
-  strncat(packetFields.data, packetDelimiters.subfield, packetDelimiters.subfieldLength);
-  free(username);
-
-  // Tcp socket
-  char ipAddress[64];
-  sprintf(ipAddress, "%d", hostTcpAddress.sin_addr.s_addr);
-  char port[64];
-  sprintf(port, "%d", hostTcpAddress.sin_port);
-  strcat(packetFields.data, ipAddress);
-  strcat(packetFields.data, packetDelimiters.subfield);
-  strcat(packetFields.data, port);
-  strcat(packetFields.data, packetDelimiters.subfield);
-
-  // Available resources
-  char* availableResources = calloc(1, MAX_DATA);
-  if (getAvailableResources(availableResources, "Public") == -1) {
-    return -1;
+void printListingEnd(void* data, bool complete) {
+  (void)data;
+  memset(listedUsername, 0, sizeof(listedUsername));
+  if (!complete) {
+    printf("Malformed resource packet\n");
   }
-  strcat(packetFields.data, availableResources);
-  free(availableResources);
-
-  sendUdpPacket(udpSocketDescriptor, serverAddress, packetFields, debugFlag);
-
-  return 0;
 }
 
 /*
- * Purpose: Send a resource packet to the server. This indicates that the client would
- * like to know all of the available resources on the network.
+ * Purpose: Print out the owners of a file sent back in response to a lookup
  * Input:
- * - Address of server to send the packet to
- * - Debug flag
+ * - Unused
+ * - The filename
+ * - Owners of the file
+ * - Number of owners
  * Output: None
  */
-void sendResourcePacket(struct sockaddr_in serverAddress, bool debugFlag) {
-  struct PacketFields packetFields;
-  strcpy(packetFields.type, "resource");
-  strcpy(packetFields.data, "dummyfield");
-
-  sendUdpPacket(udpSocketDescriptor, serverAddress, packetFields, debugFlag);
+void printLookup(void* data, char* filename, struct ClientOwner* owners, int ownerCount) {
+  (void)data;
+  printf("Filename: %s\n", filename);
+  int i;
+  for (i = 0; i < ownerCount; i++) {
+    printf("Owner: %s (%s:%lu)%s\n", owners[i].username,
+           inet_ntoa(owners[i].tcpAddress.sin_addr),
+           (unsigned long)ntohs(owners[i].tcpAddress.sin_port),
+           owners[i].possible ? " (possible)" : "");
+  }
+  if (ownerCount == 0) {
+    printf("No owners\n");
+  }
 }
 
 /*
- * Purpose: Take a packet of unknown type and call its corrosponding handler function
+ * Purpose: Print out the files sent back in response to a search
  * Input:
- * - Address of server that sent the packet
- * - Debug flag
+ * - Unused
+ * - Prefix of the filenames
+ * - The filenames
+ * - Number of filenames
+ * - Whether some files were left out
  * Output: None
  */
-void handlePacket(struct sockaddr_in serverAddress, bool debugFlag) {
-  struct PacketFields packetFields;
-  memset(&packetFields, 0, sizeof(packetFields));
-  readPacket(packet, &packetFields, debugFlag);
-
-  int packetType = getPacketType(packetFields.type, debugFlag);
-  switch (packetType) {
-  // Connection
-  case 0:
-    if (debugFlag) {
-      printf("Type of packet recieved is connection\n");
-    }
-    break;
-
-  // Status
-  case 1:
-    if (debugFlag) {
-      printf("Type of packet received is status\n");
-    }
-    handleStatusPacket(serverAddress, debugFlag);
-    break;
-
-  // Resource
-  case 2:
-    if (debugFlag) {
-      printf("Type of packet received is Resource\n");
-    }
-    handleResourcePacket(packetFields.data, debugFlag);
-    break;
-
-  default:
+void printSearch(void* data,
+                 char* prefix,
+                 char (*filenames)[MAX_FILENAME],
+                 int fileCount,
+                 bool more) {
+  (void)data;
+  printf("Files starting with \"%s\":\n", prefix);
+  int i;
+  for (i = 0; i < fileCount; i++) {
+    printf("Filename: %s\n", filenames[i]);
+  }
+  if (fileCount == 0) {
+    printf("No files\n");
+  }
+  if (more) {
+    printf("More files match, search for a longer prefix to see them\n");
   }
 }
 
 /*
- * Purpose: Print out all available resources in a sent resource packet
+ * Purpose: Print out the files sent back in response to a find
  * Input:
- * - Data field of the sent resource packet
- * - Debug flag
+ * - Unused
+ * - The substring
+ * - The filenames
+ * - Number of filenames
+ * - Whether some files were left out
  * Output: None
  */
-void handleResourcePacket(char* dataField, bool debugFlag) {
-  char* username         = calloc(1, MAX_USERNAME);
-  char* resourceSubfield = calloc(1, MAX_FILENAME);
-
-  long unsigned int dataFieldLength = strlen(dataField);
-  long unsigned int bytesRead       = 0;
-  int fieldCount                    = 0;
-  while (bytesRead != dataFieldLength) {
-    memset(resourceSubfield, 0, strlen(resourceSubfield));
-    dataField = readPacketSubfield(dataField, resourceSubfield, debugFlag);
-    bytesRead += strlen(resourceSubfield) + packetDelimiters.subfieldLength;
-
-    // First field
-    if (fieldCount == 0) {
-      strcpy(username, resourceSubfield);
-      printf("Username: %s\n", username);
-    }
-
-    // Username
-    if (fieldCount % 2 == 0) {
-      // Don't duplicate username printout
-      if (strcmp(username, resourceSubfield) == 0) {
-        ;
-      } else {
-        strcpy(username, resourceSubfield);
-        printf("Username: %s\n", username);
-      }
-    }
-    // Filename
-    else {
-      printf("Filename: %s\n", resourceSubfield);
-    }
-    fieldCount++;
+void printFind(void* data,
+               char* substring,
+               char (*filenames)[MAX_FILENAME],
+               int fileCount,
+               bool more) {
+  (void)data;
+  printf("Files containing \"%s\":\n", substring);
+  int i;
+  for (i = 0; i < fileCount; i++) {
+    printf("Filename: %s\n", filenames[i]);
+  }
+  if (fileCount == 0) {
+    printf("No files\n");
+  }
+  if (more) {
+    printf("More files match, search for a longer substring to see them\n");
   }
-
-  free(username);
-  free(resourceSubfield);
 }
 
 /*
- * Purpose: When the client receives a status packet, send one back. The data field of
- * this packet doesn't matter as the client just needs to respond to be considered still
- * connected to the server. Input:
- * - Address of server to send the response status packet to
- * - Debug flag
+ * Purpose: Print how a download went
+ * Input:
+ * - Unused
+ * - Filename of the download
+ * - Whether the file was downloaded
  * Output: None
  */
-void handleStatusPacket(struct sockaddr_in serverAddress, bool debugFlag) {
-  struct PacketFields packetFields;
-  memset(&packetFields, 0, sizeof(packetFields));
-  strcpy(packetFields.type, "status");
-  strcat(packetFields.data, "testing");
-
-  sendUdpPacket(udpSocketDescriptor, serverAddress, packetFields, debugFlag);
+void printDownload(void* data, char* filename, bool downloaded) {
+  (void)data;
+  if (downloaded) {
+    printf("Downloaded %s into %s\n", filename, DEFAULT_DOWNLOAD_DIRECTORY);
+  } else {
+    printf("Download of %s failed\n", filename);
+  }
 }
 
 /*
@@ -359,10 +377,3 @@ void setUsername(char* username) {
     free(userInput);
   }
 }
-
-struct sockaddr_in getTcpSocketInfo() {
-  struct sockaddr_in socketInfo;
-  socklen_t socketInfoSize = sizeof(socketInfo);
-  getsockname(tcpSocketDescriptor, (struct sockaddr*)&socketInfo, &socketInfoSize);
-  return socketInfo;
-}
@@ -3,18 +3,26 @@
 
 #include <stdbool.h>
 
-void shutdownClient();
-void receiveMessageFromServer();
-int getAvailableResources(char*, const char*);
-
-int sendConnectionPacket(struct sockaddr_in, struct sockaddr_in, bool);
-void sendResourcePacket(struct sockaddr_in, bool);
+#include "client_library.h"
 
-void handlePacket(struct sockaddr_in, bool);
-void handleResourcePacket(char*, bool);
-void handleStatusPacket(struct sockaddr_in, bool);
+// UNIX domain socket the stats can be read from
+#define CLIENT_STATS_PATH "client.stats"
 
+int checkSharingArguments(int,
+                          char**,
+                          unsigned long*,
+                          unsigned long*,
+                          unsigned long*,
+                          bool*);
+void shutdownClient();
 void setUsername(char*);
-struct sockaddr_in getTcpSocketInfo();
+
+// Callbacks that print what the client hears back about
+void printResource(void*, char*, char*);
+void printListingEnd(void*, bool);
+void printLookup(void*, char*, struct ClientOwner*, int);
+void printSearch(void*, char*, char (*)[MAX_FILENAME], int, bool);
+void printFind(void*, char*, char (*)[MAX_FILENAME], int, bool);
+void printDownload(void*, char*, bool);
 
 #endif
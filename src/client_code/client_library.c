@@ -0,0 +1,2266 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "../common/stats.h"
+#include "../common/trace.h"
+#include "client_library.h"
+
+// Packet delimiters that are constant for all packets
+// See packet.h & packet.c
+extern struct PacketDelimiters packetDelimiters;
+
+/*
+ * Purpose: Check that a filename names a single file in a directory, so it is safe to
+ * ask for and to serve
+ * Input: The filename
+ * Output: Whether the filename is valid
+ */
+static bool isValidFilename(char* filename) {
+  if (strlen(filename) == 0 || strlen(filename) >= MAX_FILENAME) {
+    return false;
+  }
+  if (strchr(filename, '/') != NULL) {
+    return false;
+  }
+  return strcmp(filename, ".") != 0 && strcmp(filename, "..") != 0;
+}
+
+/*
+ * Purpose: Set up a client. Nothing is sent until connectClient() is called.
+ * Input:
+ * - The client
+ * - Username to connect with
+ * - Address of the server
+ * - Directory to share files from, NULL for DEFAULT_PUBLIC_DIRECTORY
+ * - Directory to download files into, NULL for DEFAULT_DOWNLOAD_DIRECTORY
+ * - Debug flag
+ * Output: None
+ */
+void initClientContext(struct ClientContext* context,
+                       char* username,
+                       struct sockaddr_in serverAddress,
+                       char* publicDirectory,
+                       char* downloadDirectory,
+                       bool debugFlag) {
+  memset(context, 0, sizeof(*context));
+  strncpy(context->username, username, MAX_USERNAME - 1);
+  context->serverAddress = serverAddress;
+  context->debugFlag     = debugFlag;
+  strncpy(context->publicDirectory,
+          publicDirectory == NULL ? DEFAULT_PUBLIC_DIRECTORY : publicDirectory,
+          MAX_DIRECTORY_PATH - 1);
+  strncpy(context->downloadDirectory,
+          downloadDirectory == NULL ? DEFAULT_DOWNLOAD_DIRECTORY : downloadDirectory,
+          MAX_DIRECTORY_PATH - 1);
+
+  // Local UDP port
+  struct sockaddr_in hostUdpAddress;
+  memset(&hostUdpAddress, 0, sizeof(hostUdpAddress));
+  context->udpSocketDescriptor = setupUdpSocket(hostUdpAddress, false);
+
+  // Local TCP port, other clients download from it
+  struct sockaddr_in hostTcpAddress;
+  memset(&hostTcpAddress, 0, sizeof(hostTcpAddress));
+  hostTcpAddress.sin_port      = 0; // Wildcard
+  context->tcpSocketDescriptor = setupTcpSocket(hostTcpAddress);
+  socklen_t addressSize        = sizeof(context->hostTcpAddress);
+  getsockname(context->tcpSocketDescriptor, (struct sockaddr*)&context->hostTcpAddress,
+              &addressSize);
+
+  context->packet = calloc(1, MAX_PACKET);
+  initGossipState(&context->gossipState, context->username);
+  initReliableState(&context->reliableState);
+  initOwnerRanking(&context->ownerRanking);
+
+  int i;
+  for (i = 0; i < MAX_TRANSFERS; i++) {
+    context->transfers[i].socketDescriptor = -1;
+    context->transfers[i].fileDescriptor   = -1;
+  }
+  context->nextGossipRound   = getMicroseconds() + GOSSIP_PERIOD;
+  context->nextTransferCheck = getMicroseconds() + TRANSFER_CHECK_INTERVAL;
+  context->uploadBucket.lastRefill = getMicroseconds();
+}
+
+/*
+ * Purpose: Limit how fast a client uploads. The uploads sending share the total rate
+ * evenly, and each one is also held to the per upload rate.
+ * Input:
+ * - The client
+ * - Bytes per second for every upload together, 0 for no limit
+ * - Bytes per second for each upload, 0 for no limit
+ * Output: None
+ */
+void setUploadRates(struct ClientContext* context,
+                    unsigned long totalRate,
+                    unsigned long uploadRate) {
+  context->uploadBucket.rate       = totalRate;
+  context->uploadBucket.tokens     = 0;
+  context->uploadBucket.lastRefill = getMicroseconds();
+  context->uploadRate              = uploadRate;
+}
+
+/*
+ * Purpose: Stop a transfer and free its slot. A partly downloaded file is deleted.
+ * Input:
+ * - The client
+ * - The transfer
+ * Output: None
+ */
+static void closeTransfer(struct ClientContext* context, struct Transfer* transfer) {
+  if (transfer->socketDescriptor != -1) {
+    close(transfer->socketDescriptor);
+  }
+  if (transfer->fileDescriptor != -1) {
+    close(transfer->fileDescriptor);
+    if (transfer->state == TRANSFER_RECEIVING) {
+      char path[MAX_DIRECTORY_PATH + MAX_FILENAME + 8];
+      snprintf(path, sizeof(path), "%s/%s.part", context->downloadDirectory,
+               transfer->filename);
+      unlink(path);
+    }
+  }
+  // The file ring may still be reading into the buffer, so the slot isn't reused until
+  // the read is reaped, see finishFileReads()
+  bool readPending = transfer->readPending;
+  memset(transfer, 0, sizeof(*transfer));
+  transfer->socketDescriptor = -1;
+  transfer->fileDescriptor   = -1;
+  transfer->readPending      = readPending;
+}
+
+/*
+ * Purpose: Hand the uploads whose file reads have finished their data, see
+ * useFileUring()
+ * Input:
+ * - The client
+ * - Whether to wait for a read to finish if none has
+ * Output: None
+ */
+static void finishFileReads(struct ClientContext* context, bool wait) {
+  unsigned long tag;
+  int result;
+  while (reapFileUring(&context->fileQueue, wait, &tag, &result)) {
+    wait                      = false;
+    struct Transfer* transfer = &context->transfers[tag];
+    transfer->readPending     = false;
+    if (transfer->state != TRANSFER_SENDING) {
+      continue; // Closed while the read was running
+    }
+    if (result <= 0) {
+      closeTransfer(context, transfer);
+      continue;
+    }
+    TRACE(TRACE_FILE_READ, result, 0);
+    transfer->bufferStart = 0;
+    transfer->bufferEnd   = (unsigned long)result;
+    transfer->remaining -= result;
+  }
+}
+
+/*
+ * Purpose: Free everything a client holds. Transfers still running are dropped.
+ * Input: The client
+ * Output: None
+ */
+void freeClientContext(struct ClientContext* context) {
+  int i;
+  for (i = 0; i < MAX_TRANSFERS; i++) {
+    closeTransfer(context, &context->transfers[i]);
+  }
+  if (context->fileUring) {
+    for (i = 0; i < MAX_TRANSFERS; i++) {
+      while (context->transfers[i].readPending) {
+        finishFileReads(context, true);
+      }
+    }
+    closeFileUring(&context->fileQueue);
+  }
+  free(context->packet);
+  context->packet = NULL;
+  free(context->sharedFiles);
+  context->sharedFiles = NULL;
+  freeCountingBloom(&context->summary);
+  close(context->udpSocketDescriptor);
+  close(context->tcpSocketDescriptor);
+}
+
+/*
+ * Purpose: Compare two filenames, for qsort()
+ * Input: The two filenames
+ * Output: Less than, equal to or greater than 0 as the first sorts before, the same as
+ * or after the second
+ */
+static int compareFilenames(const void* first, const void* second) {
+  return strcmp((const char*)first, (const char*)second);
+}
+
+/*
+ * Purpose: Get the files in the public directory that can be shared, sorted
+ * Input:
+ * - The client
+ * - Where to put the filenames, an array the caller frees
+ * Output:
+ * - -1: The public directory couldn't be opened
+ * - Anything else: Number of files
+ */
+static int readPublicDirectory(struct ClientContext* context,
+                               char (**files)[MAX_FILENAME]) {
+  DIR* directoryStream = opendir(context->publicDirectory);
+  if (directoryStream == NULL) {
+    return -1;
+  }
+
+  int fileCount = 0;
+  int capacity  = 0;
+  *files        = NULL;
+  struct dirent* directoryEntry;
+  while ((directoryEntry = readdir(directoryStream)) != NULL) {
+    char* entryName = directoryEntry->d_name;
+    // Names that can't be served or that would break up a packet aren't shared
+    if (!isValidFilename(entryName) || strchr(entryName, packetDelimiters.field[0]) ||
+        strchr(entryName, packetDelimiters.subfield[0])) {
+      continue;
+    }
+    if (fileCount == capacity) {
+      capacity = capacity == 0 ? 64 : capacity * 2;
+      *files   = realloc(*files, (unsigned long)capacity * MAX_FILENAME);
+    }
+    strcpy((*files)[fileCount++], entryName);
+  }
+  closedir(directoryStream);
+  qsort(*files, (unsigned long)fileCount, MAX_FILENAME, compareFilenames);
+  return fileCount;
+}
+
+/*
+ * Purpose: Add as many shared files as fit to the data field of a packet
+ * Input:
+ * - The client
+ * - Data field to add the files to
+ * - Index of the first shared file to add
+ * Output: Index of the first shared file that didn't fit
+ */
+static int packSharedFiles(struct ClientContext* context, char* data, int fileIndex) {
+  unsigned long length = strlen(data);
+  while (fileIndex < context->sharedFileCount) {
+    char* filename               = context->sharedFiles[fileIndex];
+    unsigned long filenameLength = strlen(filename);
+    if (length + filenameLength + packetDelimiters.subfieldLength >= MAX_DATA) {
+      break;
+    }
+    memcpy(data + length, filename, filenameLength);
+    length += filenameLength;
+    data[length++] = packetDelimiters.subfield[0];
+    fileIndex++;
+  }
+  data[length] = '\0';
+  return fileIndex;
+}
+
+/*
+ * Purpose: Count the register packets needed for the shared files. Each one starts
+ * with its index, then has as many files as fit.
+ * Input: The client
+ * Output: Number of register packets
+ */
+static int countRegistrationChunks(struct ClientContext* context) {
+  char data[MAX_DATA];
+  int chunkCount = 0;
+  int fileIndex  = 0;
+  while (fileIndex < context->sharedFileCount) {
+    snprintf(data, sizeof(data), "%d%c", chunkCount, packetDelimiters.subfield[0]);
+    fileIndex = packSharedFiles(context, data, fileIndex);
+    chunkCount++;
+  }
+  return chunkCount;
+}
+
+/*
+ * Purpose: Build the summary of the shared files registered in summary mode. It gets
+ * SUMMARY_CELLS_PER_FILE cells for each file, rounded up to a power of two the server
+ * accepts.
+ * Input: The client
+ * Output: None
+ */
+static void buildSummary(struct ClientContext* context) {
+  unsigned long cellCount = BLOOM_MIN_CELLS;
+  while (cellCount < BLOOM_MAX_CELLS &&
+         cellCount < (unsigned long)context->sharedFileCount * SUMMARY_CELLS_PER_FILE) {
+    cellCount *= 2;
+  }
+  freeCountingBloom(&context->summary);
+  initCountingBloom(&context->summary, cellCount);
+  int i;
+  for (i = 0; i < context->sharedFileCount; i++) {
+    addBloomKey(&context->summary, context->sharedFiles[i]);
+  }
+}
+
+/*
+ * Purpose: Send a connection packet to the server. The shared files are sent with it
+ * if they all fit, otherwise it says how many register packets will follow with them.
+ * In summary mode it says how many cells the summary has and what the shared files
+ * hash to, and the register packets carry the cells instead.
+ * Input: The client
+ * Output:
+ * -1: Error sending the connection packet, the packet was not sent
+ * 0: Packet successfully sent
+ */
+static int sendConnectionPacket(struct ClientContext* context) {
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+
+  // Type
+  strcpy(packetFields.type, "connection");
+
+  // Username and TCP socket
+  char delimiter = packetDelimiters.subfield[0];
+  char header[64];
+  snprintf(header, sizeof(header), "%s%c%d%c%d%c", context->username, delimiter,
+           context->hostTcpAddress.sin_addr.s_addr, delimiter,
+           context->hostTcpAddress.sin_port, delimiter);
+
+  // Available resources
+  snprintf(packetFields.data, MAX_DATA, "%s0%c0%c", header, delimiter, delimiter);
+  context->registrationFile       = packSharedFiles(context, packetFields.data, 0);
+  context->registrationChunk      = 0;
+  context->registrationChunkCount = 0;
+  if (context->summaryMode) {
+    buildSummary(context);
+    context->registrationFile       = 0;
+    context->registrationChunkCount =
+        (int)(context->summary.cellCount / BLOOM_CELLS_PER_CHUNK);
+    snprintf(packetFields.data, MAX_DATA, "%s%d%c%lu%c%lu%c", header,
+             context->registrationChunkCount, delimiter, context->summary.cellCount,
+             delimiter, context->resourceHash, delimiter);
+  } else if (context->registrationFile < context->sharedFileCount) {
+    context->registrationFile       = 0;
+    context->registrationChunkCount = countRegistrationChunks(context);
+    snprintf(packetFields.data, MAX_DATA, "%s%d%c0%c", header,
+             context->registrationChunkCount, delimiter, delimiter);
+  }
+
+  // Retransmitted until the server acks it so a lost packet doesn't leave this
+  // client unregistered
+  return sendPacket(&context->reliableState, context->udpSocketDescriptor,
+                    context->serverAddress, packetFields, context->debugFlag);
+}
+
+/*
+ * Purpose: Check whether a register packet can be sent. They wait for the connection
+ * packet to be acked so that the server knows the client before they arrive, and only
+ * REGISTRATION_WINDOW of them can be waiting for an ack at once.
+ * Input: The client
+ * Output: Whether a register packet can be sent once it is due
+ */
+static bool canSendRegistrationChunk(struct ClientContext* context) {
+  struct ReliableState* reliableState = &context->reliableState;
+  return context->registrationChunk < context->registrationChunkCount &&
+         countPendingPackets(reliableState, "connection") == 0 &&
+         countPendingPackets(reliableState, "register") < REGISTRATION_WINDOW;
+}
+
+/*
+ * Purpose: Send the register packets that are due, one every
+ * REGISTRATION_CHUNK_INTERVAL so the server's budget for them isn't used up. In
+ * summary mode each one has BLOOM_CELLS_PER_CHUNK cells of the summary.
+ * Input: The client
+ * Output: None
+ */
+static void sendRegistrationChunks(struct ClientContext* context) {
+  if (!canSendRegistrationChunk(context)) {
+    return;
+  }
+  unsigned long currentTime = getMicroseconds();
+
+  // Time spent waiting for acks isn't made up for with more than a window's burst
+  unsigned long earliestTime =
+      currentTime - REGISTRATION_WINDOW * REGISTRATION_CHUNK_INTERVAL;
+  if (context->nextRegistrationChunk < earliestTime) {
+    context->nextRegistrationChunk = earliestTime;
+  }
+
+  while (canSendRegistrationChunk(context) &&
+         currentTime >= context->nextRegistrationChunk) {
+    struct PacketFields packetFields;
+    memset(&packetFields, 0, sizeof(packetFields));
+    strcpy(packetFields.type, "register");
+    snprintf(packetFields.data, MAX_DATA, "%d%c", context->registrationChunk,
+             packetDelimiters.subfield[0]);
+    int nextFile = context->registrationFile;
+    if (context->summaryMode) {
+      unsigned long length    = strlen(packetFields.data);
+      unsigned long firstCell =
+          (unsigned long)context->registrationChunk * BLOOM_CELLS_PER_CHUNK;
+      length += encodeBloomCells(&context->summary, firstCell, BLOOM_CELLS_PER_CHUNK,
+                                 packetFields.data + length);
+      packetFields.data[length] = packetDelimiters.subfield[0];
+    } else {
+      nextFile = packSharedFiles(context, packetFields.data, context->registrationFile);
+    }
+
+    // Reliable window is full, try again once something is acked
+    if (sendPacket(&context->reliableState, context->udpSocketDescriptor,
+                   context->serverAddress, packetFields, context->debugFlag) == -1) {
+      return;
+    }
+    context->registrationFile = nextFile;
+    context->registrationChunk++;
+    context->nextRegistrationChunk += REGISTRATION_CHUNK_INTERVAL;
+  }
+}
+
+/*
+ * Purpose: Send a resource packet to the server. This indicates that the client would
+ * like to know all of the available resources on the network. They come back a page
+ * at a time.
+ * Input:
+ * - The client
+ * - Index of the first resource wanted, 0 for the first page
+ * Output: None
+ */
+static void sendResourcePacket(struct ClientContext* context, unsigned long startIndex) {
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "resource");
+  sprintf(packetFields.data, "%lu", startIndex);
+
+  sendPacket(&context->reliableState, context->udpSocketDescriptor,
+             context->serverAddress, packetFields, context->debugFlag);
+}
+
+/*
+ * Purpose: Send a lookup packet to the server. This asks the server who has a file.
+ * Input:
+ * - The client
+ * - Filename to look up
+ * Output: None
+ */
+static void sendLookupPacket(struct ClientContext* context, char* filename) {
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "lookup");
+  strcpy(packetFields.data, filename);
+  strncat(packetFields.data, packetDelimiters.subfield, packetDelimiters.subfieldLength);
+
+  sendPacket(&context->reliableState, context->udpSocketDescriptor,
+             context->serverAddress, packetFields, context->debugFlag);
+}
+
+/*
+ * Purpose: Send a peers packet to the server. This asks the server for a few other
+ * clients to gossip directory updates with.
+ * Input: The client
+ * Output: None
+ */
+static void sendPeersPacket(struct ClientContext* context) {
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "peers");
+  strcpy(packetFields.data, "dummyfield");
+
+  sendPacket(&context->reliableState, context->udpSocketDescriptor,
+             context->serverAddress, packetFields, context->debugFlag);
+}
+
+/*
+ * Purpose: Send an announce packet to the server. This tells the server that a single
+ * resource was added to or removed from this client.
+ * Input:
+ * - The client
+ * - Filename of the resource
+ * - Whether the resource was removed
+ * Output: None
+ */
+static void sendAnnouncePacket(struct ClientContext* context,
+                               char* filename,
+                               bool removed) {
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "announce");
+  strcpy(packetFields.data, removed ? "-" : "+");
+  strncat(packetFields.data, packetDelimiters.subfield, packetDelimiters.subfieldLength);
+  strcat(packetFields.data, filename);
+  strncat(packetFields.data, packetDelimiters.subfield, packetDelimiters.subfieldLength);
+
+  sendPacket(&context->reliableState, context->udpSocketDescriptor,
+             context->serverAddress, packetFields, context->debugFlag);
+}
+
+/*
+ * Purpose: Compare the public directory against the files this client is known to
+ * share. Files that were added or removed since the last check are published to
+ * gossip peers, and optionally announced to the server. Nothing is checked while the
+ * server is still being sent the shared files.
+ * Input:
+ * - The client
+ * - Whether to announce changes to the server
+ * Output:
+ * - -1: The public directory couldn't be opened
+ * - 0: Shared files are up to date
+ */
+static int syncPublicDirectory(struct ClientContext* context, bool announceFlag) {
+  if (context->registrationChunk < context->registrationChunkCount) {
+    return 0;
+  }
+  char (*files)[MAX_FILENAME];
+  int fileCount = readPublicDirectory(context, &files);
+  if (fileCount == -1) {
+    return -1;
+  }
+
+  // Both lists are sorted, walk them together
+  struct GossipState* gossipState = &context->gossipState;
+  int sharedIndex                 = 0;
+  int fileIndex                   = 0;
+  while (sharedIndex < context->sharedFileCount || fileIndex < fileCount) {
+    int order;
+    if (sharedIndex == context->sharedFileCount) {
+      order = 1;
+    } else if (fileIndex == fileCount) {
+      order = -1;
+    } else {
+      order = strcmp(context->sharedFiles[sharedIndex], files[fileIndex]);
+    }
+    if (order == 0) {
+      sharedIndex++;
+      fileIndex++;
+      continue;
+    }
+
+    bool removed   = order < 0;
+    char* filename = removed ? context->sharedFiles[sharedIndex++] : files[fileIndex++];
+    if (removed) {
+      context->resourceHash -= hashResourceName(filename);
+    } else {
+      context->resourceHash += hashResourceName(filename);
+    }
+    if (context->debugFlag) {
+      printf("Resource %s %s\n", filename, removed ? "removed" : "added");
+    }
+    // The server is told about every file, gossip only spreads as many as it has room
+    // for
+    if (removed ? hasLocalResource(gossipState, filename)
+                : gossipState->entryCount < GOSSIP_MAX_ENTRIES) {
+      publishLocalResource(gossipState, filename, removed);
+    }
+    if (announceFlag) {
+      sendAnnouncePacket(context, filename, removed);
+    }
+  }
+
+  free(context->sharedFiles);
+  context->sharedFiles     = files;
+  context->sharedFileCount = fileCount;
+  return 0;
+}
+
+/*
+ * Purpose: Register a client with the server and start gossiping. The files in the
+ * public directory are sent along with the registration, in register packets after
+ * the connection packet if there are too many for it.
+ * Input: The client
+ * Output:
+ * - -1: The public directory couldn't be read or the connection packet couldn't be
+ *   sent
+ * - 0: Connection packet sent, it is retransmitted until the server acks it
+ */
+int connectClient(struct ClientContext* context) {
+  free(context->sharedFiles);
+  context->sharedFiles            = NULL;
+  context->sharedFileCount        = 0;
+  context->resourceHash           = 0;
+  context->registrationChunk      = 0;
+  context->registrationChunkCount = 0;
+
+  // The server sends a new session once it has the connection packet
+  context->sessionToken  = 0;
+  context->resuming      = false;
+  context->lastHeartbeat = getMicroseconds();
+
+  // Files sent in the registration only need to be gossiped
+  int connectionReturn = -1;
+  if (syncPublicDirectory(context, false) == 0) {
+    connectionReturn               = sendConnectionPacket(context);
+    context->nextRegistrationChunk = getMicroseconds();
+  }
+  sendPeersPacket(context);
+  return connectionReturn;
+}
+
+/*
+ * Purpose: Resume this client's registration once the server has gone quiet for
+ * SERVER_SILENCE_TIMEOUT. It may have expired the client while it couldn't be reached.
+ * The session token and the hash of the shared files are sent in a session packet,
+ * and the server answers whether it put the registration back, see
+ * handleSessionPacket(). A client without a session connects again in full.
+ * Input: The client
+ * Output: None
+ */
+static void resumeSession(struct ClientContext* context) {
+  context->lastHeartbeat = getMicroseconds();
+  if (context->debugFlag) {
+    printf("No heartbeat from the server, resuming session\n");
+  }
+  if (context->sessionToken == 0) {
+    connectClient(context);
+    return;
+  }
+
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "session");
+  snprintf(packetFields.data, MAX_DATA, "%lu%c%lu%c", context->sessionToken,
+           packetDelimiters.subfield[0], context->resourceHash,
+           packetDelimiters.subfield[0]);
+  context->resuming = true;
+  sendPacket(&context->reliableState, context->udpSocketDescriptor,
+             context->serverAddress, packetFields, context->debugFlag);
+}
+
+/*
+ * Purpose: Register a counting Bloom filter of the shared files with the server
+ * instead of their names, from the next connectClient() on. Takes far less of the
+ * server's memory for clients sharing many files, but they are left out of listings
+ * and searches, and lookups name them as possible owners that have to be asked.
+ * Input:
+ * - The client
+ * - Whether to register a summary
+ * Output: None
+ */
+void setSummaryMode(struct ClientContext* context, bool summaryMode) {
+  context->summaryMode = summaryMode;
+}
+
+/*
+ * Purpose: Read the files uploads send through io_uring instead of with read(). A read
+ * then runs while its upload waits for its socket, and one that has to go to the disk
+ * doesn't hold up the client's other transfers.
+ * Input: The client
+ * Output:
+ * - -1: io_uring not available, files are still read with read()
+ * - 0: Success
+ */
+int useFileUring(struct ClientContext* context) {
+  if (!context->fileUring && setupFileUring(&context->fileQueue) == -1) {
+    return -1;
+  }
+  context->fileUring = true;
+  return 0;
+}
+
+/*
+ * Purpose: Ask the server for every available resource, see onResource and
+ * onListingEnd
+ * Input: The client
+ * Output: None
+ */
+void requestResources(struct ClientContext* context) {
+  sendResourcePacket(context, 0);
+}
+
+/*
+ * Purpose: Ask the server who has a file, see onLookup
+ * Input:
+ * - The client
+ * - Filename to look up
+ * Output:
+ * - -1: Invalid filename, nothing was sent
+ * - 0: Lookup sent
+ */
+int requestLookup(struct ClientContext* context, char* filename) {
+  if (strlen(filename) == 0 || strlen(filename) >= MAX_FILENAME) {
+    return -1;
+  }
+  sendLookupPacket(context, filename);
+  return 0;
+}
+
+/*
+ * Purpose: Ask the server for every file whose name starts with a prefix, see onSearch
+ * Input:
+ * - The client
+ * - Prefix of the filenames
+ * Output:
+ * - -1: Invalid prefix, nothing was sent
+ * - 0: Search sent
+ */
+int requestSearch(struct ClientContext* context, char* prefix) {
+  if (strlen(prefix) >= MAX_FILENAME) {
+    return -1;
+  }
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "search");
+  strcpy(packetFields.data, prefix);
+  strncat(packetFields.data, packetDelimiters.subfield, packetDelimiters.subfieldLength);
+
+  sendPacket(&context->reliableState, context->udpSocketDescriptor,
+             context->serverAddress, packetFields, context->debugFlag);
+  return 0;
+}
+
+/*
+ * Purpose: Ask the server for every file whose name contains a substring, ignoring
+ * case, see onFind
+ * Input:
+ * - The client
+ * - The substring, at least TRIGRAM_LENGTH characters
+ * Output:
+ * - -1: Invalid substring, nothing was sent
+ * - 0: Find sent
+ */
+int requestFind(struct ClientContext* context, char* substring) {
+  if (strlen(substring) < TRIGRAM_LENGTH || strlen(substring) >= MAX_FILENAME) {
+    return -1;
+  }
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "find");
+  strcpy(packetFields.data, substring);
+  strncat(packetFields.data, packetDelimiters.subfield, packetDelimiters.subfieldLength);
+
+  sendPacket(&context->reliableState, context->udpSocketDescriptor,
+             context->serverAddress, packetFields, context->debugFlag);
+  return 0;
+}
+
+/*
+ * Purpose: Find a transfer slot that isn't in use
+ * Input: The client
+ * Output: The free transfer, NULL if every slot is in use
+ */
+static struct Transfer* findFreeTransfer(struct ClientContext* context) {
+  int i;
+  for (i = 0; i < MAX_TRANSFERS; i++) {
+    struct Transfer* transfer = &context->transfers[i];
+    if (transfer->state == TRANSFER_FREE && !transfer->readPending) {
+      return transfer;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Purpose: Download a file from another client into the download directory. The
+ * owners are looked up first, then tried one at a time until one of them sends the
+ * file. See onDownload.
+ * Input:
+ * - The client
+ * - Filename to download
+ * Output:
+ * - -1: Invalid filename or too many transfers running, nothing was started
+ * - 0: Download started
+ */
+int downloadResource(struct ClientContext* context, char* filename) {
+  if (!isValidFilename(filename)) {
+    return -1;
+  }
+  struct Transfer* transfer = findFreeTransfer(context);
+  if (transfer == NULL) {
+    return -1;
+  }
+  transfer->state = TRANSFER_LOOKUP;
+  strcpy(transfer->filename, filename);
+  transfer->lastProgress = getMicroseconds();
+  sendLookupPacket(context, filename);
+  return 0;
+}
+
+/*
+ * Purpose: Stop seeding a downloaded file and remove it from the public directory.
+ * Uploads of it that are running carry on.
+ * Input:
+ * - The client
+ * - Index of the file in the seeded files
+ * Output: None
+ */
+static void removeSeededFile(struct ClientContext* context, int index) {
+  struct SeededFile* seededFile = &context->seededFiles[index];
+  char path[MAX_DIRECTORY_PATH + MAX_FILENAME + 8];
+  snprintf(path, sizeof(path), "%s/%s", context->publicDirectory, seededFile->filename);
+  unlink(path);
+  if (context->debugFlag) {
+    printf("Stopped seeding %s\n", seededFile->filename);
+  }
+  context->seededBytes -= seededFile->size;
+  *seededFile = context->seededFiles[--context->seededFileCount];
+  statsAdd(STATS_SEED_EVICTIONS, 1);
+}
+
+/*
+ * Purpose: Remove the least recently used seeded files until a file of a size fits in
+ * the seed quota, and in the seeded files if one is being added
+ * Input:
+ * - The client
+ * - Bytes to make room for, 0 to only get within the quota
+ * - Whether a file is being added, which needs a free entry even if it is empty
+ * Output: None
+ */
+static void evictSeededFiles(struct ClientContext* context,
+                             unsigned long size,
+                             bool adding) {
+  while (context->seededFileCount > 0 &&
+         (context->seededBytes + size > context->seedQuota ||
+          (adding && context->seededFileCount == MAX_SEEDED_FILES))) {
+    int oldest = 0;
+    int i;
+    for (i = 1; i < context->seededFileCount; i++) {
+      if (context->seededFiles[i].lastUsed < context->seededFiles[oldest].lastUsed) {
+        oldest = i;
+      }
+    }
+    removeSeededFile(context, oldest);
+  }
+  statsSet(STATS_SEEDED_FILES, (unsigned long)context->seededFileCount);
+  statsSet(STATS_SEEDED_BYTES, context->seededBytes);
+}
+
+/*
+ * Purpose: Set how much disk a client can use to seed the files it downloads. Each
+ * downloaded file is put in the public directory and announced, and the least recently
+ * uploaded of them are removed once they take more than the quota.
+ * Input:
+ * - The client
+ * - Bytes of seeded files to keep, 0 to not seed
+ * Output: None
+ */
+void setSeedQuota(struct ClientContext* context, unsigned long quota) {
+  context->seedQuota = quota;
+  evictSeededFiles(context, 0, false);
+}
+
+/*
+ * Purpose: Copy a file, for when it can't be linked
+ * Input:
+ * - Path of the file
+ * - Path of the copy
+ * Output:
+ * - -1: The file couldn't be copied, no copy is left behind
+ * - 0: Copied
+ */
+static int copyFile(char* sourcePath, char* destinationPath) {
+  int source = open(sourcePath, O_RDONLY);
+  if (source == -1) {
+    return -1;
+  }
+  int destination = open(destinationPath, O_CREAT | O_EXCL | O_WRONLY, S_IRUSR | S_IWUSR);
+  if (destination == -1) {
+    close(source);
+    return -1;
+  }
+  char buffer[TRANSFER_BUFFER_SIZE];
+  long bytesRead;
+  while ((bytesRead = read(source, buffer, sizeof(buffer))) > 0) {
+    if (write(destination, buffer, (unsigned long)bytesRead) != bytesRead) {
+      bytesRead = -1;
+      break;
+    }
+  }
+  close(source);
+  close(destination);
+  if (bytesRead == -1) {
+    unlink(destinationPath);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Purpose: Share a file that was just downloaded by putting it in the public directory
+ * and announcing it, so other clients can download it from here too. Seeded files that
+ * haven't been used for the longest are removed to make room for it in the quota.
+ * Files that are already shared or are bigger than the quota aren't seeded.
+ * Input:
+ * - The client
+ * - The downloaded file
+ * - Its size
+ * Output: None
+ */
+static void seedDownload(struct ClientContext* context,
+                         char* filename,
+                         unsigned long size) {
+  char downloadPath[MAX_DIRECTORY_PATH + MAX_FILENAME + 8];
+  char publicPath[MAX_DIRECTORY_PATH + MAX_FILENAME + 8];
+  snprintf(downloadPath, sizeof(downloadPath), "%s/%s", context->downloadDirectory,
+           filename);
+  snprintf(publicPath, sizeof(publicPath), "%s/%s", context->publicDirectory, filename);
+  if (context->seedQuota == 0 || size > context->seedQuota ||
+      access(publicPath, F_OK) == 0) {
+    return;
+  }
+
+  evictSeededFiles(context, size, true);
+  // A link takes no more disk, but only works within a file system
+  if (link(downloadPath, publicPath) == -1 && copyFile(downloadPath, publicPath) == -1) {
+    return;
+  }
+  struct SeededFile* seededFile = &context->seededFiles[context->seededFileCount++];
+  strcpy(seededFile->filename, filename);
+  seededFile->size     = size;
+  seededFile->lastUsed = getMicroseconds();
+  context->seededBytes += size;
+  statsSet(STATS_SEEDED_FILES, (unsigned long)context->seededFileCount);
+  statsSet(STATS_SEEDED_BYTES, context->seededBytes);
+  if (context->debugFlag) {
+    printf("Seeding %s\n", filename);
+  }
+  syncPublicDirectory(context, true);
+}
+
+/*
+ * Purpose: End a download and tell the user how it went
+ * Input:
+ * - The client
+ * - The download
+ * - Whether the file was downloaded
+ * Output: None
+ */
+static void finishDownload(struct ClientContext* context,
+                           struct Transfer* transfer,
+                           bool downloaded) {
+  char filename[MAX_FILENAME];
+  strcpy(filename, transfer->filename);
+  closeTransfer(context, transfer);
+  if (context->callbacks.onDownload != NULL) {
+    context->callbacks.onDownload(context->callbackData, filename, downloaded);
+  }
+}
+
+/*
+ * Purpose: Start downloading from the next owner of the file. The download fails once
+ * there are no owners left to try.
+ * Input:
+ * - The client
+ * - The download
+ * Output: None
+ */
+static void tryNextOwner(struct ClientContext* context, struct Transfer* transfer) {
+  if (transfer->socketDescriptor != -1) {
+    close(transfer->socketDescriptor);
+    transfer->socketDescriptor = -1;
+  }
+  if (transfer->fileDescriptor != -1) {
+    close(transfer->fileDescriptor);
+    transfer->fileDescriptor = -1;
+    char path[MAX_DIRECTORY_PATH + MAX_FILENAME + 8];
+    snprintf(path, sizeof(path), "%s/%s.part", context->downloadDirectory,
+             transfer->filename);
+    unlink(path);
+  }
+
+  while (transfer->ownerIndex < transfer->ownerCount) {
+    struct ClientOwner* owner  = &transfer->owners[transfer->ownerIndex++];
+    struct sockaddr_in address = owner->tcpAddress;
+    // Clients register the address their TCP socket is bound to, usually the wildcard,
+    // so reach them on the address the server heard from instead
+    if (address.sin_addr.s_addr == INADDR_ANY) {
+      address.sin_addr = owner->udpAddress.sin_addr;
+    }
+
+    int socketDescriptor = socket(AF_INET, SOCK_STREAM, 0);
+    if (socketDescriptor == -1) {
+      continue;
+    }
+    fcntl(socketDescriptor, F_SETFL, O_NONBLOCK);
+    if (connect(socketDescriptor, (struct sockaddr*)&address, sizeof(address)) == -1 &&
+        errno != EINPROGRESS) {
+      close(socketDescriptor);
+      continue;
+    }
+    if (context->debugFlag) {
+      printf("Downloading %s from %s\n", transfer->filename, owner->username);
+    }
+    transfer->state            = TRANSFER_CONNECTING;
+    transfer->socketDescriptor = socketDescriptor;
+    transfer->headerLength     = 0;
+    transfer->remaining        = -1;
+    transfer->lastProgress     = getMicroseconds();
+    transfer->connectedAt      = transfer->lastProgress;
+    return;
+  }
+  finishDownload(context, transfer, false);
+}
+
+/*
+ * Purpose: Sort the owners of a file by how soon a download from each of them is
+ * expected to finish, see getExpectedCompletion(). Owners expected to take as long
+ * keep the server's order. Possible owners go after the ones known to have the file.
+ * Input:
+ * - The client
+ * - Owners of the file
+ * - Number of owners
+ * Output: None
+ */
+static void rankOwners(struct ClientContext* context,
+                       struct ClientOwner* owners,
+                       int ownerCount) {
+  unsigned long expected[MAX_LOOKUP_OWNERS];
+  int i;
+  for (i = 0; i < ownerCount; i++) {
+    expected[i] = getExpectedCompletion(&context->ownerRanking, owners[i].udpAddress);
+  }
+  for (i = 1; i < ownerCount; i++) {
+    struct ClientOwner owner     = owners[i];
+    unsigned long ownerExpected = expected[i];
+    int j                       = i;
+    while (j > 0 && (owners[j - 1].possible > owner.possible ||
+                     (owners[j - 1].possible == owner.possible &&
+                      expected[j - 1] > ownerExpected))) {
+      owners[j]   = owners[j - 1];
+      expected[j] = expected[j - 1];
+      j--;
+    }
+    owners[j]   = owner;
+    expected[j] = ownerExpected;
+  }
+}
+
+/*
+ * Purpose: Start the downloads that were waiting for the owners of a file. Owners
+ * whose round trip time isn't known are probed first, see startProbedDownloads().
+ * Possible owners are always probed, the probe asks them whether they have the file.
+ * Input:
+ * - The client
+ * - The file
+ * - Owners of the file
+ * - Number of owners
+ * Output: None
+ */
+static void startDownloads(struct ClientContext* context,
+                           char* filename,
+                           struct ClientOwner* owners,
+                           int ownerCount) {
+  int i;
+  for (i = 0; i < MAX_TRANSFERS; i++) {
+    struct Transfer* transfer = &context->transfers[i];
+    if (transfer->state != TRANSFER_LOOKUP || strcmp(transfer->filename, filename) != 0) {
+      continue;
+    }
+    transfer->ownerCount = 0;
+    transfer->ownerIndex = 0;
+    bool probing         = false;
+    int j;
+    for (j = 0; j < ownerCount; j++) {
+      // Nothing to gain from downloading a file from ourselves
+      if (strcmp(owners[j].username, context->username) == 0) {
+        continue;
+      }
+      transfer->owners[transfer->ownerCount++] = owners[j];
+      probePeer(&context->ownerRanking, context->udpSocketDescriptor,
+                owners[j].udpAddress, owners[j].possible ? filename : NULL,
+                context->debugFlag);
+      probing |= isProbePending(&context->ownerRanking, owners[j].udpAddress);
+    }
+    if (probing) {
+      transfer->state         = TRANSFER_PROBING;
+      transfer->probeDeadline = getMicroseconds() + RANKING_PROBE_WAIT;
+      continue;
+    }
+    rankOwners(context, transfer->owners, transfer->ownerCount);
+    tryNextOwner(context, transfer);
+  }
+}
+
+/*
+ * Purpose: Start the downloads whose owners have all answered their probes, or that
+ * have waited RANKING_PROBE_WAIT for them, from the owner expected to be fastest.
+ * Possible owners that answered they don't have the file are dropped, those that
+ * didn't answer are still tried after the others.
+ * Input: The client
+ * Output: None
+ */
+static void startProbedDownloads(struct ClientContext* context) {
+  unsigned long currentTime = getMicroseconds();
+  int i;
+  for (i = 0; i < MAX_TRANSFERS; i++) {
+    struct Transfer* transfer = &context->transfers[i];
+    if (transfer->state != TRANSFER_PROBING) {
+      continue;
+    }
+    bool probing = false;
+    int j;
+    for (j = 0; j < transfer->ownerCount && currentTime < transfer->probeDeadline; j++) {
+      probing |= isProbePending(&context->ownerRanking, transfer->owners[j].udpAddress);
+    }
+    if (probing) {
+      continue;
+    }
+    int ownerCount = 0;
+    for (j = 0; j < transfer->ownerCount; j++) {
+      struct ClientOwner* owner = &transfer->owners[j];
+      if (owner->possible) {
+        int answer = getProbedFileAnswer(&context->ownerRanking, owner->udpAddress,
+                                         transfer->filename);
+        if (answer == 0) {
+          continue;
+        }
+        owner->possible = answer != 1;
+      }
+      transfer->owners[ownerCount++] = *owner;
+    }
+    transfer->ownerCount = ownerCount;
+    rankOwners(context, transfer->owners, transfer->ownerCount);
+    if (context->debugFlag) {
+      printf("Owners of %s ranked, %s first\n", transfer->filename,
+             transfer->ownerCount > 0 ? transfer->owners[0].username : "none");
+    }
+    tryNextOwner(context, transfer);
+  }
+}
+
+/*
+ * Purpose: Move a download along. Sends the request once connected, then reads the
+ * size line and writes the file out as it arrives.
+ * Input:
+ * - The client
+ * - The download
+ * - Whether its socket can be read from
+ * - Whether its socket can be written to
+ * Output: None
+ */
+static void continueDownload(struct ClientContext* context,
+                             struct Transfer* transfer,
+                             bool readable,
+                             bool writable) {
+  if (transfer->state == TRANSFER_CONNECTING) {
+    if (!writable) {
+      return;
+    }
+    int connectError    = 0;
+    socklen_t errorSize  = sizeof(connectError);
+    getsockopt(transfer->socketDescriptor, SOL_SOCKET, SO_ERROR, &connectError,
+               &errorSize);
+    char request[TRANSFER_HEADER_SIZE];
+    int requestLength = snprintf(request, sizeof(request), "%s\n", transfer->filename);
+    // The request is tiny, a fresh connection takes all of it at once
+    if (connectError != 0 || send(transfer->socketDescriptor, request,
+                                  (size_t)requestLength, MSG_NOSIGNAL) != requestLength) {
+      tryNextOwner(context, transfer);
+      return;
+    }
+    transfer->state        = TRANSFER_RECEIVING;
+    transfer->lastProgress = getMicroseconds();
+    return;
+  }
+
+  if (!readable) {
+    return;
+  }
+  long received =
+      recv(transfer->socketDescriptor, transfer->buffer, TRANSFER_BUFFER_SIZE, 0);
+  if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return;
+  }
+  // The owner hung up early or doesn't have the file, so another owner is tried
+  if (received <= 0) {
+    tryNextOwner(context, transfer);
+    return;
+  }
+  transfer->lastProgress = getMicroseconds();
+
+  char* data           = transfer->buffer;
+  unsigned long length = (unsigned long)received;
+  char path[MAX_DIRECTORY_PATH + MAX_FILENAME + 8];
+  while (transfer->remaining == -1 && length > 0) {
+    char next = *data;
+    data++;
+    length--;
+    if (next != '\n') {
+      if (transfer->headerLength == TRANSFER_HEADER_SIZE - 1) {
+        tryNextOwner(context, transfer);
+        return;
+      }
+      transfer->header[transfer->headerLength++] = next;
+      continue;
+    }
+
+    transfer->header[transfer->headerLength] = '\0';
+    long size = strtol(transfer->header, NULL, 10);
+    if (size < 0) {
+      tryNextOwner(context, transfer);
+      return;
+    }
+    mkdir(context->downloadDirectory, S_IRWXU);
+    snprintf(path, sizeof(path), "%s/%s.part", context->downloadDirectory,
+             transfer->filename);
+    transfer->fileDescriptor =
+        open(path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+    if (transfer->fileDescriptor == -1) {
+      perror("Error opening download");
+      finishDownload(context, transfer, false);
+      return;
+    }
+    transfer->remaining = size;
+    transfer->fileSize  = size;
+  }
+
+  if (transfer->remaining != -1 && length > 0) {
+    // Anything past the end of the file is ignored
+    if (length > (unsigned long)transfer->remaining) {
+      length = (unsigned long)transfer->remaining;
+    }
+    if (write(transfer->fileDescriptor, data, length) != (long)length) {
+      perror("Error writing download");
+      finishDownload(context, transfer, false);
+      return;
+    }
+    TRACE(TRACE_FILE_WRITTEN, length, 0);
+    transfer->remaining -= (long)length;
+  }
+
+  if (transfer->remaining == 0) {
+    char finishedPath[MAX_DIRECTORY_PATH + MAX_FILENAME + 8];
+    snprintf(path, sizeof(path), "%s/%s.part", context->downloadDirectory,
+             transfer->filename);
+    snprintf(finishedPath, sizeof(finishedPath), "%s/%s", context->downloadDirectory,
+             transfer->filename);
+    close(transfer->fileDescriptor);
+    transfer->fileDescriptor = -1;
+    recordTransferRate(&context->ownerRanking,
+                       transfer->owners[transfer->ownerIndex - 1].udpAddress,
+                       (unsigned long)transfer->fileSize,
+                       getMicroseconds() - transfer->connectedAt);
+    if (rename(path, finishedPath) != 0) {
+      finishDownload(context, transfer, false);
+      return;
+    }
+    seedDownload(context, transfer->filename, (unsigned long)transfer->fileSize);
+    finishDownload(context, transfer, true);
+  }
+}
+
+/*
+ * Purpose: Count a client's transfers in a state
+ * Input:
+ * - The client
+ * - The state
+ * Output: Number of transfers in the state
+ */
+static int countTransfers(struct ClientContext* context, int state) {
+  int count = 0;
+  int i;
+  for (i = 0; i < MAX_TRANSFERS; i++) {
+    if (context->transfers[i].state == state) {
+      count++;
+    }
+  }
+  return count;
+}
+
+/*
+ * Purpose: Count the uploads sending to a host. Hosts are told apart by IP address
+ * alone, a peer opens a new port for every download.
+ * Input:
+ * - The client
+ * - Address of the host
+ * Output: Number of uploads sending to the host
+ */
+static int countPeerUploads(struct ClientContext* context, struct sockaddr_in* address) {
+  int count = 0;
+  int i;
+  for (i = 0; i < MAX_TRANSFERS; i++) {
+    struct Transfer* transfer = &context->transfers[i];
+    if (transfer->state == TRANSFER_SENDING &&
+        transfer->peerAddress.sin_addr.s_addr == address->sin_addr.s_addr) {
+      count++;
+    }
+  }
+  return count;
+}
+
+/*
+ * Purpose: Take every waiting connection from another client that wants a file. They
+ * are turned away if the client already has MAX_UPLOADS uploads or every transfer slot
+ * is in use.
+ * Input: The client
+ * Output: None
+ */
+static void acceptUploads(struct ClientContext* context) {
+  while (1) {
+    struct sockaddr_in peerAddress;
+    socklen_t addressSize = sizeof(peerAddress);
+    int socketDescriptor  = accept(context->tcpSocketDescriptor,
+                                   (struct sockaddr*)&peerAddress, &addressSize);
+    if (socketDescriptor == -1) {
+      return;
+    }
+    int uploadCount = countTransfers(context, TRANSFER_REQUEST) +
+                      countTransfers(context, TRANSFER_QUEUED) +
+                      countTransfers(context, TRANSFER_SENDING);
+    struct Transfer* transfer = NULL;
+    if (uploadCount < MAX_UPLOADS) {
+      transfer = findFreeTransfer(context);
+    }
+    if (transfer == NULL) {
+      statsAdd(STATS_UPLOADS_REJECTED, 1);
+      close(socketDescriptor);
+      continue;
+    }
+    fcntl(socketDescriptor, F_SETFL, O_NONBLOCK);
+    transfer->state            = TRANSFER_REQUEST;
+    transfer->socketDescriptor = socketDescriptor;
+    transfer->peerAddress      = peerAddress;
+    transfer->lastProgress     = getMicroseconds();
+  }
+}
+
+/*
+ * Purpose: Get the most tokens a bucket can hold
+ * Input: The bucket
+ * Output: Bytes it can save up
+ */
+static unsigned long getBucketBurst(struct UploadBucket* bucket) {
+  return bucket->rate * UPLOAD_BURST_TIME / 1000000 + 1;
+}
+
+/*
+ * Purpose: Add the tokens a bucket has earned since it was last refilled. It holds at
+ * most UPLOAD_BURST_TIME of its rate. Time that hasn't earned a whole token is left to
+ * add up.
+ * Input:
+ * - The bucket
+ * - Current time
+ * Output: None
+ */
+static void refillUploadBucket(struct UploadBucket* bucket, unsigned long currentTime) {
+  unsigned long elapsed = currentTime - bucket->lastRefill;
+  if (elapsed > UPLOAD_BURST_TIME) {
+    elapsed = UPLOAD_BURST_TIME;
+  }
+  unsigned long added = elapsed * bucket->rate / 1000000;
+  if (added == 0) {
+    return;
+  }
+  bucket->tokens += added;
+  if (bucket->tokens > getBucketBurst(bucket)) {
+    bucket->tokens = getBucketBurst(bucket);
+  }
+  bucket->lastRefill = currentTime;
+}
+
+/*
+ * Purpose: Get how many bytes an upload can send now without going over its own rate
+ * or the client's total rate. It takes no more than an even share of what the total
+ * rate can save up, so the uploads sending take turns at it.
+ * Input:
+ * - The client
+ * - The upload
+ * Output: Bytes the upload can send
+ */
+static unsigned long getUploadAllowance(struct ClientContext* context,
+                                        struct Transfer* transfer) {
+  unsigned long currentTime = getMicroseconds();
+  unsigned long allowance   = TRANSFER_BUFFER_SIZE;
+  struct UploadBucket* shared = &context->uploadBucket;
+  if (shared->rate != 0) {
+    refillUploadBucket(shared, currentTime);
+    unsigned long share =
+        getBucketBurst(shared) / (unsigned long)countTransfers(context, TRANSFER_SENDING);
+    if (share == 0) {
+      share = 1;
+    }
+    if (shared->tokens < allowance) {
+      allowance = shared->tokens;
+    }
+    if (share < allowance) {
+      allowance = share;
+    }
+  }
+  if (transfer->bucket.rate != 0) {
+    refillUploadBucket(&transfer->bucket, currentTime);
+    if (transfer->bucket.tokens < allowance) {
+      allowance = transfer->bucket.tokens;
+    }
+  }
+  return allowance;
+}
+
+/*
+ * Purpose: Open the file an upload asked for and get its size line ready to send
+ * Input:
+ * - The client
+ * - The upload
+ * Output: None
+ */
+static void startUpload(struct ClientContext* context, struct Transfer* transfer) {
+  long size = -1;
+  if (isValidFilename(transfer->header)) {
+    strcpy(transfer->filename, transfer->header);
+    char path[MAX_DIRECTORY_PATH + MAX_FILENAME + 8];
+    snprintf(path, sizeof(path), "%s/%s", context->publicDirectory, transfer->filename);
+    transfer->fileDescriptor = open(path, O_RDONLY);
+    struct stat fileInformation;
+    if (transfer->fileDescriptor != -1 &&
+        fstat(transfer->fileDescriptor, &fileInformation) == 0 &&
+        S_ISREG(fileInformation.st_mode)) {
+      size = fileInformation.st_size;
+    }
+  }
+  if (context->debugFlag) {
+    printf("Uploading %s, %ld bytes\n", transfer->header, size);
+  }
+  int i;
+  for (i = 0; i < context->seededFileCount; i++) {
+    if (strcmp(context->seededFiles[i].filename, transfer->filename) == 0) {
+      context->seededFiles[i].lastUsed = getMicroseconds();
+    }
+  }
+  transfer->bufferStart = 0;
+  transfer->bufferEnd =
+      (unsigned long)snprintf(transfer->buffer, TRANSFER_BUFFER_SIZE, "%ld\n", size);
+  transfer->remaining    = size < 0 ? 0 : size;
+  transfer->fileSize     = transfer->remaining;
+  transfer->state        = TRANSFER_SENDING;
+  transfer->lastProgress = getMicroseconds();
+
+  // Starts with a full burst so the size line goes out right away
+  transfer->bucket.rate       = context->uploadRate;
+  transfer->bucket.tokens     = getBucketBurst(&transfer->bucket);
+  transfer->bucket.lastRefill = transfer->lastProgress;
+}
+
+/*
+ * Purpose: Give free upload slots to queued uploads. The one started next is for the
+ * host with the fewest uploads sending, the longest waiting of those, so a host that
+ * asks for many files at once doesn't crowd out the others.
+ * Input: The client
+ * Output: None
+ */
+static void scheduleUploads(struct ClientContext* context) {
+  int sendingCount = countTransfers(context, TRANSFER_SENDING);
+  while (sendingCount < UPLOAD_SLOTS) {
+    struct Transfer* next = NULL;
+    int nextPeerUploads   = 0;
+    int i;
+    for (i = 0; i < MAX_TRANSFERS; i++) {
+      struct Transfer* transfer = &context->transfers[i];
+      if (transfer->state != TRANSFER_QUEUED) {
+        continue;
+      }
+      int peerUploads = countPeerUploads(context, &transfer->peerAddress);
+      if (next == NULL || peerUploads < nextPeerUploads ||
+          (peerUploads == nextPeerUploads && transfer->queuedAt < next->queuedAt)) {
+        next            = transfer;
+        nextPeerUploads = peerUploads;
+      }
+    }
+    if (next == NULL) {
+      break;
+    }
+    startUpload(context, next);
+    sendingCount++;
+  }
+  statsSet(STATS_UPLOADS_ACTIVE, (unsigned long)sendingCount);
+  statsSet(STATS_UPLOADS_QUEUED, (unsigned long)countTransfers(context, TRANSFER_QUEUED));
+}
+
+/*
+ * Purpose: Refill the empty buffer of an upload from its file. With the file ring the
+ * read is only started, and finishFileReads() fills the buffer once it is done.
+ * Input:
+ * - The client
+ * - The upload, with some of the file left to send
+ * Output: Whether the buffer was filled, false if the upload is waiting for its read or
+ * was closed
+ */
+static bool readUploadChunk(struct ClientContext* context, struct Transfer* transfer) {
+  unsigned long wanted = TRANSFER_BUFFER_SIZE;
+  if ((unsigned long)transfer->remaining < wanted) {
+    wanted = (unsigned long)transfer->remaining;
+  }
+  // Read into the buffer at the end of what has been sent, tagged with the upload's slot
+  unsigned long offset = (unsigned long)(transfer->fileSize - transfer->remaining);
+  unsigned long slot   = (unsigned long)(transfer - context->transfers);
+  if (context->fileUring &&
+      queueFileUringRead(&context->fileQueue, transfer->fileDescriptor, transfer->buffer,
+                         wanted, offset, slot) == 0) {
+    transfer->readPending = true;
+    return false;
+  }
+  long bytesRead = read(transfer->fileDescriptor, transfer->buffer, wanted);
+  if (bytesRead <= 0) {
+    closeTransfer(context, transfer);
+    return false;
+  }
+  TRACE(TRACE_FILE_READ, bytesRead, 0);
+  transfer->bufferStart = 0;
+  transfer->bufferEnd   = (unsigned long)bytesRead;
+  transfer->remaining -= bytesRead;
+  return true;
+}
+
+/*
+ * Purpose: Move an upload along. Reads the filename asked for and queues the upload
+ * for a slot, see scheduleUploads(). Once it has one, sends the size line and the file
+ * from the public directory as fast as the upload rates allow.
+ * Input:
+ * - The client
+ * - The upload
+ * - Whether its socket can be read from
+ * - Whether its socket can be written to
+ * Output: None
+ */
+static void continueUpload(struct ClientContext* context,
+                           struct Transfer* transfer,
+                           bool readable,
+                           bool writable) {
+  if (transfer->state == TRANSFER_REQUEST) {
+    if (!readable) {
+      return;
+    }
+    long received = recv(transfer->socketDescriptor,
+                         transfer->header + transfer->headerLength,
+                         TRANSFER_HEADER_SIZE - 1 - transfer->headerLength, 0);
+    if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (received <= 0) {
+      closeTransfer(context, transfer);
+      return;
+    }
+    transfer->headerLength += (unsigned long)received;
+    transfer->lastProgress = getMicroseconds();
+    char* end              = memchr(transfer->header, '\n', transfer->headerLength);
+    if (end == NULL) {
+      if (transfer->headerLength == TRANSFER_HEADER_SIZE - 1) {
+        closeTransfer(context, transfer);
+      }
+      return;
+    }
+    *end               = '\0';
+    transfer->state    = TRANSFER_QUEUED;
+    transfer->queuedAt = transfer->lastProgress;
+    return;
+  }
+
+  if (transfer->readPending || !writable ||
+      transfer->throttledUntil > getMicroseconds()) {
+    return;
+  }
+  if (transfer->bufferStart == transfer->bufferEnd &&
+      !readUploadChunk(context, transfer)) {
+    return;
+  }
+
+  unsigned long length    = transfer->bufferEnd - transfer->bufferStart;
+  unsigned long allowance = getUploadAllowance(context, transfer);
+  if (allowance == 0) {
+    transfer->throttledUntil = getMicroseconds() + UPLOAD_SHAPING_INTERVAL;
+    return;
+  }
+  if (allowance < length) {
+    length = allowance;
+  }
+  long sent = send(transfer->socketDescriptor, transfer->buffer + transfer->bufferStart,
+                   length, MSG_NOSIGNAL);
+  if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return;
+  }
+  if (sent <= 0) {
+    closeTransfer(context, transfer);
+    return;
+  }
+  if (context->uploadBucket.rate != 0) {
+    context->uploadBucket.tokens -= (unsigned long)sent;
+  }
+  if (transfer->bucket.rate != 0) {
+    transfer->bucket.tokens -= (unsigned long)sent;
+  }
+  statsAdd(STATS_UPLOAD_BYTES, (unsigned long)sent);
+  transfer->bufferStart += (unsigned long)sent;
+  transfer->lastProgress = getMicroseconds();
+  if (transfer->bufferStart == transfer->bufferEnd && transfer->remaining == 0) {
+    closeTransfer(context, transfer);
+  } else if (transfer->bufferStart == transfer->bufferEnd && context->fileUring) {
+    // Read the next chunk while the socket drains
+    readUploadChunk(context, transfer);
+  }
+}
+
+/*
+ * Purpose: Give up on transfers that haven't made progress in TRANSFER_TIMEOUT.
+ * Downloads move on to the next owner. Queued uploads count as stalled too, so the
+ * peer can try another owner instead of waiting for a slot.
+ * Input: The client
+ * Output: None
+ */
+static void checkTransferTimeouts(struct ClientContext* context) {
+  unsigned long currentTime = getMicroseconds();
+  int i;
+  for (i = 0; i < MAX_TRANSFERS; i++) {
+    struct Transfer* transfer = &context->transfers[i];
+    if (transfer->state == TRANSFER_FREE ||
+        currentTime - transfer->lastProgress < TRANSFER_TIMEOUT) {
+      continue;
+    }
+    if (transfer->state == TRANSFER_LOOKUP) {
+      finishDownload(context, transfer, false);
+    } else if (transfer->state == TRANSFER_CONNECTING ||
+               transfer->state == TRANSFER_RECEIVING) {
+      tryNextOwner(context, transfer);
+    } else {
+      closeTransfer(context, transfer);
+    }
+  }
+}
+
+/*
+ * Purpose: Add the descriptors a client is waiting on to the sets given to select()
+ * Input:
+ * - The client
+ * - Descriptors to wait to read from
+ * - Descriptors to wait to write to
+ * - Highest descriptor already in the sets
+ * Output: Highest descriptor in the sets
+ */
+int addClientDescriptors(struct ClientContext* context,
+                         fd_set* readSet,
+                         fd_set* writeSet,
+                         int maxDescriptor) {
+  FD_SET(context->udpSocketDescriptor, readSet);
+  FD_SET(context->tcpSocketDescriptor, readSet);
+  if (context->udpSocketDescriptor > maxDescriptor) {
+    maxDescriptor = context->udpSocketDescriptor;
+  }
+  if (context->tcpSocketDescriptor > maxDescriptor) {
+    maxDescriptor = context->tcpSocketDescriptor;
+  }
+  if (context->fileUring) {
+    FD_SET(context->fileQueue.ringDescriptor, readSet);
+    if (context->fileQueue.ringDescriptor > maxDescriptor) {
+      maxDescriptor = context->fileQueue.ringDescriptor;
+    }
+  }
+
+  int i;
+  for (i = 0; i < MAX_TRANSFERS; i++) {
+    struct Transfer* transfer = &context->transfers[i];
+    switch (transfer->state) {
+    case TRANSFER_SENDING:
+      if (transfer->throttledUntil > getMicroseconds()) {
+        continue; // getClientTimeout() wakes the client for it
+      }
+      if (transfer->readPending) {
+        continue; // Woken by the file ring
+      }
+      FD_SET(transfer->socketDescriptor, writeSet);
+      break;
+    case TRANSFER_CONNECTING:
+      FD_SET(transfer->socketDescriptor, writeSet);
+      break;
+    case TRANSFER_RECEIVING:
+    case TRANSFER_REQUEST:
+      FD_SET(transfer->socketDescriptor, readSet);
+      break;
+    default:
+      continue;
+    }
+    if (transfer->socketDescriptor > maxDescriptor) {
+      maxDescriptor = transfer->socketDescriptor;
+    }
+  }
+  return maxDescriptor;
+}
+
+/*
+ * Purpose: Get how long a client can be left alone before processClient() has timed
+ * work to do, for gossip rounds, retransmissions, registration, throttled uploads,
+ * downloads waiting for probes and stalled transfers
+ * Input: The client
+ * Output: Microseconds until the client needs processing
+ */
+unsigned long getClientTimeout(struct ClientContext* context) {
+  unsigned long currentTime = getMicroseconds();
+  unsigned long waitTime    = 0;
+  if (context->nextGossipRound > currentTime) {
+    waitTime = context->nextGossipRound - currentTime;
+  }
+  unsigned long retransmitTime = getReliableTimeout(&context->reliableState);
+  if (retransmitTime < waitTime) {
+    waitTime = retransmitTime;
+  }
+  if (context->lastHeartbeat != 0) {
+    unsigned long silenceTime = 0;
+    if (context->lastHeartbeat + SERVER_SILENCE_TIMEOUT > currentTime) {
+      silenceTime = context->lastHeartbeat + SERVER_SILENCE_TIMEOUT - currentTime;
+    }
+    if (silenceTime < waitTime) {
+      waitTime = silenceTime;
+    }
+  }
+  // Register packets held back by the window wait for an ack instead
+  if (canSendRegistrationChunk(context)) {
+    unsigned long chunkTime = 0;
+    if (context->nextRegistrationChunk > currentTime) {
+      chunkTime = context->nextRegistrationChunk - currentTime;
+    }
+    if (chunkTime < waitTime) {
+      waitTime = chunkTime;
+    }
+  }
+
+  int i;
+  for (i = 0; i < MAX_TRANSFERS; i++) {
+    if (context->transfers[i].state != TRANSFER_FREE) {
+      unsigned long checkTime = 0;
+      if (context->nextTransferCheck > currentTime) {
+        checkTime = context->nextTransferCheck - currentTime;
+      }
+      if (checkTime < waitTime) {
+        waitTime = checkTime;
+      }
+      break;
+    }
+  }
+  for (i = 0; i < MAX_TRANSFERS; i++) {
+    struct Transfer* transfer = &context->transfers[i];
+    if (transfer->state == TRANSFER_SENDING && transfer->throttledUntil > currentTime &&
+        transfer->throttledUntil - currentTime < waitTime) {
+      waitTime = transfer->throttledUntil - currentTime;
+    }
+    if (transfer->state == TRANSFER_PROBING) {
+      unsigned long probeTime = 0;
+      if (transfer->probeDeadline > currentTime) {
+        probeTime = transfer->probeDeadline - currentTime;
+      }
+      if (probeTime < waitTime) {
+        waitTime = probeTime;
+      }
+    }
+  }
+  return waitTime;
+}
+
+/*
+ * Purpose: Do everything a client has waiting. Timed work is done if it is due and
+ * every ready descriptor is handled. Never blocks.
+ * Input:
+ * - The client
+ * - Descriptors select() found readable, NULL to try every descriptor
+ * - Descriptors select() found writable, NULL to try every descriptor
+ * Output: None
+ */
+void processClient(struct ClientContext* context, fd_set* readSet, fd_set* writeSet) {
+  checkReliableTimeouts(&context->reliableState, context->udpSocketDescriptor,
+                        context->debugFlag);
+
+  unsigned long currentTime = getMicroseconds();
+  if (currentTime >= context->nextGossipRound) {
+    struct GossipState* gossipState = &context->gossipState;
+    syncPublicDirectory(context, true);
+    runGossipRound(gossipState, context->udpSocketDescriptor, context->debugFlag);
+    statsSet(STATS_GOSSIP_PEERS, (unsigned long)gossipState->peerCount);
+    statsSet(STATS_GOSSIP_ENTRIES, (unsigned long)gossipState->entryCount);
+    if (gossipState->roundCount % GOSSIP_PEER_REFRESH_ROUNDS == 0) {
+      sendPeersPacket(context);
+    }
+    context->nextGossipRound += GOSSIP_PERIOD;
+  }
+  if (currentTime >= context->nextTransferCheck) {
+    checkTransferTimeouts(context);
+    context->nextTransferCheck = currentTime + TRANSFER_CHECK_INTERVAL;
+  }
+  // Only once connectClient() has been called
+  if (context->lastHeartbeat != 0 &&
+      currentTime >= context->lastHeartbeat + SERVER_SILENCE_TIMEOUT) {
+    resumeSession(context);
+  }
+
+  // Message in UDP queue
+  if (readSet == NULL || FD_ISSET(context->udpSocketDescriptor, readSet)) {
+    struct sockaddr_in senderAddress;
+    memset(context->packet, 0, MAX_PACKET);
+    while (checkUdpSocket(context->udpSocketDescriptor, &senderAddress, context->packet,
+                          context->debugFlag) == 1) {
+      if (context->debugFlag) {
+        printf("Packet received\n");
+      }
+      handlePacket(context, senderAddress);
+      memset(context->packet, 0, MAX_PACKET);
+    }
+  }
+
+  // Acks that just came in may have made room for more of the registration
+  sendRegistrationChunks(context);
+
+  // Probe answers that just came in may have ranked the owners of a download
+  startProbedDownloads(context);
+
+  // Another client wants a file
+  if (readSet == NULL || FD_ISSET(context->tcpSocketDescriptor, readSet)) {
+    acceptUploads(context);
+  }
+
+  // Reads that finished since give their uploads something to send
+  if (context->fileUring) {
+    finishFileReads(context, false);
+  }
+
+  // Starts from a different transfer each time so none of them always gets the
+  // upload rates first
+  int i;
+  for (i = 0; i < MAX_TRANSFERS; i++) {
+    struct Transfer* transfer =
+        &context->transfers[(context->nextTransfer + i) % MAX_TRANSFERS];
+    if (transfer->state == TRANSFER_FREE || transfer->state == TRANSFER_LOOKUP ||
+        transfer->state == TRANSFER_PROBING || transfer->state == TRANSFER_QUEUED) {
+      continue;
+    }
+    // Uploads that were just accepted aren't in the sets yet
+    bool readable = readSet == NULL || FD_ISSET(transfer->socketDescriptor, readSet);
+    bool writable = writeSet == NULL || FD_ISSET(transfer->socketDescriptor, writeSet);
+    if (transfer->state == TRANSFER_REQUEST || transfer->state == TRANSFER_SENDING) {
+      continueUpload(context, transfer, readable, writable);
+    } else {
+      continueDownload(context, transfer, readable, writable);
+    }
+  }
+  context->nextTransfer = (context->nextTransfer + 1) % MAX_TRANSFERS;
+
+  // Uploads that finished leave slots for queued ones
+  scheduleUploads(context);
+}
+
+/*
+ * Purpose: Wait for a client to have something to do, then do it. For programs that
+ * only run clients and have no other descriptors to wait on.
+ * Input:
+ * - The client
+ * - Most microseconds to wait
+ * Output:
+ * - -1: select() failed
+ * - Anything else: Number of ready descriptors
+ */
+int pollClient(struct ClientContext* context, unsigned long timeout) {
+  fd_set readSet;
+  fd_set writeSet;
+  FD_ZERO(&readSet);
+  FD_ZERO(&writeSet);
+  int maxDescriptor = addClientDescriptors(context, &readSet, &writeSet, -1);
+
+  unsigned long clientTimeout = getClientTimeout(context);
+  if (clientTimeout < timeout) {
+    timeout = clientTimeout;
+  }
+  struct timeval waitTime;
+  waitTime.tv_sec  = (long)(timeout / 1000000);
+  waitTime.tv_usec = (long)(timeout % 1000000);
+
+  int activity = select(maxDescriptor + 1, &readSet, &writeSet, NULL, &waitTime);
+  if (activity < 0) {
+    if (errno != EINTR) {
+      perror("select error");
+    }
+    FD_ZERO(&readSet);
+    FD_ZERO(&writeSet);
+  }
+  processClient(context, &readSet, &writeSet);
+  return activity;
+}
+
+/*
+ * Purpose: Entries of a client's packet handler table. Each one takes what its handler
+ * needs out of the packet, see dispatchPacket().
+ * Input:
+ * - The client
+ * - The packet's fields
+ * - Node that sent the packet
+ * - Debug flag
+ * Output: None
+ */
+static void onStatusPacket(void* node,
+                           struct PacketFields* packetFields,
+                           struct sockaddr_in senderAddress,
+                           bool debugFlag) {
+  (void)packetFields;
+  (void)senderAddress;
+  (void)debugFlag;
+  handleStatusPacket(node);
+}
+
+static void onResourcePacket(void* node,
+                             struct PacketFields* packetFields,
+                             struct sockaddr_in senderAddress,
+                             bool debugFlag) {
+  (void)senderAddress;
+  (void)debugFlag;
+  long nextIndex = handleResourcePacket(node, packetFields->data);
+  if (nextIndex > 0) {
+    sendResourcePacket(node, (unsigned long)nextIndex);
+  }
+}
+
+static void onPeersPacket(void* node,
+                          struct PacketFields* packetFields,
+                          struct sockaddr_in senderAddress,
+                          bool debugFlag) {
+  (void)senderAddress;
+  struct ClientContext* context = node;
+  handlePeersPacket(&context->gossipState, packetFields->data, debugFlag);
+}
+
+static void onGossipPacket(void* node,
+                           struct PacketFields* packetFields,
+                           struct sockaddr_in senderAddress,
+                           bool debugFlag) {
+  struct ClientContext* context = node;
+  handleGossipPacket(&context->gossipState, packetFields->data, senderAddress,
+                     debugFlag);
+}
+
+static void onDigestPacket(void* node,
+                           struct PacketFields* packetFields,
+                           struct sockaddr_in senderAddress,
+                           bool debugFlag) {
+  struct ClientContext* context = node;
+  handleDigestPacket(&context->gossipState, packetFields->data, senderAddress,
+                     context->udpSocketDescriptor, debugFlag);
+}
+
+static void onLookupPacket(void* node,
+                           struct PacketFields* packetFields,
+                           struct sockaddr_in senderAddress,
+                           bool debugFlag) {
+  (void)senderAddress;
+  (void)debugFlag;
+  handleLookupPacket(node, packetFields->data);
+}
+
+/*
+ * Purpose: Check whether a client shares a file, to answer a probe asking about it
+ * Input:
+ * - The client
+ * - The file
+ * Output: Whether the file is in the public directory as of the last sync
+ */
+static bool isSharedFile(void* node, char* filename) {
+  struct ClientContext* context = node;
+  return context->sharedFileCount > 0 &&
+         bsearch(filename, context->sharedFiles, (unsigned long)context->sharedFileCount,
+                 MAX_FILENAME, compareFilenames) != NULL;
+}
+
+static void onProbePacket(void* node,
+                          struct PacketFields* packetFields,
+                          struct sockaddr_in senderAddress,
+                          bool debugFlag) {
+  struct ClientContext* context = node;
+  handleProbePacket(&context->ownerRanking, packetFields->data, senderAddress,
+                    context->udpSocketDescriptor, isSharedFile, context, debugFlag);
+}
+
+static void onSearchPacket(void* node,
+                           struct PacketFields* packetFields,
+                           struct sockaddr_in senderAddress,
+                           bool debugFlag) {
+  (void)senderAddress;
+  (void)debugFlag;
+  handleSearchPacket(node, packetFields->data);
+}
+
+static void onFindPacket(void* node,
+                         struct PacketFields* packetFields,
+                         struct sockaddr_in senderAddress,
+                         bool debugFlag) {
+  (void)senderAddress;
+  (void)debugFlag;
+  handleFindPacket(node, packetFields->data);
+}
+
+static void onSessionPacket(void* node,
+                            struct PacketFields* packetFields,
+                            struct sockaddr_in senderAddress,
+                            bool debugFlag) {
+  (void)senderAddress;
+  (void)debugFlag;
+  handleSessionPacket(node, packetFields->data);
+}
+
+// What a client does with each packet type, the node passed along is the client's
+// context. Acks are handled by the reliable layer.
+static const struct PacketHandlers clientPacketHandlers = {{
+    [PACKET_STATUS]   = onStatusPacket,
+    [PACKET_RESOURCE] = onResourcePacket,
+    [PACKET_PEERS]    = onPeersPacket,
+    [PACKET_GOSSIP]   = onGossipPacket,
+    [PACKET_DIGEST]   = onDigestPacket,
+    [PACKET_LOOKUP]   = onLookupPacket,
+    [PACKET_SEARCH]   = onSearchPacket,
+    [PACKET_PROBE]    = onProbePacket,
+    [PACKET_FIND]     = onFindPacket,
+    [PACKET_SESSION]  = onSessionPacket,
+}};
+
+/*
+ * Purpose: Take a packet of unknown type and call its corrosponding handler function
+ * Input:
+ * - The client, holding the packet
+ * - Address of the node that sent the packet
+ * Output: None
+ */
+void handlePacket(struct ClientContext* context, struct sockaddr_in senderAddress) {
+  bool debugFlag            = context->debugFlag;
+  unsigned long receiveTime = getNanoseconds();
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  readPacket(context->packet, &packetFields, debugFlag);
+
+  int packetType = getPacketType(packetFields.type, debugFlag);
+
+  // Acks and retransmissions of packets already handled go no further
+  if (!handleReliablePacket(&context->reliableState, context->udpSocketDescriptor,
+                            senderAddress, &packetFields, debugFlag)) {
+    statsRecordPacket(packetType, getNanoseconds() - receiveTime);
+    return;
+  }
+  dispatchPacket(&clientPacketHandlers, packetType, context, &packetFields,
+                 senderAddress, debugFlag);
+  unsigned long handleTime = getNanoseconds() - receiveTime;
+  statsRecordPacket(packetType, handleTime);
+  TRACE(TRACE_PACKET_HANDLED, packetType, handleTime);
+}
+
+/*
+ * Purpose: Pass every resource in a sent resource packet to onResource. The page is
+ * compressed, see makeCompressedResourceString() on the server. Each filename is
+ * rebuilt from the start of the filename before it in its group.
+ * Input:
+ * - The client
+ * - Data field of the sent resource packet
+ * Output: Index of the first resource of the next page to ask for, -1 if this was the
+ * last page or the page is malformed
+ */
+long handleResourcePacket(struct ClientContext* context, char* dataField) {
+  bool debugFlag = context->debugFlag;
+  char* subfield = calloc(1, MAX_DATA);
+  char* username = calloc(1, MAX_DATA);
+  char* filename = calloc(1, MAX_DATA);
+
+  dataField                = readPacketSubfield(dataField, subfield, MAX_DATA, debugFlag);
+  unsigned long nextIndex  = strtoul(subfield, NULL, 10);
+  memset(subfield, 0, MAX_DATA);
+  dataField                = readPacketSubfield(dataField, subfield, MAX_DATA, debugFlag);
+  unsigned long totalCount = strtoul(subfield, NULL, 10);
+
+  bool malformed = false;
+  while (*dataField != '\0' && !malformed) {
+    memset(username, 0, MAX_DATA);
+    dataField = readPacketSubfield(dataField, username, MAX_DATA, debugFlag);
+
+    memset(subfield, 0, MAX_DATA);
+    dataField = readPacketSubfield(dataField, subfield, MAX_DATA, debugFlag);
+    int count = atoi(subfield);
+
+    memset(filename, 0, MAX_DATA);
+    int i;
+    for (i = 0; i < count; i++) {
+      memset(subfield, 0, MAX_DATA);
+      dataField            = readPacketSubfield(dataField, subfield, MAX_DATA, debugFlag);
+      unsigned long prefix = (unsigned long)(subfield[0] - RESOURCE_PREFIX_BASE);
+      if (subfield[0] < RESOURCE_PREFIX_BASE || prefix > strlen(filename) ||
+          prefix + strlen(subfield + 1) >= MAX_FILENAME) {
+        malformed = true;
+        break;
+      }
+      strcpy(filename + prefix, subfield + 1);
+      if (context->callbacks.onResource != NULL) {
+        context->callbacks.onResource(context->callbackData, username, filename);
+      }
+    }
+  }
+
+  free(subfield);
+  free(username);
+  free(filename);
+
+  bool lastPage = nextIndex == 0 || nextIndex >= totalCount;
+  if ((malformed || lastPage) && context->callbacks.onListingEnd != NULL) {
+    context->callbacks.onListingEnd(context->callbackData, !malformed);
+  }
+  if (malformed || lastPage) {
+    return -1;
+  }
+  return (long)nextIndex;
+}
+
+/*
+ * Purpose: Pass the owners of a file sent back in response to a lookup packet to
+ * onLookup, the one expected to be fastest first, and start any downloads that were
+ * waiting for them
+ * Input:
+ * - The client
+ * - Data field of the lookup packet. Filename followed by the username, UDP address
+ * and TCP address of each owner, and 1 if it is known to have the file or 0 if it
+ * only might.
+ * Output: None
+ */
+void handleLookupPacket(struct ClientContext* context, char* dataField) {
+  bool debugFlag = context->debugFlag;
+  char* filename = calloc(1, MAX_DATA);
+  dataField      = readPacketSubfield(dataField, filename, MAX_DATA, debugFlag);
+
+  struct ClientOwner owners[MAX_LOOKUP_OWNERS];
+  memset(owners, 0, sizeof(owners));
+  char* ownerInfo[6];
+  int ownerCount = 0;
+  int i;
+  for (i = 0; i < 6; i++) {
+    ownerInfo[i] = calloc(1, MAX_DATA);
+  }
+  while (*dataField != '\0' && ownerCount < MAX_LOOKUP_OWNERS) {
+    for (i = 0; i < 6; i++) {
+      memset(ownerInfo[i], 0, MAX_DATA);
+      dataField = readPacketSubfield(dataField, ownerInfo[i], MAX_DATA, debugFlag);
+    }
+    struct ClientOwner* owner = &owners[ownerCount++];
+    strncpy(owner->username, ownerInfo[0], MAX_USERNAME - 1);
+    owner->udpAddress.sin_family      = AF_INET;
+    owner->udpAddress.sin_addr.s_addr = (unsigned int)strtoul(ownerInfo[1], NULL, 10);
+    owner->udpAddress.sin_port        = (unsigned short)strtoul(ownerInfo[2], NULL, 10);
+    owner->tcpAddress.sin_family      = AF_INET;
+    owner->tcpAddress.sin_addr.s_addr = (unsigned int)strtoul(ownerInfo[3], NULL, 10);
+    owner->tcpAddress.sin_port        = (unsigned short)strtoul(ownerInfo[4], NULL, 10);
+    owner->possible                   = strcmp(ownerInfo[5], "0") == 0;
+  }
+  for (i = 0; i < 6; i++) {
+    free(ownerInfo[i]);
+  }
+
+  // Ranked with what is known so far, downloads rank them again once probed
+  rankOwners(context, owners, ownerCount);
+  if (context->callbacks.onLookup != NULL) {
+    context->callbacks.onLookup(context->callbackData, filename, owners, ownerCount);
+  }
+  startDownloads(context, filename, owners, ownerCount);
+  free(filename);
+}
+
+/*
+ * Purpose: Pass the files sent back in response to a search or find packet to a
+ * callback
+ * Input:
+ * - The client
+ * - Data field of the packet. The prefix or substring, whether some files were left
+ * out, then the filenames.
+ * - The callback, onSearch or onFind
+ * Output: None
+ */
+static void passSearchResult(struct ClientContext* context,
+                             char* dataField,
+                             SearchCallback callback) {
+  bool debugFlag = context->debugFlag;
+  char* prefix   = calloc(1, MAX_DATA);
+  char* subfield = calloc(1, MAX_DATA);
+  dataField      = readPacketSubfield(dataField, prefix, MAX_DATA, debugFlag);
+  dataField      = readPacketSubfield(dataField, subfield, MAX_DATA, debugFlag);
+  bool more      = strcmp(subfield, "1") == 0;
+
+  // Every filename takes at least a character and a delimiter
+  char filenames[MAX_DATA / 2][MAX_FILENAME];
+  int fileCount = 0;
+  while (*dataField != '\0' && fileCount < MAX_DATA / 2) {
+    memset(subfield, 0, MAX_DATA);
+    dataField = readPacketSubfield(dataField, subfield, MAX_DATA, debugFlag);
+    strncpy(filenames[fileCount], subfield, MAX_FILENAME - 1);
+    filenames[fileCount][MAX_FILENAME - 1] = '\0';
+    fileCount++;
+  }
+  if (callback != NULL) {
+    callback(context->callbackData, prefix, filenames, fileCount, more);
+  }
+  free(prefix);
+  free(subfield);
+}
+
+/*
+ * Purpose: Pass the files sent back in response to a search packet to onSearch
+ * Input:
+ * - The client
+ * - Data field of the search packet. The prefix, whether some files were left out,
+ * then the filenames.
+ * Output: None
+ */
+void handleSearchPacket(struct ClientContext* context, char* dataField) {
+  passSearchResult(context, dataField, context->callbacks.onSearch);
+}
+
+/*
+ * Purpose: Pass the files sent back in response to a find packet to onFind
+ * Input:
+ * - The client
+ * - Data field of the find packet. The substring, whether some files were left out,
+ * then the filenames.
+ * Output: None
+ */
+void handleFindPacket(struct ClientContext* context, char* dataField) {
+  passSearchResult(context, dataField, context->callbacks.onFind);
+}
+
+/*
+ * Purpose: When the client receives a status packet, send one back. The data field of
+ * this packet doesn't matter as the client just needs to respond to be considered still
+ * connected to the server. Heartbeats also show that the server hasn't dropped the
+ * client, see SERVER_SILENCE_TIMEOUT.
+ * Input: The client
+ * Output: None
+ */
+void handleStatusPacket(struct ClientContext* context) {
+  context->lastHeartbeat = getMicroseconds();
+
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "status");
+  strcat(packetFields.data, "testing");
+
+  sendPacket(&context->reliableState, context->udpSocketDescriptor,
+             context->serverAddress, packetFields, context->debugFlag);
+}
+
+/*
+ * Purpose: When the client receives a session packet, the server is handing it the
+ * session token of its registration, or answering whether it resumed the session. A
+ * token of 0 means it couldn't, and the client connects again in full. A token of 0
+ * that doesn't answer a session packet means the server rejected the connection, the
+ * rest of the registration isn't sent and the client connects again once the server
+ * has been quiet for SERVER_SILENCE_TIMEOUT.
+ * Input:
+ * - The client
+ * - Data field of the session packet
+ * Output: None
+ */
+void handleSessionPacket(struct ClientContext* context, char* dataField) {
+  char subfield[MAX_DATA];
+  memset(subfield, 0, sizeof(subfield));
+  readPacketSubfield(dataField, subfield, sizeof(subfield), context->debugFlag);
+  unsigned long sessionToken = strtoul(subfield, NULL, 10);
+  if (sessionToken != 0) {
+    if (context->debugFlag && context->resuming) {
+      printf("Session resumed\n");
+    }
+    context->sessionToken  = sessionToken;
+    context->resuming      = false;
+    context->lastHeartbeat = getMicroseconds();
+    return;
+  }
+
+  // Only an answer to this client's own session packet makes it register again
+  if (context->resuming) {
+    if (context->debugFlag) {
+      printf("Session couldn't be resumed, connecting again\n");
+    }
+    connectClient(context);
+    return;
+  }
+  printf("Connection rejected by the server\n");
+  context->registrationChunkCount = context->registrationChunk;
+}
@@ -0,0 +1,246 @@
+#ifndef CLIENT_LIBRARY_H
+#define CLIENT_LIBRARY_H
+
+// Directories a client shares files from and downloads files into by default
+#define DEFAULT_PUBLIC_DIRECTORY   "Public"
+#define DEFAULT_DOWNLOAD_DIRECTORY "Downloads"
+
+// Max size of a directory path given to a client
+#define MAX_DIRECTORY_PATH 128
+
+// Most owners kept from a lookup
+#define MAX_LOOKUP_OWNERS 8
+
+// Most downloads and uploads a client runs at once
+#define MAX_TRANSFERS 24
+
+// Uploads sending at once. Other requests wait in the upload queue for a slot.
+#define UPLOAD_SLOTS 4
+
+// Most uploads taken on at once, sending or waiting for a slot. Connections past this
+// are turned away, which leaves the other transfers for downloads.
+#define MAX_UPLOADS 16
+
+// Microseconds a throttled upload waits before its bandwidth is checked again
+#define UPLOAD_SHAPING_INTERVAL 10000
+
+// Microseconds of an upload rate that can be saved up and sent in one burst
+#define UPLOAD_BURST_TIME 100000
+
+// Downloaded files a client seeds at once, see setSeedQuota()
+#define MAX_SEEDED_FILES 64
+
+// Cells of a summary registration for each shared file, see setSummaryMode(). A file
+// the client doesn't have matches the summary in about one lookup in 400.
+#define SUMMARY_CELLS_PER_FILE 16
+
+// Bytes moved between a file and a socket at a time
+#define TRANSFER_BUFFER_SIZE 4096
+
+// Room for the request or size line at the start of a transfer
+#define TRANSFER_HEADER_SIZE (MAX_FILENAME + 2)
+
+// Microseconds a transfer can go without progress before it is given up on
+#define TRANSFER_TIMEOUT 10000000
+
+// Microseconds between checks for stalled transfers
+#define TRANSFER_CHECK_INTERVAL 1000000
+
+// Microseconds between register packets, half the rate the server budgets for them
+#define REGISTRATION_CHUNK_INTERVAL 250
+
+// Most register packets waiting for an ack at once. Leaves the rest of the reliable
+// window for lookups and announces.
+#define REGISTRATION_WINDOW 16
+
+// Microseconds without a heartbeat from the server before a client takes it that the
+// server dropped it and resumes its session. The server sends one every 3 seconds.
+#define SERVER_SILENCE_TIMEOUT 10000000
+
+// States of a transfer
+#define TRANSFER_FREE       0
+#define TRANSFER_LOOKUP     1 // Download waiting for the owners of the file
+#define TRANSFER_PROBING    2 // Download waiting for the owners to answer probes
+#define TRANSFER_CONNECTING 3 // Download waiting to connect to an owner
+#define TRANSFER_RECEIVING  4 // Download reading the size line, then the file
+#define TRANSFER_REQUEST    5 // Upload reading the filename asked for
+#define TRANSFER_QUEUED     6 // Upload waiting for an upload slot
+#define TRANSFER_SENDING    7 // Upload writing the size line, then the file
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <sys/select.h>
+
+#include "../common/bloom.h"
+#include "../common/network_node.h"
+#include "../common/packet.h"
+#include "../common/uring.h"
+#include "gossip.h"
+#include "owner_ranking.h"
+
+// A client that has a file, as sent back by the server for a lookup
+struct ClientOwner {
+  char username[MAX_USERNAME];
+  struct sockaddr_in udpAddress;
+  struct sockaddr_in tcpAddress;
+  bool possible; // Registered a summary the file matched, it might not have the file
+};
+
+// Passed the prefix or substring, the files that matched, how many there are and
+// whether more files matched than the server could send
+typedef void (*SearchCallback)(void*, char*, char (*)[MAX_FILENAME], int, bool);
+
+// Called as answers come back from the server and from peers. Any of them can be NULL.
+// Strings and arrays passed to them are only good until the callback returns.
+struct ClientCallbacks {
+  void (*onResource)(void*, char*, char*); // Username, filename. Once per resource.
+  void (*onListingEnd)(void*, bool);       // Whether the listing was complete
+  void (*onLookup)(void*, char*, struct ClientOwner*, int);
+  SearchCallback onSearch; // Files starting with a prefix
+  SearchCallback onFind;   // Files containing a substring
+  void (*onDownload)(void*, char*, bool);  // Filename, whether it was downloaded
+};
+
+// Token bucket shaping uploads, counted in bytes
+struct UploadBucket {
+  unsigned long rate; // Bytes per second, 0 for no limit
+  unsigned long tokens;
+  unsigned long lastRefill;
+};
+
+// A downloaded file a client put in its public directory to share it
+struct SeededFile {
+  char filename[MAX_FILENAME];
+  unsigned long size;
+  unsigned long lastUsed; // When it was seeded or last uploaded
+};
+
+// A download from or an upload to another client over TCP. The downloader sends the
+// filename and a newline. The owner answers with the size of the file and a newline,
+// -1 if it doesn't have the file, then the contents of the file.
+struct Transfer {
+  int state;
+  int socketDescriptor;
+  int fileDescriptor;
+  char filename[MAX_FILENAME];
+  char header[TRANSFER_HEADER_SIZE];
+  unsigned long headerLength; // Bytes of the header read or written so far
+  long remaining;             // Bytes of the file left to move, -1 until known
+  char buffer[TRANSFER_BUFFER_SIZE];
+  unsigned long bufferStart; // Bytes read from the file that haven't been sent
+  unsigned long bufferEnd;
+  long fileSize; // Size of the file, once it is known
+  struct ClientOwner owners[MAX_LOOKUP_OWNERS]; // Downloads try each owner in turn
+  int ownerCount;
+  int ownerIndex;
+  unsigned long lastProgress;
+
+  // Downloads only
+  unsigned long probeDeadline; // Owners are ranked by then even if probes go unanswered
+  unsigned long connectedAt;   // When the current owner was connected to
+
+  // Uploads only
+  struct sockaddr_in peerAddress; // Who asked for the file
+  unsigned long queuedAt;
+  unsigned long throttledUntil; // Not sent to before this, it is over its bandwidth
+  struct UploadBucket bucket;
+  bool readPending; // The file ring is reading into the buffer, see useFileUring()
+};
+
+// Everything a single client needs. Any number of them can run in one process, each
+// one is only touched by the functions it is passed to.
+struct ClientContext {
+  int udpSocketDescriptor;
+  int tcpSocketDescriptor;
+  struct sockaddr_in serverAddress;
+  struct sockaddr_in hostTcpAddress;
+  char username[MAX_USERNAME];
+  char publicDirectory[MAX_DIRECTORY_PATH];
+  char downloadDirectory[MAX_DIRECTORY_PATH];
+  bool debugFlag;
+
+  char* packet; // Receive buffer
+  struct GossipState gossipState;
+  struct ReliableState reliableState;
+  unsigned long nextGossipRound;
+  unsigned long nextTransferCheck;
+  struct Transfer transfers[MAX_TRANSFERS];
+  struct OwnerRanking ownerRanking; // How fast other clients have been
+  int nextTransfer; // Transfers are moved along starting from a different one each time
+
+  // Upload bandwidth, shared by every upload and for each upload on its own
+  struct UploadBucket uploadBucket;
+  unsigned long uploadRate;
+
+  // Uploads read their files through io_uring instead of read() when set
+  bool fileUring;
+  struct UringQueue fileQueue;
+
+  // Downloads put in the public directory so other clients can get them from here too.
+  // The least recently used ones are removed to keep them within the quota.
+  unsigned long seedQuota; // Bytes, 0 to not seed
+  unsigned long seededBytes;
+  struct SeededFile seededFiles[MAX_SEEDED_FILES];
+  int seededFileCount;
+
+  // Files the server knows this client shares, sorted. Those that don't fit in the
+  // connection packet follow it in register packets, one chunk of files each.
+  char (*sharedFiles)[MAX_FILENAME];
+  int sharedFileCount;
+  int registrationFile;  // First shared file not sent to the server yet
+  int registrationChunk; // Index of the next register packet
+  int registrationChunkCount;
+  unsigned long nextRegistrationChunk;
+
+  // Register a counting Bloom filter of the shared files instead of their names
+  bool summaryMode;
+  struct CountingBloom summary;
+
+  // Session the server gave this client when it registered, 0 for none. Once the
+  // server goes quiet the registration is resumed with it, along with the hash of the
+  // shared files, instead of sending them all again.
+  unsigned long sessionToken;
+  unsigned long resourceHash; // Sum of hashResourceName() of the shared files
+  unsigned long lastHeartbeat;
+  bool resuming; // Waiting to hear whether the server resumed the session
+
+  struct ClientCallbacks callbacks;
+  void* callbackData; // Passed to every callback
+};
+
+// Setting up and tearing down
+void initClientContext(struct ClientContext*,
+                       char*,
+                       struct sockaddr_in,
+                       char*,
+                       char*,
+                       bool);
+void freeClientContext(struct ClientContext*);
+int connectClient(struct ClientContext*);
+void setUploadRates(struct ClientContext*, unsigned long, unsigned long);
+void setSeedQuota(struct ClientContext*, unsigned long);
+void setSummaryMode(struct ClientContext*, bool);
+int useFileUring(struct ClientContext*);
+
+// Requests, answered through the callbacks
+void requestResources(struct ClientContext*);
+int requestLookup(struct ClientContext*, char*);
+int requestSearch(struct ClientContext*, char*);
+int requestFind(struct ClientContext*, char*);
+int downloadResource(struct ClientContext*, char*);
+
+// Event loop
+int addClientDescriptors(struct ClientContext*, fd_set*, fd_set*, int);
+unsigned long getClientTimeout(struct ClientContext*);
+void processClient(struct ClientContext*, fd_set*, fd_set*);
+int pollClient(struct ClientContext*, unsigned long);
+
+void handlePacket(struct ClientContext*, struct sockaddr_in);
+long handleResourcePacket(struct ClientContext*, char*);
+void handleLookupPacket(struct ClientContext*, char*);
+void handleSearchPacket(struct ClientContext*, char*);
+void handleFindPacket(struct ClientContext*, char*);
+void handleStatusPacket(struct ClientContext*);
+void handleSessionPacket(struct ClientContext*, char*);
+
+#endif
@@ -0,0 +1,660 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../common/network_node.h"
+#include "../common/packet.h"
+#include "../common/trace.h"
+#include "gossip.h"
+
+// packet.h
+extern struct PacketDelimiters packetDelimiters;
+
+/*
+ * Purpose: Read a subfield out of a packet field and make sure it fits in the memory
+ * allocated for it. Packets from peers are not trusted to be well formed.
+ * Input:
+ * - Pointer to the field being read. Advanced past the subfield.
+ * - Memory allocated for the subfield
+ * - Size of the memory allocated for the subfield
+ * - Debug flag
+ * Output:
+ * - -1: Field was empty or subfield did not fit
+ * - 0: Success
+ */
+static int readBoundedSubfield(char** field,
+                               char* subfield,
+                               size_t subfieldSize,
+                               bool debugFlag) {
+  char buffer[MAX_DATA];
+  memset(buffer, 0, sizeof(buffer));
+  if (**field == '\0' || strlen(*field) >= sizeof(buffer)) {
+    return -1;
+  }
+  *field = readPacketSubfield(*field, buffer, sizeof(buffer), debugFlag);
+  if (strlen(buffer) == 0 || strlen(buffer) >= subfieldSize) {
+    return -1;
+  }
+  strcpy(subfield, buffer);
+  return 0;
+}
+
+/*
+ * Purpose: Hash a string together with a version number. Used to summarize the
+ * resources of an owner in a digest.
+ * Input:
+ * - String to hash
+ * - Version to mix into the hash
+ * Output: 64 bit FNV-1a hash
+ */
+static unsigned long hashEntry(char* string, unsigned long version) {
+  unsigned long hash = 14695981039346656037UL;
+  while (*string != '\0') {
+    hash ^= (unsigned char)*string;
+    hash *= 1099511628211UL;
+    string++;
+  }
+  hash ^= version;
+  hash *= 1099511628211UL;
+  return hash;
+}
+
+/*
+ * Purpose: Figure out how many rounds a new rumor should be pushed for. Rumors spread
+ * to every peer in O(log N) rounds so the count grows with the log of known peers.
+ * Input: Gossip state
+ * Output: Number of rounds
+ */
+static int getRumorRounds(struct GossipState* gossipState) {
+  int rounds    = GOSSIP_EXTRA_ROUNDS;
+  int peerCount = gossipState->peerCount + 1;
+  while (peerCount > 1) {
+    rounds++;
+    peerCount /= 2;
+  }
+  return rounds;
+}
+
+/*
+ * Purpose: Hash the owner and filename of a resource, for the entry index
+ * Input:
+ * - Owner of the resource
+ * - Filename of the resource
+ * Output: The hash
+ */
+static unsigned long hashResource(char* owner, char* filename) {
+  return hashEntry(filename, hashEntry(owner, 0));
+}
+
+/*
+ * Purpose: Find the slot of a resource in the entry index
+ * Input:
+ * - Gossip state
+ * - Owner of the resource
+ * - Filename of the resource
+ * Output: The slot of its entry, or the empty slot it would go in
+ */
+static unsigned long findEntrySlot(struct GossipState* gossipState,
+                                   char* owner,
+                                   char* filename) {
+  unsigned long slot = hashResource(owner, filename) & (GOSSIP_INDEX_SIZE - 1);
+  while (gossipState->entryIndex[slot] != 0) {
+    struct GossipEntry* entry = &gossipState->entries[gossipState->entryIndex[slot] - 1];
+    if (strcmp(entry->owner, owner) == 0 && strcmp(entry->filename, filename) == 0) {
+      break;
+    }
+    slot = (slot + 1) & (GOSSIP_INDEX_SIZE - 1);
+  }
+  return slot;
+}
+
+/*
+ * Purpose: Find the directory entry for a resource
+ * Input:
+ * - Gossip state
+ * - Owner of the resource
+ * - Filename of the resource
+ * Output: The entry, NULL if it is not in the directory
+ */
+static struct GossipEntry* findEntry(struct GossipState* gossipState,
+                                     char* owner,
+                                     char* filename) {
+  int entryIndex = gossipState->entryIndex[findEntrySlot(gossipState, owner, filename)];
+  if (entryIndex == 0) {
+    return NULL;
+  }
+  return &gossipState->entries[entryIndex - 1];
+}
+
+/*
+ * Purpose: Take an entry out of the index. Entries after it in the probe sequence are
+ * shifted back so lookups don't stop early at the gap.
+ * Input:
+ * - Gossip state
+ * - The entry
+ * Output: None
+ */
+static void unindexEntry(struct GossipState* gossipState, struct GossipEntry* entry) {
+  unsigned long mask  = GOSSIP_INDEX_SIZE - 1;
+  unsigned long empty = findEntrySlot(gossipState, entry->owner, entry->filename);
+  unsigned long next  = (empty + 1) & mask;
+  while (gossipState->entryIndex[next] != 0) {
+    struct GossipEntry* moved = &gossipState->entries[gossipState->entryIndex[next] - 1];
+    unsigned long home        = hashResource(moved->owner, moved->filename) & mask;
+    // Move the entry back unless its home slot is between the gap and where it is
+    if (((next - home) & mask) >= ((next - empty) & mask)) {
+      gossipState->entryIndex[empty] = gossipState->entryIndex[next];
+      empty                          = next;
+    }
+    next = (next + 1) & mask;
+  }
+  gossipState->entryIndex[empty] = 0;
+}
+
+/*
+ * Purpose: Get a free directory entry for a resource and add it to the index. When the
+ * directory is full a tombstone that is no longer being spread is reused.
+ * Input:
+ * - Gossip state
+ * - Owner of the resource
+ * - Filename of the resource
+ * Output: The entry, NULL if the directory is full
+ */
+static struct GossipEntry* newEntry(struct GossipState* gossipState,
+                                    char* owner,
+                                    char* filename) {
+  struct GossipEntry* entry = NULL;
+  if (gossipState->entryCount < GOSSIP_MAX_ENTRIES) {
+    entry = &gossipState->entries[gossipState->entryCount++];
+  } else {
+    int i;
+    for (i = 0; i < gossipState->entryCount && entry == NULL; i++) {
+      if (gossipState->entries[i].removed && gossipState->entries[i].rumorRounds == 0) {
+        entry = &gossipState->entries[i];
+        unindexEntry(gossipState, entry);
+      }
+    }
+    if (entry == NULL) {
+      return NULL;
+    }
+  }
+  strcpy(entry->owner, owner);
+  strcpy(entry->filename, filename);
+  gossipState->entryIndex[findEntrySlot(gossipState, owner, filename)] =
+      (int)(entry - gossipState->entries) + 1;
+  return entry;
+}
+
+/*
+ * Purpose: Apply a change to the directory if it is newer than what is already known.
+ * Input:
+ * - Gossip state
+ * - Owner of the resource
+ * - Filename of the resource
+ * - Owner's version of the change
+ * - Whether the resource was removed
+ * Output:
+ * - true: The directory changed and the change should be spread further
+ * - false: Change was already known
+ */
+static bool applyEntry(struct GossipState* gossipState,
+                       char* owner,
+                       char* filename,
+                       unsigned long version,
+                       bool removed) {
+  struct GossipEntry* entry = findEntry(gossipState, owner, filename);
+  if (entry != NULL && entry->version >= version) {
+    return false;
+  }
+  if (entry == NULL) {
+    entry = newEntry(gossipState, owner, filename);
+    if (entry == NULL) {
+      return false;
+    }
+  }
+  entry->version     = version;
+  entry->removed     = removed;
+  entry->rumorRounds = getRumorRounds(gossipState);
+  TRACE(TRACE_GOSSIP_APPLIED, version, removed);
+  return true;
+}
+
+/*
+ * Purpose: Summarize all the resources of an owner so that two peers can cheaply tell
+ * whether their views of that owner differ.
+ * Input:
+ * - Gossip state
+ * - Owner to summarize
+ * - Where to put the newest version known for the owner
+ * - Where to put the hash of the owner's available resources
+ * Output: None
+ */
+static void summarizeOwner(struct GossipState* gossipState,
+                           char* owner,
+                           unsigned long* version,
+                           unsigned long* hash) {
+  *version = 0;
+  *hash    = 0;
+  int i;
+  for (i = 0; i < gossipState->entryCount; i++) {
+    struct GossipEntry* entry = &gossipState->entries[i];
+    if (strcmp(entry->owner, owner) != 0) {
+      continue;
+    }
+    if (entry->version > *version) {
+      *version = entry->version;
+    }
+    // Order independent so peers holding the same entries agree
+    if (!entry->removed) {
+      *hash ^= hashEntry(entry->filename, entry->version);
+    }
+  }
+}
+
+/*
+ * Purpose: Send a single directory entry to a peer
+ * Input:
+ * - Gossip state
+ * - The entry to send
+ * - Socket to send on
+ * - Address of the peer
+ * - Debug flag
+ * Output: None
+ */
+static void sendGossipPacket(struct GossipState* gossipState,
+                             struct GossipEntry* entry,
+                             int udpSocketDescriptor,
+                             struct sockaddr_in peerAddress,
+                             bool debugFlag) {
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "gossip");
+  char delimiter = packetDelimiters.subfield[0];
+  snprintf(packetFields.data, MAX_DATA, "%s%c%s%c%lu%c%c%c%s%c", gossipState->username,
+           delimiter, entry->owner, delimiter, entry->version, delimiter,
+           entry->removed ? '-' : '+', delimiter, entry->filename, delimiter);
+  sendUdpPacket(udpSocketDescriptor, peerAddress, packetFields, debugFlag);
+}
+
+/*
+ * Purpose: Push every entry of an owner to a peer. Used to repair a peer whose view of
+ * the owner is behind.
+ * Input:
+ * - Gossip state
+ * - Owner whose entries to send
+ * - Socket to send on
+ * - Address of the peer
+ * - Debug flag
+ * Output: None
+ */
+static void pushOwnerEntries(struct GossipState* gossipState,
+                             char* owner,
+                             int udpSocketDescriptor,
+                             struct sockaddr_in peerAddress,
+                             bool debugFlag) {
+  int i;
+  for (i = 0; i < gossipState->entryCount; i++) {
+    struct GossipEntry* entry = &gossipState->entries[i];
+    if (strcmp(entry->owner, owner) == 0) {
+      sendGossipPacket(gossipState, entry, udpSocketDescriptor, peerAddress, debugFlag);
+    }
+  }
+}
+
+/*
+ * Purpose: Add a summary of an owner to the data field of a digest packet. Numbers are
+ * written in hex to keep the summary short.
+ * Input:
+ * - Gossip state
+ * - Data field of the digest packet
+ * - Owner to summarize
+ * Output:
+ * - true: Summary added
+ * - false: Summary did not fit in the data field
+ */
+static bool addOwnerToDigest(struct GossipState* gossipState, char* data, char* owner) {
+  unsigned long version;
+  unsigned long hash;
+  summarizeOwner(gossipState, owner, &version, &hash);
+
+  char summary[MAX_DATA];
+  char delimiter = packetDelimiters.subfield[0];
+  snprintf(summary, sizeof(summary), "%s%c%lx%c%lx%c", owner, delimiter, version,
+           delimiter, hash, delimiter);
+  if (strlen(data) + strlen(summary) >= MAX_DATA) {
+    return false;
+  }
+  strcat(data, summary);
+  return true;
+}
+
+/*
+ * Purpose: Send a digest of a few owners to a random peer. The owners covered rotate
+ * every round so that over time the whole directory is compared (anti-entropy).
+ * Input:
+ * - Gossip state
+ * - Socket to send on
+ * - Debug flag
+ * Output: None
+ */
+static void sendDigestPacket(struct GossipState* gossipState,
+                             int udpSocketDescriptor,
+                             bool debugFlag) {
+  // Distinct owners, in directory order. Each owner goes in a set holding the entry it
+  // was first seen in.
+  int* owners     = gossipState->digestOwners;
+  int* ownerSlots = gossipState->digestOwnerSlots;
+  int ownerCount  = 0;
+  memset(ownerSlots, 0, sizeof(gossipState->digestOwnerSlots));
+  int i;
+  for (i = 0; i < gossipState->entryCount; i++) {
+    char* owner        = gossipState->entries[i].owner;
+    unsigned long slot = hashEntry(owner, 0) & (GOSSIP_INDEX_SIZE - 1);
+    while (ownerSlots[slot] != 0 &&
+           strcmp(gossipState->entries[ownerSlots[slot] - 1].owner, owner) != 0) {
+      slot = (slot + 1) & (GOSSIP_INDEX_SIZE - 1);
+    }
+    if (ownerSlots[slot] == 0) {
+      ownerSlots[slot]     = i + 1;
+      owners[ownerCount++] = i;
+    }
+  }
+  if (ownerCount == 0) {
+    return;
+  }
+
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "digest");
+  strcpy(packetFields.data, gossipState->username);
+  strncat(packetFields.data, packetDelimiters.subfield, packetDelimiters.subfieldLength);
+  for (i = 0; i < GOSSIP_DIGEST_OWNERS && i < ownerCount; i++) {
+    int ownerIndex = owners[(gossipState->digestCursor + i) % ownerCount];
+    if (!addOwnerToDigest(gossipState, packetFields.data,
+                          gossipState->entries[ownerIndex].owner)) {
+      break;
+    }
+  }
+  gossipState->digestCursor = (gossipState->digestCursor + i) % ownerCount;
+
+  struct GossipPeer* peer = &gossipState->peers[rand() % gossipState->peerCount];
+  sendUdpPacket(udpSocketDescriptor, peer->udpAddress, packetFields, debugFlag);
+}
+
+/*
+ * Purpose: Initialize the gossip state of a client. The local version counter starts
+ * from the current time so that changes made after a restart are always newer than
+ * anything peers remember from before it.
+ * Input:
+ * - Gossip state to initialize
+ * - Username of this client
+ * Output: None
+ */
+void initGossipState(struct GossipState* gossipState, char* username) {
+  memset(gossipState, 0, sizeof(*gossipState));
+  strcpy(gossipState->username, username);
+
+  struct timeval currentTime;
+  gettimeofday(&currentTime, NULL);
+  gossipState->localVersion = (unsigned long)currentTime.tv_sec * 1000000UL +
+                              (unsigned long)currentTime.tv_usec;
+  srand((unsigned int)gossipState->localVersion);
+}
+
+/*
+ * Purpose: Add a peer to gossip with, or update its address if it is already known.
+ * When the peer table is full a random peer is replaced.
+ * Input:
+ * - Gossip state
+ * - Username of the peer
+ * - UDP address of the peer
+ * Output: None
+ */
+void addGossipPeer(struct GossipState* gossipState,
+                   char* username,
+                   struct sockaddr_in udpAddress) {
+  if (strcmp(username, gossipState->username) == 0) {
+    return;
+  }
+  struct GossipPeer* peer = NULL;
+  int i;
+  for (i = 0; i < gossipState->peerCount; i++) {
+    if (strcmp(gossipState->peers[i].username, username) == 0) {
+      peer = &gossipState->peers[i];
+      break;
+    }
+  }
+  if (peer == NULL) {
+    if (gossipState->peerCount < GOSSIP_MAX_PEERS) {
+      peer = &gossipState->peers[gossipState->peerCount++];
+    } else {
+      peer = &gossipState->peers[rand() % GOSSIP_MAX_PEERS];
+    }
+    strcpy(peer->username, username);
+  }
+  peer->udpAddress            = udpAddress;
+  peer->udpAddress.sin_family = AF_INET;
+}
+
+/*
+ * Purpose: Check if this client is currently sharing a resource
+ * Input:
+ * - Gossip state
+ * - Filename of the resource
+ * Output: true if the resource is available from this client
+ */
+bool hasLocalResource(struct GossipState* gossipState, char* filename) {
+  struct GossipEntry* entry = findEntry(gossipState, gossipState->username, filename);
+  return entry != NULL && !entry->removed;
+}
+
+/*
+ * Purpose: Record that a resource was added to or removed from this client and start
+ * spreading the change to peers.
+ * Input:
+ * - Gossip state
+ * - Filename of the resource
+ * - Whether the resource was removed
+ * Output: None
+ */
+void publishLocalResource(struct GossipState* gossipState, char* filename, bool removed) {
+  gossipState->localVersion++;
+  applyEntry(gossipState, gossipState->username, filename, gossipState->localVersion,
+             removed);
+}
+
+/*
+ * Purpose: Run one round of gossip. Every change that is still a hot rumor is pushed
+ * to a few random peers, and a digest is sent to one random peer so that anything
+ * missed gets repaired.
+ * Input:
+ * - Gossip state
+ * - Socket to send on
+ * - Debug flag
+ * Output: None
+ */
+void runGossipRound(struct GossipState* gossipState,
+                    int udpSocketDescriptor,
+                    bool debugFlag) {
+  gossipState->roundCount++;
+  if (gossipState->peerCount == 0) {
+    return;
+  }
+
+  int fanout = GOSSIP_FANOUT;
+  if (fanout > gossipState->peerCount) {
+    fanout = gossipState->peerCount;
+  }
+
+  int rumorsPushed = 0;
+  int i;
+  for (i = 0; i < gossipState->entryCount; i++) {
+    struct GossipEntry* entry = &gossipState->entries[i];
+    if (entry->rumorRounds == 0) {
+      continue;
+    }
+    rumorsPushed++;
+    // Consecutive peers from a random start so the fanout peers are distinct
+    int firstPeer = rand() % gossipState->peerCount;
+    int j;
+    for (j = 0; j < fanout; j++) {
+      struct GossipPeer* peer =
+          &gossipState->peers[(firstPeer + j) % gossipState->peerCount];
+      sendGossipPacket(gossipState, entry, udpSocketDescriptor, peer->udpAddress,
+                       debugFlag);
+    }
+    entry->rumorRounds--;
+  }
+  TRACE(TRACE_GOSSIP_ROUND, rumorsPushed, gossipState->peerCount);
+
+  sendDigestPacket(gossipState, udpSocketDescriptor, debugFlag);
+}
+
+/*
+ * Purpose: Add the peers the server sent in a peers packet to the peer table
+ * Input:
+ * - Gossip state
+ * - Data field of the peers packet. Username, address and port of each peer.
+ * - Debug flag
+ * Output: None
+ */
+void handlePeersPacket(struct GossipState* gossipState, char* dataField, bool debugFlag) {
+  char username[MAX_USERNAME];
+  char address[MAX_USERNAME];
+  char port[MAX_USERNAME];
+  while (readBoundedSubfield(&dataField, username, sizeof(username), debugFlag) == 0 &&
+         readBoundedSubfield(&dataField, address, sizeof(address), debugFlag) == 0 &&
+         readBoundedSubfield(&dataField, port, sizeof(port), debugFlag) == 0) {
+    struct sockaddr_in udpAddress;
+    memset(&udpAddress, 0, sizeof(udpAddress));
+    udpAddress.sin_addr.s_addr = (unsigned int)strtoul(address, NULL, 10);
+    udpAddress.sin_port        = (unsigned short)strtoul(port, NULL, 10);
+    addGossipPeer(gossipState, username, udpAddress);
+    if (debugFlag) {
+      printf("Gossip peer %s added\n", username);
+    }
+  }
+}
+
+/*
+ * Purpose: Handle a directory change gossiped by a peer. New changes are applied and
+ * become rumors that this client spreads further.
+ * Input:
+ * - Gossip state
+ * - Data field of the gossip packet
+ * - Address of the peer that sent the packet
+ * - Debug flag
+ * Output: None
+ */
+void handleGossipPacket(struct GossipState* gossipState,
+                        char* dataField,
+                        struct sockaddr_in senderAddress,
+                        bool debugFlag) {
+  char sender[MAX_USERNAME];
+  char owner[MAX_USERNAME];
+  char version[MAX_USERNAME + 1];
+  char operation[2];
+  char filename[MAX_FILENAME];
+  if (readBoundedSubfield(&dataField, sender, sizeof(sender), debugFlag) == -1 ||
+      readBoundedSubfield(&dataField, owner, sizeof(owner), debugFlag) == -1 ||
+      readBoundedSubfield(&dataField, version, sizeof(version), debugFlag) == -1 ||
+      readBoundedSubfield(&dataField, operation, sizeof(operation), debugFlag) == -1 ||
+      readBoundedSubfield(&dataField, filename, sizeof(filename), debugFlag) == -1) {
+    if (debugFlag) {
+      printf("Malformed gossip packet\n");
+    }
+    return;
+  }
+  addGossipPeer(gossipState, sender, senderAddress);
+
+  // This client is the only source of truth for its own resources
+  if (strcmp(owner, gossipState->username) == 0) {
+    return;
+  }
+
+  bool removed = strcmp(operation, "-") == 0;
+  if (applyEntry(gossipState, owner, filename, strtoul(version, NULL, 10), removed) &&
+      debugFlag) {
+    printf("Gossip: %s %s %s\n", owner, removed ? "removed" : "added", filename);
+  }
+}
+
+/*
+ * Purpose: Compare a digest sent by a peer against the local directory. For every
+ * owner where this client is ahead, its entries are pushed to the peer. For every
+ * owner where this client is behind, a digest is sent back so the peer pushes.
+ * Input:
+ * - Gossip state
+ * - Data field of the digest packet
+ * - Address of the peer that sent the packet
+ * - Socket to send on
+ * - Debug flag
+ * Output: None
+ */
+void handleDigestPacket(struct GossipState* gossipState,
+                        char* dataField,
+                        struct sockaddr_in senderAddress,
+                        int udpSocketDescriptor,
+                        bool debugFlag) {
+  char sender[MAX_USERNAME];
+  if (readBoundedSubfield(&dataField, sender, sizeof(sender), debugFlag) == -1) {
+    return;
+  }
+  addGossipPeer(gossipState, sender, senderAddress);
+
+  struct PacketFields pullFields;
+  memset(&pullFields, 0, sizeof(pullFields));
+  strcpy(pullFields.type, "digest");
+  strcpy(pullFields.data, gossipState->username);
+  strncat(pullFields.data, packetDelimiters.subfield, packetDelimiters.subfieldLength);
+  bool pulling = false;
+
+  char owner[MAX_USERNAME];
+  char remoteVersion[MAX_USERNAME + 1];
+  char remoteHash[MAX_USERNAME + 1];
+  while (readBoundedSubfield(&dataField, owner, sizeof(owner), debugFlag) == 0 &&
+         readBoundedSubfield(&dataField, remoteVersion, sizeof(remoteVersion),
+                             debugFlag) == 0 &&
+         readBoundedSubfield(&dataField, remoteHash, sizeof(remoteHash), debugFlag) ==
+             0) {
+    unsigned long localVersion;
+    unsigned long localHash;
+    summarizeOwner(gossipState, owner, &localVersion, &localHash);
+    if (localHash == strtoul(remoteHash, NULL, 16) &&
+        localVersion == strtoul(remoteVersion, NULL, 16)) {
+      continue;
+    }
+
+    if (localVersion >= strtoul(remoteVersion, NULL, 16)) {
+      pushOwnerEntries(gossipState, owner, udpSocketDescriptor, senderAddress,
+                       debugFlag);
+    } else if (strcmp(owner, gossipState->username) != 0 &&
+               addOwnerToDigest(gossipState, pullFields.data, owner)) {
+      pulling = true;
+    }
+  }
+
+  if (pulling) {
+    sendUdpPacket(udpSocketDescriptor, senderAddress, pullFields, debugFlag);
+  }
+}
+
+/*
+ * Purpose: Print out the directory as this client currently sees it
+ * Input: Gossip state
+ * Output: None
+ */
+void printGossipDirectory(struct GossipState* gossipState) {
+  printf("\n*** GOSSIP DIRECTORY (%d peers) ***\n", gossipState->peerCount);
+  int i;
+  for (i = 0; i < gossipState->entryCount; i++) {
+    struct GossipEntry* entry = &gossipState->entries[i];
+    if (entry->removed) {
+      continue;
+    }
+    printf("USERNAME: %s\n", entry->owner);
+    printf("FILENAME: %s\n", entry->filename);
+  }
+  printf("\n");
+}
@@ -0,0 +1,77 @@
+#ifndef GOSSIP_H
+#define GOSSIP_H
+
+// Microseconds between gossip rounds
+#define GOSSIP_PERIOD 1000000
+
+// Number of random peers a rumor is pushed to each round
+#define GOSSIP_FANOUT 3
+
+// Rounds a rumor is pushed for on top of log2(number of known peers)
+#define GOSSIP_EXTRA_ROUNDS 2
+
+// Rounds between asking the server for a fresh sample of peers
+#define GOSSIP_PEER_REFRESH_ROUNDS 30
+
+// Number of owners summarized in a single digest packet
+#define GOSSIP_DIGEST_OWNERS 3
+
+#define GOSSIP_MAX_PEERS   64
+#define GOSSIP_MAX_ENTRIES 4096
+
+// Slots in the entry index and the owner set of a digest. A power of two, twice the
+// entries so probes stay short.
+#define GOSSIP_INDEX_SIZE (GOSSIP_MAX_ENTRIES * 2)
+
+#include <netinet/in.h>
+#include <stdbool.h>
+
+#include "../common/network_node.h"
+
+// Another client that directory updates can be gossiped to
+struct GossipPeer {
+  char username[MAX_USERNAME];
+  struct sockaddr_in udpAddress;
+};
+
+// A single resource in the gossiped directory. Removed resources are kept as
+// tombstones so that the removal itself can spread.
+struct GossipEntry {
+  char owner[MAX_USERNAME];
+  char filename[MAX_FILENAME];
+  unsigned long version; // Owner's version counter when this entry last changed
+  bool removed;
+  int rumorRounds; // Rounds left to actively push this entry to peers
+};
+
+// Everything a client knows about the directory and the peers it gossips with
+struct GossipState {
+  char username[MAX_USERNAME];
+  unsigned long localVersion;
+  struct GossipPeer peers[GOSSIP_MAX_PEERS];
+  int peerCount;
+  struct GossipEntry entries[GOSSIP_MAX_ENTRIES];
+  int entryCount;
+  int entryIndex[GOSSIP_INDEX_SIZE]; // Hash of owner and filename to entry + 1, 0 if free
+
+  // Owners a digest covers rotate, see sendDigestPacket(). The distinct owners are found
+  // with a set that is emptied and refilled every round.
+  int digestCursor;
+  int digestOwnerSlots[GOSSIP_INDEX_SIZE];
+  int digestOwners[GOSSIP_MAX_ENTRIES];
+  unsigned long roundCount;
+};
+
+void initGossipState(struct GossipState*, char*);
+void addGossipPeer(struct GossipState*, char*, struct sockaddr_in);
+bool hasLocalResource(struct GossipState*, char*);
+void publishLocalResource(struct GossipState*, char*, bool);
+
+void runGossipRound(struct GossipState*, int, bool);
+void handlePeersPacket(struct GossipState*, char*, bool);
+void handleGossipPacket(struct GossipState*, char*, struct sockaddr_in, bool);
+void handleDigestPacket(struct GossipState*, char*, struct sockaddr_in, int, bool);
+
+void printGossipDirectory(struct GossipState*);
+
+#endif
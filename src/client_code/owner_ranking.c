@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/network_node.h"
+#include "../common/packet.h"
+#include "owner_ranking.h"
+
+// packet.h
+extern struct PacketDelimiters packetDelimiters;
+
+/*
+ * Purpose: Set up a client's table of peer measurements
+ * Input: The table
+ * Output: None
+ */
+void initOwnerRanking(struct OwnerRanking* ranking) {
+  memset(ranking, 0, sizeof(*ranking));
+}
+
+/*
+ * Purpose: Find what has been measured about a peer
+ * Input:
+ * - The table
+ * - UDP address of the peer
+ * - Whether to make room for the peer if it isn't in the table
+ * Output: The peer's measurements, NULL if it isn't in the table and wasn't added
+ */
+static struct PeerSpeed* findPeerSpeed(struct OwnerRanking* ranking,
+                                       struct sockaddr_in address,
+                                       bool create) {
+  struct PeerSpeed* oldest = &ranking->peers[0];
+  int i;
+  for (i = 0; i < RANKING_MAX_PEERS; i++) {
+    struct PeerSpeed* peer = &ranking->peers[i];
+    if (peer->address.sin_addr.s_addr == address.sin_addr.s_addr &&
+        peer->address.sin_port == address.sin_port && peer->lastUsed != 0) {
+      peer->lastUsed = getMicroseconds();
+      return peer;
+    }
+    if (peer->lastUsed < oldest->lastUsed) {
+      oldest = peer;
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+  memset(oldest, 0, sizeof(*oldest));
+  oldest->address  = address;
+  oldest->lastUsed = getMicroseconds();
+  return oldest;
+}
+
+/*
+ * Purpose: Move a moving average an eighth of the way to a new measurement
+ * Input:
+ * - The average, 0 if nothing has been measured yet
+ * - The measurement
+ * Output: The new average
+ */
+static unsigned long updateAverage(unsigned long average, unsigned long measurement) {
+  if (average == 0) {
+    return measurement;
+  }
+  return average - average / 8 + measurement / 8;
+}
+
+/*
+ * Purpose: Send a peer a probe so its round trip time is known before a download
+ * picks an owner. The probe can also ask whether the peer has a file, for owners the
+ * server only knows might have it. Peers with a recent measurement or a probe already
+ * waiting for an answer aren't probed, unless a different file is asked about.
+ * Input:
+ * - The table
+ * - UDP socket to send the probe from
+ * - UDP address of the peer
+ * - File to ask about, NULL to only measure the round trip time
+ * - Debug flag
+ * Output: Whether a probe was sent
+ */
+bool probePeer(struct OwnerRanking* ranking,
+               int udpSocketDescriptor,
+               struct sockaddr_in address,
+               char* filename,
+               bool debugFlag) {
+  unsigned long currentTime = getMicroseconds();
+  struct PeerSpeed* peer    = findPeerSpeed(ranking, address, true);
+  bool pending              = isProbePending(ranking, address);
+  if (filename == NULL
+          ? pending || (peer->smoothedRtt != 0 &&
+                        currentTime - peer->rttMeasuredAt < RANKING_RTT_LIFETIME)
+          : pending && strcmp(peer->probedFile, filename) == 0) {
+    return false;
+  }
+
+  // The peer sends the time back, so the answer alone gives the round trip time
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "probe");
+  char delimiter = packetDelimiters.subfield[0];
+  snprintf(packetFields.data, MAX_DATA, "?%c%lu%c%s%c", delimiter, currentTime,
+           delimiter, filename == NULL ? "" : filename, delimiter);
+  sendUdpPacket(udpSocketDescriptor, address, packetFields, debugFlag);
+  peer->probeSentAt = currentTime;
+  strcpy(peer->probedFile, filename == NULL ? "" : filename);
+  peer->fileAnswer = -1;
+  return true;
+}
+
+/*
+ * Purpose: Check whether a peer still has a probe out that could be answered in time
+ * to rank it
+ * Input:
+ * - The table
+ * - UDP address of the peer
+ * Output: Whether the probe was sent less than RANKING_PROBE_WAIT ago and hasn't been
+ * answered
+ */
+bool isProbePending(struct OwnerRanking* ranking, struct sockaddr_in address) {
+  struct PeerSpeed* peer = findPeerSpeed(ranking, address, false);
+  return peer != NULL && peer->probeSentAt != 0 &&
+         getMicroseconds() - peer->probeSentAt < RANKING_PROBE_WAIT;
+}
+
+/*
+ * Purpose: Get what a peer answered when a probe asked it about a file
+ * Input:
+ * - The table
+ * - UDP address of the peer
+ * - The file
+ * Output: 1 if the peer has the file, 0 if it doesn't, -1 if it wasn't asked about the
+ * file or hasn't answered
+ */
+int getProbedFileAnswer(struct OwnerRanking* ranking,
+                        struct sockaddr_in address,
+                        char* filename) {
+  struct PeerSpeed* peer = findPeerSpeed(ranking, address, false);
+  if (peer == NULL || strcmp(peer->probedFile, filename) != 0) {
+    return -1;
+  }
+  return peer->fileAnswer;
+}
+
+/*
+ * Purpose: Answer a probe from a peer, or take the round trip time from the answer to
+ * one of ours. Answers nobody is waiting for are dropped.
+ * Input:
+ * - The table
+ * - Data field of the probe packet. ? for a probe or ! for an answer, then the time
+ * the probe was sent. Probes then have the file asked about, if any, and answers have 1
+ * or 0 for whether the file is there.
+ * - Address of the node that sent the packet
+ * - UDP socket to answer from
+ * - Checks whether this client has a file, passed the node and the filename
+ * - Node passed to it
+ * - Debug flag
+ * Output: None
+ */
+void handleProbePacket(struct OwnerRanking* ranking,
+                       char* dataField,
+                       struct sockaddr_in senderAddress,
+                       int udpSocketDescriptor,
+                       bool (*hasFile)(void*, char*),
+                       void* node,
+                       bool debugFlag) {
+  char kind[MAX_DATA]     = {0};
+  char sentTime[MAX_DATA] = {0};
+  char file[MAX_DATA]     = {0};
+  if (strlen(dataField) >= MAX_DATA) {
+    return;
+  }
+  dataField = readPacketSubfield(dataField, kind, sizeof(kind), debugFlag);
+  dataField = readPacketSubfield(dataField, sentTime, sizeof(sentTime), debugFlag);
+  readPacketSubfield(dataField, file, sizeof(file), debugFlag);
+
+  unsigned long probeSentAt = strtoul(sentTime, NULL, 10);
+  if (strcmp(kind, "?") == 0) {
+    struct PacketFields packetFields;
+    memset(&packetFields, 0, sizeof(packetFields));
+    strcpy(packetFields.type, "probe");
+    char delimiter = packetDelimiters.subfield[0];
+    const char* answer = "";
+    if (file[0] != '\0') {
+      answer = strlen(file) < MAX_FILENAME && hasFile(node, file) ? "1" : "0";
+    }
+    snprintf(packetFields.data, MAX_DATA, "!%c%lu%c%s%c", delimiter, probeSentAt,
+             delimiter, answer, delimiter);
+    sendUdpPacket(udpSocketDescriptor, senderAddress, packetFields, debugFlag);
+    return;
+  }
+
+  struct PeerSpeed* peer = findPeerSpeed(ranking, senderAddress, false);
+  if (strcmp(kind, "!") != 0 || peer == NULL || peer->probeSentAt == 0 ||
+      probeSentAt != peer->probeSentAt) {
+    return;
+  }
+  unsigned long currentTime = getMicroseconds();
+  unsigned long rtt         = currentTime - peer->probeSentAt;
+  peer->smoothedRtt         = updateAverage(peer->smoothedRtt, rtt == 0 ? 1 : rtt);
+  peer->rttMeasuredAt       = currentTime;
+  peer->probeSentAt         = 0;
+  if (peer->probedFile[0] != '\0' && file[0] != '\0') {
+    peer->fileAnswer = strcmp(file, "1") == 0;
+  }
+  if (debugFlag) {
+    printf("Probe answered in %lu us\n", rtt);
+  }
+}
+
+/*
+ * Purpose: Remember how fast a download from a peer went
+ * Input:
+ * - The table
+ * - UDP address of the peer
+ * - Bytes downloaded
+ * - Microseconds from connecting to the last byte
+ * Output: None
+ */
+void recordTransferRate(struct OwnerRanking* ranking,
+                        struct sockaddr_in address,
+                        unsigned long bytes,
+                        unsigned long duration) {
+  if (bytes < RANKING_MIN_SAMPLE || duration == 0) {
+    return;
+  }
+  struct PeerSpeed* peer = findPeerSpeed(ranking, address, true);
+  peer->throughput       = updateAverage(peer->throughput, bytes * 1000000 / duration);
+}
+
+/*
+ * Purpose: Estimate how long a download from a peer would take. Connecting and asking
+ * for the file take two round trips, then a typical file is sent at the peer's
+ * throughput.
+ * Input:
+ * - The table
+ * - UDP address of the peer
+ * Output: Expected microseconds until the file is downloaded
+ */
+unsigned long getExpectedCompletion(struct OwnerRanking* ranking,
+                                    struct sockaddr_in address) {
+  unsigned long rtt        = RANKING_PROBE_WAIT;
+  unsigned long throughput = RANKING_DEFAULT_THROUGHPUT;
+  struct PeerSpeed* peer   = findPeerSpeed(ranking, address, false);
+  if (peer != NULL && peer->smoothedRtt != 0) {
+    rtt = peer->smoothedRtt;
+  }
+  if (peer != NULL && peer->throughput != 0) {
+    throughput = peer->throughput;
+  }
+  return 2 * rtt + (unsigned long)RANKING_TYPICAL_FILE * 1000000 / throughput;
+}
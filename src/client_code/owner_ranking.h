@@ -0,0 +1,67 @@
+#ifndef OWNER_RANKING_H
+#define OWNER_RANKING_H
+
+// Peers whose round trip time and throughput are remembered
+#define RANKING_MAX_PEERS 64
+
+// Microseconds a download waits for probe answers before it picks an owner. A peer
+// that hasn't answered by then is ranked as if this were its round trip time.
+#define RANKING_PROBE_WAIT 200000
+
+// Microseconds a measured round trip time is trusted before the peer is probed again
+#define RANKING_RTT_LIFETIME 60000000
+
+// Bytes a file is assumed to be when estimating how long a download takes, the size
+// isn't known until the owner sends it
+#define RANKING_TYPICAL_FILE 1048576
+
+// Bytes per second assumed for a peer no download has been timed from. Optimistic so
+// untried peers get a turn.
+#define RANKING_DEFAULT_THROUGHPUT 4194304
+
+// Smallest download timed for throughput. Smaller ones mostly measure round trips.
+#define RANKING_MIN_SAMPLE 65536
+
+#include <netinet/in.h>
+#include <stdbool.h>
+
+#include "../common/network_node.h"
+
+// What a client has measured about another client, found by its UDP address. Both
+// measurements are moving averages, a new one counts for an eighth.
+struct PeerSpeed {
+  struct sockaddr_in address;
+  unsigned long smoothedRtt; // Microseconds, 0 until a probe is answered
+  unsigned long rttMeasuredAt;
+  unsigned long throughput; // Bytes per second, 0 until a download is timed
+  unsigned long probeSentAt; // 0 if no probe is waiting for an answer
+  unsigned long lastUsed;
+
+  // File the last probe asked about, empty if it only asked for the round trip time
+  char probedFile[MAX_FILENAME];
+  int fileAnswer; // 1 if the peer has the file, 0 if it doesn't, -1 until it answers
+};
+
+// Peers a client has measured. The least recently used one makes room for a new one.
+struct OwnerRanking {
+  struct PeerSpeed peers[RANKING_MAX_PEERS];
+};
+
+void initOwnerRanking(struct OwnerRanking*);
+bool probePeer(struct OwnerRanking*, int, struct sockaddr_in, char*, bool);
+bool isProbePending(struct OwnerRanking*, struct sockaddr_in);
+int getProbedFileAnswer(struct OwnerRanking*, struct sockaddr_in, char*);
+void handleProbePacket(struct OwnerRanking*,
+                       char*,
+                       struct sockaddr_in,
+                       int,
+                       bool (*)(void*, char*),
+                       void*,
+                       bool);
+void recordTransferRate(struct OwnerRanking*,
+                        struct sockaddr_in,
+                        unsigned long,
+                        unsigned long);
+unsigned long getExpectedCompletion(struct OwnerRanking*, struct sockaddr_in);
+
+#endif
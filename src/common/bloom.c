@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bloom.h"
+
+/*
+ * Purpose: Set up an empty filter
+ * Input:
+ * - The filter
+ * - Cells it has, a power of two
+ * Output: None
+ */
+void initCountingBloom(struct CountingBloom* filter, unsigned long cellCount) {
+  filter->cellCount = cellCount;
+  filter->counters  = calloc(cellCount / 2, 1);
+}
+
+/*
+ * Purpose: Free the cells of a filter
+ * Input: The filter
+ * Output: None
+ */
+void freeCountingBloom(struct CountingBloom* filter) {
+  free(filter->counters);
+  filter->counters  = NULL;
+  filter->cellCount = 0;
+}
+
+/*
+ * Purpose: Get the memory allocated for a filter's cells
+ * Input: The filter
+ * Output: Bytes allocated
+ */
+unsigned long getBloomBytes(struct CountingBloom* filter) {
+  return filter->cellCount / 2;
+}
+
+/*
+ * Purpose: Find the cells a key is counted in. A 64 bit FNV-1a hash of the key and a
+ * second hash mixed from it step through the filter, so only one pass over the key is
+ * needed for every cell.
+ * Input:
+ * - The filter
+ * - The key
+ * - Where to put the BLOOM_HASHES cells
+ * Output: None
+ */
+static void findBloomCells(struct CountingBloom* filter,
+                           const char* key,
+                           unsigned long* cells) {
+  unsigned long hash = 14695981039346656037UL;
+  while (*key != '\0') {
+    hash ^= (unsigned char)*key;
+    hash *= 1099511628211UL;
+    key++;
+  }
+  unsigned long step = hash ^ (hash >> 31);
+  step *= 0x9e3779b97f4a7c15UL;
+  step ^= step >> 29;
+  step |= 1; // Odd, so the steps never land on the same cell twice
+
+  int i;
+  for (i = 0; i < BLOOM_HASHES; i++) {
+    cells[i] = (hash + (unsigned long)i * step) & (filter->cellCount - 1);
+  }
+}
+
+/*
+ * Purpose: Read a cell
+ * Input:
+ * - The filter
+ * - Index of the cell
+ * Output: Its count
+ */
+static unsigned int getBloomCell(struct CountingBloom* filter, unsigned long cell) {
+  return (filter->counters[cell / 2] >> (cell % 2 * 4)) & 0xf;
+}
+
+/*
+ * Purpose: Write a cell
+ * Input:
+ * - The filter
+ * - Index of the cell
+ * - Its new count, at most BLOOM_COUNTER_MAX
+ * Output: None
+ */
+static void setBloomCell(struct CountingBloom* filter,
+                         unsigned long cell,
+                         unsigned int count) {
+  unsigned int shift = (unsigned int)(cell % 2 * 4);
+  filter->counters[cell / 2] =
+      (unsigned char)((filter->counters[cell / 2] & ~(0xfu << shift)) | (count << shift));
+}
+
+/*
+ * Purpose: Put a key in a filter
+ * Input:
+ * - The filter
+ * - The key
+ * Output: None
+ */
+void addBloomKey(struct CountingBloom* filter, const char* key) {
+  unsigned long cells[BLOOM_HASHES];
+  findBloomCells(filter, key, cells);
+  int i;
+  for (i = 0; i < BLOOM_HASHES; i++) {
+    unsigned int count = getBloomCell(filter, cells[i]);
+    if (count < BLOOM_COUNTER_MAX) {
+      setBloomCell(filter, cells[i], count + 1);
+    }
+  }
+}
+
+/*
+ * Purpose: Take a key that was put in a filter out of it. Cells that have reached
+ * BLOOM_COUNTER_MAX are left alone, they might still count other keys.
+ * Input:
+ * - The filter
+ * - The key
+ * Output: None
+ */
+void removeBloomKey(struct CountingBloom* filter, const char* key) {
+  unsigned long cells[BLOOM_HASHES];
+  findBloomCells(filter, key, cells);
+  int i;
+  for (i = 0; i < BLOOM_HASHES; i++) {
+    unsigned int count = getBloomCell(filter, cells[i]);
+    if (count > 0 && count < BLOOM_COUNTER_MAX) {
+      setBloomCell(filter, cells[i], count - 1);
+    }
+  }
+}
+
+/*
+ * Purpose: Check whether a key might be in a filter. Keys that were put in are always
+ * found, others are found by mistake as often as all their cells are counting other
+ * keys.
+ * Input:
+ * - The filter
+ * - The key
+ * Output: Whether the key might be in the filter
+ */
+bool mayContainBloomKey(struct CountingBloom* filter, const char* key) {
+  if (filter->cellCount == 0) {
+    return false;
+  }
+  unsigned long cells[BLOOM_HASHES];
+  findBloomCells(filter, key, cells);
+  int i;
+  for (i = 0; i < BLOOM_HASHES; i++) {
+    if (getBloomCell(filter, cells[i]) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Purpose: Write a run of cells as hex digits, one per cell, to send them in a packet
+ * Input:
+ * - The filter
+ * - Index of the first cell
+ * - Most cells to write
+ * - Where to write them, NUL terminated
+ * Output: Number of cells written
+ */
+unsigned long encodeBloomCells(struct CountingBloom* filter,
+                               unsigned long firstCell,
+                               unsigned long cellCount,
+                               char* output) {
+  static const char digits[] = "0123456789abcdef";
+  unsigned long written      = 0;
+  while (written < cellCount && firstCell + written < filter->cellCount) {
+    output[written] = digits[getBloomCell(filter, firstCell + written)];
+    written++;
+  }
+  output[written] = '\0';
+  return written;
+}
+
+/*
+ * Purpose: Read a run of cells written by encodeBloomCells() into a filter. Reading
+ * stops at the first character that isn't a hex digit or at the end of the filter.
+ * Input:
+ * - The filter
+ * - Index of the first cell
+ * - The hex digits
+ * Output: Number of cells read
+ */
+unsigned long decodeBloomCells(struct CountingBloom* filter,
+                               unsigned long firstCell,
+                               const char* input) {
+  unsigned long read = 0;
+  while (firstCell + read < filter->cellCount) {
+    char digit = input[read];
+    unsigned int count;
+    if (digit >= '0' && digit <= '9') {
+      count = (unsigned int)(digit - '0');
+    } else if (digit >= 'a' && digit <= 'f') {
+      count = (unsigned int)(digit - 'a' + 10);
+    } else {
+      break;
+    }
+    setBloomCell(filter, firstCell + read, count);
+    read++;
+  }
+  return read;
+}
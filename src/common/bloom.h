@@ -0,0 +1,40 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+// Cells each key is counted in
+#define BLOOM_HASHES 4
+
+// Largest value of a cell. A cell that gets there stays there, what it counts is no
+// longer known.
+#define BLOOM_COUNTER_MAX 15
+
+// Smallest and largest filter a client can register with the server, in cells. Sizes
+// are powers of two.
+#define BLOOM_MIN_CELLS 1024
+#define BLOOM_MAX_CELLS (1 << 20)
+
+// Cells sent in each register packet of a summary registration, one hex digit each
+#define BLOOM_CELLS_PER_CHUNK 128
+
+#include <stdbool.h>
+
+// Counting Bloom filter of filenames. Each cell counts the keys hashed to it in 4 bits,
+// two cells to a byte, so keys can be taken out as well as put in.
+struct CountingBloom {
+  unsigned long cellCount; // Power of two
+  unsigned char* counters;
+};
+
+void initCountingBloom(struct CountingBloom*, unsigned long);
+void freeCountingBloom(struct CountingBloom*);
+unsigned long getBloomBytes(struct CountingBloom*);
+void addBloomKey(struct CountingBloom*, const char*);
+void removeBloomKey(struct CountingBloom*, const char*);
+bool mayContainBloomKey(struct CountingBloom*, const char*);
+unsigned long encodeBloomCells(struct CountingBloom*,
+                               unsigned long,
+                               unsigned long,
+                               char*);
+unsigned long decodeBloomCells(struct CountingBloom*, unsigned long, const char*);
+
+#endif
@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+#include "packet.h"
+
+/*
+ * Purpose: Create a capture file for the datagrams a node receives. Records are
+ * buffered, they only reach the file once CAPTURE_BUFFER_SIZE bytes have been written
+ * or the capture is closed.
+ * Input:
+ * - The capture
+ * - Path of the file, replaced if it exists
+ * Output: Whether the file was created
+ */
+bool openCaptureWriter(struct Capture* capture, char* path) {
+  memset(capture, 0, sizeof(*capture));
+  capture->file = fopen(path, "wb");
+  if (capture->file == NULL) {
+    perror("Error creating capture file");
+    return false;
+  }
+  setvbuf(capture->file, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+  struct CaptureFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+  header.version = CAPTURE_VERSION;
+  if (fwrite(&header, sizeof(header), 1, capture->file) != 1) {
+    perror("Error writing capture file");
+    fclose(capture->file);
+    capture->file = NULL;
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Purpose: Add a received datagram to a capture file, with its source and how long
+ * after the previous one it arrived
+ * Input:
+ * - The capture, opened with openCaptureWriter()
+ * - Address the datagram came from
+ * - The datagram, NUL terminated
+ * - Time it was received in microseconds
+ * Output: None
+ */
+void writeCapturedDatagram(struct Capture* capture,
+                           struct sockaddr_in source,
+                           char* datagram,
+                           unsigned long receiveTime) {
+  struct CaptureRecord record;
+  unsigned long gap = 0;
+  if (capture->started && receiveTime > capture->previousTime) {
+    gap = receiveTime - capture->previousTime;
+  }
+  record.gap     = gap > UINT32_MAX ? UINT32_MAX : (uint32_t)gap;
+  record.address = source.sin_addr.s_addr;
+  record.port    = source.sin_port;
+  record.length  = (uint16_t)strnlen(datagram, MAX_PACKET - 1);
+  capture->previousTime = receiveTime;
+  capture->started      = true;
+
+  if (fwrite(&record, sizeof(record), 1, capture->file) != 1 ||
+      fwrite(datagram, 1, record.length, capture->file) != record.length) {
+    perror("Error writing capture file, capture stopped");
+    closeCapture(capture);
+    return;
+  }
+  capture->datagramCount++;
+}
+
+/*
+ * Purpose: Open a capture file to read its datagrams back
+ * Input:
+ * - The capture
+ * - Path of the file
+ * Output: Whether the file is a capture file this version can read
+ */
+bool openCaptureReader(struct Capture* capture, char* path) {
+  memset(capture, 0, sizeof(*capture));
+  capture->file = fopen(path, "rb");
+  if (capture->file == NULL) {
+    perror("Error opening capture file");
+    return false;
+  }
+  setvbuf(capture->file, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+  struct CaptureFileHeader header;
+  if (fread(&header, sizeof(header), 1, capture->file) != 1 ||
+      memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != CAPTURE_VERSION) {
+    printf("Not a capture file, or written by a different version\n");
+    fclose(capture->file);
+    capture->file = NULL;
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Purpose: Read the next datagram out of a capture file
+ * Input:
+ * - The capture, opened with openCaptureReader()
+ * - Where to put the address the datagram came from
+ * - Buffer to put the datagram in, NUL terminated, at least MAX_PACKET bytes
+ * - Where to put when it arrived, in microseconds after the first datagram
+ * Output: Bytes in the datagram, -1 at the end of the file
+ */
+long readCapturedDatagram(struct Capture* capture,
+                          struct sockaddr_in* source,
+                          char* datagram,
+                          unsigned long* arrivalTime) {
+  struct CaptureRecord record;
+  if (fread(&record, sizeof(record), 1, capture->file) != 1) {
+    return -1;
+  }
+  // Longer datagrams aren't written, a file that has one is damaged
+  if (record.length > MAX_PACKET - 1 ||
+      fread(datagram, 1, record.length, capture->file) != record.length) {
+    printf("Capture file truncated after %lu datagrams\n", capture->datagramCount);
+    return -1;
+  }
+  datagram[record.length] = '\0';
+
+  memset(source, 0, sizeof(*source));
+  source->sin_family      = AF_INET;
+  source->sin_addr.s_addr = record.address;
+  source->sin_port        = record.port;
+  if (capture->datagramCount > 0) {
+    capture->elapsed += record.gap;
+  }
+  *arrivalTime = capture->elapsed;
+  capture->datagramCount++;
+  return record.length;
+}
+
+/*
+ * Purpose: Close a capture file, writing out any records still buffered
+ * Input: The capture
+ * Output: None
+ */
+void closeCapture(struct Capture* capture) {
+  if (capture->file != NULL) {
+    fclose(capture->file);
+    capture->file = NULL;
+  }
+}
@@ -0,0 +1,45 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#define CAPTURE_MAGIC   "P2PCAPTR"
+#define CAPTURE_VERSION 1
+
+// Bytes of records buffered before they are written to the capture file, so the
+// receive stage only makes a system call once in a while
+#define CAPTURE_BUFFER_SIZE (1024 * 1024)
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct CaptureFileHeader {
+  char magic[8];
+  unsigned int version;
+  unsigned int reserved;
+};
+
+// Written before each captured datagram, which follows it without a NUL
+struct CaptureRecord {
+  uint32_t gap;     // Microseconds since the previous datagram, at most UINT32_MAX
+  uint32_t address; // Source IPv4 address, network byte order
+  uint16_t port;    // Source port, network byte order
+  uint16_t length;  // Bytes in the datagram
+};
+
+// A capture file being written or read
+struct Capture {
+  FILE* file;
+  unsigned long previousTime; // Microseconds, of the last datagram written
+  unsigned long elapsed;      // Microseconds from the first datagram to the last read
+  unsigned long datagramCount;
+  bool started; // A datagram has been written
+};
+
+bool openCaptureWriter(struct Capture*, char*);
+void writeCapturedDatagram(struct Capture*, struct sockaddr_in, char*, unsigned long);
+bool openCaptureReader(struct Capture*, char*);
+long readCapturedDatagram(struct Capture*, struct sockaddr_in*, char*, unsigned long*);
+void closeCapture(struct Capture*);
+
+#endif
@@ -1,47 +1,71 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "network_node.h"
+#include "ring.h"
+#include "stats.h"
+#include "trace.h"
+#include "uring.h"
+
+// A message waiting for the send stage, see startUdpSendStage()
+struct QueuedUdpMessage {
+  struct sockaddr_in destination;
+  char message[MAX_PACKET];
+};
+
+// Socket whose messages go through the send stage, -1 if there is no send stage
+static int sendStageSocket = -1;
+static struct MpmcRing sendStageRing;
+static pthread_t sendStageThread;
+
+// Messages handed to the send stage and messages it has sent, see drainUdpSendStage()
+static atomic_ulong sendStageQueued;
+static atomic_ulong sendStageSent;
 
 /*
  * Name: checkCommandLineArguments
  * Purpose: Check for command line arguments when starting up a network node.
- * At the moment it is only used for setting the debug flag.
+ * -d sets the debug flag, -u selects the io_uring backend where it is supported.
  * Input:
  * - Number of command line arguments
  * - The command line arguments
  * - Debug flag
+ * - io_uring flag, NULL if the node doesn't support io_uring
  * Output: None
  */
-void checkCommandLineArguments(int argc, char** argv, bool* debugFlag) {
+void checkCommandLineArguments(int argc, char** argv, bool* debugFlag, bool* uringFlag) {
   char* programName = argv[0];
   programName += 2;
 
-  switch (argc) {
-    // Normal
-  case 1:
-    printf("Running %s in normal mode\n", programName);
-    break;
-
+  int i;
+  for (i = 1; i < argc; i++) {
     // Debug mode
-  case 2:
-    if (strcmp(argv[1], "-d") == 0) {
+    if (strcmp(argv[i], "-d") == 0) {
       *debugFlag = 1;
-      printf("Running %s in debug mode\n", programName);
-    } else {
-      printf("Invalid usage of %s", programName);
     }
-    break;
+    // io_uring backend
+    else if (strcmp(argv[i], "-u") == 0 && uringFlag != NULL) {
+      *uringFlag = 1;
+    }
+    // Invalid
+    else {
+      printf("Invalid usage of %s\n", programName);
+    }
+  }
 
-  // Invalid
-  default:
-    printf("Invalid usage of %s", programName);
+  if (*debugFlag) {
+    printf("Running %s in debug mode\n", programName);
+  } else {
+    printf("Running %s in normal mode\n", programName);
   }
 }
 
@@ -56,35 +80,132 @@ void getUserInput(char* userInput) {
 }
 
 /*
- * Purpose: Send a message via UDP
+ * Purpose: Hand a UDP message to the socket, or to io_uring if the socket uses it. A
+ * message that can't be sent, because the socket's buffer is full under load for
+ * instance, is dropped and counted in send_errors_total.
  * Input:
  * - Socket to send the message out on
  * - Socket address to send the message to
  * - The message to send
- * - Debug flag
+ * Output: None
+ */
+static void transmitUdpMessage(int udpSocketDescriptor,
+                               struct sockaddr_in destinationAddress,
+                               char* message) {
+  long int sendtoReturn = 0;
+  if (usingUdpUring(udpSocketDescriptor)) {
+    sendtoReturn = queueUdpUringSend(udpSocketDescriptor, destinationAddress, message);
+  } else {
+    sendtoReturn =
+        sendto(udpSocketDescriptor, message, strlen(message), 0,
+               (struct sockaddr*)&destinationAddress, sizeof(destinationAddress));
+  }
+  if (sendtoReturn == -1) {
+    statsAdd(STATS_SEND_ERRORS, 1);
+    TRACE(TRACE_SEND_FAILED, errno, TRACE_ADDRESS(destinationAddress));
+    return;
+  }
+  TRACE(TRACE_PACKET_SENT, sendtoReturn, TRACE_ADDRESS(destinationAddress));
+  statsAdd(STATS_PACKETS_SENT, 1);
+  statsAdd(STATS_BYTES_SENT, (unsigned long)sendtoReturn);
+}
+
+/*
+ * Purpose: Send a message via UDP. If the socket has a send stage the message is
+ * queued for it, waiting for room if the stage is behind.
+ * Input:
+ * - Socket to send the message out on
+ * - Socket address to send the message to
+ * - The message to send
+ * - Debug flag, unused. Sends are traced instead, see trace.h
  * Output: None
  */
 void sendUdpMessage(int udpSocketDescriptor,
                     struct sockaddr_in destinationAddress,
                     char* message,
                     bool debugFlag) {
-  if (debugFlag) {
-    printf("Sending UDP message:\n");
-    printf("%s\n", message);
-    printf("To %d:%d\n", ntohl(destinationAddress.sin_addr.s_addr),
-           ntohs(destinationAddress.sin_port));
+  (void)debugFlag;
+  if (udpSocketDescriptor != sendStageSocket) {
+    transmitUdpMessage(udpSocketDescriptor, destinationAddress, message);
+    return;
   }
+  struct QueuedUdpMessage queued;
+  queued.destination = destinationAddress;
+  strncpy(queued.message, message, MAX_PACKET - 1);
+  queued.message[MAX_PACKET - 1] = '\0';
+  while (!pushMpmcRingWait(&sendStageRing, &queued, 0)) {
+  }
+  atomic_fetch_add_explicit(&sendStageQueued, 1, memory_order_relaxed);
+}
 
-  long int sendtoReturn = 0;
-  sendtoReturn =
-      sendto(udpSocketDescriptor, message, strlen(message), 0,
-             (struct sockaddr*)&destinationAddress, sizeof(destinationAddress));
-  if (sendtoReturn == -1) {
-    perror("UDP send error");
-    exit(1);
-  } else if (debugFlag) {
-    printf("UDP message sent\n");
+/*
+ * Purpose: Send the messages queued for the send stage, for as long as the program
+ * runs. Queued io_uring sends are flushed whenever the queue runs dry.
+ * Input: Unused
+ * Output: None
+ */
+static void* runUdpSendStage(void* input) {
+  (void)input;
+  struct QueuedUdpMessage queued;
+  while (1) {
+    if (!popMpmcRing(&sendStageRing, &queued)) {
+      flushUdpMessages();
+      while (!popMpmcRingWait(&sendStageRing, &queued, 0)) {
+      }
+    }
+    transmitUdpMessage(sendStageSocket, queued.destination, queued.message);
+    atomic_fetch_add_explicit(&sendStageSent, 1, memory_order_release);
   }
+  return NULL;
+}
+
+/*
+ * Purpose: Give a UDP socket a send stage, a thread that sends every message sent on
+ * the socket from then on. Threads sending on the socket only copy their message into
+ * the stage's ring, so they don't wait on the socket unless the ring fills up.
+ * Input:
+ * - The socket
+ * - Messages the stage can have queued
+ * Output:
+ * - -1: The thread couldn't be started, messages are sent directly
+ * - 0: Success
+ */
+int startUdpSendStage(int udpSocketDescriptor, unsigned long capacity) {
+  initMpmcRing(&sendStageRing, capacity, sizeof(struct QueuedUdpMessage));
+  sendStageSocket = udpSocketDescriptor;
+  if (pthread_create(&sendStageThread, NULL, runUdpSendStage, NULL) != 0) {
+    perror("Error starting send stage");
+    sendStageSocket = -1;
+    freeMpmcRing(&sendStageRing);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Purpose: Send every UDP message that is still queued. Only the io_uring backend
+ * queues messages, call this before sleeping so they aren't held up.
+ * Input: None
+ * Output: None
+ */
+void flushUdpMessages() {
+  flushUdpUring();
+}
+
+/*
+ * Purpose: Wait until the send stage has sent every message queued so far, for a
+ * program that is about to exit. Nothing else should be sending while it waits.
+ * Input: None
+ * Output: None
+ */
+void drainUdpSendStage() {
+  if (sendStageSocket != -1) {
+    while (atomic_load_explicit(&sendStageSent, memory_order_acquire) !=
+           atomic_load_explicit(&sendStageQueued, memory_order_relaxed)) {
+      usleep(100);
+    }
+  }
+  flushUdpMessages();
 }
 
 /*
@@ -124,20 +245,24 @@ void printReceivedMessage(struct sockaddr_in sender,
 int readFile(char* fileName, char* buffer, bool debugFlag) {
   // Open the file
   int fileDescriptor;
-  printf("Opening file %s...\n", fileName);
+  if (debugFlag) {
+    printf("Opening file %s...\n", fileName);
+  }
 
-  // Create if does not exist + read and write mode
-  fileDescriptor = open(fileName, O_CREAT, O_RDWR);
+  fileDescriptor = open(fileName, O_RDONLY);
   if (fileDescriptor == -1) {
     perror("Error opening file");
     return -1;
   }
-  printf("File %s opened\n", fileName);
+  if (debugFlag) {
+    printf("File %s opened\n", fileName);
+  }
 
   // Get the size of the file in bytes
   struct stat fileInformation;
-  if (stat(fileName, &fileInformation) == -1) {
+  if (fstat(fileDescriptor, &fileInformation) == -1) {
     perror("Error getting file size");
+    close(fileDescriptor);
     return -1;
   };
   long int fileSize = fileInformation.st_size;
@@ -146,17 +271,19 @@ int readFile(char* fileName, char* buffer, bool debugFlag) {
   }
 
   // Read out the contents of the file
-  printf("Reading file...\n");
-  ssize_t bytesReadFromFile = 0;
-  bytesReadFromFile         = read(fileDescriptor, buffer, (long unsigned int)fileSize);
+  if (debugFlag) {
+    printf("Reading file...\n");
+  }
+  ssize_t bytesReadFromFile = read(fileDescriptor, buffer, (long unsigned int)fileSize);
+  close(fileDescriptor);
   if (bytesReadFromFile == -1) {
     perror("Error reading file");
     return -1;
   }
+  TRACE(TRACE_FILE_READ, bytesReadFromFile, 0);
   if (debugFlag) {
     printf("%zd bytes read from %s\n", bytesReadFromFile, fileName);
   }
-  printf("File read successfully\n");
   return 0;
 }
 
@@ -188,6 +315,7 @@ int writeFile(char* fileName, char* fileContents, size_t fileSize) {
     perror("File write error");
     return -1;
   }
+  TRACE(TRACE_FILE_WRITTEN, writeReturn, 0);
   return 0;
 }
 
@@ -219,6 +347,14 @@ int setupUdpSocket(struct sockaddr_in serverAddress, bool bindFlag) {
 
   printf("UDP socket set up\n");
 
+  // Have the kernel report how many packets it dropped because the receive queue was
+  // full. Not fatal if unsupported.
+  int rxqOverflow = 1;
+  if (setsockopt(udpSocketDescriptor, SOL_SOCKET, SO_RXQ_OVFL, &rxqOverflow,
+                 sizeof(rxqOverflow)) == -1) {
+    perror("Error when enabling UDP receive queue drop reporting");
+  }
+
   // Maybe bind UDP socket
   if (!bindFlag) {
     return udpSocketDescriptor;
@@ -236,12 +372,13 @@ int setupUdpSocket(struct sockaddr_in serverAddress, bool bindFlag) {
 
 /*
  * Name: checkUdpSocket
- * Purpose: Check if there is message on a UDP port.
+ * Purpose: Check if there is message on a UDP port. A socket handed to setupUring() is
+ * read from its io_uring receive buffers instead.
  * Input:
  * - Address of the UDP port that is receiving messages.
  * - If message is received, socket address data structure to store the senders
  * address in
- * - Buffer to read message into
+ * - Buffer to read message into, at least MAX_PACKET bytes
  * - Debug flag
  * Output: None
  * 0: No incoming messages
@@ -251,16 +388,51 @@ int checkUdpSocket(int listeningUDPSocketDescriptor,
                    struct sockaddr_in* incomingAddress,
                    char* message,
                    bool debugFlag) {
-  socklen_t incomingAddressLength = sizeof(incomingAddress);
-  long int bytesReceived =
-      recvfrom(listeningUDPSocketDescriptor, message, 250, 0,
-               (struct sockaddr*)incomingAddress, &incomingAddressLength);
-  int nonBlockingReturn = handleErrorNonBlocking((int)bytesReceived);
+  if (usingUdpUring(listeningUDPSocketDescriptor)) {
+    long int bytesReceived = checkUdpUring(incomingAddress, message);
+    if (bytesReceived == 0) {
+      return 0;
+    }
+    message[bytesReceived] = '\0';
+    statsAdd(STATS_BYTES_RECEIVED, (unsigned long)bytesReceived);
+    TRACE(TRACE_PACKET_RECEIVED, bytesReceived, TRACE_ADDRESS(*incomingAddress));
+    printReceivedMessage(*incomingAddress, bytesReceived, message, debugFlag);
+    return 1;
+  }
+
+  struct iovec messageVector;
+  messageVector.iov_base = message;
+  messageVector.iov_len  = MAX_PACKET - 1;
+
+  // Ancillary data carries the receive queue drop count
+  char control[CMSG_SPACE(sizeof(uint32_t))];
+  struct msghdr messageHeader;
+  memset(&messageHeader, 0, sizeof(messageHeader));
+  messageHeader.msg_name       = incomingAddress;
+  messageHeader.msg_namelen    = sizeof(*incomingAddress);
+  messageHeader.msg_iov        = &messageVector;
+  messageHeader.msg_iovlen     = 1;
+  messageHeader.msg_control    = control;
+  messageHeader.msg_controllen = sizeof(control);
+
+  long int bytesReceived = recvmsg(listeningUDPSocketDescriptor, &messageHeader, 0);
+  int nonBlockingReturn  = handleErrorNonBlocking((int)bytesReceived);
 
   // No incoming message
   if (nonBlockingReturn == 1) {
     return 0;
   }
+  message[bytesReceived] = '\0';
+
+  struct cmsghdr* controlMessage = CMSG_FIRSTHDR(&messageHeader);
+  if (controlMessage != NULL && controlMessage->cmsg_level == SOL_SOCKET &&
+      controlMessage->cmsg_type == SO_RXQ_OVFL) {
+    uint32_t drops;
+    memcpy(&drops, CMSG_DATA(controlMessage), sizeof(drops));
+    statsSet(STATS_RECEIVE_QUEUE_DROPS, drops);
+  }
+  statsAdd(STATS_BYTES_RECEIVED, (unsigned long)bytesReceived);
+  TRACE(TRACE_PACKET_RECEIVED, bytesReceived, TRACE_ADDRESS(*incomingAddress));
 
   // Incoming message
   printReceivedMessage(*incomingAddress, bytesReceived, message, debugFlag);
@@ -332,3 +504,31 @@ int setupTcpSocket(struct sockaddr_in hostAddress) {
   }
   return tcpSocketDescriptor;
 }
+
+/*
+ * Name: getMicroseconds
+ * Purpose: Get the current time from a monotonic clock. Used for scheduling periodic
+ * work and measuring intervals, not for wall clock time.
+ * Input: None
+ * Output: Current monotonic time in microseconds
+ */
+unsigned long getMicroseconds() {
+  struct timespec currentTime;
+  clock_gettime(CLOCK_MONOTONIC, &currentTime);
+  return (unsigned long)currentTime.tv_sec * 1000000UL +
+         (unsigned long)currentTime.tv_nsec / 1000UL;
+}
+
+/*
+ * Name: getNanoseconds
+ * Purpose: Get the current time from a monotonic clock with nanosecond resolution.
+ * Used for measuring how long short operations take.
+ * Input: None
+ * Output: Current monotonic time in nanoseconds
+ */
+unsigned long getNanoseconds() {
+  struct timespec currentTime;
+  clock_gettime(CLOCK_MONOTONIC, &currentTime);
+  return (unsigned long)currentTime.tv_sec * 1000000000UL +
+         (unsigned long)currentTime.tv_nsec;
+}
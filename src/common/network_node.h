@@ -34,9 +34,12 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
-void checkCommandLineArguments(int, char**, bool*);
+void checkCommandLineArguments(int, char**, bool*, bool*);
 void getUserInput(char*);
 void sendUdpMessage(int, struct sockaddr_in, char*, bool);
+void flushUdpMessages();
+int startUdpSendStage(int, unsigned long);
+void drainUdpSendStage();
 void printReceivedMessage(struct sockaddr_in, long int, char*, bool);
 
 // File I/O
@@ -49,4 +52,7 @@ int handleErrorNonBlocking(int);
 
 int setupTcpSocket(struct sockaddr_in);
 
+unsigned long getMicroseconds();
+unsigned long getNanoseconds();
+
 #endif
@@ -6,8 +6,47 @@
 #include <sys/types.h>
 
 #include "packet.h"
+#include "stats.h"
+#include "trace.h"
 
-static const char* packetTypes[NUM_PACKET_TYPES] = {"connection", "status", "resource"};
+// Everything about each packet type, in packet type order. Rate limits are the budget
+// each client address gets at the server, resource listings take one packet per page.
+static const struct PacketTypeInfo packetTypeInfo[NUM_PACKET_TYPES] = {
+    [PACKET_CONNECTION] = {"connection", PACKET_RELIABLE, {2, 8}}, // Room for retries
+    [PACKET_STATUS]     = {"status", PACKET_UNRELIABLE, {2, 4}},
+    [PACKET_RESOURCE]   = {"resource", PACKET_UNRELIABLE, {10, 20}},
+    [PACKET_PEERS]      = {"peers", PACKET_UNRELIABLE, {2, 5}},
+    [PACKET_ANNOUNCE]   = {"announce", PACKET_RELIABLE, {50, 100}},
+    [PACKET_GOSSIP]     = {"gossip", PACKET_UNRELIABLE, {1, 1}}, // Only between clients
+    [PACKET_DIGEST]     = {"digest", PACKET_UNRELIABLE, {1, 1}}, // Only between clients
+    [PACKET_LOOKUP]     = {"lookup", PACKET_RELIABLE, {50, 100}},
+    [PACKET_ACK]        = {"ack", PACKET_UNRELIABLE, {100, 200}},
+    [PACKET_SEARCH]     = {"search", PACKET_UNRELIABLE, {20, 40}},
+    [PACKET_REGISTER]   = {"register", PACKET_RELIABLE, {8000, 200}}, // 2x client rate
+    [PACKET_PROBE]      = {"probe", PACKET_UNRELIABLE, {1, 1}}, // Only between clients
+    [PACKET_FIND]       = {"find", PACKET_UNRELIABLE, {20, 40}},
+    [PACKET_SESSION]    = {"session", PACKET_RELIABLE, {2, 8}}, // Room for retries
+};
+
+// Perfect hash from packet type name to packet type plus one, 0 for an empty slot. Two
+// names landing in the same slot initialize it twice, which -Woverride-init turns into
+// a build error, so a new packet type needs a new multiplier in PACKET_TYPE_SLOT().
+static const unsigned char packetTypeSlots[PACKET_TYPE_SLOTS] = {
+    [PACKET_TYPE_SLOT('c', 'n', 10)] = PACKET_CONNECTION + 1,
+    [PACKET_TYPE_SLOT('s', 's', 6)]  = PACKET_STATUS + 1,
+    [PACKET_TYPE_SLOT('r', 'e', 8)]  = PACKET_RESOURCE + 1,
+    [PACKET_TYPE_SLOT('p', 's', 5)]  = PACKET_PEERS + 1,
+    [PACKET_TYPE_SLOT('a', 'e', 8)]  = PACKET_ANNOUNCE + 1,
+    [PACKET_TYPE_SLOT('g', 'p', 6)]  = PACKET_GOSSIP + 1,
+    [PACKET_TYPE_SLOT('d', 't', 6)]  = PACKET_DIGEST + 1,
+    [PACKET_TYPE_SLOT('l', 'p', 6)]  = PACKET_LOOKUP + 1,
+    [PACKET_TYPE_SLOT('a', 'k', 3)]  = PACKET_ACK + 1,
+    [PACKET_TYPE_SLOT('s', 'h', 6)]  = PACKET_SEARCH + 1,
+    [PACKET_TYPE_SLOT('r', 'r', 8)]  = PACKET_REGISTER + 1,
+    [PACKET_TYPE_SLOT('p', 'e', 5)]  = PACKET_PROBE + 1,
+    [PACKET_TYPE_SLOT('f', 'd', 4)]  = PACKET_FIND + 1,
+    [PACKET_TYPE_SLOT('s', 'n', 7)]  = PACKET_SESSION + 1,
+};
 
 struct PacketDelimiters packetDelimiters = {
     1,
@@ -20,27 +59,82 @@ struct PacketDelimiters packetDelimiters = {
 
 /*
  * Purpose: Take in the type of the packet as a string and return an integer associated
- * with that packet type.
+ * with that packet type. The name is hashed to the only type it can be, then compared
+ * with that type's name once.
  * Input:
  * - The type of the packet as a string
- * Output: Integer representing the type of the packet
- * -1 = invalid
- * 0 = connection
- * 1 = status
- * 2 = resource
- * Notes: Might look at using an enum for packet type
+ * - Debug flag, unused
+ * Output: Integer representing the type of the packet, one of the PACKET_ types in
+ * packet.h, -1 if it is invalid
  */
 int getPacketType(char* packetType, bool debugFlag) {
+  (void)debugFlag;
+  unsigned long length = strlen(packetType);
+  if (length == 0) {
+    return -1;
+  }
+  unsigned int first = (unsigned char)packetType[0];
+  unsigned int last  = (unsigned char)packetType[length - 1];
+  int type = packetTypeSlots[PACKET_TYPE_SLOT(first, last, (unsigned int)length)] - 1;
+  if (type == -1 || strcmp(packetType, packetTypeInfo[type].name) != 0) {
+    return -1;
+  }
+  return type;
+}
+
+/*
+ * Purpose: Get the name of a packet type, the reverse of getPacketType()
+ * Input: Integer representing the type of the packet
+ * Output: The type of the packet as a string, "invalid" if it isn't a packet type
+ */
+const char* getPacketTypeName(int packetType) {
+  if (packetType < 0 || packetType >= NUM_PACKET_TYPES) {
+    return "invalid";
+  }
+  return packetTypeInfo[packetType].name;
+}
+
+/*
+ * Purpose: Get what is known about a packet type, its reliability and rate limit
+ * Input: Integer representing the type of the packet
+ * Output: The packet type's information, NULL if it isn't a packet type
+ */
+const struct PacketTypeInfo* getPacketTypeInfo(int packetType) {
+  if (packetType < 0 || packetType >= NUM_PACKET_TYPES) {
+    return NULL;
+  }
+  return &packetTypeInfo[packetType];
+}
+
+/*
+ * Purpose: Pass a received packet to the handler a node has for its type
+ * Input:
+ * - The node's handlers
+ * - Type of the packet, see getPacketType()
+ * - The node, passed on to the handler
+ * - The packet's fields
+ * - Who sent the packet
+ * - Debug flag
+ * Output: Whether the node had a handler for the packet
+ */
+bool dispatchPacket(const struct PacketHandlers* packetHandlers,
+                    int packetType,
+                    void* node,
+                    struct PacketFields* packetFields,
+                    struct sockaddr_in sourceAddress,
+                    bool debugFlag) {
+  if (packetType < 0 || packetType >= NUM_PACKET_TYPES) {
+    return false;
+  }
   if (debugFlag) {
+    printf("Type of packet received is %s\n", packetTypeInfo[packetType].name);
   }
-  int returnVal = -1;
-  int i         = 0;
-  for (i = 0; i < NUM_PACKET_TYPES; i++) {
-    if (strcmp(packetType, packetTypes[i]) == 0) {
-      returnVal = i;
-    }
+  PacketHandler handler = packetHandlers->handlers[packetType];
+  if (handler == NULL) {
+    return false;
   }
-  return returnVal;
+  handler(node, packetFields, sourceAddress, debugFlag);
+  return true;
 }
 
 /*
@@ -49,29 +143,31 @@ int getPacketType(char* packetType, bool debugFlag) {
  * Input:
  * - String where the completed packet is to go
  * - struct containing the information the packet is to contain
- * - Debug flag
+ * - Debug flag, unused. The codec is traced instead, see trace.h
  * Output: None
  */
 void buildPacket(char* builtPacket, struct PacketFields packetFields, bool debugFlag) {
+  (void)debugFlag;
+
   // Type
   strcpy(builtPacket, packetFields.type);
   strncat(builtPacket, packetDelimiters.field, packetDelimiters.fieldLength);
-  if (debugFlag) {
-    printf("Packet after adding type: %s\n", builtPacket);
-  }
 
   // Data
   strcat(builtPacket, packetFields.data);
   strncat(builtPacket, packetDelimiters.field, packetDelimiters.fieldLength);
-  if (debugFlag) {
-    printf("Packet after adding data: %s\n", builtPacket);
+
+  // Sequence, only for packets sent reliably
+  if (packetFields.sequence != 0) {
+    char sequence[16];
+    snprintf(sequence, sizeof(sequence), "%u%c", packetFields.sequence,
+             packetDelimiters.field[0]);
+    strcat(builtPacket, sequence);
   }
 
   // End
   strncat(builtPacket, packetDelimiters.end, packetDelimiters.endLength);
-  if (debugFlag) {
-    printf("Entire packet: %s\n", builtPacket);
-  }
+  TRACE(TRACE_PACKET_BUILT, strlen(builtPacket), 0);
 }
 
 /*
@@ -86,13 +182,23 @@ void buildPacket(char* builtPacket, struct PacketFields packetFields, bool debug
 int readPacket(char* packetToBeRead, struct PacketFields* packetFields, bool debugFlag) {
   char* packet      = calloc(1, MAX_PACKET);
   char* packetStart = packet;
-  strcpy(packet, packetToBeRead);
+  strncpy(packet, packetToBeRead, MAX_PACKET - 1);
 
   // Type. Advance after reading type (set packet to return val) so that data can be read.
-  packet = readPacketField(packet, packetFields->type, debugFlag);
+  packet = readPacketField(packet, packetFields->type, sizeof(packetFields->type),
+                           debugFlag);
 
   // Data
-  readPacketField(packet, packetFields->data, debugFlag);
+  packet = readPacketField(packet, packetFields->data, sizeof(packetFields->data),
+                           debugFlag);
+
+  // Sequence if there is one, otherwise this is the end
+  char sequence[MAX_PACKET] = {0};
+  readPacketField(packet, sequence, sizeof(sequence), debugFlag);
+  if (strncmp(sequence, packetDelimiters.end, packetDelimiters.endLength) != 0) {
+    packetFields->sequence = (unsigned int)strtoul(sequence, NULL, 10);
+  }
+  TRACE(TRACE_PACKET_READ, strlen(packetToBeRead), 0);
 
   free(packetStart);
   return 0;
@@ -100,54 +206,93 @@ int readPacket(char* packetToBeRead, struct PacketFields* packetFields, bool deb
 
 /*
  * Purpose: Read a single field from a packet. Reads the packet string until the field
- * delimiter is hit. Field is returned in second argument.
+ * delimiter is hit. Field is returned in second argument, cut short if it doesn't fit.
  * Input:
  * - The packet to read the field from
  * - Memory allocated for the field
- * - Debug flag
+ * - Size of the memory allocated for the field
+ * - Debug flag, unused. The codec is traced instead, see trace.h
  * Output: Packet after reading a field from it
  */
-char* readPacketField(char* packet, char* field, bool debugFlag) {
-  if (debugFlag) {
-    printf("Reading field from packet: %s\n", packet);
-  }
+char* readPacketField(char* packet,
+                      char* field,
+                      unsigned long fieldSize,
+                      bool debugFlag) {
+  (void)debugFlag;
 
+  unsigned long length = strlen(field);
   while (strncmp(packet, packetDelimiters.field, packetDelimiters.fieldLength) != 0) {
-    strncat(field, packet, 1);
+    // Malformed packet, don't read past the end of it
+    if (*packet == '\0') {
+      field[length] = '\0';
+      return packet;
+    }
+    // The rest of a field that doesn't fit is skipped, so the next one starts in place
+    if (length < fieldSize - 1) {
+      field[length++] = *packet;
+    }
     packet++;
   }
+  field[length] = '\0';
   packet += packetDelimiters.fieldLength;
-
-  if (debugFlag) {
-    printf("Field read: %s\n", field);
-  }
+  TRACE(TRACE_FIELD_READ, strlen(field), 0);
   return packet;
 }
 
 /*
- * Purpose: Read a subfield from a packet.
+ * Purpose: Read a subfield from a packet, cut short if it doesn't fit
  * Input:
  * - Field to read the subfield from
  * - Memory allocated for the subfield
- *
+ * - Size of the memory allocated for the subfield
+ * - Debug flag, unused. The codec is traced instead, see trace.h
  * Output: Field after reading a subfield from it
  */
-char* readPacketSubfield(char* field, char* subfield, bool debugFlag) {
-  if (debugFlag) {
-    printf("Reading subfield from packet field: %s\n", field);
-  }
+char* readPacketSubfield(char* field,
+                         char* subfield,
+                         unsigned long subfieldSize,
+                         bool debugFlag) {
+  (void)debugFlag;
 
+  unsigned long length = strlen(subfield);
   while (strncmp(field, packetDelimiters.subfield, packetDelimiters.subfieldLength) !=
          0) {
-    strncat(subfield, field, 1);
+    // Malformed field, don't read past the end of it
+    if (*field == '\0') {
+      subfield[length] = '\0';
+      return field;
+    }
+    if (length < subfieldSize - 1) {
+      subfield[length++] = *field;
+    }
     field++;
   }
+  subfield[length] = '\0';
   field += packetDelimiters.subfieldLength;
+  TRACE(TRACE_SUBFIELD_READ, strlen(subfield), 0);
+  return field;
+}
 
-  if (debugFlag) {
-    printf("Subfield read: %s\n", subfield);
+/*
+ * Purpose: Hash a filename into the hash of a resource set. The hash of a set is the
+ * sum of the hashes of its filenames, so the client and the server can keep it up to
+ * date as files are added and removed, in any order. A 64 bit FNV-1a hash of the
+ * filename, mixed so that the sum of a few of them doesn't cancel out.
+ * Input: The filename
+ * Output: Its hash, added to the set's hash when the file is added and subtracted when
+ * it is removed
+ */
+unsigned long hashResourceName(const char* filename) {
+  unsigned long hash = 14695981039346656037UL;
+  while (*filename != '\0') {
+    hash ^= (unsigned char)*filename;
+    hash *= 1099511628211UL;
+    filename++;
   }
-  return field;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdUL;
+  hash ^= hash >> 33;
+  return hash;
 }
 
 void sendUdpPacket(int socketDescriptor,
@@ -159,3 +304,355 @@ void sendUdpPacket(int socketDescriptor,
   sendUdpMessage(socketDescriptor, destinationAddress, packet, debugFlag);
   free(packet);
 }
+
+/*
+ * Purpose: Check if two socket addresses are the same
+ * Input: The two addresses
+ * Output: Whether the address and port match
+ */
+static bool isSameAddress(struct sockaddr_in first, struct sockaddr_in second) {
+  return first.sin_addr.s_addr == second.sin_addr.s_addr &&
+         first.sin_port == second.sin_port;
+}
+
+/*
+ * Purpose: Find the round trip time estimate for a destination. Destinations without
+ * one take over the estimate used least recently.
+ * Input:
+ * - Reliable state
+ * - The destination
+ * Output: The destination's estimate
+ */
+static struct RttEstimator* getRttEstimator(struct ReliableState* state,
+                                            struct sockaddr_in destination) {
+  struct RttEstimator* oldest = &state->estimators[0];
+  int i;
+  for (i = 0; i < RELIABLE_MAX_PEERS; i++) {
+    struct RttEstimator* estimator = &state->estimators[i];
+    if (estimator->retransmissionTimeout != 0 &&
+        isSameAddress(estimator->peer, destination)) {
+      estimator->lastUsed = getMicroseconds();
+      return estimator;
+    }
+    if (estimator->lastUsed < oldest->lastUsed) {
+      oldest = estimator;
+    }
+  }
+  memset(oldest, 0, sizeof(*oldest));
+  oldest->peer                  = destination;
+  oldest->retransmissionTimeout = RELIABLE_INITIAL_RTO;
+  oldest->lastUsed              = getMicroseconds();
+  return oldest;
+}
+
+/*
+ * Purpose: Update a round trip time estimate with a new measurement, RFC 6298 section 2
+ * Input:
+ * - The estimate
+ * - Measured round trip time in microseconds
+ * Output: None
+ */
+static void updateRttEstimator(struct RttEstimator* estimator, unsigned long rtt) {
+  if (!estimator->measured) {
+    estimator->smoothedRtt = rtt;
+    estimator->rttVariance = rtt / 2;
+    estimator->measured    = true;
+  } else {
+    unsigned long difference = rtt - estimator->smoothedRtt;
+    if (estimator->smoothedRtt > rtt) {
+      difference = estimator->smoothedRtt - rtt;
+    }
+    estimator->rttVariance = (3 * estimator->rttVariance + difference) / 4;
+    estimator->smoothedRtt = (7 * estimator->smoothedRtt + rtt) / 8;
+  }
+  unsigned long timeout = estimator->smoothedRtt + 4 * estimator->rttVariance;
+  if (timeout < RELIABLE_MIN_RTO) {
+    timeout = RELIABLE_MIN_RTO;
+  }
+  if (timeout > RELIABLE_MAX_RTO) {
+    timeout = RELIABLE_MAX_RTO;
+  }
+  estimator->retransmissionTimeout = timeout;
+}
+
+/*
+ * Purpose: Work out when the earliest pending packet has to be retransmitted
+ * Input: Reliable state
+ * Output: None
+ */
+static void updateNextDeadline(struct ReliableState* state) {
+  state->nextDeadline = RELIABLE_NO_DEADLINE;
+  int i;
+  for (i = 0; i < RELIABLE_MAX_PENDING; i++) {
+    if (state->pending[i].inUse && state->pending[i].deadline < state->nextDeadline) {
+      state->nextDeadline = state->pending[i].deadline;
+    }
+  }
+}
+
+/*
+ * Purpose: Set up the state for sending and receiving packets reliably
+ * Input: Reliable state
+ * Output: None
+ */
+void initReliableState(struct ReliableState* state) {
+  memset(state, 0, sizeof(*state));
+  // Start somewhere different every run so a restarted node's packets aren't
+  // mistaken for retransmissions
+  state->nextSequence = (unsigned int)(getMicroseconds() & 0x7fffffff) + 1;
+  state->nextDeadline = RELIABLE_NO_DEADLINE;
+}
+
+/*
+ * Purpose: Send a packet that is retransmitted until the destination acks it
+ * Input:
+ * - Reliable state
+ * - Socket to send on
+ * - Address to send to
+ * - Fields of the packet. The sequence is filled in here.
+ * - Debug flag
+ * Output:
+ * -1: Too many packets waiting for an ack, the packet was not sent
+ * 0: Packet sent
+ */
+int sendReliablePacket(struct ReliableState* state,
+                       int socketDescriptor,
+                       struct sockaddr_in destinationAddress,
+                       struct PacketFields packetFields,
+                       bool debugFlag) {
+  struct PendingPacket* pending = NULL;
+  int i;
+  for (i = 0; i < RELIABLE_MAX_PENDING; i++) {
+    if (!state->pending[i].inUse) {
+      pending = &state->pending[i];
+      break;
+    }
+  }
+  if (pending == NULL) {
+    if (debugFlag) {
+      printf("Too many packets waiting for an ack, %s packet not sent\n",
+             packetFields.type);
+    }
+    return -1;
+  }
+
+  packetFields.sequence = state->nextSequence++;
+  if (state->nextSequence == 0) {
+    state->nextSequence = 1; // 0 means unsequenced
+  }
+
+  struct RttEstimator* estimator = getRttEstimator(state, destinationAddress);
+  memset(pending, 0, sizeof(*pending));
+  pending->inUse       = true;
+  pending->sequence    = packetFields.sequence;
+  pending->destination = destinationAddress;
+  pending->sentAt      = getMicroseconds();
+  pending->deadline    = pending->sentAt + estimator->retransmissionTimeout;
+  strcpy(pending->type, packetFields.type);
+  buildPacket(pending->packet, packetFields, debugFlag);
+  state->pendingCount++;
+  if (pending->deadline < state->nextDeadline) {
+    state->nextDeadline = pending->deadline;
+  }
+
+  sendUdpMessage(socketDescriptor, destinationAddress, pending->packet, debugFlag);
+  return 0;
+}
+
+/*
+ * Purpose: Do the reliable delivery part of handling a received packet. Acks are
+ * matched to pending packets. Sequenced packets are acked, and dropped if they were
+ * already handled.
+ * Input:
+ * - Reliable state
+ * - Socket to send acks on
+ * - Who sent the packet
+ * - The packet's fields
+ * - Debug flag
+ * Output:
+ * - true: The packet should be handled
+ * - false: The packet was an ack or a retransmission, nothing more to do
+ */
+bool handleReliablePacket(struct ReliableState* state,
+                          int socketDescriptor,
+                          struct sockaddr_in sourceAddress,
+                          struct PacketFields* packetFields,
+                          bool debugFlag) {
+  if (strcmp(packetFields->type, "ack") == 0) {
+    unsigned int sequence = (unsigned int)strtoul(packetFields->data, NULL, 10);
+    int i;
+    for (i = 0; i < RELIABLE_MAX_PENDING; i++) {
+      // Sequences are unique per state. Not matched on address as packets can be sent
+      // to a wildcard address and acked from a real one.
+      struct PendingPacket* pending = &state->pending[i];
+      if (!pending->inUse || pending->sequence != sequence) {
+        continue;
+      }
+      // Karn's algorithm, an ack for a retransmitted packet can't be timed
+      unsigned long rtt = getMicroseconds() - pending->sentAt;
+      if (pending->retries == 0) {
+        updateRttEstimator(getRttEstimator(state, pending->destination), rtt);
+      }
+      TRACE(TRACE_PACKET_ACKED, sequence, rtt);
+      pending->inUse = false;
+      state->pendingCount--;
+      updateNextDeadline(state);
+      break;
+    }
+    return false;
+  }
+
+  if (packetFields->sequence == 0) {
+    return true;
+  }
+
+  // Ack every copy, the ack for an earlier one may have been lost
+  struct PacketFields ackFields;
+  memset(&ackFields, 0, sizeof(ackFields));
+  strcpy(ackFields.type, "ack");
+  snprintf(ackFields.data, sizeof(ackFields.data), "%u", packetFields->sequence);
+  sendUdpPacket(socketDescriptor, sourceAddress, ackFields, debugFlag);
+
+  unsigned int seenIndex =
+      (packetFields->sequence ^ sourceAddress.sin_addr.s_addr ^ sourceAddress.sin_port) &
+      (RELIABLE_SEEN_SIZE - 1);
+  struct SeenPacket* seen = &state->seen[seenIndex];
+  if (seen->sequence == packetFields->sequence &&
+      isSameAddress(seen->source, sourceAddress)) {
+    if (debugFlag) {
+      printf("Dropping retransmitted %s packet %u\n", packetFields->type,
+             packetFields->sequence);
+    }
+    statsAdd(STATS_DUPLICATE_PACKETS, 1);
+    return false;
+  }
+  seen->source   = sourceAddress;
+  seen->sequence = packetFields->sequence;
+  return true;
+}
+
+/*
+ * Purpose: Retransmit every pending packet whose ack is overdue and double its
+ * destination's retransmission timeout. Packets retransmitted RELIABLE_MAX_RETRIES
+ * times are given up on. Cheap to call when nothing is due.
+ * Input:
+ * - Reliable state
+ * - Socket to send on
+ * - Debug flag
+ * Output: Number of packets given up on
+ */
+int checkReliableTimeouts(struct ReliableState* state,
+                          int socketDescriptor,
+                          bool debugFlag) {
+  if (state->pendingCount == 0) {
+    return 0;
+  }
+  unsigned long currentTime = getMicroseconds();
+  if (currentTime < state->nextDeadline) {
+    return 0;
+  }
+
+  int failures = 0;
+  int i;
+  for (i = 0; i < RELIABLE_MAX_PENDING; i++) {
+    struct PendingPacket* pending = &state->pending[i];
+    if (!pending->inUse || currentTime < pending->deadline) {
+      continue;
+    }
+    if (pending->retries >= RELIABLE_MAX_RETRIES) {
+      if (debugFlag) {
+        printf("No ack for %s packet after %d retries, giving up\n", pending->type,
+               pending->retries);
+      }
+      statsAdd(STATS_DELIVERY_FAILURES, 1);
+      pending->inUse = false;
+      state->pendingCount--;
+      failures++;
+      continue;
+    }
+
+    // Back off, RFC 6298 section 5.5
+    struct RttEstimator* estimator = getRttEstimator(state, pending->destination);
+    estimator->retransmissionTimeout *= 2;
+    if (estimator->retransmissionTimeout > RELIABLE_MAX_RTO) {
+      estimator->retransmissionTimeout = RELIABLE_MAX_RTO;
+    }
+    pending->retries++;
+    pending->deadline = currentTime + estimator->retransmissionTimeout;
+    if (debugFlag) {
+      printf("Retransmitting %s packet %u, try %d\n", pending->type, pending->sequence,
+             pending->retries);
+    }
+    TRACE(TRACE_PACKET_RETRANSMITTED, pending->sequence, pending->retries);
+    statsAdd(STATS_RETRANSMISSIONS, 1);
+    sendUdpMessage(socketDescriptor, pending->destination, pending->packet, debugFlag);
+  }
+  updateNextDeadline(state);
+  return failures;
+}
+
+/*
+ * Purpose: Send a packet the way its type is sent, reliably or just once
+ * Input:
+ * - Reliable state, only used for reliable packet types
+ * - Socket to send on
+ * - Address to send to
+ * - Fields of the packet
+ * - Debug flag
+ * Output:
+ * -1: Too many packets waiting for an ack, the packet was not sent
+ * 0: Packet sent
+ */
+int sendPacket(struct ReliableState* state,
+               int socketDescriptor,
+               struct sockaddr_in destinationAddress,
+               struct PacketFields packetFields,
+               bool debugFlag) {
+  const struct PacketTypeInfo* info =
+      getPacketTypeInfo(getPacketType(packetFields.type, debugFlag));
+  if (info != NULL && info->reliability == PACKET_RELIABLE) {
+    return sendReliablePacket(state, socketDescriptor, destinationAddress, packetFields,
+                              debugFlag);
+  }
+  sendUdpPacket(socketDescriptor, destinationAddress, packetFields, debugFlag);
+  return 0;
+}
+
+/*
+ * Purpose: Count the packets of one type that are still waiting for an ack
+ * Input:
+ * - Reliable state
+ * - Type of the packets
+ * Output: Number of packets waiting
+ */
+int countPendingPackets(struct ReliableState* state, const char* type) {
+  if (state->pendingCount == 0) {
+    return 0;
+  }
+  int count = 0;
+  int i;
+  for (i = 0; i < RELIABLE_MAX_PENDING; i++) {
+    if (state->pending[i].inUse && strcmp(state->pending[i].type, type) == 0) {
+      count++;
+    }
+  }
+  return count;
+}
+
+/*
+ * Purpose: Find how long until checkReliableTimeouts() has something to do. Used to
+ * bound how long a node sleeps.
+ * Input: Reliable state
+ * Output: Microseconds until the next retransmission, RELIABLE_NO_DEADLINE if nothing
+ * is waiting for an ack
+ */
+unsigned long getReliableTimeout(struct ReliableState* state) {
+  if (state->pendingCount == 0) {
+    return RELIABLE_NO_DEADLINE;
+  }
+  unsigned long currentTime = getMicroseconds();
+  if (currentTime >= state->nextDeadline) {
+    return 0;
+  }
+  return state->nextDeadline - currentTime;
+}
@@ -1,11 +1,68 @@
 #ifndef PACKET_H
 #define PACKET_H
 
-#define MAX_PACKET       220
-#define NUM_PACKET_TYPES 3
+#define MAX_PACKET       240 // Room for a full data field and a sequence number
+#define NUM_PACKET_TYPES 14
 #define MAX_PACKET_TYPE  20
 #define MAX_DATA         200
 
+// Packet types, each one's index in the packet type table, see packet.c
+#define PACKET_CONNECTION 0
+#define PACKET_STATUS     1
+#define PACKET_RESOURCE   2
+#define PACKET_PEERS      3
+#define PACKET_ANNOUNCE   4
+#define PACKET_GOSSIP     5
+#define PACKET_DIGEST     6
+#define PACKET_LOOKUP     7
+#define PACKET_ACK        8
+#define PACKET_SEARCH     9
+#define PACKET_REGISTER   10
+#define PACKET_PROBE      11
+#define PACKET_FIND       12
+#define PACKET_SESSION    13
+
+// How a packet type is sent, see sendPacket()
+#define PACKET_UNRELIABLE 0 // Sent once, losing it is harmless or repaired later
+#define PACKET_RELIABLE   1 // Sequenced and retransmitted until acked
+
+// Slots in the perfect hash from packet type names to packet types, a power of two
+#define PACKET_TYPE_SLOTS 32
+
+// Slot of a packet type name from its first and last character and its length. The
+// multiplier is picked so every packet type gets its own slot, see packet.c.
+#define PACKET_TYPE_SLOT(first, last, length)                                           \
+  (((first) * 29 + (last) + (length)) & (PACKET_TYPE_SLOTS - 1))
+
+// Characters in a trigram of the server's substring index, see trigram.h. Find packets
+// with a shorter substring can't be looked up.
+#define TRIGRAM_LENGTH 3
+
+// Front coded filenames in resource listings start with the length of the prefix they
+// share with the previous filename, as a single character counted up from this one
+#define RESOURCE_PREFIX_BASE '0'
+
+// Packets sent reliably that can be waiting for an ack at once
+#define RELIABLE_MAX_PENDING 32
+
+// Destinations with their own round trip time estimate
+#define RELIABLE_MAX_PEERS 16
+
+// Sequenced packets remembered to drop retransmissions, must be a power of two
+#define RELIABLE_SEEN_SIZE 1024
+
+// Retransmission timeout bounds in microseconds. Starts at the initial value until a
+// round trip time has been measured.
+#define RELIABLE_INITIAL_RTO 250000
+#define RELIABLE_MIN_RTO     20000
+#define RELIABLE_MAX_RTO     4000000
+
+// Retransmissions before giving up on a packet
+#define RELIABLE_MAX_RETRIES 6
+
+// Returned by getReliableTimeout() when nothing is waiting for an ack
+#define RELIABLE_NO_DEADLINE ((unsigned long)-1)
+
 #include <netdb.h>
 #include <stdbool.h>
 #include <sys/socket.h>
@@ -22,18 +79,107 @@ struct PacketDelimiters {
   char end[9];
 };
 
+// How fast a source can send one type of packet
+struct RateLimit {
+  unsigned int rate;  // Packets per second
+  unsigned int burst; // Packets that can be sent back to back
+};
+
+// Everything about a packet type that doesn't depend on which node handles it
+struct PacketTypeInfo {
+  const char* name;
+  int reliability;            // PACKET_UNRELIABLE or PACKET_RELIABLE
+  struct RateLimit rateLimit; // Budget of each source at the server
+};
+
 struct PacketFields {
   char type[MAX_PACKET_TYPE];
   char data[MAX_DATA];
+  unsigned int sequence; // 0 if the packet isn't sent reliably
+};
+
+// A reliably sent packet that hasn't been acked yet
+struct PendingPacket {
+  bool inUse;
+  unsigned int sequence;
+  char type[MAX_PACKET_TYPE];
+  struct sockaddr_in destination;
+  char packet[MAX_PACKET];
+  unsigned long sentAt;   // Microseconds, first transmission
+  unsigned long deadline; // Microseconds, when to retransmit
+  int retries;
+};
+
+// Round trip time estimate for one destination, see RFC 6298. All in microseconds.
+struct RttEstimator {
+  struct sockaddr_in peer;
+  unsigned long smoothedRtt;
+  unsigned long rttVariance;
+  unsigned long retransmissionTimeout;
+  unsigned long lastUsed;
+  bool measured;
+};
+
+// A sequenced packet that has already been handled
+struct SeenPacket {
+  struct sockaddr_in source;
+  unsigned int sequence;
+};
+
+// Everything needed to send and receive packets reliably. Each node, or each client
+// context, owns one. Not thread safe.
+struct ReliableState {
+  unsigned int nextSequence;
+  struct PendingPacket pending[RELIABLE_MAX_PENDING];
+  int pendingCount;
+  unsigned long nextDeadline;
+  struct RttEstimator estimators[RELIABLE_MAX_PEERS];
+  struct SeenPacket seen[RELIABLE_SEEN_SIZE];
+};
+
+// Handles a received packet for a node. Passed the node, the packet, who sent it and
+// the debug flag.
+typedef void (*PacketHandler)(void*, struct PacketFields*, struct sockaddr_in, bool);
+
+// What a node does with each packet type, indexed by packet type. Types without a
+// handler are ignored.
+struct PacketHandlers {
+  PacketHandler handlers[NUM_PACKET_TYPES];
 };
 
 int getPacketType(char*, bool);
+const char* getPacketTypeName(int);
+const struct PacketTypeInfo* getPacketTypeInfo(int);
+bool dispatchPacket(const struct PacketHandlers*,
+                    int,
+                    void*,
+                    struct PacketFields*,
+                    struct sockaddr_in,
+                    bool);
 void buildPacket(char*, struct PacketFields, bool);
 
 int readPacket(char*, struct PacketFields*, bool);
-char* readPacketField(char*, char*, bool);
-char* readPacketSubfield(char*, char*, bool);
+char* readPacketField(char*, char*, unsigned long, bool);
+char* readPacketSubfield(char*, char*, unsigned long, bool);
+unsigned long hashResourceName(const char*);
 
 void sendUdpPacket(int, struct sockaddr_in, struct PacketFields, bool);
 
+// Reliable delivery
+void initReliableState(struct ReliableState*);
+int sendReliablePacket(struct ReliableState*,
+                       int,
+                       struct sockaddr_in,
+                       struct PacketFields,
+                       bool);
+bool handleReliablePacket(struct ReliableState*,
+                          int,
+                          struct sockaddr_in,
+                          struct PacketFields*,
+                          bool);
+int checkReliableTimeouts(struct ReliableState*, int, bool);
+int countPendingPackets(struct ReliableState*, const char*);
+int sendPacket(struct ReliableState*, int, struct sockaddr_in, struct PacketFields, bool);
+unsigned long getReliableTimeout(struct ReliableState*);
+
 #endif
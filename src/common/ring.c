@@ -0,0 +1,307 @@
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+/*
+ * Purpose: Round a ring's capacity up to a power of two
+ * Input: Entries asked for
+ * Output: Entries the ring will hold
+ */
+static unsigned long roundCapacity(unsigned long capacity) {
+  unsigned long rounded = 1;
+  while (rounded < capacity) {
+    rounded *= 2;
+  }
+  return rounded;
+}
+
+/*
+ * Purpose: Wake every thread sleeping on a ring's signal after the ring has moved.
+ * The futex is only touched if someone is sleeping.
+ * Input: The signal
+ * Output: None
+ */
+static void notifyRing(struct RingSignal* signal) {
+  atomic_fetch_add(&signal->sequence, 1);
+  if (atomic_load(&signal->waiters) != 0) {
+    syscall(SYS_futex, &signal->sequence, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+  }
+}
+
+/*
+ * Purpose: Keep trying a push or pop, sleeping on the ring's signal once spinning
+ * hasn't helped. The thread says it is waiting before it tries the last time, so a
+ * push or pop from the other end either shows up in that try or wakes it.
+ * Input:
+ * - Signal of the end of the ring being waited for
+ * - The push or pop to try
+ * - The ring
+ * - Entry to push or to pop into
+ * - Microseconds to sleep for at most, 0 to sleep until woken
+ * Output: Whether the push or pop happened. It can fail before the timeout if the
+ * thread is woken and another thread gets there first.
+ */
+static bool waitForRing(struct RingSignal* signal,
+                        bool (*attempt)(void*, void*),
+                        void* ring,
+                        void* entry,
+                        unsigned long timeout) {
+  int spins;
+  for (spins = 0; spins < RING_SPIN_LIMIT; spins++) {
+    if (attempt(ring, entry)) {
+      return true;
+    }
+  }
+
+  atomic_fetch_add(&signal->waiters, 1);
+  unsigned int seen = atomic_load(&signal->sequence);
+  bool done         = attempt(ring, entry);
+  if (!done) {
+    struct timespec sleepTime;
+    sleepTime.tv_sec  = (time_t)(timeout / 1000000);
+    sleepTime.tv_nsec = (long)(timeout % 1000000) * 1000;
+    syscall(SYS_futex, &signal->sequence, FUTEX_WAIT_PRIVATE, seen,
+            timeout == 0 ? NULL : &sleepTime, NULL, 0);
+    done = attempt(ring, entry);
+  }
+  atomic_fetch_sub(&signal->waiters, 1);
+  return done;
+}
+
+/*
+ * Purpose: Set up an empty single producer, single consumer ring
+ * Input:
+ * - The ring
+ * - Entries it holds, rounded up to a power of two
+ * - Bytes in an entry
+ * Output: None
+ */
+void initSpscRing(struct SpscRing* ring,
+                  unsigned long capacity,
+                  unsigned long entrySize) {
+  memset(ring, 0, sizeof(*ring));
+  ring->capacity  = roundCapacity(capacity);
+  ring->entrySize = entrySize;
+  ring->entries   = calloc(ring->capacity, entrySize);
+}
+
+/*
+ * Purpose: Free the entries of a single producer, single consumer ring
+ * Input: The ring
+ * Output: None
+ */
+void freeSpscRing(struct SpscRing* ring) {
+  free(ring->entries);
+  ring->entries = NULL;
+}
+
+/*
+ * Purpose: Push an entry onto a single producer, single consumer ring. Only called by
+ * the producer.
+ * Input:
+ * - The ring
+ * - Entry to copy in
+ * Output: Whether there was room for the entry
+ */
+bool pushSpscRing(struct SpscRing* ring, const void* entry) {
+  unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  if (tail - ring->cachedHead == ring->capacity) {
+    ring->cachedHead = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - ring->cachedHead == ring->capacity) {
+      return false;
+    }
+  }
+  memcpy(ring->entries + (tail & (ring->capacity - 1)) * ring->entrySize, entry,
+         ring->entrySize);
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  notifyRing(&ring->readable);
+  return true;
+}
+
+/*
+ * Purpose: Pop an entry off a single producer, single consumer ring. Only called by
+ * the consumer.
+ * Input:
+ * - The ring
+ * - Where to copy the entry to
+ * Output: Whether there was an entry
+ */
+bool popSpscRing(struct SpscRing* ring, void* entry) {
+  unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (head == ring->cachedTail) {
+    ring->cachedTail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == ring->cachedTail) {
+      return false;
+    }
+  }
+  memcpy(entry, ring->entries + (head & (ring->capacity - 1)) * ring->entrySize,
+         ring->entrySize);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  notifyRing(&ring->writable);
+  return true;
+}
+
+static bool attemptSpscPop(void* ring, void* entry) {
+  return popSpscRing(ring, entry);
+}
+
+/*
+ * Purpose: Pop an entry off a single producer, single consumer ring, waiting for one
+ * if it is empty
+ * Input:
+ * - The ring
+ * - Where to copy the entry to
+ * - Microseconds to wait for at most, 0 to wait until an entry is pushed
+ * Output: Whether an entry was popped
+ */
+bool popSpscRingWait(struct SpscRing* ring, void* entry, unsigned long timeout) {
+  return waitForRing(&ring->readable, attemptSpscPop, ring, entry, timeout);
+}
+
+/*
+ * Purpose: Set up an empty multiple producer, multiple consumer ring
+ * Input:
+ * - The ring
+ * - Entries it holds, rounded up to a power of two
+ * - Bytes in an entry
+ * Output: None
+ */
+void initMpmcRing(struct MpmcRing* ring,
+                  unsigned long capacity,
+                  unsigned long entrySize) {
+  memset(ring, 0, sizeof(*ring));
+  ring->capacity  = roundCapacity(capacity);
+  ring->entrySize = entrySize;
+  ring->entries   = calloc(ring->capacity, entrySize);
+  ring->sequences = calloc(ring->capacity, sizeof(atomic_ulong));
+
+  // Entry i is first filled by the push at position i
+  unsigned long i;
+  for (i = 0; i < ring->capacity; i++) {
+    atomic_init(&ring->sequences[i], i);
+  }
+}
+
+/*
+ * Purpose: Free the entries of a multiple producer, multiple consumer ring
+ * Input: The ring
+ * Output: None
+ */
+void freeMpmcRing(struct MpmcRing* ring) {
+  free(ring->entries);
+  free(ring->sequences);
+  ring->entries   = NULL;
+  ring->sequences = NULL;
+}
+
+/*
+ * Purpose: Push an entry onto a multiple producer, multiple consumer ring. An entry
+ * whose sequence is the tail's position is free for this lap, producers race to move
+ * the tail past it and the winner fills it in.
+ * Input:
+ * - The ring
+ * - Entry to copy in
+ * Output: Whether there was room for the entry
+ */
+bool pushMpmcRing(struct MpmcRing* ring, const void* entry) {
+  unsigned long position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  unsigned long index;
+  while (1) {
+    index = position & (ring->capacity - 1);
+    unsigned long sequence =
+        atomic_load_explicit(&ring->sequences[index], memory_order_acquire);
+    long difference = (long)(sequence - position);
+    if (difference == 0) {
+      if (atomic_compare_exchange_weak_explicit(&ring->tail, &position, position + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (difference < 0) {
+      return false; // Still holds the entry from the last lap
+    } else {
+      position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    }
+  }
+  memcpy(ring->entries + index * ring->entrySize, entry, ring->entrySize);
+  atomic_store_explicit(&ring->sequences[index], position + 1, memory_order_release);
+  notifyRing(&ring->readable);
+  return true;
+}
+
+static bool attemptMpmcPush(void* ring, void* entry) {
+  return pushMpmcRing(ring, entry);
+}
+
+/*
+ * Purpose: Push an entry onto a multiple producer, multiple consumer ring, waiting for
+ * room if it is full
+ * Input:
+ * - The ring
+ * - Entry to copy in
+ * - Microseconds to wait for at most, 0 to wait until there is room
+ * Output: Whether the entry was pushed
+ */
+bool pushMpmcRingWait(struct MpmcRing* ring, const void* entry, unsigned long timeout) {
+  return waitForRing(&ring->writable, attemptMpmcPush, ring, (void*)entry, timeout);
+}
+
+/*
+ * Purpose: Pop an entry off a multiple producer, multiple consumer ring. An entry
+ * whose sequence is one past the head's position has been filled, consumers race to
+ * move the head past it and the winner reads it. Its sequence is then moved a lap on
+ * so it is free for the push a lap later.
+ * Input:
+ * - The ring
+ * - Where to copy the entry to
+ * Output: Whether there was an entry
+ */
+bool popMpmcRing(struct MpmcRing* ring, void* entry) {
+  unsigned long position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned long index;
+  while (1) {
+    index = position & (ring->capacity - 1);
+    unsigned long sequence =
+        atomic_load_explicit(&ring->sequences[index], memory_order_acquire);
+    long difference = (long)(sequence - (position + 1));
+    if (difference == 0) {
+      if (atomic_compare_exchange_weak_explicit(&ring->head, &position, position + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (difference < 0) {
+      return false; // Not filled yet
+    } else {
+      position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    }
+  }
+  memcpy(entry, ring->entries + index * ring->entrySize, ring->entrySize);
+  atomic_store_explicit(&ring->sequences[index], position + ring->capacity,
+                        memory_order_release);
+  notifyRing(&ring->writable);
+  return true;
+}
+
+static bool attemptMpmcPop(void* ring, void* entry) {
+  return popMpmcRing(ring, entry);
+}
+
+/*
+ * Purpose: Pop an entry off a multiple producer, multiple consumer ring, waiting for
+ * one if it is empty
+ * Input:
+ * - The ring
+ * - Where to copy the entry to
+ * - Microseconds to wait for at most, 0 to wait until an entry is pushed
+ * Output: Whether an entry was popped
+ */
+bool popMpmcRingWait(struct MpmcRing* ring, void* entry, unsigned long timeout) {
+  return waitForRing(&ring->readable, attemptMpmcPop, ring, entry, timeout);
+}
@@ -0,0 +1,63 @@
+#ifndef RING_H
+#define RING_H
+
+// Bytes in a cache line. The two ends of a ring are kept on separate lines so the
+// producers and consumers don't keep taking the line from each other.
+#define RING_CACHE_LINE 64
+
+// Times a thread tries an empty or full ring again before going to sleep on it
+#define RING_SPIN_LIMIT 64
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Lets threads sleep until the other end of a ring moves. The sequence changes every
+// time it does, sleepers wait on it with a futex.
+struct RingSignal {
+  atomic_uint sequence;
+  atomic_uint waiters;
+};
+
+// Bounded lock-free queue between exactly one producer thread and one consumer thread.
+// Each end keeps a copy of the other end's position and only reads the real one when
+// the copy says the ring is empty or full.
+struct SpscRing {
+  _Alignas(RING_CACHE_LINE) atomic_ulong tail; // Next entry to push, moved by producer
+  unsigned long cachedHead;
+  _Alignas(RING_CACHE_LINE) atomic_ulong head; // Next entry to pop, moved by consumer
+  unsigned long cachedTail;
+  _Alignas(RING_CACHE_LINE) struct RingSignal readable; // Pushed to
+  struct RingSignal writable;                           // Popped from
+  unsigned char* entries;
+  unsigned long entrySize;
+  unsigned long capacity; // Power of two
+};
+
+// Bounded lock-free queue any number of threads push to and pop from. Each entry has a
+// sequence that says whether it is waiting to be filled or to be read in the current
+// lap of the ring, so pushes and pops only contend on moving the ends.
+struct MpmcRing {
+  _Alignas(RING_CACHE_LINE) atomic_ulong tail;
+  _Alignas(RING_CACHE_LINE) atomic_ulong head;
+  _Alignas(RING_CACHE_LINE) struct RingSignal readable;
+  struct RingSignal writable;
+  atomic_ulong* sequences;
+  unsigned char* entries;
+  unsigned long entrySize;
+  unsigned long capacity; // Power of two
+};
+
+void initSpscRing(struct SpscRing*, unsigned long, unsigned long);
+void freeSpscRing(struct SpscRing*);
+bool pushSpscRing(struct SpscRing*, const void*);
+bool popSpscRing(struct SpscRing*, void*);
+bool popSpscRingWait(struct SpscRing*, void*, unsigned long);
+
+void initMpmcRing(struct MpmcRing*, unsigned long, unsigned long);
+void freeMpmcRing(struct MpmcRing*);
+bool pushMpmcRing(struct MpmcRing*, const void*);
+bool pushMpmcRingWait(struct MpmcRing*, const void*, unsigned long);
+bool popMpmcRing(struct MpmcRing*, void*);
+bool popMpmcRingWait(struct MpmcRing*, void*, unsigned long);
+
+#endif
@@ -0,0 +1,334 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+// Size of the buffer the stats are formatted into
+#define STATS_BUFFER_SIZE 65536
+
+struct StatsCounterInfo {
+  const char* name;
+  bool gauge;
+};
+
+static const struct StatsCounterInfo statsNames[NUM_STATS_COUNTERS] = {
+    {"packets_sent_total", false},
+    {"bytes_sent_total", false},
+    {"bytes_received_total", false},
+    {"unknown_packets_total", false},
+    {"receive_queue_drops_total", false},
+    {"heartbeat_timeouts_total", false},
+    {"retransmissions_total", false},
+    {"delivery_failures_total", false},
+    {"duplicate_packets_total", false},
+    {"rate_limited_packets_total", false},
+    {"connected_clients", true},
+    {"resources", true},
+    {"gossip_peers", true},
+    {"gossip_entries", true},
+    {"resources_rejected_total", false},
+    {"resources_evicted_total", false},
+    {"directory_bytes", true},
+    {"directory_budget_bytes", true},
+    {"client_table_bytes", true},
+    {"pipeline_dropped_total", false},
+    {"uploads_active", true},
+    {"uploads_queued", true},
+    {"uploads_rejected_total", false},
+    {"upload_bytes_total", false},
+    {"seeded_files", true},
+    {"seeded_bytes", true},
+    {"seed_evictions_total", false},
+    {"resource_summaries", true},
+    {"parked_sessions", true},
+    {"sessions_resumed_total", false},
+    {"send_errors_total", false},
+};
+
+static atomic_ulong counters[NUM_STATS_COUNTERS];
+static struct StatsHistogram packetLatency[NUM_PACKET_TYPES];
+
+/*
+ * Purpose: Find the histogram bucket a value falls into
+ * Input: The value
+ * Output: Index of the bucket
+ */
+static int getBucketIndex(unsigned long value) {
+  if (value < STATS_EXACT_BUCKETS) {
+    return (int)value;
+  }
+  int exponent    = 63 - __builtin_clzl(value);
+  int subBucket   = (int)(value >> (exponent - STATS_SUB_BUCKET_BITS)) & 7;
+  int bucketIndex = STATS_EXACT_BUCKETS + (exponent - 4) * 8 + subBucket;
+  if (bucketIndex >= STATS_HISTOGRAM_BUCKETS) {
+    return STATS_HISTOGRAM_BUCKETS - 1;
+  }
+  return bucketIndex;
+}
+
+/*
+ * Purpose: Find the largest value that falls into a histogram bucket
+ * Input: Index of the bucket
+ * Output: Upper bound of the bucket, inclusive
+ */
+static unsigned long getBucketUpperBound(int bucketIndex) {
+  if (bucketIndex < STATS_EXACT_BUCKETS) {
+    return (unsigned long)bucketIndex;
+  }
+  int exponent          = (bucketIndex - STATS_EXACT_BUCKETS) / 8 + 4;
+  unsigned long subSize = 1UL << (exponent - STATS_SUB_BUCKET_BITS);
+  unsigned long lower   = (unsigned long)(8 + (bucketIndex - STATS_EXACT_BUCKETS) % 8)
+                        << (exponent - STATS_SUB_BUCKET_BITS);
+  return lower + subSize - 1;
+}
+
+/*
+ * Purpose: Add to a counter
+ * Input:
+ * - Counter to add to
+ * - Amount to add
+ * Output: None
+ */
+void statsAdd(enum StatsCounter counter, unsigned long amount) {
+  atomic_fetch_add_explicit(&counters[counter], amount, memory_order_relaxed);
+}
+
+/*
+ * Purpose: Subtract from a gauge
+ * Input:
+ * - Gauge to subtract from
+ * - Amount to subtract
+ * Output: None
+ */
+void statsSubtract(enum StatsCounter counter, unsigned long amount) {
+  atomic_fetch_sub_explicit(&counters[counter], amount, memory_order_relaxed);
+}
+
+/*
+ * Purpose: Set a gauge to its current value
+ * Input:
+ * - Gauge to set
+ * - The value
+ * Output: None
+ */
+void statsSet(enum StatsCounter counter, unsigned long value) {
+  atomic_store_explicit(&counters[counter], value, memory_order_relaxed);
+}
+
+/*
+ * Purpose: Read the current value of a counter or gauge
+ * Input: The counter
+ * Output: Its value
+ */
+unsigned long statsGet(enum StatsCounter counter) {
+  return atomic_load_explicit(&counters[counter], memory_order_relaxed);
+}
+
+/*
+ * Purpose: Record that a packet was handled and how long handling it took
+ * Input:
+ * - Type of the packet, see getPacketType()
+ * - Nanoseconds from receiving the packet to finishing handling it
+ * Output: None
+ */
+void statsRecordPacket(int packetType, unsigned long latency) {
+  if (packetType < 0 || packetType >= NUM_PACKET_TYPES) {
+    statsAdd(STATS_UNKNOWN_PACKETS, 1);
+    return;
+  }
+  statsRecordValue(&packetLatency[packetType], latency);
+}
+
+/*
+ * Purpose: Record a value in a histogram
+ * Input:
+ * - The histogram
+ * - Value to record
+ * Output: None
+ */
+void statsRecordValue(struct StatsHistogram* histogram, unsigned long value) {
+  atomic_fetch_add_explicit(&histogram->buckets[getBucketIndex(value)], 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+}
+
+/*
+ * Purpose: Estimate a percentile of the values recorded in a histogram
+ * Input:
+ * - The histogram
+ * - Percentile in tenths of a percent. 500 is the median, 999 is p99.9
+ * Output: Upper bound of the bucket the percentile falls into, 0 if empty
+ */
+unsigned long statsPercentile(struct StatsHistogram* histogram, unsigned long permille) {
+  unsigned long count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+  if (count == 0) {
+    return 0;
+  }
+  // Rank of the value wanted, rounded up
+  unsigned long rank       = (count * permille + 999) / 1000;
+  unsigned long cumulative = 0;
+  int bucketIndex;
+  for (bucketIndex = 0; bucketIndex < STATS_HISTOGRAM_BUCKETS; bucketIndex++) {
+    cumulative +=
+        atomic_load_explicit(&histogram->buckets[bucketIndex], memory_order_relaxed);
+    if (cumulative >= rank && cumulative > 0) {
+      return getBucketUpperBound(bucketIndex);
+    }
+  }
+  return getBucketUpperBound(STATS_HISTOGRAM_BUCKETS - 1);
+}
+
+/*
+ * Purpose: Format every counter, gauge and histogram in the Prometheus text format so
+ * that it can be read by a machine.
+ * Input:
+ * - Buffer to write the stats into
+ * - Size of the buffer
+ * Output: Number of bytes written
+ */
+int writeStats(char* buffer, long unsigned int bufferSize) {
+  int length = 0;
+  int i;
+  for (i = 0; i < NUM_STATS_COUNTERS && (long unsigned int)length < bufferSize; i++) {
+    length += snprintf(buffer + length, bufferSize - (long unsigned int)length,
+                       "# TYPE %s %s\n%s %lu\n", statsNames[i].name,
+                       statsNames[i].gauge ? "gauge" : "counter", statsNames[i].name,
+                       statsGet(i));
+  }
+
+  // Allocator
+  struct mallinfo2 allocatorInfo = mallinfo2();
+  if ((long unsigned int)length < bufferSize) {
+    length += snprintf(buffer + length, bufferSize - (long unsigned int)length,
+                       "# TYPE malloc_bytes gauge\n"
+                       "malloc_bytes{state=\"arena\"} %zu\n"
+                       "malloc_bytes{state=\"in_use\"} %zu\n"
+                       "malloc_bytes{state=\"free\"} %zu\n"
+                       "malloc_bytes{state=\"mmap\"} %zu\n"
+                       "# TYPE packet_latency_ns histogram\n",
+                       allocatorInfo.arena, allocatorInfo.uordblks,
+                       allocatorInfo.fordblks, allocatorInfo.hblkhd);
+  }
+
+  // Per packet type latency. Only buckets that have been hit are written out.
+  for (i = 0; i < NUM_PACKET_TYPES; i++) {
+    struct StatsHistogram* histogram = &packetLatency[i];
+    const char* typeName             = getPacketTypeName(i);
+    unsigned long cumulative         = 0;
+    int bucketIndex;
+    for (bucketIndex = 0; bucketIndex < STATS_HISTOGRAM_BUCKETS; bucketIndex++) {
+      unsigned long bucketCount =
+          atomic_load_explicit(&histogram->buckets[bucketIndex], memory_order_relaxed);
+      if (bucketCount == 0 || (long unsigned int)length >= bufferSize) {
+        continue;
+      }
+      cumulative += bucketCount;
+      length += snprintf(buffer + length, bufferSize - (long unsigned int)length,
+                         "packet_latency_ns_bucket{type=\"%s\",le=\"%lu\"} %lu\n",
+                         typeName, getBucketUpperBound(bucketIndex), cumulative);
+    }
+    if ((long unsigned int)length >= bufferSize) {
+      break;
+    }
+    unsigned long count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+    length += snprintf(buffer + length, bufferSize - (long unsigned int)length,
+                       "packet_latency_ns_bucket{type=\"%s\",le=\"+Inf\"} %lu\n"
+                       "packet_latency_ns_sum{type=\"%s\"} %lu\n"
+                       "packet_latency_ns_count{type=\"%s\"} %lu\n",
+                       typeName, count, typeName,
+                       atomic_load_explicit(&histogram->sum, memory_order_relaxed),
+                       typeName, count);
+  }
+
+  if ((long unsigned int)length >= bufferSize) {
+    return (int)bufferSize - 1;
+  }
+  return length;
+}
+
+/*
+ * Purpose: Setup a UNIX domain socket that anything on the machine can connect to in
+ * order to read the stats. Set it non blocking so it can be checked from the main loop.
+ * Input: Path to create the socket at
+ * Output:
+ * - -1: Error, stats will not be available
+ * - The socket descriptor
+ */
+int setupStatsSocket(char* path) {
+  int statsSocketDescriptor = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (statsSocketDescriptor == -1) {
+    perror("Error when setting up stats socket");
+    return -1;
+  }
+
+  struct sockaddr_un statsAddress;
+  memset(&statsAddress, 0, sizeof(statsAddress));
+  statsAddress.sun_family = AF_UNIX;
+  strncpy(statsAddress.sun_path, path, sizeof(statsAddress.sun_path) - 1);
+
+  // Left behind by a previous run that didn't shut down cleanly
+  unlink(path);
+
+  if (bind(statsSocketDescriptor, (struct sockaddr*)&statsAddress,
+           sizeof(statsAddress)) == -1 ||
+      listen(statsSocketDescriptor, 4) == -1) {
+    perror("Error when binding stats socket");
+    close(statsSocketDescriptor);
+    return -1;
+  }
+
+  if (fcntl(statsSocketDescriptor, F_SETFL, O_NONBLOCK) == -1) {
+    perror("Error when setting stats socket non blocking");
+  }
+  return statsSocketDescriptor;
+}
+
+/*
+ * Purpose: Check if anyone connected to the stats socket. Everyone who did gets a
+ * copy of the current stats and is then disconnected.
+ * Input: The stats socket
+ * Output: None
+ */
+void checkStatsSocket(int statsSocketDescriptor) {
+  if (statsSocketDescriptor == -1) {
+    return;
+  }
+
+  int connectionDescriptor;
+  while ((connectionDescriptor = accept(statsSocketDescriptor, NULL, NULL)) != -1) {
+    char* buffer = malloc(STATS_BUFFER_SIZE);
+    int length   = writeStats(buffer, STATS_BUFFER_SIZE);
+    if (send(connectionDescriptor, buffer, (long unsigned int)length, MSG_NOSIGNAL) ==
+        -1) {
+      perror("Error sending stats");
+    }
+    free(buffer);
+    close(connectionDescriptor);
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK) {
+    perror("Error accepting stats connection");
+  }
+}
+
+/*
+ * Purpose: Close the stats socket and remove it from the filesystem
+ * Input:
+ * - The stats socket
+ * - Path the socket was created at
+ * Output: None
+ */
+void closeStatsSocket(int statsSocketDescriptor, char* path) {
+  if (statsSocketDescriptor == -1) {
+    return;
+  }
+  close(statsSocketDescriptor);
+  unlink(path);
+}
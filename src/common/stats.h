@@ -0,0 +1,75 @@
+#ifndef STATS_H
+#define STATS_H
+
+// Histogram buckets. Values below 16 get their own bucket, above that each power of
+// two is split into 8 sub-buckets (HDR style, at most 12.5% error).
+#define STATS_EXACT_BUCKETS     16
+#define STATS_SUB_BUCKET_BITS   3
+#define STATS_HISTOGRAM_BUCKETS 320
+
+// Packets handled between checks of the stats socket while busy
+#define STATS_POLL_INTERVAL 1024
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "packet.h"
+
+// Counters and gauges. Keep in the same order as statsNames in stats.c
+enum StatsCounter {
+  STATS_PACKETS_SENT,
+  STATS_BYTES_SENT,
+  STATS_BYTES_RECEIVED,
+  STATS_UNKNOWN_PACKETS,
+  STATS_RECEIVE_QUEUE_DROPS,
+  STATS_HEARTBEAT_TIMEOUTS,
+  STATS_RETRANSMISSIONS,
+  STATS_DELIVERY_FAILURES,
+  STATS_DUPLICATE_PACKETS,
+  STATS_RATE_LIMITED_PACKETS,
+  STATS_CONNECTED_CLIENTS,
+  STATS_RESOURCES,
+  STATS_GOSSIP_PEERS,
+  STATS_GOSSIP_ENTRIES,
+  STATS_RESOURCES_REJECTED,
+  STATS_RESOURCES_EVICTED,
+  STATS_DIRECTORY_BYTES,
+  STATS_DIRECTORY_BUDGET,
+  STATS_CLIENT_TABLE_BYTES,
+  STATS_PIPELINE_DROPPED,
+  STATS_UPLOADS_ACTIVE,
+  STATS_UPLOADS_QUEUED,
+  STATS_UPLOADS_REJECTED,
+  STATS_UPLOAD_BYTES,
+  STATS_SEEDED_FILES,
+  STATS_SEEDED_BYTES,
+  STATS_SEED_EVICTIONS,
+  STATS_RESOURCE_SUMMARIES,
+  STATS_PARKED_SESSIONS,
+  STATS_SESSIONS_RESUMED,
+  STATS_SEND_ERRORS,
+  NUM_STATS_COUNTERS
+};
+
+// Latency histogram for a single packet type. Only ever updated with relaxed atomic
+// adds so recording never takes a lock.
+struct StatsHistogram {
+  atomic_ulong buckets[STATS_HISTOGRAM_BUCKETS];
+  atomic_ulong count;
+  atomic_ulong sum;
+};
+
+void statsAdd(enum StatsCounter, unsigned long);
+void statsSubtract(enum StatsCounter, unsigned long);
+void statsSet(enum StatsCounter, unsigned long);
+unsigned long statsGet(enum StatsCounter);
+void statsRecordPacket(int, unsigned long);
+void statsRecordValue(struct StatsHistogram*, unsigned long);
+unsigned long statsPercentile(struct StatsHistogram*, unsigned long);
+
+int writeStats(char*, long unsigned int);
+int setupStatsSocket(char*);
+void checkStatsSocket(int);
+void closeStatsSocket(int, char*);
+
+#endif
@@ -0,0 +1,191 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "network_node.h"
+#include "trace.h"
+
+static const char* traceEventNames[NUM_TRACE_EVENTS] = {
+    "packet_received",  "packet_sent",     "packet_handled",
+    "packet_built",     "packet_read",     "field_read",
+    "subfield_read",    "resource_added",  "resource_removed",
+    "user_resources_removed", "client_connected", "client_expired",
+    "heartbeat_round",  "gossip_round",    "gossip_applied",
+    "file_read",        "file_written",    "packet_acked",
+    "packet_retransmitted", "packet_rate_limited", "resource_rejected",
+    "user_evicted", "packet_dropped", "send_failed"};
+
+static struct TraceRing* traceRings[TRACE_MAX_THREADS];
+static atomic_uint traceRingCount;
+static __thread struct TraceRing* threadRing;
+
+// Worked out when the handlers are installed, formatting it in a signal handler isn't
+// safe
+static char traceDumpPath[64];
+
+/*
+ * Purpose: Give the calling thread its own trace ring and add it to the rings that get
+ * dumped
+ * Input: None
+ * Output: The ring, NULL if there are already TRACE_MAX_THREADS rings
+ */
+static struct TraceRing* registerTraceRing() {
+  unsigned int ringIndex =
+      atomic_fetch_add_explicit(&traceRingCount, 1, memory_order_relaxed);
+  if (ringIndex >= TRACE_MAX_THREADS) {
+    atomic_fetch_sub_explicit(&traceRingCount, 1, memory_order_relaxed);
+    return NULL;
+  }
+  struct TraceRing* ring = calloc(1, sizeof(struct TraceRing));
+  if (ring == NULL) {
+    return NULL;
+  }
+  ring->threadId = (unsigned long)syscall(SYS_gettid);
+  threadRing     = ring;
+  __atomic_store_n(&traceRings[ringIndex], ring, __ATOMIC_RELEASE);
+  return ring;
+}
+
+/*
+ * Purpose: Record an event in the calling thread's trace ring. Use the TRACE() macro
+ * rather than calling this directly so trace points can be compiled out.
+ * Input:
+ * - The event
+ * - First argument, see enum TraceEventType for what it holds
+ * - Second argument
+ * Output: None
+ */
+void traceEvent(enum TraceEventType event, unsigned long arg0, unsigned long arg1) {
+  struct TraceRing* ring = threadRing;
+  if (ring == NULL) {
+    ring = registerTraceRing();
+    if (ring == NULL) {
+      return;
+    }
+  }
+  unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  struct TraceEvent* traceEntry = &ring->events[head & (TRACE_RING_SIZE - 1)];
+  traceEntry->timestamp         = getNanoseconds();
+  traceEntry->arg0              = arg0;
+  traceEntry->arg1              = arg1;
+  traceEntry->event             = event;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/*
+ * Purpose: Get the name of a trace event
+ * Input: The event
+ * Output: Name of the event, "unknown" if it isn't an event
+ */
+const char* getTraceEventName(unsigned int event) {
+  if (event >= NUM_TRACE_EVENTS) {
+    return "unknown";
+  }
+  return traceEventNames[event];
+}
+
+/*
+ * Purpose: Write every trace ring out to a file. Only uses async signal safe calls so
+ * it can be called from a signal handler. Rings still being written to may have a
+ * torn event at their head.
+ * Input: Path of the file to write
+ * Output:
+ * - -1: Error
+ * - 0: Success
+ */
+int dumpTrace(char* path) {
+  int fileDescriptor = open(path, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fileDescriptor == -1) {
+    return -1;
+  }
+
+  unsigned int ringCount = atomic_load_explicit(&traceRingCount, memory_order_acquire);
+  if (ringCount > TRACE_MAX_THREADS) {
+    ringCount = TRACE_MAX_THREADS;
+  }
+  // A ring can be counted before it is stored
+  unsigned int storedRings = 0;
+  unsigned int i;
+  for (i = 0; i < ringCount; i++) {
+    if (__atomic_load_n(&traceRings[i], __ATOMIC_ACQUIRE) != NULL) {
+      storedRings++;
+    }
+  }
+
+  struct TraceFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version   = TRACE_VERSION;
+  header.ringSize  = TRACE_RING_SIZE;
+  header.ringCount = storedRings;
+
+  int returnValue = 0;
+  if (write(fileDescriptor, &header, sizeof(header)) != sizeof(header)) {
+    returnValue = -1;
+  }
+  for (i = 0; i < ringCount && returnValue == 0; i++) {
+    struct TraceRing* ring = __atomic_load_n(&traceRings[i], __ATOMIC_ACQUIRE);
+    if (ring == NULL) {
+      continue;
+    }
+    if (write(fileDescriptor, ring, sizeof(*ring)) != sizeof(*ring)) {
+      returnValue = -1;
+    }
+  }
+  close(fileDescriptor);
+  return returnValue;
+}
+
+/*
+ * Purpose: Dump the trace when asked to with SIGUSR1
+ * Input: The signal
+ * Output: None
+ */
+static void handleTraceSignal(int signalNumber) {
+  (void)signalNumber;
+  dumpTrace(traceDumpPath);
+}
+
+/*
+ * Purpose: Dump the trace on a crash then let the crash carry on as it would have
+ * Input: The signal
+ * Output: None
+ */
+static void handleCrashSignal(int signalNumber) {
+  dumpTrace(traceDumpPath);
+  signal(signalNumber, SIG_DFL);
+  raise(signalNumber);
+}
+
+/*
+ * Purpose: Set up dumping the trace to <program>.<pid>.trace on SIGUSR1 and when the
+ * program crashes
+ * Input: Name of the program, used in the name of the trace file
+ * Output: None
+ */
+void installTraceHandlers(char* programName) {
+  snprintf(traceDumpPath, sizeof(traceDumpPath), "%s.%d.trace", programName,
+           (int)getpid());
+
+  struct sigaction traceAction;
+  memset(&traceAction, 0, sizeof(traceAction));
+  traceAction.sa_handler = handleTraceSignal;
+  traceAction.sa_flags   = SA_RESTART;
+  sigemptyset(&traceAction.sa_mask);
+  sigaction(SIGUSR1, &traceAction, NULL);
+
+  struct sigaction crashAction;
+  memset(&crashAction, 0, sizeof(crashAction));
+  crashAction.sa_handler = handleCrashSignal;
+  sigemptyset(&crashAction.sa_mask);
+  int crashSignals[] = {SIGSEGV, SIGBUS, SIGABRT, SIGFPE, SIGILL};
+  unsigned long i;
+  for (i = 0; i < sizeof(crashSignals) / sizeof(crashSignals[0]); i++) {
+    sigaction(crashSignals[i], &crashAction, NULL);
+  }
+}
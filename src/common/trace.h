@@ -0,0 +1,87 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Events kept per thread, must be a power of two. Older events are overwritten.
+#define TRACE_RING_SIZE 8192
+
+// Most threads that can have a trace ring
+#define TRACE_MAX_THREADS 16
+
+#define TRACE_MAGIC   "P2PTRACE"
+#define TRACE_VERSION 1
+
+#include <netinet/in.h>
+#include <stdatomic.h>
+
+// Compiling with -DNO_TRACE removes every trace point
+#ifdef NO_TRACE
+#define TRACE(event, arg0, arg1) ((void)0)
+#else
+#define TRACE(event, arg0, arg1)                                                         \
+  traceEvent((event), (unsigned long)(arg0), (unsigned long)(arg1))
+#endif
+
+// Pack an IPv4 address and port into one trace argument
+#define TRACE_ADDRESS(address)                                                           \
+  (((unsigned long)ntohl((address).sin_addr.s_addr) << 16) | ntohs((address).sin_port))
+
+// Keep in the same order as traceEventNames in trace.c
+enum TraceEventType {
+  TRACE_PACKET_RECEIVED, // bytes, address
+  TRACE_PACKET_SENT,     // bytes, address
+  TRACE_PACKET_HANDLED,  // packet type, nanoseconds
+  TRACE_PACKET_BUILT,    // packet length, 0
+  TRACE_PACKET_READ,     // packet length, 0
+  TRACE_FIELD_READ,      // field length, 0
+  TRACE_SUBFIELD_READ,   // subfield length, 0
+  TRACE_RESOURCE_ADDED,  // filename length, 0
+  TRACE_RESOURCE_REMOVED,
+  TRACE_USER_RESOURCES_REMOVED, // resources removed, 0
+  TRACE_CLIENT_CONNECTED,       // client index, address
+  TRACE_CLIENT_EXPIRED,         // client index, address
+  TRACE_HEARTBEAT_ROUND,        // status packets sent, 0
+  TRACE_GOSSIP_ROUND,           // rumors pushed, peers
+  TRACE_GOSSIP_APPLIED,         // version, removed
+  TRACE_FILE_READ,              // bytes, 0
+  TRACE_FILE_WRITTEN,           // bytes, 0
+  TRACE_PACKET_ACKED,           // sequence, microseconds
+  TRACE_PACKET_RETRANSMITTED,   // sequence, retries
+  TRACE_PACKET_RATE_LIMITED,    // packet type, address
+  TRACE_RESOURCE_REJECTED,      // filename length, 0
+  TRACE_USER_EVICTED,           // username id, resources evicted
+  TRACE_PACKET_DROPPED,         // packet type, address
+  TRACE_SEND_FAILED,            // errno, address
+  NUM_TRACE_EVENTS
+};
+
+// A single timestamped event. Fixed size so a ring can be written out as is.
+struct TraceEvent {
+  unsigned long timestamp; // Monotonic nanoseconds
+  unsigned long arg0;
+  unsigned long arg1;
+  unsigned int event;
+  unsigned int reserved;
+};
+
+// Events recorded by one thread. Only that thread writes to it.
+struct TraceRing {
+  unsigned long threadId;
+  atomic_ulong head; // Total events ever recorded
+  struct TraceEvent events[TRACE_RING_SIZE];
+};
+
+// Start of a trace file, followed by each ring
+struct TraceFileHeader {
+  char magic[8];
+  unsigned int version;
+  unsigned int ringSize;
+  unsigned int ringCount;
+  unsigned int reserved;
+};
+
+void traceEvent(enum TraceEventType, unsigned long, unsigned long);
+const char* getTraceEventName(unsigned int);
+void installTraceHandlers(char*);
+int dumpTrace(char*);
+
+#endif
@@ -0,0 +1,598 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "uring.h"
+
+// Ring used for the UDP socket
+static struct UringQueue networkQueue;
+static bool networkQueueReady;
+static int uringSocketDescriptor = -1;
+
+// Provided buffers the kernel receives datagrams into
+static struct io_uring_buf_ring* receiveBufferRing;
+static char* receiveBuffers;
+static unsigned short receiveBufferTail;
+static struct msghdr receiveHeader;
+static bool receiveArmed;
+static bool receivePaused; // See pauseUdpUring()
+
+// Reaped receive completions, at most one per buffer
+static struct UringReceived receivedQueue[URING_RECEIVE_BUFFERS];
+static unsigned receivedHead;
+static unsigned receivedTail;
+
+static struct UringSendSlot sendSlots[URING_SEND_SLOTS];
+static int freeSendSlots[URING_SEND_SLOTS];
+static int freeSendSlotCount;
+
+/*
+ * Purpose: Create an io_uring instance and map its rings
+ * Input:
+ * - Queue to set up
+ * - Number of submission queue entries
+ * Output:
+ * - -1: Error, io_uring isn't available
+ * - 0: Success
+ */
+static int setupUringQueue(struct UringQueue* queue, unsigned entries) {
+  struct io_uring_params parameters;
+  memset(&parameters, 0, sizeof(parameters));
+  memset(queue, 0, sizeof(*queue));
+
+  int ringDescriptor = (int)syscall(__NR_io_uring_setup, entries, &parameters);
+  if (ringDescriptor == -1) {
+    perror("Error setting up io_uring");
+    return -1;
+  }
+  // Both rings in one mapping, every kernel with multishot receive has this
+  if (!(parameters.features & IORING_FEAT_SINGLE_MMAP)) {
+    printf("io_uring is too old\n");
+    close(ringDescriptor);
+    return -1;
+  }
+
+  unsigned long submissionSize =
+      parameters.sq_off.array + parameters.sq_entries * sizeof(unsigned);
+  unsigned long completionSize =
+      parameters.cq_off.cqes + parameters.cq_entries * sizeof(struct io_uring_cqe);
+  queue->ringMemorySize = submissionSize;
+  if (completionSize > submissionSize) {
+    queue->ringMemorySize = completionSize;
+  }
+  queue->ringMemory = mmap(NULL, queue->ringMemorySize, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ringDescriptor, IORING_OFF_SQ_RING);
+  if (queue->ringMemory == MAP_FAILED) {
+    perror("Error mapping io_uring rings");
+    close(ringDescriptor);
+    return -1;
+  }
+  queue->submissionEntriesSize = parameters.sq_entries * sizeof(struct io_uring_sqe);
+  queue->submissionEntries =
+      mmap(NULL, queue->submissionEntriesSize, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, ringDescriptor, IORING_OFF_SQES);
+  if (queue->submissionEntries == MAP_FAILED) {
+    perror("Error mapping io_uring submission entries");
+    munmap(queue->ringMemory, queue->ringMemorySize);
+    close(ringDescriptor);
+    return -1;
+  }
+
+  char* ring                  = queue->ringMemory;
+  queue->ringDescriptor       = ringDescriptor;
+  queue->submissionHead       = (unsigned*)(ring + parameters.sq_off.head);
+  queue->submissionTail       = (unsigned*)(ring + parameters.sq_off.tail);
+  queue->submissionMask       = (unsigned*)(ring + parameters.sq_off.ring_mask);
+  queue->submissionArray      = (unsigned*)(ring + parameters.sq_off.array);
+  queue->submissionEntryCount = parameters.sq_entries;
+  queue->completionHead       = (unsigned*)(ring + parameters.cq_off.head);
+  queue->completionTail       = (unsigned*)(ring + parameters.cq_off.tail);
+  queue->completionMask       = (unsigned*)(ring + parameters.cq_off.ring_mask);
+  queue->completionEntries    = (struct io_uring_cqe*)(ring + parameters.cq_off.cqes);
+  pthread_mutex_init(&queue->lock, NULL);
+  return 0;
+}
+
+/*
+ * Purpose: Unmap a queue's rings and close it
+ * Input: The queue
+ * Output: None
+ */
+static void closeUringQueue(struct UringQueue* queue) {
+  munmap(queue->submissionEntries, queue->submissionEntriesSize);
+  munmap(queue->ringMemory, queue->ringMemorySize);
+  close(queue->ringDescriptor);
+  pthread_mutex_destroy(&queue->lock);
+}
+
+/*
+ * Purpose: Copy a prepared entry onto the submission queue. It isn't seen by the
+ * kernel until the queue is submitted. Queue lock must be held.
+ * Input:
+ * - The queue
+ * - The prepared entry
+ * Output:
+ * - -1: Submission queue full
+ * - 0: Success
+ */
+static int queueUringEntry(struct UringQueue* queue, struct io_uring_sqe* entry) {
+  unsigned tail = *queue->submissionTail;
+  unsigned head = __atomic_load_n(queue->submissionHead, __ATOMIC_ACQUIRE);
+  if (tail - head >= queue->submissionEntryCount) {
+    return -1;
+  }
+  unsigned index                    = tail & *queue->submissionMask;
+  queue->submissionEntries[index]   = *entry;
+  queue->submissionArray[index]     = index;
+  __atomic_store_n(queue->submissionTail, tail + 1, __ATOMIC_RELEASE);
+  queue->pending++;
+  return 0;
+}
+
+/*
+ * Purpose: Hand queued entries to the kernel and optionally wait for completions.
+ * Queue lock must be held.
+ * Input:
+ * - The queue
+ * - Number of completions to wait for, 0 to not wait
+ * Output:
+ * - -1: Error
+ * - 0: Success
+ */
+static int submitUringQueue(struct UringQueue* queue, unsigned waitFor) {
+  if (queue->pending == 0 && waitFor == 0) {
+    return 0;
+  }
+  unsigned flags = 0;
+  if (waitFor > 0) {
+    flags = IORING_ENTER_GETEVENTS;
+  }
+  long submitted = syscall(__NR_io_uring_enter, queue->ringDescriptor, queue->pending,
+                           waitFor, flags, NULL, 0);
+  if (submitted == -1) {
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      perror("Error submitting to io_uring");
+    }
+    return -1;
+  }
+  queue->pending -= (unsigned)submitted;
+  return 0;
+}
+
+/*
+ * Purpose: Give a receive buffer back to the kernel. Network queue lock must be held.
+ * Input: Id of the buffer
+ * Output: None
+ */
+static void recycleReceiveBuffer(unsigned short bufferId) {
+  struct io_uring_buf* buffer =
+      &receiveBufferRing->bufs[receiveBufferTail & (URING_RECEIVE_BUFFERS - 1)];
+  buffer->addr = (unsigned long)(receiveBuffers + bufferId * URING_RECEIVE_BUFFER_SIZE);
+  buffer->len  = URING_RECEIVE_BUFFER_SIZE;
+  buffer->bid  = bufferId;
+  receiveBufferTail++;
+  __atomic_store_n(&receiveBufferRing->tail, receiveBufferTail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Purpose: Queue a multishot recvmsg on the UDP socket. One submission keeps receiving
+ * until the kernel runs out of buffers or hits an error. Network queue lock must be
+ * held.
+ * Input: None
+ * Output: None
+ */
+static void armReceive() {
+  struct io_uring_sqe entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.opcode    = IORING_OP_RECVMSG;
+  entry.fd        = uringSocketDescriptor;
+  entry.addr      = (unsigned long)&receiveHeader;
+  entry.flags     = IOSQE_BUFFER_SELECT;
+  entry.buf_group = URING_BUFFER_GROUP;
+  entry.ioprio    = IORING_RECV_MULTISHOT;
+  entry.user_data = URING_RECEIVE_TAG;
+  if (queueUringEntry(&networkQueue, &entry) == 0) {
+    receiveArmed = true;
+  }
+}
+
+/*
+ * Purpose: Handle every completion waiting on the network queue. Finished sends free
+ * their slot, received datagrams are queued until checkUdpUring() reads them. Network
+ * queue lock must be held.
+ * Input: None
+ * Output: None
+ */
+static void reapNetworkQueue() {
+  unsigned head = *networkQueue.completionHead;
+  unsigned tail = __atomic_load_n(networkQueue.completionTail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    struct io_uring_cqe* completion =
+        &networkQueue.completionEntries[head & *networkQueue.completionMask];
+
+    if (completion->user_data == URING_RECEIVE_TAG) {
+      if (!(completion->flags & IORING_CQE_F_MORE)) {
+        receiveArmed = false; // Out of buffers or an error, rearmed once read
+      }
+      if (completion->flags & IORING_CQE_F_BUFFER) {
+        receivedQueue[receivedTail % URING_RECEIVE_BUFFERS].bufferId =
+            (unsigned short)(completion->flags >> IORING_CQE_BUFFER_SHIFT);
+        receivedQueue[receivedTail % URING_RECEIVE_BUFFERS].result = completion->res;
+        receivedTail++;
+      } else if (completion->res < 0 && completion->res != -ENOBUFS &&
+                 completion->res != -ECANCELED) {
+        printf("UDP receive error: %s\n", strerror(-completion->res));
+      }
+    } else if ((completion->user_data & URING_SEND_TAG) != 0) {
+      if (completion->res < 0) {
+        printf("UDP send error: %s\n", strerror(-completion->res));
+      }
+      freeSendSlots[freeSendSlotCount++] = (int)(completion->user_data & 0xffffffff);
+    }
+    head++;
+  }
+  __atomic_store_n(networkQueue.completionHead, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Purpose: Submit what is queued on the network queue and reap the completions the
+ * kernel has posted. The kernel turns submissions away with EBUSY while its completion
+ * queue is full, so reaping is what lets a retry through. Network queue lock must be
+ * held.
+ * Input: Number of completions to wait for, 0 to not wait
+ * Output:
+ * - -1: Error other than the kernel being busy
+ * - 0: Success, or the kernel was busy and it is worth trying again
+ */
+static int flushNetworkQueue(unsigned waitFor) {
+  int result      = submitUringQueue(&networkQueue, waitFor);
+  int submitError = errno;
+  reapNetworkQueue();
+  errno = submitError;
+  if (result == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Purpose: Switch a UDP socket over to io_uring. Leaves the socket alone if io_uring
+ * isn't available so the caller can keep using the socket calls.
+ * Input: The UDP socket, already set up
+ * Output:
+ * - -1: io_uring not available, nothing changed
+ * - 0: Success
+ */
+int setupUring(int udpSocketDescriptor) {
+  if (setupUringQueue(&networkQueue, URING_ENTRIES) == -1) {
+    return -1;
+  }
+
+  // Buffer ring has to be page aligned
+  unsigned long bufferRingSize = URING_RECEIVE_BUFFERS * sizeof(struct io_uring_buf);
+  receiveBufferRing = mmap(NULL, bufferRingSize, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  receiveBuffers    = malloc(URING_RECEIVE_BUFFERS * URING_RECEIVE_BUFFER_SIZE);
+  if (receiveBufferRing == MAP_FAILED || receiveBuffers == NULL) {
+    perror("Error allocating io_uring receive buffers");
+    closeUringQueue(&networkQueue);
+    return -1;
+  }
+
+  struct io_uring_buf_reg bufferRegistration;
+  memset(&bufferRegistration, 0, sizeof(bufferRegistration));
+  bufferRegistration.ring_addr    = (unsigned long)receiveBufferRing;
+  bufferRegistration.ring_entries = URING_RECEIVE_BUFFERS;
+  bufferRegistration.bgid         = URING_BUFFER_GROUP;
+  if (syscall(__NR_io_uring_register, networkQueue.ringDescriptor,
+              IORING_REGISTER_PBUF_RING, &bufferRegistration, 1) == -1) {
+    perror("Error registering io_uring receive buffers");
+    munmap(receiveBufferRing, bufferRingSize);
+    free(receiveBuffers);
+    closeUringQueue(&networkQueue);
+    return -1;
+  }
+  unsigned short bufferId;
+  for (bufferId = 0; bufferId < URING_RECEIVE_BUFFERS; bufferId++) {
+    recycleReceiveBuffer(bufferId);
+  }
+
+  // Space the kernel leaves in each buffer for the sender and the drop count
+  memset(&receiveHeader, 0, sizeof(receiveHeader));
+  receiveHeader.msg_namelen    = sizeof(struct sockaddr_in);
+  receiveHeader.msg_controllen = CMSG_SPACE(sizeof(uint32_t));
+
+  int slot;
+  for (slot = 0; slot < URING_SEND_SLOTS; slot++) {
+    freeSendSlots[slot] = slot;
+  }
+  freeSendSlotCount = URING_SEND_SLOTS;
+
+  uringSocketDescriptor = udpSocketDescriptor;
+  armReceive();
+  if (submitUringQueue(&networkQueue, 0) == -1) {
+    munmap(receiveBufferRing, bufferRingSize);
+    free(receiveBuffers);
+    closeUringQueue(&networkQueue);
+    uringSocketDescriptor = -1;
+    return -1;
+  }
+  networkQueueReady = true;
+  return 0;
+}
+
+/*
+ * Purpose: Check if a UDP socket is handled by io_uring
+ * Input: The socket
+ * Output: Whether checkUdpUring() and queueUdpUringSend() should be used for it
+ */
+bool usingUdpUring(int udpSocketDescriptor) {
+  return networkQueueReady && udpSocketDescriptor == uringSocketDescriptor;
+}
+
+/*
+ * Purpose: Get a descriptor to wait on for the io_uring socket. poll() reports it
+ * readable once there are completions for checkUdpUring() to reap.
+ * Input: None
+ * Output: The descriptor of the ring
+ */
+int getUdpUringDescriptor() {
+  return networkQueue.ringDescriptor;
+}
+
+/*
+ * Purpose: Get the next datagram received on the io_uring socket. Never makes a system
+ * call while datagrams are waiting, queued sends are submitted once there are none.
+ * Input:
+ * - Where to put the sender's address
+ * - Buffer to copy the datagram into, at least MAX_PACKET bytes. Not NUL terminated.
+ * Output: Bytes received, 0 if there was nothing waiting
+ */
+long checkUdpUring(struct sockaddr_in* incomingAddress, char* message) {
+  pthread_mutex_lock(&networkQueue.lock);
+  if (receivedHead == receivedTail) {
+    reapNetworkQueue();
+  }
+  if (receivedHead == receivedTail) {
+    // Idle, good time to send what has been queued
+    if (!receiveArmed && !receivePaused) {
+      armReceive();
+    }
+    submitUringQueue(&networkQueue, 0);
+    pthread_mutex_unlock(&networkQueue.lock);
+    return 0;
+  }
+
+  struct UringReceived received = receivedQueue[receivedHead % URING_RECEIVE_BUFFERS];
+  receivedHead++;
+  char* buffer = receiveBuffers + received.bufferId * URING_RECEIVE_BUFFER_SIZE;
+
+  // Buffer holds the recvmsg header, sender, control data and datagram in that order
+  long bytesReceived = 0;
+  if (received.result >= (int)sizeof(struct io_uring_recvmsg_out)) {
+    struct io_uring_recvmsg_out* header = (struct io_uring_recvmsg_out*)buffer;
+    char* name    = buffer + sizeof(*header);
+    char* control = name + receiveHeader.msg_namelen;
+    char* payload = control + receiveHeader.msg_controllen;
+
+    memcpy(incomingAddress, name, sizeof(*incomingAddress));
+    bytesReceived = header->payloadlen;
+    if (bytesReceived > MAX_PACKET - 1) {
+      bytesReceived = MAX_PACKET - 1;
+    }
+    memcpy(message, payload, (unsigned long)bytesReceived);
+
+    struct msghdr controlHeader;
+    memset(&controlHeader, 0, sizeof(controlHeader));
+    controlHeader.msg_control      = control;
+    controlHeader.msg_controllen   = header->controllen;
+    struct cmsghdr* controlMessage = CMSG_FIRSTHDR(&controlHeader);
+    if (controlMessage != NULL && controlMessage->cmsg_level == SOL_SOCKET &&
+        controlMessage->cmsg_type == SO_RXQ_OVFL) {
+      uint32_t drops;
+      memcpy(&drops, CMSG_DATA(controlMessage), sizeof(drops));
+      statsSet(STATS_RECEIVE_QUEUE_DROPS, drops);
+    }
+  }
+  recycleReceiveBuffer(received.bufferId);
+  if (!receiveArmed && !receivePaused) {
+    armReceive();
+    submitUringQueue(&networkQueue, 0);
+  }
+  pthread_mutex_unlock(&networkQueue.lock);
+  return bytesReceived;
+}
+
+/*
+ * Purpose: Queue a datagram to be sent. Sends are submitted in batches, when the
+ * socket goes idle or by flushUdpUring(). If the ring stays full through
+ * URING_SEND_RETRIES tries to make room, the datagram is given up on.
+ * Input:
+ * - Socket to send on
+ * - Address to send to
+ * - The message, copied so it doesn't have to outlive the call
+ * Output: Bytes queued, -1 if it couldn't be queued
+ */
+long queueUdpUringSend(int udpSocketDescriptor,
+                       struct sockaddr_in destinationAddress,
+                       char* message) {
+  unsigned long messageLength = strnlen(message, MAX_PACKET - 1);
+
+  pthread_mutex_lock(&networkQueue.lock);
+  int tries = 0;
+  while (freeSendSlotCount == 0) {
+    // Every slot is in flight, wait for one to finish
+    if (flushNetworkQueue(1) == -1 || ++tries == URING_SEND_RETRIES) {
+      pthread_mutex_unlock(&networkQueue.lock);
+      return -1;
+    }
+  }
+  int slotIndex              = freeSendSlots[--freeSendSlotCount];
+  struct UringSendSlot* slot = &sendSlots[slotIndex];
+  memcpy(slot->message, message, messageLength);
+  slot->address = destinationAddress;
+  slot->vector.iov_base = slot->message;
+  slot->vector.iov_len  = messageLength;
+  memset(&slot->header, 0, sizeof(slot->header));
+  slot->header.msg_name    = &slot->address;
+  slot->header.msg_namelen = sizeof(slot->address);
+  slot->header.msg_iov     = &slot->vector;
+  slot->header.msg_iovlen  = 1;
+
+  struct io_uring_sqe entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.opcode    = IORING_OP_SENDMSG;
+  entry.fd        = udpSocketDescriptor;
+  entry.addr      = (unsigned long)&slot->header;
+  entry.len       = 1;
+  entry.user_data = URING_SEND_TAG | (unsigned)slotIndex;
+  tries = 0;
+  while (queueUringEntry(&networkQueue, &entry) == -1) {
+    // Submission queue full, make room and try again
+    if (flushNetworkQueue(0) == -1 || ++tries == URING_SEND_RETRIES) {
+      freeSendSlots[freeSendSlotCount++] = slotIndex;
+      pthread_mutex_unlock(&networkQueue.lock);
+      return -1;
+    }
+  }
+  if (networkQueue.pending >= URING_SEND_BATCH) {
+    submitUringQueue(&networkQueue, 0);
+  }
+  pthread_mutex_unlock(&networkQueue.lock);
+  return (long)messageLength;
+}
+
+/*
+ * Purpose: Submit every queued send now. Used by threads that are about to sleep.
+ * Input: None
+ * Output: None
+ */
+void flushUdpUring() {
+  if (!networkQueueReady) {
+    return;
+  }
+  pthread_mutex_lock(&networkQueue.lock);
+  submitUringQueue(&networkQueue, 0);
+  pthread_mutex_unlock(&networkQueue.lock);
+}
+
+/*
+ * Purpose: Stop or start receiving on the io_uring socket. Stopping cancels the
+ * multishot receive and waits for the kernel to finish with it, so every datagram it
+ * took off the socket can still be read with checkUdpUring() and the rest stay on the
+ * socket for whoever reads it next.
+ * Input: Whether to stop receiving
+ * Output: None
+ */
+void pauseUdpUring(bool paused) {
+  if (!networkQueueReady) {
+    return;
+  }
+  pthread_mutex_lock(&networkQueue.lock);
+  receivePaused = paused;
+  if (paused && receiveArmed) {
+    struct io_uring_sqe entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.opcode    = IORING_OP_ASYNC_CANCEL;
+    entry.fd        = -1;
+    entry.addr      = URING_RECEIVE_TAG;
+    entry.user_data = URING_CANCEL_TAG;
+    queueUringEntry(&networkQueue, &entry);
+    // The receive's last completion comes without IORING_CQE_F_MORE
+    while (receiveArmed) {
+      if (submitUringQueue(&networkQueue, 1) == -1 && errno != EINTR) {
+        break;
+      }
+      reapNetworkQueue();
+    }
+  }
+  pthread_mutex_unlock(&networkQueue.lock);
+}
+
+/*
+ * Purpose: Set up a ring to read files through without blocking. Unlike the network
+ * ring it belongs to the caller, and only the thread that owns it may use it.
+ * Input: Queue to set up
+ * Output:
+ * - -1: io_uring not available
+ * - 0: Success
+ */
+int setupFileUring(struct UringQueue* queue) {
+  return setupUringQueue(queue, URING_FILE_ENTRIES);
+}
+
+/*
+ * Purpose: Close a file ring. Reads still in flight have to be reaped first.
+ * Input: The queue
+ * Output: None
+ */
+void closeFileUring(struct UringQueue* queue) {
+  closeUringQueue(queue);
+}
+
+/*
+ * Purpose: Start reading part of a file. The buffer has to stay put until
+ * reapFileUring() hands back the read's tag.
+ * Input:
+ * - The file ring
+ * - File to read from
+ * - Buffer to read into
+ * - Bytes to read
+ * - Offset in the file to read from
+ * - Tag to tell the read apart by once it is done
+ * Output:
+ * - -1: The ring is full, nothing was started
+ * - 0: Success
+ */
+int queueFileUringRead(struct UringQueue* queue,
+                       int fileDescriptor,
+                       char* buffer,
+                       unsigned long length,
+                       unsigned long offset,
+                       unsigned long tag) {
+  struct io_uring_sqe entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.opcode    = IORING_OP_READ;
+  entry.fd        = fileDescriptor;
+  entry.off       = offset;
+  entry.addr      = (unsigned long)buffer;
+  entry.len       = (unsigned)length;
+  entry.user_data = tag;
+  if (queueUringEntry(queue, &entry) == -1) {
+    return -1;
+  }
+  // Left queued if the kernel is busy, reapFileUring() submits it again
+  submitUringQueue(queue, 0);
+  return 0;
+}
+
+/*
+ * Purpose: Take the next finished read off a file ring, or wait for one. Reads that
+ * couldn't be submitted when they were started are submitted first.
+ * Input:
+ * - The file ring
+ * - Whether to wait for a read to finish if none has
+ * - Where to put the tag of the read
+ * - Where to put the bytes read, or the negated errno if the read failed
+ * Output: Whether a read had finished
+ */
+bool reapFileUring(struct UringQueue* queue, bool wait, unsigned long* tag, int* result) {
+  unsigned head = *queue->completionHead;
+  if (head == __atomic_load_n(queue->completionTail, __ATOMIC_ACQUIRE)) {
+    if (submitUringQueue(queue, wait ? 1 : 0) == -1 ||
+        head == __atomic_load_n(queue->completionTail, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+  }
+  struct io_uring_cqe* completion =
+      &queue->completionEntries[head & *queue->completionMask];
+  *tag    = completion->user_data;
+  *result = completion->res;
+  __atomic_store_n(queue->completionHead, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
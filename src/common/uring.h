@@ -0,0 +1,99 @@
+#ifndef URING_H
+#define URING_H
+
+// Submission queue entries of the ring, the completion queue is twice as big
+#define URING_ENTRIES 256
+
+// Buffers the kernel picks from for received datagrams, must be a power of two
+#define URING_RECEIVE_BUFFERS 256
+
+// Each receive buffer holds the recvmsg header, sender address and control data
+// followed by the datagram
+#define URING_RECEIVE_BUFFER_SIZE 512
+
+// Buffer group the receive buffers are registered as
+#define URING_BUFFER_GROUP 0
+
+// Sends that can be in flight at once
+#define URING_SEND_SLOTS 128
+
+// Sends queued before they are submitted without waiting for the socket to go idle
+#define URING_SEND_BATCH 16
+
+// Times a send tries to make room on a full ring before its datagram is dropped
+#define URING_SEND_RETRIES 8
+
+// Submission queue entries of a ring for file reads, see setupFileUring()
+#define URING_FILE_ENTRIES 32
+
+// Completion user data, the low bits of a send hold its slot
+#define URING_RECEIVE_TAG (1UL << 32)
+#define URING_SEND_TAG    (2UL << 32)
+#define URING_CANCEL_TAG  (4UL << 32)
+
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+
+#include "packet.h"
+
+// An io_uring instance with its rings mapped in
+struct UringQueue {
+  int ringDescriptor;
+  void* ringMemory;
+  unsigned long ringMemorySize;
+  struct io_uring_sqe* submissionEntries;
+  unsigned long submissionEntriesSize;
+
+  // Submission queue
+  unsigned* submissionHead;
+  unsigned* submissionTail;
+  unsigned* submissionMask;
+  unsigned* submissionArray;
+  unsigned submissionEntryCount;
+  unsigned pending; // Queued but not yet submitted
+
+  // Completion queue
+  unsigned* completionHead;
+  unsigned* completionTail;
+  unsigned* completionMask;
+  struct io_uring_cqe* completionEntries;
+
+  pthread_mutex_t lock;
+};
+
+// A send waiting for the kernel. Everything it points to has to stay put until it
+// completes.
+struct UringSendSlot {
+  struct msghdr header;
+  struct iovec vector;
+  struct sockaddr_in address;
+  char message[MAX_PACKET];
+};
+
+// A received datagram whose completion was reaped but which hasn't been read yet
+struct UringReceived {
+  unsigned short bufferId;
+  int result;
+};
+
+int setupUring(int);
+bool usingUdpUring(int);
+int getUdpUringDescriptor();
+long checkUdpUring(struct sockaddr_in*, char*);
+long queueUdpUringSend(int, struct sockaddr_in, char*);
+void flushUdpUring();
+void pauseUdpUring(bool);
+int setupFileUring(struct UringQueue*);
+void closeFileUring(struct UringQueue*);
+int queueFileUringRead(struct UringQueue*,
+                       int,
+                       char*,
+                       unsigned long,
+                       unsigned long,
+                       unsigned long);
+bool reapFileUring(struct UringQueue*, bool, unsigned long*, int*);
+
+#endif
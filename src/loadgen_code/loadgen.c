@@ -0,0 +1,555 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../common/network_node.h"
+#include "../common/packet.h"
+#include "../common/stats.h"
+#include "loadgen.h"
+
+// packet.h
+extern struct PacketDelimiters packetDelimiters;
+
+int epollDescriptor;
+struct LoadResults results;
+
+// Main function
+int main(int argc, char* argv[]) {
+  struct LoadOptions options;
+  parseLoadOptions(argc, argv, &options);
+
+  // One socket per simulated client, make sure the process is allowed that many
+  struct rlimit fileLimit;
+  getrlimit(RLIMIT_NOFILE, &fileLimit);
+  fileLimit.rlim_cur = fileLimit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &fileLimit);
+  if ((long unsigned int)options.clients + 16 > fileLimit.rlim_cur) {
+    fprintf(stderr, "Open file limit %lu is too low for %d clients\n",
+            (unsigned long)fileLimit.rlim_cur, options.clients);
+    exit(1);
+  }
+
+  epollDescriptor = epoll_create1(0);
+  if (epollDescriptor == -1) {
+    perror("Error creating epoll instance");
+    exit(1);
+  }
+
+  struct SimulatedClient* clients = calloc((size_t)options.clients, sizeof(*clients));
+  memset(&results, 0, sizeof(results));
+  srand((unsigned int)getMicroseconds());
+
+  printf("Simulating %d clients with %d resources each for %d seconds\n", options.clients,
+         options.resources, options.duration);
+
+  char* packet                    = calloc(1, MAX_PACKET);
+  struct epoll_event* events      = calloc(256, sizeof(struct epoll_event));
+  unsigned long startTime         = getMicroseconds();
+  unsigned long endTime           = startTime + (unsigned long)options.duration * 1000000UL;
+  unsigned long nextScan          = startTime + SCAN_INTERVAL;
+  unsigned long listingsScheduled = 0;
+  unsigned long lookupsScheduled  = 0;
+  unsigned long churnScheduled    = 0;
+  int nextClient                  = 0;
+
+  unsigned long currentTime = startTime;
+  while (currentTime < endTime) {
+    unsigned long elapsed = currentTime - startTime;
+
+    // Bring clients up, as fast as possible or at the requested rate
+    while (nextClient < options.clients &&
+           (options.registrationRate == 0 ||
+            (unsigned long)nextClient <
+                (unsigned long)options.registrationRate * elapsed / 1000000UL + 1)) {
+      if (startClient(&clients[nextClient], nextClient, epollDescriptor) == 0) {
+        sendRegistration(&clients[nextClient], &options);
+      }
+      nextClient++;
+    }
+
+    // Listings, lookups and churn, each spread over the run at their own rate
+    while (listingsScheduled < (unsigned long)options.listingRate * elapsed / 1000000UL) {
+      listingsScheduled++;
+      struct SimulatedClient* client = &clients[rand() % options.clients];
+      if (client->active && client->confirmed && client->listingSentAt == 0) {
+        sendListing(client, &options);
+      }
+    }
+    while (lookupsScheduled < (unsigned long)options.lookupRate * elapsed / 1000000UL) {
+      lookupsScheduled++;
+      struct SimulatedClient* client = &clients[rand() % options.clients];
+      struct SimulatedClient* owner  = &clients[rand() % options.clients];
+      if (client->active && client->confirmed && client->lookupSentAt == 0 &&
+          owner->active) {
+        char filename[MAX_FILENAME];
+        snprintf(filename, sizeof(filename), "%s_f%d.dat", owner->username,
+                 rand() % options.resources);
+        sendLookup(client, filename, &options);
+        client->lookupSentAt = getMicroseconds();
+        results.lookupsSent++;
+      }
+    }
+    while (churnScheduled < (unsigned long)options.churnRate * elapsed / 1000000UL) {
+      churnScheduled++;
+      int clientIndex                = rand() % options.clients;
+      struct SimulatedClient* client = &clients[clientIndex];
+      if (!client->active || !client->confirmed) {
+        continue;
+      }
+      // Leave without telling the server, then come back as a new user
+      stopClient(client, epollDescriptor);
+      client->generation++;
+      results.churned++;
+      if (startClient(client, clientIndex, epollDescriptor) == 0) {
+        sendRegistration(client, &options);
+      }
+    }
+
+    // Replies from the server
+    int eventCount = epoll_wait(epollDescriptor, events, 256, 1);
+    if (eventCount == -1 && errno != EINTR) {
+      perror("epoll_wait error");
+      exit(1);
+    }
+    int i;
+    for (i = 0; i < eventCount; i++) {
+      struct SimulatedClient* client = &clients[events[i].data.u32];
+      long int bytesReceived;
+      while ((bytesReceived = recv(client->socketDescriptor, packet, MAX_PACKET - 1, 0)) >
+             0) {
+        packet[bytesReceived] = '\0';
+        handleReply(client, packet, &options, getMicroseconds());
+      }
+    }
+
+    currentTime = getMicroseconds();
+    if (currentTime >= nextScan) {
+      scanClients(clients, &options, currentTime);
+      nextScan = currentTime + SCAN_INTERVAL;
+    }
+  }
+
+  printResults(currentTime - startTime);
+
+  int i;
+  for (i = 0; i < options.clients; i++) {
+    stopClient(&clients[i], epollDescriptor);
+  }
+  free(events);
+  free(packet);
+  free(clients);
+  close(epollDescriptor);
+  return 0;
+}
+
+/*
+ * Purpose: Print how to use the load generator and exit
+ * Input: Name of the program
+ * Output: None
+ */
+static void printUsage(char* programName) {
+  printf("Usage: %s [options]\n", programName);
+  printf("  -n clients       Number of simulated clients (%d)\n", DEFAULT_CLIENTS);
+  printf("  -r resources     Resources registered per client (%d)\n", DEFAULT_RESOURCES);
+  printf("  -t seconds       How long to run for (%d)\n", DEFAULT_DURATION);
+  printf("  -R rate          Registrations per second, 0 is unlimited (%d)\n",
+         DEFAULT_REGISTRATION_RATE);
+  printf("  -l rate          Listings per second (%d)\n", DEFAULT_LISTING_RATE);
+  printf("  -k rate          Lookups per second (%d)\n", DEFAULT_LOOKUP_RATE);
+  printf("  -c rate          Clients churning out and back in per second (%d)\n",
+         DEFAULT_CHURN_RATE);
+  printf("  -s address       IPv4 address of the server (127.0.0.1)\n");
+  printf("  -p port          Port of the server (%d)\n", PORT);
+  printf("  -d               Debug mode\n");
+  exit(1);
+}
+
+/*
+ * Purpose: Read the command line options of the load generator
+ * Input:
+ * - Number of command line arguments
+ * - The command line arguments
+ * - Options to fill in
+ * Output: None
+ */
+void parseLoadOptions(int argc, char** argv, struct LoadOptions* options) {
+  memset(options, 0, sizeof(*options));
+  options->clients          = DEFAULT_CLIENTS;
+  options->resources        = DEFAULT_RESOURCES;
+  options->duration         = DEFAULT_DURATION;
+  options->registrationRate = DEFAULT_REGISTRATION_RATE;
+  options->listingRate      = DEFAULT_LISTING_RATE;
+  options->lookupRate       = DEFAULT_LOOKUP_RATE;
+  options->churnRate        = DEFAULT_CHURN_RATE;
+  options->serverAddress.sin_family      = AF_INET;
+  options->serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  options->serverAddress.sin_port        = htons(PORT);
+
+  int option;
+  while ((option = getopt(argc, argv, "n:r:t:R:l:k:c:s:p:d")) != -1) {
+    switch (option) {
+    case 'n':
+      options->clients = atoi(optarg);
+      break;
+    case 'r':
+      options->resources = atoi(optarg);
+      break;
+    case 't':
+      options->duration = atoi(optarg);
+      break;
+    case 'R':
+      options->registrationRate = atoi(optarg);
+      break;
+    case 'l':
+      options->listingRate = atoi(optarg);
+      break;
+    case 'k':
+      options->lookupRate = atoi(optarg);
+      break;
+    case 'c':
+      options->churnRate = atoi(optarg);
+      break;
+    case 's':
+      if (inet_pton(AF_INET, optarg, &options->serverAddress.sin_addr) != 1) {
+        printUsage(argv[0]);
+      }
+      break;
+    case 'p':
+      options->serverAddress.sin_port = htons((unsigned short)atoi(optarg));
+      break;
+    case 'd':
+      options->debugFlag = true;
+      break;
+    default:
+      printUsage(argv[0]);
+    }
+  }
+  if (options->clients <= 0 || options->resources <= 0 || options->duration <= 0) {
+    printUsage(argv[0]);
+  }
+}
+
+/*
+ * Purpose: Give a simulated client its own UDP socket so the server sees it as a
+ * separate client, and start watching the socket for replies.
+ * Input:
+ * - The simulated client
+ * - Index of the client, used for its username and to find it again
+ * - epoll instance to add the socket to
+ * Output:
+ * - -1: Error, the client was not started
+ * - 0: Success
+ */
+int startClient(struct SimulatedClient* client, int clientIndex, int epollInstance) {
+  client->socketDescriptor = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (client->socketDescriptor == -1) {
+    perror("Error setting up simulated client socket");
+    return -1;
+  }
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events   = EPOLLIN;
+  event.data.u32 = (unsigned int)clientIndex;
+  if (epoll_ctl(epollInstance, EPOLL_CTL_ADD, client->socketDescriptor, &event) == -1) {
+    perror("Error watching simulated client socket");
+    close(client->socketDescriptor);
+    return -1;
+  }
+
+  snprintf(client->username, MAX_USERNAME, "c%06dg%d", clientIndex, client->generation);
+  client->active        = true;
+  client->confirmed     = false;
+  client->expired       = false;
+  client->listingSentAt = 0;
+  client->lookupSentAt  = 0;
+  return 0;
+}
+
+/*
+ * Purpose: Stop a simulated client without telling the server, as if it crashed
+ * Input:
+ * - The simulated client
+ * - epoll instance watching the client's socket
+ * Output: None
+ */
+void stopClient(struct SimulatedClient* client, int epollInstance) {
+  if (!client->active) {
+    return;
+  }
+  epoll_ctl(epollInstance, EPOLL_CTL_DEL, client->socketDescriptor, NULL);
+  close(client->socketDescriptor);
+  client->active = false;
+}
+
+/*
+ * Purpose: Send a packet from a simulated client to the server. Unlike sendUdpPacket()
+ * a failed send is counted instead of exiting, the kernel may run out of buffers when
+ * thousands of clients are sending.
+ * Input:
+ * - The simulated client
+ * - Fields of the packet
+ * - Load options
+ * Output: None
+ */
+static void sendFromClient(struct SimulatedClient* client,
+                           struct PacketFields packetFields,
+                           struct LoadOptions* options) {
+  char packet[MAX_PACKET + MAX_PACKET_TYPE];
+  memset(packet, 0, sizeof(packet));
+  buildPacket(packet, packetFields, false);
+  if (sendto(client->socketDescriptor, packet, strlen(packet), 0,
+             (struct sockaddr*)&options->serverAddress,
+             sizeof(options->serverAddress)) == -1) {
+    if (options->debugFlag) {
+      perror("Simulated client send error");
+    }
+    results.sendErrors++;
+  }
+}
+
+/*
+ * Purpose: Register a simulated client with the server. Its resources are named after
+ * it so that lookups for them can be generated. A lookup for its first resource is
+ * sent right after, the registration is confirmed when the server lists the client
+ * as an owner.
+ * Input:
+ * - The simulated client
+ * - Load options
+ * Output: None
+ */
+void sendRegistration(struct SimulatedClient* client, struct LoadOptions* options) {
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "connection");
+
+  char delimiter = packetDelimiters.subfield[0];
+  // No register packets or summary follow, the resources all go in the connection
+  // packet
+  snprintf(packetFields.data, MAX_DATA, "%s%c0%c0%c0%c0%c", client->username, delimiter,
+           delimiter, delimiter, delimiter, delimiter);
+  int i;
+  for (i = 0; i < options->resources; i++) {
+    char resource[MAX_FILENAME + 1];
+    snprintf(resource, sizeof(resource), "%s_f%d.dat%c", client->username, i, delimiter);
+    if (strlen(packetFields.data) + strlen(resource) >= MAX_DATA) {
+      break;
+    }
+    strcat(packetFields.data, resource);
+  }
+
+  sendFromClient(client, packetFields, options);
+  client->registerSentAt = getMicroseconds();
+  if (results.registrationsSent == 0) {
+    results.firstRegistrationAt = client->registerSentAt;
+  }
+  results.registrationsSent++;
+
+  char filename[MAX_FILENAME];
+  snprintf(filename, sizeof(filename), "%s_f0.dat", client->username);
+  sendLookup(client, filename, options);
+  client->confirmSentAt = client->registerSentAt;
+}
+
+/*
+ * Purpose: Send a lookup packet from a simulated client
+ * Input:
+ * - The simulated client
+ * - Filename to look up
+ * - Load options
+ * Output: None
+ */
+void sendLookup(struct SimulatedClient* client,
+                char* filename,
+                struct LoadOptions* options) {
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "lookup");
+  strcpy(packetFields.data, filename);
+  strncat(packetFields.data, packetDelimiters.subfield, packetDelimiters.subfieldLength);
+  sendFromClient(client, packetFields, options);
+}
+
+/*
+ * Purpose: Ask the server for a listing of every resource from a simulated client
+ * Input:
+ * - The simulated client
+ * - Load options
+ * Output: None
+ */
+void sendListing(struct SimulatedClient* client, struct LoadOptions* options) {
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "resource");
+  strcpy(packetFields.data, "dummyfield");
+  sendFromClient(client, packetFields, options);
+  client->listingSentAt = getMicroseconds();
+  results.listingsSent++;
+}
+
+/*
+ * Purpose: Handle a packet the server sent to a simulated client. Heartbeats are
+ * answered, replies to listings and lookups are timed.
+ * Input:
+ * - The simulated client
+ * - The packet
+ * - Load options
+ * - Time the packet was received
+ * Output: None
+ */
+void handleReply(struct SimulatedClient* client,
+                 char* packet,
+                 struct LoadOptions* options,
+                 unsigned long receiveTime) {
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  readPacket(packet, &packetFields, false);
+
+  switch (getPacketType(packetFields.type, false)) {
+  case PACKET_STATUS:
+    client->lastStatusAt = receiveTime;
+    memset(&packetFields, 0, sizeof(packetFields));
+    strcpy(packetFields.type, "status");
+    strcpy(packetFields.data, "testing");
+    sendFromClient(client, packetFields, options);
+    results.heartbeatsAnswered++;
+    break;
+
+  case PACKET_RESOURCE:
+    if (client->listingSentAt != 0) {
+      statsRecordValue(&results.listingLatency, receiveTime - client->listingSentAt);
+      client->listingSentAt = 0;
+    }
+    break;
+
+  case PACKET_LOOKUP:
+    if (!client->confirmed) {
+      char owner[MAX_USERNAME + 2];
+      snprintf(owner, sizeof(owner), "%c%s%c", packetDelimiters.subfield[0],
+               client->username, packetDelimiters.subfield[0]);
+      if (strstr(packetFields.data, owner) != NULL) {
+        client->confirmed    = true;
+        client->lastStatusAt = receiveTime;
+        statsRecordValue(&results.registrationLatency,
+                         receiveTime - client->registerSentAt);
+        results.registrationsConfirmed++;
+        // Throughput is measured over the initial wave, not churn spread over the run
+        if (client->generation == 0) {
+          results.initialConfirmed++;
+          results.lastConfirmationAt = receiveTime;
+        }
+        if (options->debugFlag) {
+          printf("%s registered\n", client->username);
+        }
+      }
+    } else if (client->lookupSentAt != 0) {
+      statsRecordValue(&results.lookupLatency, receiveTime - client->lookupSentAt);
+      client->lookupSentAt = 0;
+    }
+    break;
+
+  default:
+  }
+}
+
+/*
+ * Purpose: Check every simulated client for registrations that need confirming again,
+ * requests that timed out and clients the server expired even though they answered
+ * every heartbeat.
+ * Input:
+ * - The simulated clients
+ * - Load options
+ * - Current time
+ * Output: None
+ */
+void scanClients(struct SimulatedClient* clients,
+                 struct LoadOptions* options,
+                 unsigned long currentTime) {
+  int i;
+  for (i = 0; i < options->clients; i++) {
+    struct SimulatedClient* client = &clients[i];
+    if (!client->active) {
+      continue;
+    }
+
+    if (!client->confirmed) {
+      if (client->registerSentAt != 0 &&
+          currentTime - client->confirmSentAt >= CONFIRM_RETRY_INTERVAL) {
+        char filename[MAX_FILENAME];
+        snprintf(filename, sizeof(filename), "%s_f0.dat", client->username);
+        sendLookup(client, filename, options);
+        client->confirmSentAt = currentTime;
+      }
+      continue;
+    }
+
+    if (client->listingSentAt != 0 &&
+        currentTime - client->listingSentAt >= REQUEST_TIMEOUT) {
+      client->listingSentAt = 0;
+      results.requestsTimedOut++;
+    }
+    if (client->lookupSentAt != 0 && currentTime - client->lookupSentAt >= REQUEST_TIMEOUT) {
+      client->lookupSentAt = 0;
+      results.requestsTimedOut++;
+    }
+
+    // The server stops sending heartbeats to clients it has expired
+    if (!client->expired && currentTime - client->lastStatusAt >= EXPIRY_THRESHOLD) {
+      client->expired = true;
+      results.falselyExpired++;
+      if (options->debugFlag) {
+        printf("%s was expired by the server\n", client->username);
+      }
+    }
+  }
+}
+
+/*
+ * Purpose: Print a latency histogram as percentiles
+ * Input:
+ * - Name of what was measured
+ * - Histogram of latencies in microseconds
+ * Output: None
+ */
+static void printLatency(char* name, struct StatsHistogram* histogram) {
+  printf("%-13s count %-8lu p50 %-8lu p99 %-8lu p999 %-8lu (us)\n", name,
+         atomic_load(&histogram->count), statsPercentile(histogram, 500),
+         statsPercentile(histogram, 990), statsPercentile(histogram, 999));
+}
+
+/*
+ * Purpose: Print out everything measured during the run
+ * Input: How long the run took in microseconds
+ * Output: None
+ */
+void printResults(unsigned long runTime) {
+  unsigned long registrationTime = 1;
+  if (results.lastConfirmationAt > results.firstRegistrationAt) {
+    registrationTime = results.lastConfirmationAt - results.firstRegistrationAt;
+  }
+
+  printf("\n*** LOAD RESULTS ***\n");
+  printf("Run time:                %lu ms\n", runTime / 1000);
+  printf("Registrations sent:      %lu\n", results.registrationsSent);
+  printf("Registrations confirmed: %lu\n", results.registrationsConfirmed);
+  printf("Registration throughput: %lu per second\n",
+         results.initialConfirmed * 1000000UL / registrationTime);
+  printf("Listings sent:           %lu\n", results.listingsSent);
+  printf("Lookups sent:            %lu\n", results.lookupsSent);
+  printf("Requests timed out:      %lu\n", results.requestsTimedOut);
+  printf("Heartbeats answered:     %lu\n", results.heartbeatsAnswered);
+  printf("Clients churned:         %lu\n", results.churned);
+  printf("Falsely expired clients: %lu\n", results.falselyExpired);
+  printf("Send errors:             %lu\n", results.sendErrors);
+  printLatency("Registration", &results.registrationLatency);
+  printLatency("Listing", &results.listingLatency);
+  printLatency("Lookup", &results.lookupLatency);
+}
@@ -0,0 +1,88 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+// Defaults for everything that can be set on the command line
+#define DEFAULT_CLIENTS           1000
+#define DEFAULT_RESOURCES         4
+#define DEFAULT_DURATION          30  // Seconds
+#define DEFAULT_REGISTRATION_RATE 0   // Registrations per second, 0 is unlimited
+#define DEFAULT_LISTING_RATE      50  // Listings per second across all clients
+#define DEFAULT_LOOKUP_RATE       200 // Lookups per second across all clients
+#define DEFAULT_CHURN_RATE        5   // Clients leaving and rejoining per second
+
+// Microseconds between lookups sent to check that a registration went through
+#define CONFIRM_RETRY_INTERVAL 500000
+
+// Microseconds a listing or lookup can go unanswered before it counts as lost
+#define REQUEST_TIMEOUT 2000000
+
+// Microseconds a registered client can go without a status packet before it is
+// considered expired by the server. Two missed heartbeat rounds plus some slack.
+#define EXPIRY_THRESHOLD (2 * STATUS_SEND_INTERVAL + 1000000)
+
+// Microseconds between scans of every client for retries, timeouts and expiry
+#define SCAN_INTERVAL 100000
+
+#include <stdbool.h>
+
+#include "../common/network_node.h"
+#include "../common/stats.h"
+#include "../server_code/server.h"
+
+// One client simulated by the load generator
+struct SimulatedClient {
+  int socketDescriptor;
+  char username[MAX_USERNAME];
+  int generation; // Bumped every time the client churns so its username is new
+  bool active;
+  bool confirmed;
+  bool expired;
+  unsigned long registerSentAt;
+  unsigned long confirmSentAt;
+  unsigned long lastStatusAt;
+  unsigned long listingSentAt;
+  unsigned long lookupSentAt;
+};
+
+struct LoadOptions {
+  int clients;
+  int resources;
+  int duration;
+  int registrationRate;
+  int listingRate;
+  int lookupRate;
+  int churnRate;
+  struct sockaddr_in serverAddress;
+  bool debugFlag;
+};
+
+// Everything measured during a run
+struct LoadResults {
+  unsigned long registrationsSent;
+  unsigned long registrationsConfirmed;
+  unsigned long initialConfirmed;
+  unsigned long firstRegistrationAt;
+  unsigned long lastConfirmationAt;
+  unsigned long listingsSent;
+  unsigned long lookupsSent;
+  unsigned long requestsTimedOut;
+  unsigned long heartbeatsAnswered;
+  unsigned long churned;
+  unsigned long falselyExpired;
+  unsigned long sendErrors;
+  struct StatsHistogram registrationLatency;
+  struct StatsHistogram listingLatency;
+  struct StatsHistogram lookupLatency;
+};
+
+void parseLoadOptions(int, char**, struct LoadOptions*);
+int startClient(struct SimulatedClient*, int, int);
+void stopClient(struct SimulatedClient*, int);
+void sendRegistration(struct SimulatedClient*, struct LoadOptions*);
+void sendLookup(struct SimulatedClient*, char*, struct LoadOptions*);
+void sendListing(struct SimulatedClient*, struct LoadOptions*);
+void handleReply(struct SimulatedClient*, char*, struct LoadOptions*, unsigned long);
+void scanClients(struct SimulatedClient*, struct LoadOptions*, unsigned long);
+void printResults(unsigned long);
+
+#endif
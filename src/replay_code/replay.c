@@ -0,0 +1,413 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../common/capture.h"
+#include "../common/network_node.h"
+#include "../common/packet.h"
+#include "../common/stats.h"
+#include "replay.h"
+
+int epollDescriptor;
+struct ReplayResults results;
+
+// Sources in the order they first appear in the capture, found by their captured
+// address through sourceIndex. Each slot holds the index of a source plus one, 0 for an
+// empty slot.
+struct ReplaySource* sources;
+int sourceCount;
+int sourceCapacity;
+static unsigned int sourceIndex[REPLAY_SOURCE_SLOTS];
+
+// Packet types the server answers with a packet of the same type. Reliably sent
+// packets of any type are also answered by an ack.
+static const bool answeredPacketTypes[NUM_PACKET_TYPES] = {
+    [PACKET_RESOURCE] = true, [PACKET_PEERS] = true, [PACKET_LOOKUP] = true,
+    [PACKET_SEARCH] = true,   [PACKET_FIND] = true,
+};
+
+// Main function
+int main(int argc, char* argv[]) {
+  struct ReplayOptions options;
+  parseReplayOptions(argc, argv, &options);
+
+  struct Capture capture;
+  if (!openCaptureReader(&capture, options.capturePath)) {
+    exit(1);
+  }
+
+  // One socket per captured source, make sure the process is allowed that many
+  struct rlimit fileLimit;
+  getrlimit(RLIMIT_NOFILE, &fileLimit);
+  fileLimit.rlim_cur = fileLimit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &fileLimit);
+
+  epollDescriptor = epoll_create1(0);
+  if (epollDescriptor == -1) {
+    perror("Error creating epoll instance");
+    exit(1);
+  }
+  memset(&results, 0, sizeof(results));
+
+  if (options.speed == 0) {
+    printf("Replaying %s as fast as possible\n", options.capturePath);
+  } else {
+    printf("Replaying %s at %gx\n", options.capturePath, options.speed);
+  }
+
+  char* datagram          = calloc(1, MAX_PACKET);
+  unsigned long startTime = getMicroseconds();
+  struct sockaddr_in capturedAddress;
+  unsigned long arrivalTime;
+  while (readCapturedDatagram(&capture, &capturedAddress, datagram, &arrivalTime) != -1) {
+    // Keep to the captured timing, scaled, answering replies while waiting
+    unsigned long currentTime = getMicroseconds();
+    if (options.speed != 0) {
+      unsigned long sendTime =
+          startTime + (unsigned long)((double)arrivalTime / options.speed);
+      while (currentTime < sendTime) {
+        int timeout = 0;
+        if (sendTime - currentTime > REPLAY_SPIN_THRESHOLD) {
+          timeout = (int)((sendTime - currentTime - REPLAY_SPIN_THRESHOLD) / 1000);
+        }
+        receiveReplies(timeout, &options);
+        currentTime = getMicroseconds();
+      }
+      statsRecordValue(&results.sendLateness, currentTime - sendTime);
+    }
+
+    struct ReplaySource* source = findReplaySource(capturedAddress, epollDescriptor);
+    if (source == NULL) {
+      results.sourcesSkipped++;
+      continue;
+    }
+    sendCapturedDatagram(source, datagram, &options);
+    receiveReplies(0, &options);
+  }
+  closeCapture(&capture);
+
+  unsigned long endTime =
+      getMicroseconds() + (unsigned long)options.replyWait * 1000000UL;
+  while (getMicroseconds() < endTime) {
+    receiveReplies(10, &options);
+  }
+
+  int i;
+  for (i = 0; i < sourceCount; i++) {
+    int slot;
+    for (slot = 0; slot < REPLAY_PENDING_REPLIES; slot++) {
+      if (sources[i].pending[slot].sentAt != 0) {
+        results.requestsUnanswered++;
+      }
+    }
+    close(sources[i].socketDescriptor);
+  }
+  printReplayResults(results.lastSentAt - results.firstSentAt);
+
+  free(sources);
+  free(datagram);
+  close(epollDescriptor);
+  return 0;
+}
+
+/*
+ * Purpose: Print how to use the replay tool and exit
+ * Input: Name of the program
+ * Output: None
+ */
+static void printUsage(char* programName) {
+  printf("Usage: %s -f capture [options]\n", programName);
+  printf("  -f capture       Capture file written by the server's -c option\n");
+  printf("  -x speed         Multiple of the captured rate, 0 is as fast as possible "
+         "(1)\n");
+  printf("  -w seconds       How long to wait for replies after the last datagram (%d)\n",
+         DEFAULT_REPLY_WAIT);
+  printf("  -s address       IPv4 address of the server (127.0.0.1)\n");
+  printf("  -p port          Port of the server (%d)\n", PORT);
+  printf("  -d               Debug mode\n");
+  exit(1);
+}
+
+/*
+ * Purpose: Read the command line options of the replay tool
+ * Input:
+ * - Number of command line arguments
+ * - The command line arguments
+ * - Options to fill in
+ * Output: None
+ */
+void parseReplayOptions(int argc, char** argv, struct ReplayOptions* options) {
+  memset(options, 0, sizeof(*options));
+  options->speed                         = 1;
+  options->replyWait                     = DEFAULT_REPLY_WAIT;
+  options->serverAddress.sin_family      = AF_INET;
+  options->serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  options->serverAddress.sin_port        = htons(PORT);
+
+  int option;
+  while ((option = getopt(argc, argv, "f:x:w:s:p:d")) != -1) {
+    switch (option) {
+    case 'f':
+      options->capturePath = optarg;
+      break;
+    case 'x':
+      options->speed = strtod(optarg, NULL);
+      break;
+    case 'w':
+      options->replyWait = atoi(optarg);
+      break;
+    case 's':
+      if (inet_pton(AF_INET, optarg, &options->serverAddress.sin_addr) != 1) {
+        printUsage(argv[0]);
+      }
+      break;
+    case 'p':
+      options->serverAddress.sin_port = htons((unsigned short)atoi(optarg));
+      break;
+    case 'd':
+      options->debugFlag = true;
+      break;
+    default:
+      printUsage(argv[0]);
+    }
+  }
+  if (options->capturePath == NULL || options->speed < 0 || options->replyWait < 0) {
+    printUsage(argv[0]);
+  }
+}
+
+/*
+ * Purpose: Find the source a captured address is replayed from. A source seen for the
+ * first time gets its own UDP socket, watched for replies.
+ * Input:
+ * - Address the datagram was captured from
+ * - epoll instance to add a new socket to
+ * Output: The source, NULL if there are too many sources or its socket couldn't be set
+ * up. Only good until the next source is added.
+ */
+struct ReplaySource* findReplaySource(struct sockaddr_in capturedAddress,
+                                      int epollInstance) {
+  unsigned long key =
+      ((unsigned long)capturedAddress.sin_addr.s_addr << 16) | capturedAddress.sin_port;
+  unsigned int slot =
+      (unsigned int)((key * 0x9e3779b97f4a7c15ul) >> 32) & (REPLAY_SOURCE_SLOTS - 1);
+  while (sourceIndex[slot] != 0) {
+    struct ReplaySource* source = &sources[sourceIndex[slot] - 1];
+    if (source->capturedAddress.sin_addr.s_addr == capturedAddress.sin_addr.s_addr &&
+        source->capturedAddress.sin_port == capturedAddress.sin_port) {
+      return source;
+    }
+    slot = (slot + 1) & (REPLAY_SOURCE_SLOTS - 1);
+  }
+  if (sourceCount == REPLAY_MAX_SOURCES) {
+    return NULL;
+  }
+
+  int socketDescriptor = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (socketDescriptor == -1) {
+    perror("Error setting up replay socket");
+    return NULL;
+  }
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events   = EPOLLIN;
+  event.data.u32 = (unsigned int)sourceCount;
+  if (epoll_ctl(epollInstance, EPOLL_CTL_ADD, socketDescriptor, &event) == -1) {
+    perror("Error watching replay socket");
+    close(socketDescriptor);
+    return NULL;
+  }
+
+  if (sourceCount == sourceCapacity) {
+    sourceCapacity = sourceCapacity == 0 ? 64 : sourceCapacity * 2;
+    sources = realloc(sources, (unsigned long)sourceCapacity * sizeof(*sources));
+  }
+  struct ReplaySource* source = &sources[sourceCount];
+  memset(source, 0, sizeof(*source));
+  source->capturedAddress  = capturedAddress;
+  source->socketDescriptor = socketDescriptor;
+  sourceIndex[slot]        = (unsigned int)++sourceCount;
+  return source;
+}
+
+/*
+ * Purpose: Send a captured datagram to the server from its source's socket. Requests
+ * the server answers are remembered so the reply can be timed.
+ * Input:
+ * - The source
+ * - The datagram
+ * - Replay options
+ * Output: None
+ */
+void sendCapturedDatagram(struct ReplaySource* source,
+                          char* datagram,
+                          struct ReplayOptions* options) {
+  unsigned long sentAt = getMicroseconds();
+  if (sendto(source->socketDescriptor, datagram, strlen(datagram), 0,
+             (struct sockaddr*)&options->serverAddress,
+             sizeof(options->serverAddress)) == -1) {
+    if (options->debugFlag) {
+      perror("Replay send error");
+    }
+    results.sendErrors++;
+    return;
+  }
+  if (results.datagramsSent == 0) {
+    results.firstSentAt = sentAt;
+  }
+  results.lastSentAt = sentAt;
+  results.datagramsSent++;
+
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  readPacket(datagram, &packetFields, false);
+  int packetType = getPacketType(packetFields.type, false);
+  if (packetType == -1 ||
+      (packetFields.sequence == 0 && !answeredPacketTypes[packetType])) {
+    return;
+  }
+
+  // A full table gives up on its oldest request
+  struct PendingReply* pending = &source->pending[0];
+  int slot;
+  for (slot = 0; slot < REPLAY_PENDING_REPLIES; slot++) {
+    if (source->pending[slot].sentAt < pending->sentAt) {
+      pending = &source->pending[slot];
+    }
+  }
+  if (pending->sentAt != 0) {
+    results.requestsUnanswered++;
+  }
+  pending->packetType = packetType;
+  pending->sequence   = packetFields.sequence;
+  pending->sentAt     = sentAt;
+}
+
+/*
+ * Purpose: Handle the replies that have reached the sources' sockets
+ * Input:
+ * - Milliseconds to wait for a reply if there are none yet, 0 to not wait
+ * - Replay options
+ * Output: None
+ */
+void receiveReplies(int timeout, struct ReplayOptions* options) {
+  struct epoll_event events[256];
+  int eventCount = epoll_wait(epollDescriptor, events, 256, timeout);
+  if (eventCount == -1 && errno != EINTR) {
+    perror("epoll_wait error");
+    exit(1);
+  }
+
+  char packet[MAX_PACKET];
+  int i;
+  for (i = 0; i < eventCount; i++) {
+    struct ReplaySource* source = &sources[events[i].data.u32];
+    long int bytesReceived;
+    while ((bytesReceived = recv(source->socketDescriptor, packet, MAX_PACKET - 1, 0)) >
+           0) {
+      packet[bytesReceived] = '\0';
+      if (options->debugFlag) {
+        printReceivedMessage(options->serverAddress, bytesReceived, packet, true);
+      }
+      handleReplyPacket(source, packet, getMicroseconds());
+    }
+  }
+}
+
+/*
+ * Purpose: Time the request a reply from the server answers. An ack answers the
+ * reliable request with its sequence, anything else the oldest request of its type.
+ * Packets the server sends on its own, such as heartbeats, answer nothing.
+ * Input:
+ * - Source the reply was sent to
+ * - The reply
+ * - Time it was received
+ * Output: None
+ */
+void handleReplyPacket(struct ReplaySource* source,
+                       char* packet,
+                       unsigned long receiveTime) {
+  results.repliesReceived++;
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  readPacket(packet, &packetFields, false);
+  int packetType = getPacketType(packetFields.type, false);
+
+  unsigned int ackedSequence = 0;
+  if (packetType == PACKET_ACK) {
+    ackedSequence = (unsigned int)strtoul(packetFields.data, NULL, 10);
+  }
+  struct PendingReply* answered = NULL;
+  int slot;
+  for (slot = 0; slot < REPLAY_PENDING_REPLIES; slot++) {
+    struct PendingReply* pending = &source->pending[slot];
+    if (pending->sentAt == 0) {
+      continue;
+    }
+    bool answers = packetType == PACKET_ACK
+                       ? ackedSequence != 0 && pending->sequence == ackedSequence
+                       : pending->packetType == packetType;
+    if (answers && (answered == NULL || pending->sentAt < answered->sentAt)) {
+      answered = pending;
+    }
+  }
+  if (answered == NULL) {
+    return;
+  }
+  statsRecordValue(&results.replyLatency[answered->packetType],
+                   receiveTime - answered->sentAt);
+  answered->sentAt = 0;
+  results.requestsAnswered++;
+}
+
+/*
+ * Purpose: Print a latency histogram as percentiles
+ * Input:
+ * - Name of what was measured
+ * - Histogram of latencies in microseconds
+ * Output: None
+ */
+static void printLatency(const char* name, struct StatsHistogram* histogram) {
+  printf("%-13s count %-8lu p50 %-8lu p99 %-8lu p999 %-8lu (us)\n", name,
+         atomic_load(&histogram->count), statsPercentile(histogram, 500),
+         statsPercentile(histogram, 990), statsPercentile(histogram, 999));
+}
+
+/*
+ * Purpose: Print out everything measured during the replay
+ * Input: Microseconds from the first datagram sent to the last
+ * Output: None
+ */
+void printReplayResults(unsigned long sendTime) {
+  unsigned long rateTime = sendTime == 0 ? 1 : sendTime;
+
+  printf("\n*** REPLAY RESULTS ***\n");
+  printf("Send time:             %lu ms\n", sendTime / 1000);
+  printf("Sources:               %d\n", sourceCount);
+  printf("Datagrams sent:        %lu\n", results.datagramsSent);
+  printf("Send throughput:       %lu per second\n",
+         results.datagramsSent * 1000000UL / rateTime);
+  printf("Send errors:           %lu\n", results.sendErrors);
+  printf("Datagrams skipped:     %lu\n", results.sourcesSkipped);
+  printf("Replies received:      %lu\n", results.repliesReceived);
+  printf("Requests answered:     %lu\n", results.requestsAnswered);
+  printf("Answer throughput:     %lu per second\n",
+         results.requestsAnswered * 1000000UL / rateTime);
+  printf("Requests unanswered:   %lu\n", results.requestsUnanswered);
+  if (atomic_load(&results.sendLateness.count) > 0) {
+    printLatency("Send lateness", &results.sendLateness);
+  }
+  int packetType;
+  for (packetType = 0; packetType < NUM_PACKET_TYPES; packetType++) {
+    if (atomic_load(&results.replyLatency[packetType].count) > 0) {
+      printLatency(getPacketTypeName(packetType), &results.replyLatency[packetType]);
+    }
+  }
+}
@@ -0,0 +1,74 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+// Seconds to keep listening for replies after the last datagram is sent
+#define DEFAULT_REPLY_WAIT 2
+
+// Most captured source addresses replayed, each gets its own socket. Datagrams from
+// sources past this are skipped.
+#define REPLAY_MAX_SOURCES 65536
+
+// Slots in the index from captured address to source. A power of two, twice the
+// sources so probes stay short.
+#define REPLAY_SOURCE_SLOTS (REPLAY_MAX_SOURCES * 2)
+
+// Requests from one source that can be waiting for a reply at once. The oldest is
+// given up on to make room for a new one.
+#define REPLAY_PENDING_REPLIES 32
+
+// Microseconds ahead of a datagram's time that waiting is done by spinning instead of
+// sleeping in epoll_wait(), which only wakes up to the millisecond
+#define REPLAY_SPIN_THRESHOLD 2000
+
+#include <stdbool.h>
+
+#include "../common/capture.h"
+#include "../common/network_node.h"
+#include "../common/packet.h"
+#include "../common/stats.h"
+
+// A request that expects a reply from the server
+struct PendingReply {
+  int packetType;
+  unsigned int sequence; // Reliable requests are also answered by an ack for this
+  unsigned long sentAt;  // Microseconds, 0 for a free slot
+};
+
+// A source address from the capture, replayed from its own socket so the server sees
+// it as a separate client
+struct ReplaySource {
+  struct sockaddr_in capturedAddress;
+  int socketDescriptor;
+  struct PendingReply pending[REPLAY_PENDING_REPLIES];
+};
+
+struct ReplayOptions {
+  char* capturePath;
+  double speed; // Multiple of the captured rate, 0 for as fast as possible
+  int replyWait;
+  struct sockaddr_in serverAddress;
+  bool debugFlag;
+};
+
+// Everything measured during a replay
+struct ReplayResults {
+  unsigned long datagramsSent;
+  unsigned long sendErrors;
+  unsigned long sourcesSkipped; // Datagrams from sources past REPLAY_MAX_SOURCES
+  unsigned long repliesReceived;
+  unsigned long requestsAnswered;
+  unsigned long requestsUnanswered;
+  unsigned long firstSentAt;
+  unsigned long lastSentAt;
+  struct StatsHistogram sendLateness; // Microseconds behind the scaled capture time
+  struct StatsHistogram replyLatency[NUM_PACKET_TYPES];
+};
+
+void parseReplayOptions(int, char**, struct ReplayOptions*);
+struct ReplaySource* findReplaySource(struct sockaddr_in, int);
+void sendCapturedDatagram(struct ReplaySource*, char*, struct ReplayOptions*);
+void receiveReplies(int, struct ReplayOptions*);
+void handleReplyPacket(struct ReplaySource*, char*, unsigned long);
+void printReplayResults(unsigned long);
+
+#endif
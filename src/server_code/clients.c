@@ -0,0 +1,319 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "clients.h"
+
+// Cold data of each client, only read once a client has been found
+struct ConnectedClient connectedClients[MAX_CONNECTED_CLIENTS];
+
+// UDP address of each client, read by every heartbeat sent
+struct sockaddr_in clientUdpAddresses[MAX_CONNECTED_CLIENTS];
+
+// Liveness of every client, one bit per client. A heartbeat round probes the connected
+// clients that are alive and clears their alive bit, replies set it again. Clients still
+// probed but not alive at the end of the round have expired.
+static unsigned long connectedBits[CLIENT_WORDS];
+static unsigned long aliveBits[CLIENT_WORDS];
+static unsigned long probedBits[CLIENT_WORDS];
+static unsigned long expiredBits[CLIENT_WORDS];
+
+// No word of connectedBits before this one has a free spot
+static int firstFreeWord;
+
+// Open addressing indexes from UDP address and username to client, linear probing.
+// Each slot holds the index of a client plus one, 0 for an empty slot.
+static unsigned int addressIndex[CLIENT_INDEX_SIZE];
+static unsigned int usernameIndex[CLIENT_INDEX_SIZE];
+
+/*
+ * Purpose: Hash a UDP address
+ * Input: The address
+ * Output: The hash
+ */
+static unsigned int hashAddress(struct sockaddr_in address) {
+  unsigned long key = ((unsigned long)address.sin_addr.s_addr << 16) | address.sin_port;
+  return (unsigned int)((key * 0x9e3779b97f4a7c15ul) >> 32);
+}
+
+/*
+ * Purpose: Hash a username, FNV-1a
+ * Input: The username
+ * Output: The hash
+ */
+static unsigned int hashUsername(const char* username) {
+  unsigned int hash = 2166136261u;
+  while (*username != '\0') {
+    hash ^= (unsigned char)*username;
+    hash *= 16777619u;
+    username++;
+  }
+  return hash;
+}
+
+/*
+ * Purpose: Hash the key a client is indexed by
+ * Input:
+ * - Index of the client
+ * - Whether the key is the username or the UDP address
+ * Output: The hash
+ */
+static unsigned int hashClient(int clientIndex, bool byUsername) {
+  if (byUsername) {
+    return hashUsername(connectedClients[clientIndex].username);
+  }
+  return hashAddress(clientUdpAddresses[clientIndex]);
+}
+
+/*
+ * Purpose: Add a client to an index
+ * Input:
+ * - The index
+ * - Hash of the client's key
+ * - Index of the client
+ * Output: None
+ */
+static void insertIndex(unsigned int* index, unsigned int hash, int clientIndex) {
+  unsigned int slot = hash & (CLIENT_INDEX_SIZE - 1);
+  while (index[slot] != 0) {
+    slot = (slot + 1) & (CLIENT_INDEX_SIZE - 1);
+  }
+  index[slot] = (unsigned int)clientIndex + 1;
+}
+
+/*
+ * Purpose: Take a client out of an index. Clients after it in the probe sequence are
+ * shifted back so lookups don't stop early at the gap.
+ * Input:
+ * - The index
+ * - Index of the client, its key must not have changed since it was inserted
+ * - Whether the index is by username or by UDP address
+ * Output: None
+ */
+static void removeIndex(unsigned int* index, int clientIndex, bool byUsername) {
+  unsigned int slot = hashClient(clientIndex, byUsername) & (CLIENT_INDEX_SIZE - 1);
+  while (index[slot] != (unsigned int)clientIndex + 1) {
+    slot = (slot + 1) & (CLIENT_INDEX_SIZE - 1);
+  }
+
+  unsigned int empty = slot;
+  unsigned int next  = (slot + 1) & (CLIENT_INDEX_SIZE - 1);
+  while (index[next] != 0) {
+    unsigned int home =
+        hashClient((int)index[next] - 1, byUsername) & (CLIENT_INDEX_SIZE - 1);
+    // Move the client back unless its home slot is between the gap and where it is
+    if (((next - home) & (CLIENT_INDEX_SIZE - 1)) >=
+        ((next - empty) & (CLIENT_INDEX_SIZE - 1))) {
+      index[empty] = index[next];
+      empty        = next;
+    }
+    next = (next + 1) & (CLIENT_INDEX_SIZE - 1);
+  }
+  index[empty] = 0;
+}
+
+/*
+ * Purpose: Find the first client at or after an index with its bit set in a bitset.
+ * Whole words of clear bits are skipped at once.
+ * Input:
+ * - The bitset
+ * - Index of the first client to look at
+ * Output: Index of the client, -1 if there are none left
+ */
+static int nextClient(const unsigned long* bits, int clientIndex) {
+  if (clientIndex < 0 || clientIndex >= MAX_CONNECTED_CLIENTS) {
+    return -1;
+  }
+  int word              = clientIndex / CLIENT_WORD_BITS;
+  unsigned long current = bits[word] & (~0ul << (clientIndex % CLIENT_WORD_BITS));
+  while (current == 0) {
+    word++;
+    if (word == CLIENT_WORDS) {
+      return -1;
+    }
+    current = bits[word];
+  }
+  return word * CLIENT_WORD_BITS + __builtin_ctzl(current);
+}
+
+/*
+ * Purpose: Give a new client a spot in the client table, the first free one
+ * Input:
+ * - UDP address of the client
+ * - Username of the client
+ * Output:
+ * - -1: All spots in the client table are full
+ * - Anything else: Index of the client. It starts out alive.
+ */
+int addConnectedClient(struct sockaddr_in udpAddress, char* username) {
+  while (firstFreeWord < CLIENT_WORDS && connectedBits[firstFreeWord] == ~0ul) {
+    firstFreeWord++;
+  }
+  if (firstFreeWord == CLIENT_WORDS) {
+    return -1;
+  }
+  int word        = firstFreeWord;
+  int clientIndex = word * CLIENT_WORD_BITS + __builtin_ctzl(~connectedBits[word]);
+
+  struct ConnectedClient* client = &connectedClients[clientIndex];
+  memset(client, 0, sizeof(*client));
+  strncpy(client->username, username, MAX_USERNAME - 1);
+  memset(&clientUdpAddresses[clientIndex], 0, sizeof(struct sockaddr_in));
+  clientUdpAddresses[clientIndex].sin_addr.s_addr = udpAddress.sin_addr.s_addr;
+  clientUdpAddresses[clientIndex].sin_port        = udpAddress.sin_port;
+
+  insertIndex(addressIndex, hashClient(clientIndex, false), clientIndex);
+  insertIndex(usernameIndex, hashClient(clientIndex, true), clientIndex);
+
+  unsigned long bit = 1ul << (clientIndex % CLIENT_WORD_BITS);
+  connectedBits[word] |= bit;
+  aliveBits[word] |= bit;
+  return clientIndex;
+}
+
+/*
+ * Purpose: Remove a client from the client table
+ * Input: Index of the client
+ * Output: None
+ */
+void removeConnectedClient(int clientIndex) {
+  int word          = clientIndex / CLIENT_WORD_BITS;
+  unsigned long bit = 1ul << (clientIndex % CLIENT_WORD_BITS);
+  if ((connectedBits[word] & bit) == 0) {
+    return;
+  }
+  removeIndex(addressIndex, clientIndex, false);
+  removeIndex(usernameIndex, clientIndex, true);
+
+  connectedBits[word] &= ~bit;
+  if (word < firstFreeWord) {
+    firstFreeWord = word;
+  }
+  aliveBits[word] &= ~bit;
+  probedBits[word] &= ~bit;
+  expiredBits[word] &= ~bit;
+  free(connectedClients[clientIndex].chunkBits);
+  memset(&connectedClients[clientIndex], 0, sizeof(struct ConnectedClient));
+  memset(&clientUdpAddresses[clientIndex], 0, sizeof(struct sockaddr_in));
+}
+
+/*
+ * Purpose: Find the connected client that is using a UDP address
+ * Input: UDP address of the client
+ * Output:
+ * - -1: No connected client is using the address
+ * - Anything else: Index of the client
+ */
+int findConnectedClient(struct sockaddr_in udpAddress) {
+  unsigned int slot = hashAddress(udpAddress) & (CLIENT_INDEX_SIZE - 1);
+  while (addressIndex[slot] != 0) {
+    int clientIndex                  = (int)addressIndex[slot] - 1;
+    struct sockaddr_in* foundAddress = &clientUdpAddresses[clientIndex];
+    if (foundAddress->sin_addr.s_addr == udpAddress.sin_addr.s_addr &&
+        foundAddress->sin_port == udpAddress.sin_port) {
+      return clientIndex;
+    }
+    slot = (slot + 1) & (CLIENT_INDEX_SIZE - 1);
+  }
+  return -1;
+}
+
+/*
+ * Purpose: Find the connected client with a username
+ * Input: Username of the client
+ * Output:
+ * - -1: No connected client has the username
+ * - Anything else: Index of the client
+ */
+int findConnectedClientByUsername(char* username) {
+  unsigned int slot = hashUsername(username) & (CLIENT_INDEX_SIZE - 1);
+  while (usernameIndex[slot] != 0) {
+    int clientIndex = (int)usernameIndex[slot] - 1;
+    if (strcmp(connectedClients[clientIndex].username, username) == 0) {
+      return clientIndex;
+    }
+    slot = (slot + 1) & (CLIENT_INDEX_SIZE - 1);
+  }
+  return -1;
+}
+
+/*
+ * Purpose: Record that a client answered a heartbeat
+ * Input: Index of the client
+ * Output: None
+ */
+void markClientAlive(int clientIndex) {
+  // Workers mark clients alive side by side under the directory's read lock
+  __atomic_fetch_or(&aliveBits[clientIndex / CLIENT_WORD_BITS],
+                    1ul << (clientIndex % CLIENT_WORD_BITS), __ATOMIC_RELAXED);
+}
+
+/*
+ * Purpose: Start a heartbeat round. Every connected client that answered the last
+ * round is probed and has to answer again before findExpiredClients() is called.
+ * Input: None
+ * Output: Number of clients probed, see nextProbedClient()
+ */
+unsigned long startHeartbeatRound() {
+  unsigned long probed = 0;
+  int word;
+  for (word = 0; word < CLIENT_WORDS; word++) {
+    probedBits[word] = connectedBits[word] & aliveBits[word];
+    aliveBits[word] &= ~probedBits[word];
+    probed += (unsigned long)__builtin_popcountl(probedBits[word]);
+  }
+  return probed;
+}
+
+/*
+ * Purpose: End a heartbeat round. Probed clients that didn't answer have expired.
+ * Input: None
+ * Output: Number of expired clients, see nextExpiredClient()
+ */
+unsigned long findExpiredClients() {
+  unsigned long expired = 0;
+  int word;
+  for (word = 0; word < CLIENT_WORDS; word++) {
+    expiredBits[word] = probedBits[word] & ~aliveBits[word];
+    expired += (unsigned long)__builtin_popcountl(expiredBits[word]);
+  }
+  return expired;
+}
+
+/*
+ * Purpose: Iterate over the connected clients
+ * Input: Index to start looking from
+ * Output: Index of the next connected client, -1 if there are none left
+ */
+int nextConnectedClient(int clientIndex) {
+  return nextClient(connectedBits, clientIndex);
+}
+
+/*
+ * Purpose: Iterate over the clients probed by the current heartbeat round
+ * Input: Index to start looking from
+ * Output: Index of the next probed client, -1 if there are none left
+ */
+int nextProbedClient(int clientIndex) {
+  return nextClient(probedBits, clientIndex);
+}
+
+/*
+ * Purpose: Iterate over the clients found by findExpiredClients()
+ * Input: Index to start looking from
+ * Output: Index of the next expired client, -1 if there are none left
+ */
+int nextExpiredClient(int clientIndex) {
+  return nextClient(expiredBits, clientIndex);
+}
+
+/*
+ * Purpose: Count the memory held by the client table. It is allocated up front, so this
+ * doesn't change while the server runs.
+ * Input: None
+ * Output: Bytes used by the client table, its liveness bitsets and its indexes
+ */
+unsigned long getClientTableBytes() {
+  return sizeof(connectedClients) + sizeof(clientUdpAddresses) + sizeof(connectedBits) +
+         sizeof(aliveBits) + sizeof(probedBits) + sizeof(expiredBits) +
+         sizeof(addressIndex) + sizeof(usernameIndex);
+}
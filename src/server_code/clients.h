@@ -0,0 +1,54 @@
+#ifndef CLIENTS_H
+#define CLIENTS_H
+
+// Maximum number of clients that can be connected to the server, a multiple of
+// CLIENT_WORD_BITS
+#define MAX_CONNECTED_CLIENTS (1 << 20)
+
+// Clients in one word of a client bitset
+#define CLIENT_WORD_BITS 64
+#define CLIENT_WORDS     (MAX_CONNECTED_CLIENTS / CLIENT_WORD_BITS)
+
+// Slots in each client hash index. A power of two, twice the clients so probes stay
+// short.
+#define CLIENT_INDEX_SIZE (MAX_CONNECTED_CLIENTS * 2)
+
+// Most register packets a connection can promise. Each one holds at least one file, so
+// this is ten times the default user quota.
+#define MAX_REGISTRATION_CHUNKS (1 << 20)
+
+// Chunks in one word of a client's bitmap of register packets received
+#define CHUNK_WORD_BITS 64
+
+#include <netinet/in.h>
+#include <stdbool.h>
+
+#include "../common/network_node.h"
+
+// Data about a client connected to the server that is only needed once the client has
+// been found. Its UDP address and liveness are kept apart so the heartbeat sweep only
+// touches those, see clients.c.
+struct ConnectedClient {
+  char username[MAX_USERNAME];
+  struct sockaddr_in socketTcpAddress;
+  unsigned int registrationChunks; // Register packets promised by the connection packet
+  unsigned int chunksReceived;
+  unsigned long* chunkBits; // Register packets received, freed once they all have been
+  bool summarized; // Registered a filter of its filenames, see addResourceSummary()
+  unsigned long sessionToken; // Resumes the registration once expired, see session.h
+  unsigned long resourceHash; // Sum of hashResourceName() of the files it has
+};
+
+int addConnectedClient(struct sockaddr_in, char*);
+void removeConnectedClient(int);
+int findConnectedClient(struct sockaddr_in);
+int findConnectedClientByUsername(char*);
+void markClientAlive(int);
+unsigned long startHeartbeatRound();
+unsigned long findExpiredClients();
+int nextConnectedClient(int);
+int nextProbedClient(int);
+int nextExpiredClient(int);
+unsigned long getClientTableBytes();
+
+#endif
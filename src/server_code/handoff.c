@@ -0,0 +1,491 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../common/stats.h"
+#include "clients.h"
+#include "handoff.h"
+
+// clients.c
+extern struct ConnectedClient connectedClients[MAX_CONNECTED_CLIENTS];
+extern struct sockaddr_in clientUdpAddresses[MAX_CONNECTED_CLIENTS];
+
+/*
+ * Purpose: Setup the UNIX domain socket a new server connects to in order to take
+ * over. Only the user running the server can connect, since whoever does gets its UDP
+ * socket. Set non blocking so it can be checked from the main loop.
+ * Input: Path to create the socket at
+ * Output:
+ * - -1: Error, the server can't be hot restarted
+ * - The socket descriptor
+ */
+int setupHandoffSocket(char* path) {
+  int handoffSocketDescriptor = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (handoffSocketDescriptor == -1) {
+    perror("Error when setting up handoff socket");
+    return -1;
+  }
+
+  struct sockaddr_un handoffAddress;
+  memset(&handoffAddress, 0, sizeof(handoffAddress));
+  handoffAddress.sun_family = AF_UNIX;
+  strncpy(handoffAddress.sun_path, path, sizeof(handoffAddress.sun_path) - 1);
+
+  // Left behind by the server this one took over from, or one that crashed
+  unlink(path);
+
+  if (bind(handoffSocketDescriptor, (struct sockaddr*)&handoffAddress,
+           sizeof(handoffAddress)) == -1 ||
+      chmod(path, S_IRUSR | S_IWUSR) == -1 || listen(handoffSocketDescriptor, 1) == -1) {
+    perror("Error when binding handoff socket");
+    close(handoffSocketDescriptor);
+    return -1;
+  }
+
+  if (fcntl(handoffSocketDescriptor, F_SETFL, O_NONBLOCK) == -1) {
+    perror("Error when setting handoff socket non blocking");
+  }
+  return handoffSocketDescriptor;
+}
+
+/*
+ * Purpose: Stop either server from waiting forever on the other one
+ * Input: Connection between the two servers
+ * Output: None
+ */
+static void setHandoffTimeout(int connection) {
+  struct timeval timeout;
+  memset(&timeout, 0, sizeof(timeout));
+  timeout.tv_sec = HANDOFF_TIMEOUT;
+  setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+/*
+ * Purpose: Write a resource to the state stream, for visitResources()
+ * Input:
+ * - The stream
+ * - Username of the owner
+ * - The filename
+ * Output: Whether the resource was written
+ */
+static bool writeHandoffResource(void* stream, char* username, char* filename) {
+  struct HandoffResource record;
+  memset(&record, 0, sizeof(record));
+  strncpy(record.username, username, MAX_USERNAME - 1);
+  strncpy(record.filename, filename, MAX_FILENAME - 1);
+  return fwrite(&record, sizeof(record), 1, stream) == 1;
+}
+
+/*
+ * Purpose: Write the parked sessions to the state stream, oldest first so they are
+ * parked again in the same order
+ * Input:
+ * - The stream
+ * - The parked sessions
+ * Output: Whether every session was written
+ */
+static bool writeParkedSessions(FILE* stream, struct SessionTable* sessions) {
+  struct ParkedSession* session;
+  for (session = sessions->oldest; session != NULL; session = session->newer) {
+    struct HandoffParkedSession record;
+    memset(&record, 0, sizeof(record));
+    record.token        = session->token;
+    record.resourceHash = session->resourceHash;
+    memcpy(record.username, session->username, MAX_USERNAME);
+    record.tcpAddress      = session->tcpAddress;
+    record.expiresAt       = session->expiresAt;
+    record.filenameCount   = session->filenameCount;
+    record.filenamesLength = session->filenamesLength;
+    record.cellCount       = session->summary.cellCount;
+    unsigned long summaryBytes = getBloomBytes(&session->summary);
+    if (fwrite(&record, sizeof(record), 1, stream) != 1 ||
+        fwrite(session->filenames, 1, session->filenamesLength, stream) !=
+            session->filenamesLength ||
+        fwrite(session->summary.counters, 1, summaryBytes, stream) != summaryBytes) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Purpose: Write the client table, the resource directory and the parked sessions to
+ * the state stream, in the order of the counts in the header
+ * Input:
+ * - The stream
+ * - The resource directory
+ * - The parked sessions
+ * Output: Whether everything was written
+ */
+static bool writeServerState(FILE* stream,
+                             struct ResourceDirectory* directory,
+                             struct SessionTable* sessions) {
+  int clientIndex;
+  for (clientIndex = nextConnectedClient(0); clientIndex != -1;
+       clientIndex = nextConnectedClient(clientIndex + 1)) {
+    struct ConnectedClient* client = &connectedClients[clientIndex];
+    bool summarized =
+        client->summarized && findResourceSummary(directory, client->username) != NULL;
+    struct HandoffClient record;
+    memset(&record, 0, sizeof(record));
+    memcpy(record.username, client->username, MAX_USERNAME);
+    record.udpAddress         = clientUdpAddresses[clientIndex];
+    record.tcpAddress         = client->socketTcpAddress;
+    record.registrationChunks = client->registrationChunks;
+    record.chunksReceived     = client->chunksReceived;
+    record.registering        = client->chunkBits != NULL;
+    record.summarized         = summarized;
+    record.sessionToken       = client->sessionToken;
+    record.resourceHash       = client->resourceHash;
+    if (fwrite(&record, sizeof(record), 1, stream) != 1) {
+      return false;
+    }
+    unsigned long chunkWords =
+        (client->registrationChunks + CHUNK_WORD_BITS - 1) / CHUNK_WORD_BITS;
+    if (record.registering &&
+        fwrite(client->chunkBits, sizeof(unsigned long), chunkWords, stream) !=
+            chunkWords) {
+      return false;
+    }
+  }
+
+  if (!visitResources(directory, writeHandoffResource, stream)) {
+    return false;
+  }
+
+  unsigned int i;
+  for (i = 0; i < directory->summaryCount; i++) {
+    struct ResourceSummary* summary = &directory->summaries[i];
+    struct HandoffSummary record;
+    memset(&record, 0, sizeof(record));
+    memcpy(record.username, summary->username, MAX_USERNAME);
+    record.cellCount = summary->filter.cellCount;
+    if (fwrite(&record, sizeof(record), 1, stream) != 1 ||
+        fwrite(summary->filter.counters, 1, getBloomBytes(&summary->filter), stream) !=
+            getBloomBytes(&summary->filter)) {
+      return false;
+    }
+  }
+  return writeParkedSessions(stream, sessions) && fflush(stream) == 0;
+}
+
+/*
+ * Purpose: Hand the server over to a new server that connected to the handoff socket.
+ * The UDP socket is passed to it with SCM_RIGHTS along with the header of the state
+ * stream, then every connected client, every resource, every summary and every
+ * parked session are streamed to it. Nothing may receive from the UDP socket or change
+ * the directory meanwhile, datagrams that arrive wait on the socket for the new server.
+ * Input:
+ * - Connection from the new server
+ * - The UDP socket
+ * - The resource directory
+ * - The parked sessions
+ * - Debug flag
+ * Output: Whether the new server loaded the state and took over. If it didn't, this
+ * server can go on as before.
+ */
+bool sendServerState(int connection,
+                     int udpSocketDescriptor,
+                     struct ResourceDirectory* directory,
+                     struct SessionTable* sessions,
+                     bool debugFlag) {
+  setHandoffTimeout(connection);
+
+  // Neither server reads the socket until the new one has loaded the state
+  int receiveBuffer = HANDOFF_RECEIVE_BUFFER;
+  setsockopt(udpSocketDescriptor, SOL_SOCKET, SO_RCVBUF, &receiveBuffer,
+             sizeof(receiveBuffer));
+
+  struct HandoffHeader header;
+  memset(&header, 0, sizeof(header));
+  header.version = HANDOFF_VERSION;
+  int clientIndex;
+  for (clientIndex = nextConnectedClient(0); clientIndex != -1;
+       clientIndex = nextConnectedClient(clientIndex + 1)) {
+    header.clientCount++;
+  }
+  header.resourceCount = directory->resourceCount;
+  header.summaryCount  = directory->summaryCount;
+  header.parkedCount   = sessions->sessionCount;
+
+  struct iovec headerVector;
+  headerVector.iov_base = &header;
+  headerVector.iov_len  = sizeof(header);
+
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct msghdr messageHeader;
+  memset(&messageHeader, 0, sizeof(messageHeader));
+  messageHeader.msg_iov        = &headerVector;
+  messageHeader.msg_iovlen     = 1;
+  messageHeader.msg_control    = control;
+  messageHeader.msg_controllen = sizeof(control);
+
+  struct cmsghdr* controlMessage = CMSG_FIRSTHDR(&messageHeader);
+  controlMessage->cmsg_level     = SOL_SOCKET;
+  controlMessage->cmsg_type      = SCM_RIGHTS;
+  controlMessage->cmsg_len       = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(controlMessage), &udpSocketDescriptor, sizeof(int));
+
+  if (sendmsg(connection, &messageHeader, MSG_NOSIGNAL) != (long)sizeof(header)) {
+    perror("Error sending the UDP socket to the new server");
+    return false;
+  }
+  if (debugFlag) {
+    printf("Sending %u clients, %lu resources, %u summaries and %lu parked sessions\n",
+           header.clientCount, header.resourceCount, header.summaryCount,
+           header.parkedCount);
+  }
+
+  // A new server that goes away mid stream fails the write instead of killing this one
+  void (*previousHandler)(int) = signal(SIGPIPE, SIG_IGN);
+  bool written                 = false;
+  FILE* stream                 = fdopen(dup(connection), "w");
+  if (stream != NULL) {
+    written = writeServerState(stream, directory, sessions);
+    fclose(stream);
+  }
+  signal(SIGPIPE, previousHandler);
+  if (!written) {
+    perror("Error sending the state to the new server");
+    return false;
+  }
+
+  char ready = 0;
+  if (recv(connection, &ready, 1, 0) != 1 || ready != HANDOFF_READY) {
+    printf("New server didn't load the state\n");
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Purpose: Read the parked sessions off the state stream and park them again. Those
+ * past PARKED_SESSION_BUDGET are dropped, their clients connect again in full.
+ * Input:
+ * - The stream
+ * - The parked sessions, empty
+ * - Number of sessions in the stream
+ * Output: Whether every session was read
+ */
+static bool readParkedSessions(FILE* stream,
+                               struct SessionTable* sessions,
+                               unsigned long sessionCount) {
+  unsigned long i;
+  for (i = 0; i < sessionCount; i++) {
+    struct HandoffParkedSession record;
+    if (fread(&record, sizeof(record), 1, stream) != 1 ||
+        record.filenamesLength > PARKED_SESSION_BUDGET ||
+        record.cellCount > BLOOM_MAX_CELLS) {
+      return false;
+    }
+    record.username[MAX_USERNAME - 1] = '\0';
+    struct ParkedSession* session     = createParkedSession(
+        record.token, record.resourceHash, record.username, record.tcpAddress);
+    session->filenames         = malloc(record.filenamesLength);
+    session->filenamesLength   = record.filenamesLength;
+    session->filenamesCapacity = record.filenamesLength;
+    session->filenameCount     = record.filenameCount;
+    if (record.cellCount != 0) {
+      initCountingBloom(&session->summary, record.cellCount);
+    }
+    unsigned long summaryBytes = getBloomBytes(&session->summary);
+    if (fread(session->filenames, 1, record.filenamesLength, stream) !=
+            record.filenamesLength ||
+        fread(session->summary.counters, 1, summaryBytes, stream) != summaryBytes) {
+      freeParkedSession(session);
+      return false;
+    }
+    if (!parkSession(sessions, session, record.expiresAt)) {
+      freeParkedSession(session);
+    }
+  }
+  return true;
+}
+
+/*
+ * Purpose: Take over from the server listening on a handoff socket. Its UDP socket is
+ * received along with its client table, resource directory and parked sessions, which
+ * are loaded into this server's. Clients start out alive. Limits are this server's
+ * own, resources or summaries over them are rejected.
+ * Input:
+ * - Path of the handoff socket
+ * - The resource directory, empty
+ * - The parked sessions, empty
+ * - Debug flag
+ * Output:
+ * - -1: No server is listening on the handoff socket, nothing changed
+ * - The UDP socket, already bound. The old server stops once this returns. Exits if the
+ * handoff fails part way, the old server then goes on as before.
+ */
+int receiveServerState(char* path,
+                       struct ResourceDirectory* directory,
+                       struct SessionTable* sessions,
+                       bool debugFlag) {
+  int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un handoffAddress;
+  memset(&handoffAddress, 0, sizeof(handoffAddress));
+  handoffAddress.sun_family = AF_UNIX;
+  strncpy(handoffAddress.sun_path, path, sizeof(handoffAddress.sun_path) - 1);
+  if (connection == -1 || connect(connection, (struct sockaddr*)&handoffAddress,
+                                  sizeof(handoffAddress)) == -1) {
+    perror("Error connecting to the server to take over");
+    if (connection != -1) {
+      close(connection);
+    }
+    return -1;
+  }
+  printf("Taking over from the running server...\n");
+  setHandoffTimeout(connection);
+
+  struct HandoffHeader header;
+  memset(&header, 0, sizeof(header));
+  struct iovec headerVector;
+  headerVector.iov_base = &header;
+  headerVector.iov_len  = sizeof(header);
+
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct msghdr messageHeader;
+  memset(&messageHeader, 0, sizeof(messageHeader));
+  messageHeader.msg_iov        = &headerVector;
+  messageHeader.msg_iovlen     = 1;
+  messageHeader.msg_control    = control;
+  messageHeader.msg_controllen = sizeof(control);
+
+  long received                  = recvmsg(connection, &messageHeader, MSG_WAITALL);
+  struct cmsghdr* controlMessage = CMSG_FIRSTHDR(&messageHeader);
+  if (received != (long)sizeof(header) || controlMessage == NULL ||
+      controlMessage->cmsg_level != SOL_SOCKET ||
+      controlMessage->cmsg_type != SCM_RIGHTS) {
+    printf("Didn't receive the UDP socket from the running server\n");
+    exit(1);
+  }
+  int udpSocketDescriptor;
+  memcpy(&udpSocketDescriptor, CMSG_DATA(controlMessage), sizeof(int));
+  if (header.version != HANDOFF_VERSION) {
+    printf("Running server sends state version %u, expected %u\n", header.version,
+           HANDOFF_VERSION);
+    exit(1);
+  }
+
+  FILE* stream = fdopen(connection, "r");
+  if (stream == NULL) {
+    perror("Error reading the state from the running server");
+    exit(1);
+  }
+
+  unsigned int i;
+  for (i = 0; i < header.clientCount; i++) {
+    struct HandoffClient record;
+    if (fread(&record, sizeof(record), 1, stream) != 1) {
+      printf("State from the running server ended after %u clients\n", i);
+      exit(1);
+    }
+    record.username[MAX_USERNAME - 1] = '\0';
+    unsigned long* chunkBits          = NULL;
+    if (record.registering) {
+      unsigned long chunkWords =
+          (record.registrationChunks + CHUNK_WORD_BITS - 1) / CHUNK_WORD_BITS;
+      if (record.registrationChunks <= MAX_REGISTRATION_CHUNKS) {
+        chunkBits = calloc(chunkWords, sizeof(unsigned long));
+      }
+      if (chunkBits == NULL ||
+          fread(chunkBits, sizeof(unsigned long), chunkWords, stream) != chunkWords) {
+        printf("State from the running server ended after %u clients\n", i);
+        exit(1);
+      }
+    }
+    int clientIndex = addConnectedClient(record.udpAddress, record.username);
+    if (clientIndex == -1) {
+      free(chunkBits);
+      continue;
+    }
+    struct ConnectedClient* client = &connectedClients[clientIndex];
+    client->socketTcpAddress       = record.tcpAddress;
+    client->registrationChunks     = record.registrationChunks;
+    client->chunksReceived         = record.chunksReceived;
+    client->chunkBits              = chunkBits;
+    client->summarized             = record.summarized;
+    client->sessionToken           = record.sessionToken;
+    client->resourceHash           = record.resourceHash;
+    statsAdd(STATS_CONNECTED_CLIENTS, 1);
+  }
+
+  unsigned long resource;
+  unsigned long rejected = 0;
+  for (resource = 0; resource < header.resourceCount; resource++) {
+    struct HandoffResource record;
+    if (fread(&record, sizeof(record), 1, stream) != 1) {
+      printf("State from the running server ended after %lu resources\n", resource);
+      exit(1);
+    }
+    record.username[MAX_USERNAME - 1] = '\0';
+    record.filename[MAX_FILENAME - 1] = '\0';
+    if (!addResource(directory, record.username, record.filename)) {
+      rejected++;
+    }
+  }
+
+  for (i = 0; i < header.summaryCount; i++) {
+    struct HandoffSummary record;
+    if (fread(&record, sizeof(record), 1, stream) != 1 ||
+        record.cellCount > BLOOM_MAX_CELLS) {
+      printf("State from the running server ended after %u summaries\n", i);
+      exit(1);
+    }
+    record.username[MAX_USERNAME - 1] = '\0';
+    struct CountingBloom filter;
+    initCountingBloom(&filter, record.cellCount);
+    bool complete = fread(filter.counters, 1, getBloomBytes(&filter), stream) ==
+                    getBloomBytes(&filter);
+    if (!complete) {
+      printf("State from the running server ended after %u summaries\n", i);
+      exit(1);
+    }
+    if (addResourceSummary(directory, record.username, record.cellCount)) {
+      struct ResourceSummary* summary = findResourceSummary(directory, record.username);
+      memcpy(summary->filter.counters, filter.counters, getBloomBytes(&filter));
+    } else {
+      // Registers again when it connects again, lookups just can't find it until then
+      int clientIndex = findConnectedClientByUsername(record.username);
+      if (clientIndex != -1) {
+        connectedClients[clientIndex].summarized         = false;
+        connectedClients[clientIndex].registrationChunks = 0;
+        free(connectedClients[clientIndex].chunkBits);
+        connectedClients[clientIndex].chunkBits = NULL;
+      }
+      rejected++;
+    }
+    freeCountingBloom(&filter);
+  }
+
+  if (!readParkedSessions(stream, sessions, header.parkedCount)) {
+    printf("State from the running server ended in the parked sessions\n");
+    exit(1);
+  }
+
+  char ready = HANDOFF_READY;
+  if (send(connection, &ready, 1, MSG_NOSIGNAL) != 1) {
+    perror("Error telling the running server to stop");
+    exit(1);
+  }
+  fclose(stream);
+
+  printf("Took over %u clients, %lu resources, %u summaries and %lu parked sessions\n",
+         header.clientCount, header.resourceCount, header.summaryCount,
+         header.parkedCount);
+  if (rejected > 0 || debugFlag) {
+    printf("%lu resources and summaries over this server's limits were rejected\n",
+           rejected);
+  }
+  return udpSocketDescriptor;
+}
@@ -0,0 +1,81 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+// UNIX domain socket a new server connects to in order to take over from this one,
+// see -t
+#define SERVER_HANDOFF_PATH "server.handoff"
+
+// Changed whenever the records of the state stream change, so servers that can't read
+// each other's state don't try
+#define HANDOFF_VERSION 3
+
+// Seconds either server waits on the other before giving up on the handoff
+#define HANDOFF_TIMEOUT 60
+
+// Bytes the UDP socket's receive queue is grown to while neither server reads from it,
+// the kernel caps it at net.core.rmem_max
+#define HANDOFF_RECEIVE_BUFFER (8 * 1024 * 1024)
+
+// Sent back by the new server once the state is loaded and it is about to receive
+#define HANDOFF_READY 'r'
+
+#include <netinet/in.h>
+#include <stdbool.h>
+
+#include "../common/network_node.h"
+#include "resource.h"
+#include "session.h"
+
+// First record of the state stream, sent along with the UDP socket
+struct HandoffHeader {
+  unsigned int version;
+  unsigned int clientCount;
+  unsigned long resourceCount;
+  unsigned int summaryCount;
+  unsigned long parkedCount;
+};
+
+// A connected client, followed by the words of its bitmap of register packets received
+// if it is still registering
+struct HandoffClient {
+  char username[MAX_USERNAME];
+  struct sockaddr_in udpAddress;
+  struct sockaddr_in tcpAddress;
+  unsigned int registrationChunks;
+  unsigned int chunksReceived;
+  bool registering; // Has a bitmap of register packets received
+  bool summarized;
+  unsigned long sessionToken;
+  unsigned long resourceHash;
+};
+
+// A resource in the trie
+struct HandoffResource {
+  char username[MAX_USERNAME];
+  char filename[MAX_FILENAME];
+};
+
+// A summary, followed by the cellCount / 2 bytes of its filter's counters
+struct HandoffSummary {
+  char username[MAX_USERNAME];
+  unsigned long cellCount;
+};
+
+// A parked session, followed by its filenames then the cellCount / 2 bytes of its
+// summary's counters
+struct HandoffParkedSession {
+  unsigned long token;
+  unsigned long resourceHash;
+  char username[MAX_USERNAME];
+  struct sockaddr_in tcpAddress;
+  unsigned long expiresAt; // Microseconds of CLOCK_MONOTONIC, the same for both servers
+  unsigned long filenameCount;
+  unsigned long filenamesLength;
+  unsigned long cellCount;
+};
+
+int setupHandoffSocket(char*);
+bool sendServerState(int, int, struct ResourceDirectory*, struct SessionTable*, bool);
+int receiveServerState(char*, struct ResourceDirectory*, struct SessionTable*, bool);
+
+#endif
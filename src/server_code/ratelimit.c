@@ -0,0 +1,111 @@
+#include <string.h>
+
+#include "ratelimit.h"
+
+// packet.h
+extern struct PacketDelimiters packetDelimiters;
+
+static struct RateLimitSource sources[RATE_LIMIT_SOURCES];
+
+/*
+ * Purpose: Find the budget of a client address. Addresses seen for the first time take
+ * over a free or idle slot, or the least recently seen one if there isn't one.
+ * Input:
+ * - Client address
+ * - Current time in microseconds
+ * Output: The address's budget
+ */
+static struct RateLimitSource* findRateLimitSource(struct sockaddr_in address,
+                                                   unsigned long currentTime) {
+  unsigned int hash = (address.sin_addr.s_addr * 2654435761u) ^ address.sin_port;
+  struct RateLimitSource* freeSource   = NULL;
+  struct RateLimitSource* oldestSource = NULL;
+  int probe;
+  for (probe = 0; probe < RATE_LIMIT_PROBES; probe++) {
+    struct RateLimitSource* source =
+        &sources[(hash + (unsigned int)probe) & (RATE_LIMIT_SOURCES - 1)];
+    if (source->inUse && source->address.sin_addr.s_addr == address.sin_addr.s_addr &&
+        source->address.sin_port == address.sin_port) {
+      source->lastSeen = currentTime;
+      return source;
+    }
+    if (freeSource == NULL &&
+        (!source->inUse || currentTime - source->lastSeen > RATE_LIMIT_IDLE)) {
+      freeSource = source;
+    }
+    if (oldestSource == NULL || source->lastSeen < oldestSource->lastSeen) {
+      oldestSource = source;
+    }
+  }
+
+  struct RateLimitSource* source = freeSource;
+  if (source == NULL) {
+    source = oldestSource;
+  }
+  memset(source, 0, sizeof(*source));
+  source->address  = address;
+  source->lastSeen = currentTime;
+  source->inUse    = true;
+  return source;
+}
+
+/*
+ * Purpose: Work out the type of a packet from its first field without parsing the rest
+ * of it. Cheap enough to run on every packet before deciding whether to handle it.
+ * Input: The packet as received
+ * Output: Type of the packet, see getPacketType()
+ */
+int classifyPacket(char* packet) {
+  char type[MAX_PACKET_TYPE];
+  int length = 0;
+  while (packet[length] != packetDelimiters.field[0]) {
+    if (packet[length] == '\0' || length == MAX_PACKET_TYPE - 1) {
+      return -1;
+    }
+    type[length] = packet[length];
+    length++;
+  }
+  type[length] = '\0';
+  return getPacketType(type, false);
+}
+
+/*
+ * Purpose: Take a token from a client's bucket for a packet type. Buckets refill at the
+ * type's rate up to its burst.
+ * Input:
+ * - Address the packet came from
+ * - Type of the packet from classifyPacket(), not -1
+ * - Current time in microseconds
+ * Output:
+ * - true: Within budget, handle the packet
+ * - false: Over budget, drop the packet
+ */
+bool admitPacket(struct sockaddr_in address, int packetType, unsigned long currentTime) {
+  const struct RateLimit* limit = &getPacketTypeInfo(packetType)->rateLimit;
+  struct TokenBucket* bucket =
+      &findRateLimitSource(address, currentTime)->buckets[packetType];
+  unsigned long capacity = limit->burst * RATE_LIMIT_TOKEN;
+
+  unsigned long elapsed = currentTime - bucket->lastRefill;
+  if (bucket->lastRefill == 0 || elapsed > RATE_LIMIT_IDLE) {
+    bucket->tokens     = capacity;
+    bucket->lastRefill = currentTime;
+  } else {
+    // Only move the refill time forward once a whole unit has been added so that
+    // frequent packets don't round every refill down to nothing
+    unsigned long added = elapsed * limit->rate * RATE_LIMIT_TOKEN / 1000000;
+    if (added > 0) {
+      bucket->tokens += added;
+      if (bucket->tokens > capacity) {
+        bucket->tokens = capacity;
+      }
+      bucket->lastRefill = currentTime;
+    }
+  }
+
+  if (bucket->tokens < RATE_LIMIT_TOKEN) {
+    return false;
+  }
+  bucket->tokens -= RATE_LIMIT_TOKEN;
+  return true;
+}
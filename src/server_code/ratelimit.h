@@ -0,0 +1,38 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+// Sources with their own token buckets, must be a power of two
+#define RATE_LIMIT_SOURCES 4096
+
+// Slots looked at for a source before the least recently seen one is taken over
+#define RATE_LIMIT_PROBES 8
+
+// Microseconds a source can go unseen before its slot is free to reuse. Long enough
+// for every bucket to have refilled.
+#define RATE_LIMIT_IDLE 10000000
+
+// Tokens are counted in thousandths so slow rates refill smoothly
+#define RATE_LIMIT_TOKEN 1000
+
+#include <netinet/in.h>
+#include <stdbool.h>
+
+#include "../common/packet.h"
+
+struct TokenBucket {
+  unsigned long tokens; // In RATE_LIMIT_TOKEN units
+  unsigned long lastRefill;
+};
+
+// Budget of a single client address
+struct RateLimitSource {
+  struct sockaddr_in address;
+  unsigned long lastSeen;
+  bool inUse;
+  struct TokenBucket buckets[NUM_PACKET_TYPES];
+};
+
+int classifyPacket(char*);
+bool admitPacket(struct sockaddr_in, int, unsigned long);
+
+#endif
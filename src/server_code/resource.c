@@ -2,223 +2,1183 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "../common/stats.h"
+#include "../common/trace.h"
 #include "resource.h"
 
 /*
- * Purpose: Print out username and filename of a resource and the one after it in the
- * resource directory.
+ * Purpose: Count the memory held by a trie node, not including the nodes below it
+ * Input: The node
+ * Output: Bytes allocated for the node and its child and owner arrays
+ */
+static unsigned long getNodeBytes(struct ResourceNode* node) {
+  return sizeof(struct ResourceNode) + node->labelLength +
+         node->childCapacity * sizeof(struct ResourceNode*) +
+         node->ownerCapacity * sizeof(unsigned int);
+}
+
+/*
+ * Purpose: Allocate a trie node with no children or owners
  * Input:
- * - Resource to print username and filename
- * - Name of the resource for printing purposes
+ * - The resource directory the node is for
+ * - Part of the filename the node holds
+ * - Length of that part
+ * Output: The new node
+ */
+static struct ResourceNode* newResourceNode(struct ResourceDirectory* directory,
+                                            const char* label,
+                                            unsigned long labelLength) {
+  directory->bytesUsed += sizeof(struct ResourceNode) + labelLength;
+  struct ResourceNode* node = malloc(sizeof(struct ResourceNode) + labelLength);
+  node->children            = NULL;
+  node->owners              = NULL;
+  node->childCount          = 0;
+  node->childCapacity       = 0;
+  node->ownerCount          = 0;
+  node->ownerCapacity       = 0;
+  node->labelLength         = (unsigned char)labelLength;
+  memcpy(node->label, label, labelLength);
+  return node;
+}
+
+/*
+ * Purpose: Free a trie node and everything below it
+ * Input: The node
  * Output: None
  */
-static void printResourceInfo(struct Resource* resource, char* resourceName) {
-  printf("%s->username: %s\n", resourceName, resource->username);
-  printf("%s->filename: %s\n", resourceName, resource->filename);
-  printf("%s->next->username: %s\n", resourceName, resource->next->username);
-  printf("%s->next->filename: %s\n", resourceName, resource->next->filename);
+static void freeResourceNode(struct ResourceNode* node) {
+  int i;
+  for (i = 0; i < node->childCount; i++) {
+    freeResourceNode(node->children[i]);
+  }
+  free(node->owners);
+  free(node->children);
+  free(node);
 }
 
 /*
- * Purpose: Remove the resource at the head of the resource directory
+ * Purpose: Binary search the children of a node for the one whose label starts with a
+ * character
  * Input:
- * - The resource at the head of the resource directory
- * - debugFlag
- * Output: New head of resource directory
+ * - The node
+ * - First character of the child's label
+ * - Set to whether the child was found
+ * Output: Index of the child, or where it would go if it wasn't found
  */
-static struct Resource* removeHeadResource(struct Resource* headResource,
-                                           bool debugFlag) {
-  if (debugFlag) {
-    printf("\nRemoving resource %s at head\n", headResource->filename);
-    printf("BEFORE REMOVAL\n");
-    char* resourceName = calloc(1, 20);
-    strcpy(resourceName, "headResource");
-    printResourceInfo(headResource, resourceName);
-    free(resourceName);
-  }
-  headResource = headResource->next;
-  if (debugFlag) {
-    if (headResource->next == NULL) {
-      printf("HEAD RESOURCE EMPTY AFTER REMOVAL\n");
-      return headResource;
+static int findChild(struct ResourceNode* node, char first, bool* found) {
+  int low  = 0;
+  int high = node->childCount;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    char label = node->children[middle]->label[0];
+    if (label == first) {
+      *found = true;
+      return middle;
+    }
+    if ((unsigned char)label < (unsigned char)first) {
+      low = middle + 1;
+    } else {
+      high = middle;
     }
-    printf("AFTER REMOVAL\n");
-    char* resourceName = calloc(1, 20);
-    strcpy(resourceName, "headResource");
-    printResourceInfo(headResource, resourceName);
-    free(resourceName);
-    printf("\n");
   }
-  return headResource;
+  *found = false;
+  return low;
 }
 
 /*
- * Purpose: Remove a non head resource from the resource directory.
+ * Purpose: Put a new child into a node's children, keeping them sorted
  * Input:
- * - The resource before the one to remove
- * - The resource to remove
- * - Whether or not the resource removed was the last resource
- * - Debug flag
- * Output: Current resource after removing the resource. Before removal if R1 = Previous
- * Resource, R2 = Current Resource, R3 = Next Resource, R3 would be returned, as R2 would
- * have been removed.
- */
-static struct Resource* removeNonHeadResource(struct Resource* previousResource,
-                                              struct Resource* currentResource,
-                                              bool* atEnd,
-                                              bool debugFlag) {
-  if (debugFlag) {
-    char* resourceName = calloc(1, 20);
-    printf("\nRemoving resource %s not at head\n", currentResource->filename);
-    printf("BEFORE REMOVAL\n");
-    strcpy(resourceName, "previousResource");
-    printResourceInfo(previousResource, resourceName);
-    strcpy(resourceName, "currentResource");
-    printResourceInfo(currentResource, resourceName);
-    free(resourceName);
+ * - The resource directory
+ * - The node
+ * - Index for the child, see findChild()
+ * - The child
+ * Output: None
+ */
+static void insertChild(struct ResourceDirectory* directory,
+                        struct ResourceNode* node,
+                        int index,
+                        struct ResourceNode* child) {
+  if (node->childCount == node->childCapacity) {
+    directory->bytesUsed -= node->childCapacity * sizeof(struct ResourceNode*);
+    node->childCapacity =
+        node->childCapacity == 0 ? 2 : (unsigned short)(node->childCapacity * 2);
+    directory->bytesUsed += node->childCapacity * sizeof(struct ResourceNode*);
+    node->children =
+        realloc(node->children, node->childCapacity * sizeof(struct ResourceNode*));
   }
+  memmove(&node->children[index + 1], &node->children[index],
+          (unsigned long)(node->childCount - index) * sizeof(struct ResourceNode*));
+  node->children[index] = child;
+  node->childCount++;
+}
 
-  previousResource->next = currentResource->next;
-  currentResource        = previousResource->next;
+/*
+ * Purpose: Take a child out of a node's children
+ * Input:
+ * - The node
+ * - Index of the child
+ * Output: None
+ */
+static void removeChild(struct ResourceNode* node, int index) {
+  node->childCount--;
+  memmove(&node->children[index], &node->children[index + 1],
+          (unsigned long)(node->childCount - index) * sizeof(struct ResourceNode*));
+}
 
-  // Indicate that at end of linked list if the last element is removed
-  if (currentResource->next == NULL) {
-    *atEnd = true;
-    return currentResource;
+/*
+ * Purpose: Count how many characters at the start of a node's label a string shares
+ * Input:
+ * - The node
+ * - The string
+ * Output: Number of shared characters
+ */
+static unsigned long sharedLength(struct ResourceNode* node, const char* string) {
+  unsigned long length = 0;
+  while (length < node->labelLength && string[length] == node->label[length]) {
+    length++;
   }
+  return length;
+}
 
-  if (debugFlag) {
-    char* resourceName = calloc(1, 20);
-    printf("AFTER REMOVAL\n");
-    strcpy(resourceName, "previousResource");
-    printResourceInfo(previousResource, resourceName);
-    strcpy(resourceName, "currentResource");
-    printResourceInfo(currentResource, resourceName);
-    free(resourceName);
-    printf("\n");
+/*
+ * Purpose: Find the node where a filename ends
+ * Input:
+ * - The resource directory
+ * - The filename
+ * - Set to the nodes on the way to it and the index of each in its parent, the root is
+ * first. NULL if they aren't needed.
+ * - Set to the number of nodes on the way, NULL if it isn't needed
+ * Output: The node, NULL if no filename in the directory ends there
+ */
+static struct ResourceNode* findResourceNode(struct ResourceDirectory* directory,
+                                             const char* filename,
+                                             struct ResourceNode** path,
+                                             int* pathIndexes,
+                                             int* pathLength) {
+  struct ResourceNode* node = directory->root;
+  int depth                 = 0;
+  while (*filename != '\0') {
+    if (path != NULL) {
+      path[depth] = node;
+    }
+    bool found;
+    int index = findChild(node, *filename, &found);
+    if (!found) {
+      return NULL;
+    }
+    node                 = node->children[index];
+    unsigned long shared = sharedLength(node, filename);
+    if (shared < node->labelLength) {
+      return NULL;
+    }
+    if (pathIndexes != NULL) {
+      pathIndexes[depth] = index;
+    }
+    filename += shared;
+    depth++;
+  }
+  if (path != NULL) {
+    path[depth] = node;
+    *pathLength = depth + 1;
+  }
+  return node;
+}
+
+/*
+ * Purpose: Shrink a node that no longer needs to be in the trie. A node without owners
+ * is freed if it has no children, and merged into its child if it has one.
+ * Input:
+ * - The resource directory
+ * - The node, not the root
+ * Output: What the node's parent should point to instead of it. The node itself if it
+ * is still needed, NULL if it was freed.
+ */
+static struct ResourceNode* pruneResourceNode(struct ResourceDirectory* directory,
+                                              struct ResourceNode* node) {
+  if (node->ownerCount > 0 || node->childCount > 1) {
+    return node;
+  }
+  directory->bytesUsed -= getNodeBytes(node);
+  if (node->childCount == 0) {
+    free(node->owners);
+    free(node->children);
+    free(node);
+    return NULL;
+  }
+
+  // The merged node takes over the child's arrays
+  struct ResourceNode* child  = node->children[0];
+  struct ResourceNode* merged = malloc(sizeof(struct ResourceNode) + node->labelLength +
+                                       child->labelLength);
+  directory->bytesUsed += node->labelLength;
+  memcpy(merged->label, node->label, node->labelLength);
+  memcpy(merged->label + node->labelLength, child->label, child->labelLength);
+  merged->labelLength   = (unsigned char)(node->labelLength + child->labelLength);
+  merged->children      = child->children;
+  merged->childCount    = child->childCount;
+  merged->childCapacity = child->childCapacity;
+  merged->owners        = child->owners;
+  merged->ownerCount    = child->ownerCount;
+  merged->ownerCapacity = child->ownerCapacity;
+  free(node->owners);
+  free(node->children);
+  free(node);
+  free(child);
+  return merged;
+}
+
+/*
+ * Purpose: Set up an empty resource directory
+ * Input: The resource directory
+ * Output: None
+ */
+void initResourceDirectory(struct ResourceDirectory* directory) {
+  memset(directory, 0, sizeof(*directory));
+  directory->root         = newResourceNode(directory, "", 0);
+  directory->listingStale = true;
+  initUsernameTable(&directory->usernames);
+  initTrigramIndex(&directory->trigrams);
+  statsSet(STATS_DIRECTORY_BYTES, getDirectoryBytes(directory));
+}
+
+/*
+ * Purpose: Free everything in a resource directory
+ * Input: The resource directory
+ * Output: None
+ */
+void freeResourceDirectory(struct ResourceDirectory* directory) {
+  statsSubtract(STATS_RESOURCES, directory->resourceCount);
+  freeResourceNode(directory->root);
+  freeUsernameTable(&directory->usernames);
+  freeTrigramIndex(&directory->trigrams);
+  free(directory->listing);
+  free(directory->listingFilenames);
+  unsigned int i;
+  for (i = 0; i < directory->summaryCount; i++) {
+    freeCountingBloom(&directory->summaries[i].filter);
+  }
+  free(directory->summaries);
+  statsSubtract(STATS_RESOURCE_SUMMARIES, directory->summaryCount);
+  memset(directory, 0, sizeof(*directory));
+  statsSet(STATS_DIRECTORY_BYTES, 0);
+}
+
+/*
+ * Purpose: Count the memory held by a resource directory, including its usernames and
+ * trigram index
+ * Input: The resource directory
+ * Output: Bytes allocated for the directory
+ */
+unsigned long getDirectoryBytes(struct ResourceDirectory* directory) {
+  return directory->bytesUsed + directory->usernames.bytesUsed +
+         directory->trigrams.bytesUsed;
+}
+
+/*
+ * Purpose: Check whether a node lists a user as an owner
+ * Input:
+ * - The node
+ * - Id of the user's interned username, USERNAME_NONE if the user has no resources
+ * Output: Whether the user owns the file the node ends
+ */
+static bool isOwner(struct ResourceNode* node, unsigned int id) {
+  int i;
+  for (i = 0; id != USERNAME_NONE && i < node->ownerCount; i++) {
+    if (node->owners[i] == id) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Purpose: Find the user with the most resources
+ * Input: The resource directory
+ * Output: Id of the user's interned username, USERNAME_NONE if there are no users
+ */
+static unsigned int findLargestUser(struct ResourceDirectory* directory) {
+  unsigned int largest           = USERNAME_NONE;
+  unsigned int largestReferences = 0;
+  unsigned int id;
+  for (id = 0; id < directory->usernames.usernameCount; id++) {
+    unsigned int references = getUsernameReferences(&directory->usernames, id);
+    if (references > largestReferences) {
+      largest           = id;
+      largestReferences = references;
+    }
   }
+  return largest;
+}
 
-  return currentResource;
+/*
+ * Purpose: Check that another resource of a user fits within the directory's limits.
+ * Once the byte budget is used up, either nothing more fits or, if the directory
+ * evicts when full, users with the most resources are evicted until it does. A user is
+ * never evicted for their own resource.
+ * Input:
+ * - The resource directory
+ * - Id of the user's interned username, USERNAME_NONE if the user has no resources
+ * Output: Whether the resource can be added
+ */
+static bool makeRoomForResource(struct ResourceDirectory* directory, unsigned int id) {
+  if (directory->userQuota != 0 && id != USERNAME_NONE &&
+      getUsernameReferences(&directory->usernames, id) >= directory->userQuota) {
+    return false;
+  }
+  while (directory->byteBudget != 0 &&
+         getDirectoryBytes(directory) >= directory->byteBudget) {
+    if (!directory->evictWhenFull) {
+      return false;
+    }
+    unsigned int largest = findLargestUser(directory);
+    if (largest == USERNAME_NONE || largest == id) {
+      return false;
+    }
+    // The username is released along with the user's last resource
+    char username[MAX_USERNAME];
+    strcpy(username, getUsername(&directory->usernames, largest));
+    unsigned long evicted = removeUserResources(directory, username, false);
+    statsAdd(STATS_RESOURCES_EVICTED, evicted);
+    TRACE(TRACE_USER_EVICTED, largest, evicted);
+  }
+  return true;
 }
 
 /*
- * Purpose: Add a resource to the resource directory linked list. The new resource is
- * added at the beginning of the list. The head resource is the resource that was just
- * added.
+ * Purpose: Add a resource to the resource directory. The filename is walked down the
+ * trie, splitting the node where it leaves an existing label, and the user is added to
+ * the owners of the node it ends at. Resources over the directory's limits are
+ * rejected, see makeRoomForResource().
  * Input:
- * - Head resource in the linked list
+ * - The resource directory
  * - Username of the new resource
  * - filename of the new resource
- * Output: The new head node in the resource directory
+ * Output:
+ * - true: The resource was added
+ * - false: The user already has the file, the username or filename is too long, or
+ *   the resource doesn't fit within the directory's limits
  */
-struct Resource* addResource(struct Resource* headResource,
-                             char* username,
-                             char* filename) {
-  struct Resource* currentResource = malloc(sizeof(struct Resource));
+bool addResource(struct ResourceDirectory* directory, char* username, char* filename) {
+  if (strlen(username) >= MAX_USERNAME || strlen(filename) >= MAX_FILENAME) {
+    return false;
+  }
 
-  strcpy(currentResource->username, username);
-  strcpy(currentResource->filename, filename);
-  currentResource->next = headResource;
-  headResource          = currentResource;
-  return headResource;
+  // A user whose username isn't interned has no files yet
+  unsigned int id = findUsername(&directory->usernames, username);
+  if (!makeRoomForResource(directory, id)) {
+    // Sending a file the user already has again isn't over the limits
+    struct ResourceNode* owned = findResourceNode(directory, filename, NULL, NULL, NULL);
+    if (owned == NULL || !isOwner(owned, id)) {
+      statsAdd(STATS_RESOURCES_REJECTED, 1);
+      TRACE(TRACE_RESOURCE_REJECTED, strlen(filename), 0);
+    }
+    return false;
+  }
+
+  struct ResourceNode* node = directory->root;
+  const char* rest          = filename;
+  while (*rest != '\0') {
+    bool found;
+    int index = findChild(node, *rest, &found);
+    if (!found) {
+      struct ResourceNode* leaf = newResourceNode(directory, rest, strlen(rest));
+      insertChild(directory, node, index, leaf);
+      node = leaf;
+      break;
+    }
+
+    struct ResourceNode* child = node->children[index];
+    unsigned long shared       = sharedLength(child, rest);
+    // Filename leaves the child's label part way through, split the child there
+    if (shared < child->labelLength) {
+      struct ResourceNode* middle = newResourceNode(directory, child->label, shared);
+      child->labelLength          = (unsigned char)(child->labelLength - shared);
+      memmove(child->label, child->label + shared, child->labelLength);
+      // Give back the part of the label the middle node took
+      child = realloc(child, sizeof(struct ResourceNode) + child->labelLength);
+      directory->bytesUsed -= shared;
+      insertChild(directory, middle, 0, child);
+      node->children[index] = middle;
+      child                 = middle;
+    }
+    node = child;
+    rest += shared;
+  }
+
+  // Eviction may have freed the user's username, it isn't freed while they own this
+  id = findUsername(&directory->usernames, username);
+  if (isOwner(node, id)) {
+    return false;
+  }
+  if (node->ownerCount == node->ownerCapacity) {
+    directory->bytesUsed -= node->ownerCapacity * sizeof(unsigned int);
+    node->ownerCapacity =
+        node->ownerCapacity == 0 ? 1 : (unsigned short)(node->ownerCapacity * 2);
+    directory->bytesUsed += node->ownerCapacity * sizeof(unsigned int);
+    node->owners = realloc(node->owners, node->ownerCapacity * sizeof(unsigned int));
+  }
+  node->owners[node->ownerCount++] = internUsername(&directory->usernames, username);
+  if (node->ownerCount == 1) {
+    addIndexedFilename(&directory->trigrams, filename);
+  }
+
+  directory->resourceCount++;
+  directory->listingStale = true;
+  statsAdd(STATS_RESOURCES, 1);
+  statsSet(STATS_DIRECTORY_BYTES, getDirectoryBytes(directory));
+  TRACE(TRACE_RESOURCE_ADDED, strlen(filename), 0);
+  return true;
+}
+
+/*
+ * Purpose: Remove a user from the owners of a node, dropping the resource's reference
+ * to its username
+ * Input:
+ * - The resource directory
+ * - The node
+ * - Id of the owner's interned username
+ * Output: Whether the user was an owner
+ */
+static bool removeOwner(struct ResourceDirectory* directory,
+                        struct ResourceNode* node,
+                        unsigned int id) {
+  int i;
+  for (i = 0; i < node->ownerCount; i++) {
+    if (node->owners[i] == id) {
+      node->owners[i] = node->owners[--node->ownerCount];
+      releaseUsername(&directory->usernames, id);
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Purpose: Remove a single resource from the resource directory. Used when a client
+ * announces that it no longer has a file available. Nodes left without owners or a
+ * reason to split are pruned on the way back up.
+ * Input:
+ * - The resource directory
+ * - Username of the resource to remove
+ * - Filename of the resource to remove
+ * - Debug flag
+ * Output: Whether the resource was in the directory
+ */
+bool removeResource(struct ResourceDirectory* directory,
+                    char* username,
+                    char* filename,
+                    bool debugFlag) {
+  struct ResourceNode* path[MAX_FILENAME + 1];
+  int pathIndexes[MAX_FILENAME];
+  int pathLength;
+  if (strlen(filename) >= MAX_FILENAME) {
+    return false;
+  }
+  unsigned int id = findUsername(&directory->usernames, username);
+  if (id == USERNAME_NONE) {
+    return false;
+  }
+  struct ResourceNode* node =
+      findResourceNode(directory, filename, path, pathIndexes, &pathLength);
+  if (node == NULL || !removeOwner(directory, node, id)) {
+    return false;
+  }
+  if (node->ownerCount == 0) {
+    removeIndexedFilename(&directory->trigrams, filename);
+  }
+  if (debugFlag) {
+    printf("Removing resource %s of user %s\n", filename, username);
+  }
+
+  int depth;
+  for (depth = pathLength - 1; depth > 0; depth--) {
+    struct ResourceNode* parent      = path[depth - 1];
+    struct ResourceNode* replacement = pruneResourceNode(directory, path[depth]);
+    if (replacement == path[depth]) {
+      break;
+    }
+    if (replacement != NULL) {
+      parent->children[pathIndexes[depth - 1]] = replacement;
+      break;
+    }
+    removeChild(parent, pathIndexes[depth - 1]);
+  }
+
+  directory->resourceCount--;
+  directory->listingStale = true;
+  statsSubtract(STATS_RESOURCES, 1);
+  statsSet(STATS_DIRECTORY_BYTES, getDirectoryBytes(directory));
+  TRACE(TRACE_RESOURCE_REMOVED, strlen(filename), 0);
+  return true;
+}
+
+/*
+ * Purpose: Remove a user from the owners of every node below a node, pruning nodes that
+ * are no longer needed. Owners are compared by id, not username. Files left without
+ * owners are taken out of the trigram index.
+ * Input:
+ * - The resource directory
+ * - The node
+ * - Buffer holding the filename up to the node, MAX_FILENAME bytes
+ * - Length of the filename up to the node
+ * - Id of the owner's interned username
+ * - Number of the user's resources still to remove, the walk stops once it reaches 0
+ * - Function passed the data and the filename of each resource removed, or NULL
+ * - Data passed to it
+ * Output: Number of resources removed
+ */
+static unsigned long removeOwnerBelow(struct ResourceDirectory* directory,
+                                      struct ResourceNode* node,
+                                      char* filename,
+                                      unsigned long length,
+                                      unsigned int id,
+                                      unsigned long* remaining,
+                                      void (*take)(void*, char*),
+                                      void* data) {
+  memcpy(filename + length, node->label, node->labelLength);
+  length += node->labelLength;
+  filename[length] = '\0';
+
+  unsigned long removed = 0;
+  if (removeOwner(directory, node, id)) {
+    removed++;
+    (*remaining)--;
+    if (node->ownerCount == 0) {
+      removeIndexedFilename(&directory->trigrams, filename);
+    }
+    if (take != NULL) {
+      take(data, filename);
+    }
+  }
+  int i = 0;
+  while (i < node->childCount && *remaining > 0) {
+    removed += removeOwnerBelow(directory, node->children[i], filename, length, id,
+                                remaining, take, data);
+    struct ResourceNode* replacement = pruneResourceNode(directory, node->children[i]);
+    if (replacement == NULL) {
+      removeChild(node, i);
+    } else {
+      node->children[i] = replacement;
+      i++;
+    }
+  }
+  return removed;
+}
+
+/*
+ * Purpose: Find the owners of a file. Takes time proportional to the length of the
+ * filename, not the size of the directory.
+ * Input:
+ * - The resource directory
+ * - The filename
+ * - Set to the number of owners
+ * Output: Interned usernames of the owners, see getUsername()
+ */
+unsigned int* findResourceOwners(struct ResourceDirectory* directory,
+                                 char* filename,
+                                 int* ownerCount) {
+  struct ResourceNode* node = findResourceNode(directory, filename, NULL, NULL, NULL);
+  if (node == NULL) {
+    *ownerCount = 0;
+    return NULL;
+  }
+  *ownerCount = node->ownerCount;
+  return node->owners;
+}
+
+/*
+ * Purpose: Add every resource at or below a node to the listing, in filename order
+ * Input:
+ * - The resource directory
+ * - The node
+ * - Buffer holding the filename up to the node, MAX_FILENAME bytes
+ * - Length of the filename up to the node
+ * - Number of resources listed so far, updated
+ * Output: None
+ */
+static void listResources(struct ResourceDirectory* directory,
+                          struct ResourceNode* node,
+                          char* filename,
+                          unsigned long length,
+                          unsigned long* listed) {
+  memcpy(filename + length, node->label, node->labelLength);
+  length += node->labelLength;
+  filename[length] = '\0';
+
+  if (node->ownerCount > 0) {
+    if (directory->listingFilenamesLength + length + 1 >
+        directory->listingFilenamesCapacity) {
+      directory->bytesUsed -= directory->listingFilenamesCapacity;
+      directory->listingFilenamesCapacity =
+          (directory->listingFilenamesCapacity + length + 1) * 2;
+      directory->bytesUsed += directory->listingFilenamesCapacity;
+      directory->listingFilenames =
+          realloc(directory->listingFilenames, directory->listingFilenamesCapacity);
+    }
+    unsigned long offset = directory->listingFilenamesLength;
+    memcpy(directory->listingFilenames + offset, filename, length + 1);
+    directory->listingFilenamesLength += length + 1;
+
+    int i;
+    for (i = 0; i < node->ownerCount; i++) {
+      struct ResourceListing* entry = &directory->listing[*listed];
+      entry->username       = getUsername(&directory->usernames, node->owners[i]);
+      entry->filenameOffset = offset;
+      (*listed)++;
+    }
+  }
+
+  int i;
+  for (i = 0; i < node->childCount; i++) {
+    listResources(directory, node->children[i], filename, length, listed);
+  }
+}
+
+/*
+ * Purpose: Order listing entries by username then filename, for qsort(). Filenames
+ * were added in order so their offsets sort the same way they do.
+ * Input: Pointers to the two entries
+ * Output: Negative, zero or positive as the first entry sorts before, the same as or
+ * after the second
+ */
+static int compareListings(const void* first, const void* second) {
+  const struct ResourceListing* firstListing  = first;
+  const struct ResourceListing* secondListing = second;
+  int comparison = strcmp(firstListing->username, secondListing->username);
+  if (comparison != 0) {
+    return comparison;
+  }
+  if (firstListing->filenameOffset < secondListing->filenameOffset) {
+    return -1;
+  }
+  return firstListing->filenameOffset > secondListing->filenameOffset;
+}
+
+/*
+ * Purpose: Bring the listing up to date if the directory changed since it was last
+ * built
+ * Input: The resource directory
+ * Output: None
+ */
+static void sortResources(struct ResourceDirectory* directory) {
+  if (!directory->listingStale) {
+    return;
+  }
+  if (directory->resourceCount > directory->listingCapacity) {
+    directory->bytesUsed -= directory->listingCapacity * sizeof(struct ResourceListing);
+    directory->listingCapacity = directory->resourceCount * 2;
+    directory->listing         = realloc(
+        directory->listing, directory->listingCapacity * sizeof(struct ResourceListing));
+    directory->bytesUsed += directory->listingCapacity * sizeof(struct ResourceListing);
+  }
+
+  unsigned long listed              = 0;
+  directory->listingFilenamesLength = 0;
+  char filename[MAX_FILENAME];
+  listResources(directory, directory->root, filename, 0, &listed);
+
+  if (listed > 0) {
+    qsort(directory->listing, listed, sizeof(struct ResourceListing), compareListings);
+  }
+  directory->listingStale = false;
+  statsSet(STATS_DIRECTORY_BYTES, getDirectoryBytes(directory));
 }
 
 /*
  * Purpose: Take all the available resources and put them into one string. Add the
- * username then the filename of each resource
+ * username then the filename of each resource. Resources that don't fit in a packet
+ * data field are left out.
  * Input:
- * - String to put all the resources in
- * - The first resource in the resource directory
+ * - String to put all the resources in, MAX_DATA bytes
+ * - The resource directory
  * - Delimiter to put between resources
  * Output: The resource string
  */
 char* makeResourceString(char* resourceString,
-                         struct Resource* headResource,
+                         struct ResourceDirectory* directory,
                          char* delimiter) {
-  struct Resource* currentResource = headResource;
-  while (currentResource->next != NULL) {
-    strncat(resourceString, currentResource->username, strlen(currentResource->username));
-    strcat(resourceString, delimiter);
-    strncat(resourceString, currentResource->filename, strlen(currentResource->filename));
-    strcat(resourceString, delimiter);
-
-    currentResource = currentResource->next;
+  sortResources(directory);
+  unsigned long i;
+  for (i = 0; i < directory->resourceCount; i++) {
+    char* username = directory->listing[i].username;
+    char* filename = directory->listingFilenames + directory->listing[i].filenameOffset;
+    if (strlen(resourceString) + strlen(username) + strlen(filename) + 2 >= MAX_DATA) {
+      break;
+    }
+    strncat(resourceString, username, strlen(username));
+    strncat(resourceString, delimiter, 1);
+    strncat(resourceString, filename, strlen(filename));
+    strncat(resourceString, delimiter, 1);
   }
   return resourceString;
 }
 
 /*
- * Purpose: Print out all available resources. Print all the fields of the resource type.
- * Traverses the linked list that the available resources are stored in. Input:
- * - The first resource in the resource directory
+ * Purpose: Put one page of the resource directory into a string, compressed. Resources
+ * are sorted and grouped by username so each username is sent once per group, and
+ * each filename only sends what differs from the filename before it in the group.
+ * Format: next&total& then for each group username&count& followed by count entries of
+ * <shared prefix length><rest of filename>&
+ * Input:
+ * - String to put the page in, MAX_DATA bytes
+ * - The resource directory
+ * - Index of the first resource in the page, 0 for the first page
+ * - Delimiter to put between fields
+ * Output: Index of the first resource of the next page, the total when this page is
+ * the last
+ */
+unsigned long makeCompressedResourceString(char* resourceString,
+                                           struct ResourceDirectory* directory,
+                                           unsigned long startIndex,
+                                           char delimiter) {
+  sortResources(directory);
+  unsigned long resourceCount = directory->resourceCount;
+
+  // Header is written last, leave room for it at its largest
+  char header[48];
+  snprintf(header, sizeof(header), "%lu%c%lu%c", resourceCount, delimiter, resourceCount,
+           delimiter);
+  unsigned long room = MAX_DATA - 1 - strlen(header);
+
+  char body[MAX_DATA]  = {0};
+  unsigned long length = 0;
+  unsigned long index  = startIndex;
+  while (index < resourceCount) {
+    char* username = directory->listing[index].username;
+    char group[MAX_DATA];
+    unsigned long groupLength = 0;
+    int count                 = 0;
+    const char* previous      = "";
+
+    while (index < resourceCount && directory->listing[index].username == username) {
+      char* filename =
+          directory->listingFilenames + directory->listing[index].filenameOffset;
+      unsigned long prefix = 0;
+      while (previous[prefix] != '\0' && previous[prefix] == filename[prefix]) {
+        prefix++;
+      }
+      char entry[MAX_FILENAME + 2];
+      int entryLength = snprintf(entry, sizeof(entry), "%c%s%c",
+                                 (char)(RESOURCE_PREFIX_BASE + prefix), filename + prefix,
+                                 delimiter);
+      // Count can gain a digit with this entry
+      unsigned long headerLength = strlen(username) + 1 + 10 + 1;
+      if (length + headerLength + groupLength + (unsigned long)entryLength > room) {
+        break;
+      }
+      memcpy(group + groupLength, entry, (unsigned long)entryLength + 1);
+      groupLength += (unsigned long)entryLength;
+      count++;
+      previous = filename;
+      index++;
+    }
+    if (count == 0) {
+      break;
+    }
+    length += (unsigned long)snprintf(body + length, sizeof(body) - length, "%s%c%d%c%s",
+                                      username, delimiter, count, delimiter, group);
+
+    // Page filled up part way through the group
+    if (index < resourceCount && directory->listing[index].username == username) {
+      break;
+    }
+  }
+
+  int headerLength = snprintf(resourceString, MAX_DATA, "%lu%c%lu%c", index, delimiter,
+                              resourceCount, delimiter);
+  memcpy(resourceString + headerLength, body, length + 1);
+  return index;
+}
+
+/*
+ * Purpose: Add the filenames at or below a node to a search result, in order
+ * Input:
+ * - The node
+ * - Buffer holding the filename up to the node, MAX_FILENAME bytes
+ * - Length of the filename up to the node
+ * - Search result being built, MAX_DATA bytes
+ * - Longest the search result can get
+ * - Delimiter to put after each filename
+ * Output: Whether every filename fit
+ */
+static bool searchResources(struct ResourceNode* node,
+                            char* filename,
+                            unsigned long length,
+                            char* searchString,
+                            unsigned long room,
+                            char delimiter) {
+  memcpy(filename + length, node->label, node->labelLength);
+  length += node->labelLength;
+  filename[length] = '\0';
+
+  if (node->ownerCount > 0) {
+    unsigned long searchLength = strlen(searchString);
+    if (searchLength + length + 1 > room) {
+      return false;
+    }
+    memcpy(searchString + searchLength, filename, length);
+    searchString[searchLength + length]     = delimiter;
+    searchString[searchLength + length + 1] = '\0';
+  }
+
+  int i;
+  for (i = 0; i < node->childCount; i++) {
+    if (!searchResources(node->children[i], filename, length, searchString, room,
+                         delimiter)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Purpose: Find the filenames that start with a prefix. Finding where they are in the
+ * trie takes time proportional to the length of the prefix.
+ * Format: prefix&more& then each filename followed by &. more is 1 if some filenames
+ * didn't fit, 0 if they are all there.
+ * Input:
+ * - String to put the filenames in, MAX_DATA bytes
+ * - The resource directory
+ * - The prefix, shorter than MAX_FILENAME
+ * - Delimiter to put between fields
+ * Output: The search string
+ */
+char* makeSearchString(char* searchString,
+                       struct ResourceDirectory* directory,
+                       char* prefix,
+                       char delimiter) {
+  char filename[MAX_FILENAME];
+  unsigned long length      = 0;
+  struct ResourceNode* node = directory->root;
+  const char* rest          = prefix;
+
+  // Walk down to the node the prefix ends in
+  while (*rest != '\0' && node != NULL) {
+    bool found;
+    int index = findChild(node, *rest, &found);
+    if (!found) {
+      node = NULL;
+      break;
+    }
+    struct ResourceNode* child = node->children[index];
+    unsigned long shared       = sharedLength(child, rest);
+    if (shared < child->labelLength && rest[shared] != '\0') {
+      node = NULL;
+      break;
+    }
+    node = child;
+    rest += shared;
+    if (*rest != '\0') {
+      memcpy(filename + length, child->label, child->labelLength);
+      length += child->labelLength;
+    }
+  }
+
+  // Header is written last, leave room for it
+  unsigned long room   = MAX_DATA - 1 - (strlen(prefix) + 4);
+  char files[MAX_DATA] = {0};
+  bool complete        = true;
+  if (node != NULL) {
+    complete = searchResources(node, filename, length, files, room, delimiter);
+  }
+
+  int headerLength = snprintf(searchString, MAX_DATA, "%s%c%d%c", prefix, delimiter,
+                              complete ? 0 : 1, delimiter);
+  memcpy(searchString + headerLength, files, strlen(files) + 1);
+  return searchString;
+}
+
+// A substring search result being built, see makeSubstringSearchString()
+struct SubstringSearch {
+  char* files; // MAX_DATA bytes
+  unsigned long length;
+  unsigned long room; // Longest the result can get
+  char delimiter;
+};
+
+/*
+ * Purpose: Add a filename to a substring search result
+ * Input:
+ * - The search result
+ * - The filename
+ * Output: Whether the filename fit
+ */
+static bool addSubstringMatch(void* data, char* filename) {
+  struct SubstringSearch* search = data;
+  unsigned long filenameLength   = strlen(filename);
+  if (search->length + filenameLength + 1 > search->room) {
+    return false;
+  }
+  memcpy(search->files + search->length, filename, filenameLength);
+  search->length += filenameLength;
+  search->files[search->length++] = search->delimiter;
+  search->files[search->length]   = '\0';
+  return true;
+}
+
+/*
+ * Purpose: Find the filenames that contain a substring, ignoring case, through the
+ * trigram index. Users that registered a summary are left out.
+ * Format: substring&more& then each filename followed by &, the same as
+ * makeSearchString()
+ * Input:
+ * - String to put the filenames in, MAX_DATA bytes
+ * - The resource directory
+ * - The substring, from TRIGRAM_LENGTH characters to shorter than MAX_FILENAME
+ * - Delimiter to put between fields
+ * Output: The search string
+ */
+char* makeSubstringSearchString(char* searchString,
+                                struct ResourceDirectory* directory,
+                                char* substring,
+                                char delimiter) {
+  char files[MAX_DATA] = {0};
+  // Header is written last, leave room for it
+  struct SubstringSearch search = {files, 0, MAX_DATA - 1 - (strlen(substring) + 4),
+                                   delimiter};
+  bool complete =
+      findSubstringMatches(&directory->trigrams, substring, addSubstringMatch, &search);
+
+  int headerLength = snprintf(searchString, MAX_DATA, "%s%c%d%c", substring, delimiter,
+                              complete ? 0 : 1, delimiter);
+  memcpy(searchString + headerLength, files, search.length + 1);
+  return searchString;
+}
+
+/*
+ * Purpose: Pass every resource below a node to a function, see visitResources()
+ * Input:
+ * - The resource directory
+ * - The node
+ * - Buffer holding the filename up to the node, MAX_FILENAME bytes
+ * - Length of the filename up to the node
+ * - Function to pass each resource to
+ * - Data passed to it
+ * Output: Whether every resource was passed, false if the function stopped the walk
+ */
+static bool visitResourceNode(struct ResourceDirectory* directory,
+                              struct ResourceNode* node,
+                              char* filename,
+                              unsigned long length,
+                              bool (*visit)(void*, char*, char*),
+                              void* data) {
+  memcpy(filename + length, node->label, node->labelLength);
+  length += node->labelLength;
+  filename[length] = '\0';
+
+  int i;
+  for (i = 0; i < node->ownerCount; i++) {
+    if (!visit(data, getUsername(&directory->usernames, node->owners[i]), filename)) {
+      return false;
+    }
+  }
+  for (i = 0; i < node->childCount; i++) {
+    if (!visitResourceNode(directory, node->children[i], filename, length, visit,
+                           data)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Purpose: Pass every resource in the directory to a function, in filename order. The
+ * directory must not change until this returns.
+ * Input:
+ * - The resource directory
+ * - Function to pass each resource to, with the data, the username and the filename.
+ * It returns false to stop the walk.
+ * - Data passed to it
+ * Output: Whether every resource was passed
+ */
+bool visitResources(struct ResourceDirectory* directory,
+                    bool (*visit)(void*, char*, char*),
+                    void* data) {
+  char filename[MAX_FILENAME];
+  return visitResourceNode(directory, directory->root, filename, 0, visit, data);
+}
+
+/*
+ * Purpose: Print out all available resources. Print all the fields of every resource,
+ * sorted by username then filename.
+ * Input: The resource directory
  * Output: None
  */
-void printAllResources(struct Resource* headResource) {
+void printAllResources(struct ResourceDirectory* directory) {
   printf("\n*** PRINTING ALL RESOURCES***\n");
-  struct Resource* currentResource = headResource;
-  while (currentResource->next != NULL) {
-    printf("USERNAME: %s\n", currentResource->username);
-    printf("FILENAME: %s\n", currentResource->filename);
-    currentResource = currentResource->next;
+  sortResources(directory);
+  unsigned long i;
+  for (i = 0; i < directory->resourceCount; i++) {
+    printf("USERNAME: %s\n", directory->listing[i].username);
+    printf("FILENAME: %s\n",
+           directory->listingFilenames + directory->listing[i].filenameOffset);
   }
   printf("\n");
 }
 
+/*
+ * Purpose: Remove a user's resources from the resource directory, passing each one to
+ * a function on the way out. It walks the trie removing the user from the owners of
+ * every file until all of the user's files are found, and prunes the nodes that are no
+ * longer needed. The user's summary, if it has one, is freed.
+ * Input:
+ * - The resource directory
+ * - Username of the user
+ * - Function passed the data and the filename of each resource removed, or NULL
+ * - Data passed to it
+ * Output: Number of resources removed
+ */
+unsigned long takeUserResources(struct ResourceDirectory* directory,
+                                char* username,
+                                void (*take)(void*, char*),
+                                void* data) {
+  removeResourceSummary(directory, username);
+  unsigned int id = findUsername(&directory->usernames, username);
+  if (id == USERNAME_NONE) {
+    return 0;
+  }
+  // Every resource of the user holds a reference to its username
+  unsigned long remaining = directory->usernames.usernames[id].references;
+  char filename[MAX_FILENAME];
+  unsigned long removed = removeOwnerBelow(directory, directory->root, filename, 0, id,
+                                           &remaining, take, data);
+  if (removed > 0) {
+    directory->resourceCount -= removed;
+    directory->listingStale = true;
+    statsSubtract(STATS_RESOURCES, removed);
+    statsSet(STATS_DIRECTORY_BYTES, getDirectoryBytes(directory));
+  }
+  TRACE(TRACE_USER_RESOURCES_REMOVED, removed, 0);
+  return removed;
+}
+
 /*
  * Purpose: When a user disconnects, this function removes their resources from the
- * resource directory. It loops through the resouce directory looking for resources with a
- * username matching the disconnected user. It then removes those links.
+ * resource directory, see takeUserResources()
  * Input:
+ * - The resource directory
  * - Username of the disconnected user
- * - The resource at the head of the resource directory
  * - Debug flag
- * Output:
- * - Resource at the head of the resource directory. If resources are removed from the
- * beginning of the directory, the head will change.
+ * Output: Number of resources removed
  */
-struct Resource* removeUserResources(char* username,
-                                     struct Resource* headResource,
-                                     bool debugFlag) {
+unsigned long removeUserResources(struct ResourceDirectory* directory,
+                                  char* username,
+                                  bool debugFlag) {
   if (debugFlag) {
     printf("\nRemoving resources for user: %s\n", username);
   }
-  struct Resource* previousResource;
-  struct Resource* currentResource = headResource;
-
-  bool atHead = true;
-  bool atEnd  = false;
-
-  while (!atEnd) {
-    // Link has username of disconnected user, remove it
-    if (strcmp(currentResource->username, username) == 0) {
-      if (atHead) {
-        headResource    = removeHeadResource(headResource, debugFlag);
-        currentResource = headResource;
-      } else {
-        currentResource =
-            removeNonHeadResource(previousResource, currentResource, &atEnd, debugFlag);
-        if (atEnd) {
-          if (debugFlag) {
-            printf("At end after removing non head resource\n");
-          }
-          break;
-        }
-      }
-    }
-    // Next resource
-    else {
-      atHead           = false;
-      previousResource = currentResource;
-      currentResource  = currentResource->next;
-    }
-    if (!currentResource) {
-      printf("At end of user directory\n");
-      atEnd = true;
-    }
-  }
+  unsigned long removed = takeUserResources(directory, username, NULL, NULL);
   if (debugFlag) {
     printf("Resource directory after removing user %s resources", username);
-    printAllResources(headResource);
+    printAllResources(directory);
+  }
+  return removed;
+}
+
+/*
+ * Purpose: Register a user's resources as a counting Bloom filter of their filenames.
+ * The cells arrive later in register packets, and announces add and remove filenames
+ * from the filter. A filter takes the same memory however many files the user has,
+ * and counts towards the byte budget like any other resource.
+ * Input:
+ * - The resource directory
+ * - Username of the user, who must not have resources in the trie
+ * - Cells in the filter, a power of two from BLOOM_MIN_CELLS to BLOOM_MAX_CELLS
+ * Output: Whether the filter was added. It isn't if its size is invalid or it doesn't
+ * fit in the budget.
+ */
+bool addResourceSummary(struct ResourceDirectory* directory,
+                        char* username,
+                        unsigned long cellCount) {
+  if (cellCount < BLOOM_MIN_CELLS || cellCount > BLOOM_MAX_CELLS ||
+      (cellCount & (cellCount - 1)) != 0 ||
+      findResourceSummary(directory, username) != NULL) {
+    return false;
+  }
+  unsigned long filterBytes = cellCount / 2;
+  if (directory->byteBudget != 0 &&
+      getDirectoryBytes(directory) + filterBytes > directory->byteBudget) {
+    statsAdd(STATS_RESOURCES_REJECTED, 1);
+    TRACE(TRACE_RESOURCE_REJECTED, 0, 0);
+    return false;
+  }
+
+  if (directory->summaryCount == directory->summaryCapacity) {
+    unsigned int capacity = directory->summaryCapacity == 0
+                                ? 16
+                                : directory->summaryCapacity * 2;
+    directory->summaries =
+        realloc(directory->summaries, capacity * sizeof(struct ResourceSummary));
+    directory->bytesUsed +=
+        (capacity - directory->summaryCapacity) * sizeof(struct ResourceSummary);
+    directory->summaryCapacity = capacity;
+  }
+  struct ResourceSummary* summary = &directory->summaries[directory->summaryCount++];
+  memset(summary, 0, sizeof(*summary));
+  strncpy(summary->username, username, MAX_USERNAME - 1);
+  initCountingBloom(&summary->filter, cellCount);
+  directory->bytesUsed += filterBytes;
+  statsAdd(STATS_RESOURCE_SUMMARIES, 1);
+  statsSet(STATS_DIRECTORY_BYTES, getDirectoryBytes(directory));
+  return true;
+}
+
+/*
+ * Purpose: Remove the filter a user registered instead of their filenames, leaving
+ * anything the user has in the trie
+ * Input:
+ * - The resource directory
+ * - Username of the user
+ * Output: Whether the user had a summary
+ */
+bool removeResourceSummary(struct ResourceDirectory* directory, char* username) {
+  struct ResourceSummary* summary = findResourceSummary(directory, username);
+  if (summary == NULL) {
+    return false;
+  }
+  directory->bytesUsed -= getBloomBytes(&summary->filter);
+  freeCountingBloom(&summary->filter);
+  *summary = directory->summaries[--directory->summaryCount];
+  statsSubtract(STATS_RESOURCE_SUMMARIES, 1);
+  statsSet(STATS_DIRECTORY_BYTES, getDirectoryBytes(directory));
+  return true;
+}
+
+/*
+ * Purpose: Find the filter a user registered instead of their filenames
+ * Input:
+ * - The resource directory
+ * - Username of the user
+ * Output: The user's summary, NULL if the user's resources are in the trie
+ */
+struct ResourceSummary* findResourceSummary(struct ResourceDirectory* directory,
+                                            char* username) {
+  unsigned int i;
+  for (i = 0; i < directory->summaryCount; i++) {
+    if (strcmp(directory->summaries[i].username, username) == 0) {
+      return &directory->summaries[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Purpose: Find the next user whose filter says they might have a file. Every filter
+ * is checked, so this takes time proportional to the number of summaries.
+ * Input:
+ * - The resource directory
+ * - Filename to look for
+ * - Index of the next summary to check, 0 to start. Moved past the user found.
+ * Output: Username of the user, NULL if there are no more
+ */
+char* nextPossibleOwner(struct ResourceDirectory* directory,
+                        char* filename,
+                        unsigned int* index) {
+  while (*index < directory->summaryCount) {
+    struct ResourceSummary* summary = &directory->summaries[(*index)++];
+    if (mayContainBloomKey(&summary->filter, filename)) {
+      return summary->username;
+    }
   }
-  return headResource;
+  return NULL;
 }
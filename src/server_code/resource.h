@@ -3,20 +3,96 @@
 
 #include <stdbool.h>
 
+#include "../common/bloom.h"
 #include "../common/network_node.h"
 #include "../common/packet.h"
+#include "trigram.h"
+#include "username.h"
 
-// A single available resource that a connected client possesses. Is a single link
-// in a linked list containing all available resources.
-struct Resource {
+// A node in the radix trie of filenames. Each node holds the part of a filename that
+// follows its parent's part, so filenames that share a prefix share the nodes that
+// spell it out. Nodes where a filename ends have owners, the interned usernames of the
+// users that have the file. Children are sorted by the first character of their label.
+struct ResourceNode {
+  struct ResourceNode** children;
+  unsigned int* owners;
+  unsigned short childCount;
+  unsigned short childCapacity;
+  unsigned short ownerCount;
+  unsigned short ownerCapacity;
+  unsigned char labelLength;
+  char label[]; // Not NUL terminated
+};
+
+// A single resource in a listing, see makeCompressedResourceString()
+struct ResourceListing {
+  char* username; // Interned, only good until the directory changes
+  unsigned long filenameOffset; // Into the listing's filenames
+};
+
+// A user that registered a counting Bloom filter of its filenames instead of the
+// filenames, see addResourceSummary()
+struct ResourceSummary {
   char username[MAX_USERNAME];
-  char filename[MAX_FILENAME];
-  struct Resource* next;
+  struct CountingBloom filter;
+};
+
+// All available resources of the connected clients
+struct ResourceDirectory {
+  struct ResourceNode* root;
+  unsigned long resourceCount;
+  struct UsernameTable usernames; // Referenced once by each resource
+  struct TrigramIndex trigrams;    // Every filename with an owner, for substring search
+
+  // Every resource sorted by username then filename, for building listings. Rebuilt
+  // on the next listing after the directory changes.
+  struct ResourceListing* listing;
+  unsigned long listingCapacity;
+  char* listingFilenames;
+  unsigned long listingFilenamesLength;
+  unsigned long listingFilenamesCapacity;
+  bool listingStale;
+
+  // Users whose resources are only known from a filter. Lookups can only say that they
+  // might have a file, and listings and searches leave them out.
+  struct ResourceSummary* summaries;
+  unsigned int summaryCount;
+  unsigned int summaryCapacity;
+
+  // Memory allocated for the trie, the listing and the summaries. The username table
+  // and the trigram index count their own.
+  unsigned long bytesUsed;
+
+  // Limits, 0 for none. Once the directory has used its byte budget new resources are
+  // rejected, or the user with the most resources is evicted to make room for them.
+  unsigned long byteBudget;
+  unsigned int userQuota; // Most resources a single user can have
+  bool evictWhenFull;
 };
 
-struct Resource* addResource(struct Resource*, char*, char*);
-char* makeResourceString(char*, struct Resource*, char*);
-void printAllResources(struct Resource*);
-struct Resource* removeUserResources(char*, struct Resource*, bool);
+void initResourceDirectory(struct ResourceDirectory*);
+void freeResourceDirectory(struct ResourceDirectory*);
+bool addResource(struct ResourceDirectory*, char*, char*);
+bool removeResource(struct ResourceDirectory*, char*, char*, bool);
+unsigned long takeUserResources(struct ResourceDirectory*,
+                                char*,
+                                void (*)(void*, char*),
+                                void*);
+unsigned long removeUserResources(struct ResourceDirectory*, char*, bool);
+bool addResourceSummary(struct ResourceDirectory*, char*, unsigned long);
+bool removeResourceSummary(struct ResourceDirectory*, char*);
+struct ResourceSummary* findResourceSummary(struct ResourceDirectory*, char*);
+char* nextPossibleOwner(struct ResourceDirectory*, char*, unsigned int*);
+unsigned int* findResourceOwners(struct ResourceDirectory*, char*, int*);
+char* makeResourceString(char*, struct ResourceDirectory*, char*);
+unsigned long makeCompressedResourceString(char*,
+                                           struct ResourceDirectory*,
+                                           unsigned long,
+                                           char);
+char* makeSearchString(char*, struct ResourceDirectory*, char*, char);
+char* makeSubstringSearchString(char*, struct ResourceDirectory*, char*, char);
+bool visitResources(struct ResourceDirectory*, bool (*)(void*, char*, char*), void*);
+void printAllResources(struct ResourceDirectory*);
+unsigned long getDirectoryBytes(struct ResourceDirectory*);
 
 #endif
@@ -1,6 +1,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
@@ -11,52 +12,227 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "../common/capture.h"
 #include "../common/network_node.h"
 #include "../common/packet.h"
+#include "../common/stats.h"
+#include "../common/trace.h"
+#include "../common/uring.h"
+#include "clients.h"
+#include "handoff.h"
+#include "ratelimit.h"
 #include "resource.h"
 #include "server.h"
+#include "session.h"
 
 // Global so that signal handler can free resources
 int udpSocketDescriptor;
+int statsSocketDescriptor;
+int handoffSocketDescriptor = -1;
 char* packet;
 
-// User and resource "directories"
-struct ConnectedClient connectedClients[MAX_CONNECTED_CLIENTS];
-struct Resource* headResource;
+// Every datagram received, see -c
+struct Capture capture;
+
+// Resource "directory", the user directory is in clients.c
+struct ResourceDirectory resourceDirectory;
+
+// Registrations of expired clients, kept so they can resume them. Guarded by the
+// directory lock like the directory they came out of.
+struct SessionTable parkedSessions;
+
+// The status thread probes and expires clients and removes their resources while the
+// workers read and change the client table and the resource directory. Packets that
+// only read them are handled under the read lock, see readOnlyPacketTypes.
+pthread_rwlock_t directoryLock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Acks, retransmissions and duplicate detection for control packets. Taken after the
+// directory lock when both are held.
+struct ReliableState reliableState;
+pthread_mutex_t reliableMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Workers that parse and handle received packets. Each has its own ring from the
+// receive stage and every client address always goes to the same worker, so packets
+// from a client are handled in the order they came in.
+struct PipelineWorker pipelineWorkers[MAX_PIPELINE_WORKERS];
+int pipelineWorkerCount;
 
 // packet.h
 extern struct PacketDelimiters packetDelimiters;
 
+// clients.h
+extern struct ConnectedClient connectedClients[MAX_CONNECTED_CLIENTS];
+extern struct sockaddr_in clientUdpAddresses[MAX_CONNECTED_CLIENTS];
+
+// Packet types whose handlers only read the resource directory and the client table.
+// Resource and search packets only read it once the listing has been built.
+static const bool readOnlyPacketTypes[NUM_PACKET_TYPES] = {
+    [PACKET_STATUS] = true, [PACKET_RESOURCE] = true, [PACKET_PEERS] = true,
+    [PACKET_LOOKUP] = true, [PACKET_SEARCH] = true, [PACKET_FIND] = true,
+};
+
+/*
+ * Purpose: Entries of the server's packet handler table. Each one takes what its
+ * handle...Packet() function needs out of the packet, see dispatchPacket().
+ * Input:
+ * - Unused, the server's state is global
+ * - The packet's fields
+ * - Client that sent the packet
+ * - Debug flag
+ * Output: None
+ */
+static void onConnectionPacket(void* node,
+                               struct PacketFields* packetFields,
+                               struct sockaddr_in clientUdpAddress,
+                               bool debugFlag) {
+  (void)node;
+  handleConnectionPacket(packetFields->data, clientUdpAddress, debugFlag);
+}
+
+static void onStatusPacket(void* node,
+                           struct PacketFields* packetFields,
+                           struct sockaddr_in clientUdpAddress,
+                           bool debugFlag) {
+  (void)node;
+  (void)packetFields;
+  (void)debugFlag;
+  handleStatusPacket(clientUdpAddress);
+}
+
+static void onResourcePacket(void* node,
+                             struct PacketFields* packetFields,
+                             struct sockaddr_in clientUdpAddress,
+                             bool debugFlag) {
+  (void)node;
+  handleResourcePacket(packetFields->data, clientUdpAddress, debugFlag);
+}
+
+static void onPeersPacket(void* node,
+                          struct PacketFields* packetFields,
+                          struct sockaddr_in clientUdpAddress,
+                          bool debugFlag) {
+  (void)node;
+  (void)packetFields;
+  handlePeersPacket(clientUdpAddress, debugFlag);
+}
+
+static void onAnnouncePacket(void* node,
+                             struct PacketFields* packetFields,
+                             struct sockaddr_in clientUdpAddress,
+                             bool debugFlag) {
+  (void)node;
+  handleAnnouncePacket(packetFields->data, clientUdpAddress, debugFlag);
+}
+
+static void onLookupPacket(void* node,
+                           struct PacketFields* packetFields,
+                           struct sockaddr_in clientUdpAddress,
+                           bool debugFlag) {
+  (void)node;
+  handleLookupPacket(packetFields->data, clientUdpAddress, packetFields->sequence != 0,
+                     debugFlag);
+}
+
+static void onSearchPacket(void* node,
+                           struct PacketFields* packetFields,
+                           struct sockaddr_in clientUdpAddress,
+                           bool debugFlag) {
+  (void)node;
+  handleSearchPacket(packetFields->data, clientUdpAddress, debugFlag);
+}
+
+static void onFindPacket(void* node,
+                         struct PacketFields* packetFields,
+                         struct sockaddr_in clientUdpAddress,
+                         bool debugFlag) {
+  (void)node;
+  handleFindPacket(packetFields->data, clientUdpAddress, debugFlag);
+}
+
+static void onRegisterPacket(void* node,
+                             struct PacketFields* packetFields,
+                             struct sockaddr_in clientUdpAddress,
+                             bool debugFlag) {
+  (void)node;
+  handleRegisterPacket(packetFields->data, clientUdpAddress, debugFlag);
+}
+
+static void onSessionPacket(void* node,
+                            struct PacketFields* packetFields,
+                            struct sockaddr_in clientUdpAddress,
+                            bool debugFlag) {
+  (void)node;
+  handleSessionPacket(packetFields->data, clientUdpAddress, debugFlag);
+}
+
+// What the server does with each packet type. Gossip and digest packets are only sent
+// between clients, acks are handled by the reliable layer.
+static const struct PacketHandlers serverPacketHandlers = {{
+    [PACKET_CONNECTION] = onConnectionPacket,
+    [PACKET_STATUS]     = onStatusPacket,
+    [PACKET_RESOURCE]   = onResourcePacket,
+    [PACKET_PEERS]      = onPeersPacket,
+    [PACKET_ANNOUNCE]   = onAnnouncePacket,
+    [PACKET_LOOKUP]     = onLookupPacket,
+    [PACKET_SEARCH]     = onSearchPacket,
+    [PACKET_REGISTER]   = onRegisterPacket,
+    [PACKET_FIND]       = onFindPacket,
+    [PACKET_SESSION]    = onSessionPacket,
+}};
+
 // Main fucntion
 int main(int argc, char* argv[]) {
   // Assign callback function for Ctrl-c
   signal(SIGINT, shutdownServer);
+  installTraceHandlers("server");
 
   bool debugFlag = false; // Can add conditional statements with this flag to
                           // print out extra info
 
-  // Make sure all connectedClients are set to 0
-  int i;
-  for (i = 0; i < MAX_CONNECTED_CLIENTS; i++) {
-    memset(&(connectedClients[i].socketUdpAddress), 0,
-           sizeof(connectedClients[i].socketUdpAddress));
-  }
+  initResourceDirectory(&resourceDirectory);
+  initSessionTable(&parkedSessions);
 
-  headResource       = malloc(sizeof(struct Resource));
-  headResource->next = NULL;
+  initReliableState(&reliableState);
 
-  // UDP socket clients should connect to
-  struct sockaddr_in serverAddress;
-  memset(&serverAddress, 0, sizeof(serverAddress));
-  serverAddress.sin_family      = AF_INET; // IPV4
-  serverAddress.sin_addr.s_addr = htonl(INADDR_ANY);
-  serverAddress.sin_port        = htons(PORT);
-  udpSocketDescriptor           = setupUdpSocket(serverAddress, 1);
+  bool uringFlag      = false;
+  bool takeOverFlag   = false;
+  pipelineWorkerCount = DEFAULT_PIPELINE_WORKERS;
+  argc                = checkLimitArguments(argc, argv, &resourceDirectory);
+  argc                = checkPipelineArguments(argc, argv, &pipelineWorkerCount);
+  argc                = checkHandoffArguments(argc, argv, &takeOverFlag);
+  argc                = checkCaptureArguments(argc, argv, &capture);
+  checkCommandLineArguments(argc, argv, &debugFlag, &uringFlag);
 
-  checkCommandLineArguments(argc, argv, &debugFlag);
+  // UDP socket clients should connect to, taken over from the running server with -t
+  udpSocketDescriptor = -1;
+  if (takeOverFlag) {
+    udpSocketDescriptor =
+        receiveServerState(SERVER_HANDOFF_PATH, &resourceDirectory, &parkedSessions,
+                           debugFlag);
+  }
+  if (udpSocketDescriptor == -1) {
+    struct sockaddr_in serverAddress;
+    memset(&serverAddress, 0, sizeof(serverAddress));
+    serverAddress.sin_family      = AF_INET; // IPV4
+    serverAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+    serverAddress.sin_port        = htons(PORT);
+    udpSocketDescriptor           = setupUdpSocket(serverAddress, 1);
+  }
+
+  if (uringFlag) {
+    if (setupUring(udpSocketDescriptor) == 0) {
+      printf("Using io_uring for UDP\n");
+    } else {
+      printf("io_uring not available, using sockets\n");
+    }
+  }
+  startPipeline(debugFlag);
+
+  statsSocketDescriptor = setupStatsSocket(SERVER_STATS_PATH);
+  statsSet(STATS_CLIENT_TABLE_BYTES, getClientTableBytes());
+  handoffSocketDescriptor = setupHandoffSocket(SERVER_HANDOFF_PATH);
 
-  bool packetAvailable = false;
-  int packetType       = 0;
+  unsigned long packetCount = 0;
 
   // pthread to check client connection status
   pthread_t processId;
@@ -64,55 +240,462 @@ int main(int argc, char* argv[]) {
 
   packet = calloc(1, MAX_PACKET);
 
-  // Continously listen for new UDP packets and new TCP connections
+  // The receive stage. Continously listen for new UDP packets, drop the ones that are
+  // over budget and pass the rest on to the workers.
   while (1) {
-    struct sockaddr_in clientUDPAddress;
-    packetAvailable = checkUdpSocket(udpSocketDescriptor, &clientUDPAddress, packet,
-                                     debugFlag); // Check the UDP socket
+    pthread_mutex_lock(&reliableMutex);
+    checkReliableTimeouts(&reliableState, udpSocketDescriptor, debugFlag);
+    pthread_mutex_unlock(&reliableMutex);
 
-    if (!packetAvailable) {
+    if (!receivePacket(debugFlag)) {
+      waitForActivity(debugFlag);
       continue;
     }
 
+    // Keep stats available and the server upgradable while busy
+    packetCount++;
+    if (packetCount % STATS_POLL_INTERVAL == 0) {
+      checkStatsSocket(statsSocketDescriptor);
+      checkHandoffSocket(debugFlag);
+    }
+  } // while(1)
+  return 0;
+} // main
+
+/*
+ * Purpose: Take the next packet off the UDP socket, drop it if its client is over
+ * budget and otherwise pass it on to its worker
+ * Input: Debug flag
+ * Output: Whether there was a packet
+ */
+bool receivePacket(bool debugFlag) {
+  struct ReceivedPacket received;
+  if (!checkUdpSocket(udpSocketDescriptor, &received.address, packet, debugFlag)) {
+    return false;
+  }
+  received.receiveTime = getNanoseconds();
+  if (capture.file != NULL) {
+    writeCapturedDatagram(&capture, received.address, packet,
+                          received.receiveTime / 1000);
+  }
+
+  // Drop packets that aren't of any type, and those from clients that are over budget,
+  // before spending time on them
+  received.packetType = classifyPacket(packet);
+  if (received.packetType == -1) {
+    statsAdd(STATS_UNKNOWN_PACKETS, 1);
+    TRACE(TRACE_PACKET_DROPPED, received.packetType, TRACE_ADDRESS(received.address));
+    memset(packet, 0, strlen(packet));
+    return true;
+  }
+  if (!admitPacket(received.address, received.packetType,
+                   received.receiveTime / 1000)) {
+    statsAdd(STATS_RATE_LIMITED_PACKETS, 1);
+    TRACE(TRACE_PACKET_RATE_LIMITED, received.packetType,
+          TRACE_ADDRESS(received.address));
+    memset(packet, 0, strlen(packet));
+    return true;
+  }
+
+  strcpy(received.packet, packet);
+  memset(packet, 0, strlen(packet));
+  if (pipelineWorkerCount == 0) {
+    handleReceivedPacket(&received, debugFlag);
+    return true;
+  }
+
+  // A worker that has fallen behind sheds load rather than holding up the others
+  struct PipelineWorker* worker = &pipelineWorkers[pickWorker(received.address)];
+  if (!pushSpscRing(&worker->ring, &received)) {
+    statsAdd(STATS_PIPELINE_DROPPED, 1);
+    TRACE(TRACE_PACKET_DROPPED, received.packetType, TRACE_ADDRESS(received.address));
     if (debugFlag) {
-      printf("Packet received\n");
+      printf("Worker %d is full, packet dropped\n", worker->index);
     }
-    struct PacketFields packetFields;
-    memset(&packetFields, 0, sizeof(packetFields));
-    readPacket(packet, &packetFields, debugFlag);
-    packetType = getPacketType(packetFields.type, debugFlag);
+    return true;
+  }
+  worker->pushed++;
+  return true;
+}
 
-    switch (packetType) {
-    // Connection packet
-    case 0:
-      if (debugFlag) {
-        printf("Type of packet recieved is connection\n");
-      }
-      handleConnectionPacket(packetFields.data, clientUDPAddress, debugFlag);
-      break;
+/*
+ * Purpose: Take the options that limit the server's memory out of the command line
+ * arguments and apply them to the resource directory. The rest are left for
+ * checkCommandLineArguments().
+ * -m <megabytes> caps the memory of the resource directory, 0 for no limit.
+ * -q <resources> caps the resources of a single user, 0 for no limit.
+ * -e evicts the users with the most resources once the directory is full, instead of
+ * rejecting new resources.
+ * Input:
+ * - Number of command line arguments
+ * - The command line arguments
+ * - The resource directory
+ * Output: Number of command line arguments left
+ */
+int checkLimitArguments(int argc, char** argv, struct ResourceDirectory* directory) {
+  unsigned long budget     = DEFAULT_DIRECTORY_BUDGET_MB;
+  directory->userQuota     = DEFAULT_USER_QUOTA;
+  directory->evictWhenFull = false;
 
-    // Status packet
-    case 1:
-      if (debugFlag) {
-        printf("Type of packet received is status\n");
+  int remaining = 1;
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+      budget = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+      directory->userQuota = (unsigned int)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-e") == 0) {
+      directory->evictWhenFull = true;
+    } else {
+      argv[remaining++] = argv[i];
+    }
+  }
+  directory->byteBudget = budget * 1024 * 1024;
+  statsSet(STATS_DIRECTORY_BUDGET, directory->byteBudget);
+
+  printf("Resource directory budget: ");
+  if (directory->byteBudget == 0) {
+    printf("unlimited");
+  } else {
+    printf("%lu MB", budget);
+  }
+  printf(", user quota: ");
+  if (directory->userQuota == 0) {
+    printf("unlimited");
+  } else {
+    printf("%u resources", directory->userQuota);
+  }
+  printf(", %s when full\n", directory->evictWhenFull ? "evicting" : "rejecting");
+  return remaining;
+}
+
+/*
+ * Purpose: Take the -w <workers> option out of the command line arguments. It sets how
+ * many workers parse and handle packets, up to MAX_PIPELINE_WORKERS. With 0 the main
+ * thread handles every packet as soon as it is received.
+ * Input:
+ * - Number of command line arguments
+ * - The command line arguments
+ * - Number of workers, left as is if the option isn't given
+ * Output: Number of command line arguments left
+ */
+int checkPipelineArguments(int argc, char** argv, int* workerCount) {
+  int remaining = 1;
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+      *workerCount = atoi(argv[++i]);
+      if (*workerCount < 0) {
+        *workerCount = 0;
       }
-      handleStatusPacket(clientUDPAddress);
-      break;
+      if (*workerCount > MAX_PIPELINE_WORKERS) {
+        *workerCount = MAX_PIPELINE_WORKERS;
+      }
+    } else {
+      argv[remaining++] = argv[i];
+    }
+  }
+  return remaining;
+}
 
-    // Resource packet
-    case 2:
-      if (debugFlag) {
-        printf("Type of packet received is Resource\n");
+/*
+ * Purpose: Take the -t option out of the command line arguments. It has the server
+ * take over from the one running in the same directory, see checkHandoffSocket().
+ * Input:
+ * - Number of command line arguments
+ * - The command line arguments
+ * - Whether to take over, set if the option is given
+ * Output: Number of command line arguments left
+ */
+int checkHandoffArguments(int argc, char** argv, bool* takeOverFlag) {
+  int remaining = 1;
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-t") == 0) {
+      *takeOverFlag = true;
+    } else {
+      argv[remaining++] = argv[i];
+    }
+  }
+  return remaining;
+}
+
+/*
+ * Purpose: Take the -c <file> option out of the command line arguments. It records
+ * every datagram received, before rate limiting, with its source and arrival time to
+ * a capture file the replay tool can send back to a server.
+ * Input:
+ * - Number of command line arguments
+ * - The command line arguments
+ * - The capture, opened if the option is given
+ * Output: Number of command line arguments left
+ */
+int checkCaptureArguments(int argc, char** argv, struct Capture* datagramCapture) {
+  int remaining = 1;
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      i++;
+      if (openCaptureWriter(datagramCapture, argv[i])) {
+        printf("Capturing received datagrams to %s\n", argv[i]);
       }
-      handleResourcePacket(clientUDPAddress, debugFlag);
+    } else {
+      argv[remaining++] = argv[i];
+    }
+  }
+  return remaining;
+}
+
+/*
+ * Purpose: Start the send stage and the workers. Nothing is started when there are no
+ * workers, the main thread then does everything.
+ * Input: Debug flag
+ * Output: None
+ */
+void startPipeline(bool debugFlag) {
+  if (pipelineWorkerCount == 0) {
+    printf("Handling packets on the main thread\n");
+    return;
+  }
+  if (startUdpSendStage(udpSocketDescriptor, SEND_RING_SIZE) == -1) {
+    printf("Sending packets from the workers\n");
+  }
+
+  int i;
+  for (i = 0; i < pipelineWorkerCount; i++) {
+    struct PipelineWorker* worker = &pipelineWorkers[i];
+    worker->index                 = i;
+    worker->debugFlag             = debugFlag;
+    initSpscRing(&worker->ring, PIPELINE_RING_SIZE, sizeof(struct ReceivedPacket));
+    if (pthread_create(&worker->thread, NULL, runPipelineWorker, worker) != 0) {
+      perror("Error starting worker");
+      freeSpscRing(&worker->ring);
       break;
+    }
+  }
+  pipelineWorkerCount = i;
+  printf("Handling packets on %d workers\n", pipelineWorkerCount);
+}
 
-    default:
+/*
+ * Purpose: Pick the worker that handles the packets from a client address
+ * Input: The address
+ * Output: Index of the worker
+ */
+int pickWorker(struct sockaddr_in address) {
+  unsigned long key  = ((unsigned long)address.sin_addr.s_addr << 16) | address.sin_port;
+  unsigned long hash = (key * 0x9e3779b97f4a7c15ul) >> 32;
+  return (int)(hash % (unsigned long)pipelineWorkerCount);
+}
+
+/*
+ * Purpose: Handle the packets the receive stage passes to a worker, for as long as the
+ * server runs
+ * Input: The worker
+ * Output: None
+ * Notes: This function is run in a thread spawned from the main process, one for
+ * each worker.
+ */
+void* runPipelineWorker(void* input) {
+  struct PipelineWorker* worker = input;
+  struct ReceivedPacket received;
+  while (1) {
+    if (popSpscRingWait(&worker->ring, &received, 0)) {
+      handleReceivedPacket(&received, worker->debugFlag);
+      atomic_fetch_add_explicit(&worker->handled, 1, memory_order_release);
     }
-    memset(packet, 0, strlen(packet));
-  } // while(1)
-  return 0;
-} // main
+  }
+  return NULL;
+}
+
+/*
+ * Purpose: Wait for the workers to handle every packet the receive stage gave them.
+ * Only called by the receive stage, while it isn't giving them any more.
+ * Input: None
+ * Output: None
+ */
+void drainPipeline() {
+  int i;
+  for (i = 0; i < pipelineWorkerCount; i++) {
+    struct PipelineWorker* worker = &pipelineWorkers[i];
+    while (atomic_load_explicit(&worker->handled, memory_order_acquire) !=
+           worker->pushed) {
+      usleep(100);
+    }
+  }
+}
+
+/*
+ * Purpose: Check if a new server connected to the handoff socket to take over from
+ * this one. If one did, receiving stops and the packets already received are handled,
+ * then the UDP socket and the state are handed to the new server while the directory
+ * is locked. Once the new server has the state this one exits without touching the
+ * socket files, which the new server has replaced. Datagrams that arrive meanwhile
+ * wait on the socket, so none are lost unless its receive queue overflows.
+ * Input: Debug flag
+ * Output: None, returns only if this server is still the one serving
+ */
+void checkHandoffSocket(bool debugFlag) {
+  if (handoffSocketDescriptor == -1) {
+    return;
+  }
+  int connection = accept(handoffSocketDescriptor, NULL, NULL);
+  if (connection == -1) {
+    return;
+  }
+  printf("Handing off to a new server...\n");
+
+  // Datagrams io_uring already took off the socket have to be handled here
+  if (usingUdpUring(udpSocketDescriptor)) {
+    pauseUdpUring(true);
+    while (receivePacket(debugFlag)) {
+    }
+  }
+  drainPipeline();
+
+  pthread_rwlock_wrlock(&directoryLock);
+  bool handedOff = sendServerState(connection, udpSocketDescriptor, &resourceDirectory,
+                                   &parkedSessions, debugFlag);
+  close(connection);
+  if (handedOff) {
+    printf("New server took over\n");
+    closeCapture(&capture);
+    drainUdpSendStage();
+    exit(0);
+  }
+  pthread_rwlock_unlock(&directoryLock);
+  pauseUdpUring(false);
+  printf("Hot restart failed, still serving\n");
+}
+
+/*
+ * Purpose: Sleep until a datagram arrives, a connection is waiting on the stats or
+ * handoff socket or a reliable packet is due for retransmission, so an idle receive
+ * stage doesn't spin. Connections are accepted before returning.
+ * Input: Debug flag
+ * Output: None
+ */
+void waitForActivity(bool debugFlag) {
+  pthread_mutex_lock(&reliableMutex);
+  unsigned long timeout = getReliableTimeout(&reliableState);
+  pthread_mutex_unlock(&reliableMutex);
+  if (timeout > RECEIVE_IDLE_TIMEOUT) {
+    timeout = RECEIVE_IDLE_TIMEOUT;
+  }
+
+  // Negative descriptors are skipped by poll()
+  struct pollfd descriptors[3];
+  memset(descriptors, 0, sizeof(descriptors));
+  descriptors[0].fd = udpSocketDescriptor;
+  if (usingUdpUring(udpSocketDescriptor)) {
+    descriptors[0].fd = getUdpUringDescriptor();
+  }
+  descriptors[1].fd = statsSocketDescriptor;
+  descriptors[2].fd = handoffSocketDescriptor;
+  int i;
+  for (i = 0; i < 3; i++) {
+    descriptors[i].events = POLLIN;
+  }
+  // Rounded up, so a retransmission isn't polled for until it is due
+  if (poll(descriptors, 3, (int)((timeout + 999) / 1000)) <= 0) {
+    return;
+  }
+  if (descriptors[1].revents & POLLIN) {
+    checkStatsSocket(statsSocketDescriptor);
+  }
+  if (descriptors[2].revents & POLLIN) {
+    checkHandoffSocket(debugFlag);
+  }
+}
+
+/*
+ * Purpose: Parse a received packet and hand it to its handler. Acks and retransmissions
+ * of packets already handled go no further. The handler runs under the directory's
+ * read lock if it only reads, see readOnlyPacketTypes, otherwise under its write lock.
+ * Input:
+ * - The packet, as passed on by the receive stage
+ * - Debug flag
+ * Output: None
+ */
+void handleReceivedPacket(struct ReceivedPacket* received, bool debugFlag) {
+  if (debugFlag) {
+    printf("Packet received\n");
+  }
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  readPacket(received->packet, &packetFields, debugFlag);
+
+  pthread_mutex_lock(&reliableMutex);
+  bool handle = handleReliablePacket(&reliableState, udpSocketDescriptor,
+                                     received->address, &packetFields, debugFlag);
+  pthread_mutex_unlock(&reliableMutex);
+  if (!handle) {
+    statsRecordPacket(received->packetType, getNanoseconds() - received->receiveTime);
+    return;
+  }
+
+  bool readOnly = getPacketTypeInfo(received->packetType) != NULL &&
+                  readOnlyPacketTypes[received->packetType];
+  if (readOnly) {
+    pthread_rwlock_rdlock(&directoryLock);
+    // Building the listing changes the directory. Nothing can make it stale again
+    // while the read lock is held.
+    bool usesListing = received->packetType == PACKET_RESOURCE ||
+                       received->packetType == PACKET_SEARCH;
+    if (usesListing && resourceDirectory.listingStale) {
+      pthread_rwlock_unlock(&directoryLock);
+      readOnly = false;
+    }
+  }
+  if (!readOnly) {
+    pthread_rwlock_wrlock(&directoryLock);
+  }
+  dispatchPacket(&serverPacketHandlers, received->packetType, NULL, &packetFields,
+                 received->address, debugFlag);
+  pthread_rwlock_unlock(&directoryLock);
+
+  unsigned long handleTime = getNanoseconds() - received->receiveTime;
+  statsRecordPacket(received->packetType, handleTime);
+  TRACE(TRACE_PACKET_HANDLED, received->packetType, handleTime);
+}
+
+/*
+ * Purpose: Take the resources of a client that stopped answering heartbeats out of the
+ * directory and park them under its session token, so that it can resume its
+ * registration without sending them again. A client whose registration never finished
+ * just has its resources removed.
+ * Input:
+ * - Index of the client, removed from the client table by the caller
+ * - Debug flag
+ * Output: None
+ */
+static void parkClientSession(int clientIndex, bool debugFlag) {
+  struct ConnectedClient* client = &connectedClients[clientIndex];
+  if (client->sessionToken == 0 || client->chunksReceived < client->registrationChunks) {
+    removeUserResources(&resourceDirectory, client->username, debugFlag);
+    return;
+  }
+  struct ParkedSession* session = createParkedSession(
+      client->sessionToken, client->resourceHash, client->username,
+      client->socketTcpAddress);
+  struct ResourceSummary* summary = NULL;
+  if (client->summarized) {
+    summary = findResourceSummary(&resourceDirectory, client->username);
+  }
+  if (summary != NULL) {
+    initCountingBloom(&session->summary, summary->filter.cellCount);
+    memcpy(session->summary.counters, summary->filter.counters,
+           getBloomBytes(&summary->filter));
+  }
+  takeUserResources(&resourceDirectory, client->username, addParkedFilename, session);
+  if (debugFlag) {
+    printf("Session of %s parked with %lu resources\n", client->username,
+           session->filenameCount);
+  }
+  if (!parkSession(&parkedSessions, session, getMicroseconds() + SESSION_RETENTION)) {
+    freeParkedSession(session);
+  }
+}
 
 /*
  * Purpose: Check if clients are still connected to the server. Send every
@@ -120,7 +703,8 @@ int main(int argc, char* argv[]) {
  * response within the set time frame, they are considered to still be
  * connected. If they do not send a packet back, they are considered to be no
  * longer connected. If a client is no longer connected, its information is
- * erased from the user directory (connectedClients).
+ * erased from the user directory (connectedClients) and its registration is parked
+ * until it resumes it or SESSION_RETENTION passes.
  * Input: None
  * Output: None
  * Notes: This function is run in a thread spawned from the main process. It is
@@ -133,51 +717,67 @@ void* checkClientStatus(void* input) {
 
   // Status packet
   struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
   strcpy(packetFields.type, "status");
   strcpy(packetFields.data, "testing");
   char* statusPacket = calloc(1, MAX_PACKET);
   buildPacket(statusPacket, packetFields, debugFlag);
 
-  struct ConnectedClient* client;
-  struct sockaddr_in clientUdpAddress;
-
+  struct sockaddr_in probedAddresses[CLIENT_WORD_BITS];
+  int probedIndexes[CLIENT_WORD_BITS];
   int clientIndex;
+  int i;
   while (1) {
-    for (clientIndex = 0; clientIndex < 100; clientIndex++) {
-      client           = &connectedClients[clientIndex];
-      clientUdpAddress = client->socketUdpAddress;
+    pthread_rwlock_wrlock(&directoryLock);
+    unsigned long statusSent = startHeartbeatRound();
+    pthread_rwlock_unlock(&directoryLock);
+    TRACE(TRACE_HEARTBEAT_ROUND, statusSent, 0);
+    (void)statusSent; // Only traced
 
-      // Check that client is initialized and connected
-      if (clientUdpAddress.sin_addr.s_addr == 0 && clientUdpAddress.sin_port == 0) {
-        continue;
-      }
-      if (client->status == false) {
-        continue;
+    // Workers connect and remove clients meanwhile, so the addresses of a word of
+    // probed clients at a time are copied under the lock and sent to without it
+    clientIndex = 0;
+    while (clientIndex != -1) {
+      int probedCount = 0;
+      pthread_rwlock_rdlock(&directoryLock);
+      for (clientIndex = nextProbedClient(clientIndex);
+           clientIndex != -1 && probedCount < CLIENT_WORD_BITS;
+           clientIndex = nextProbedClient(clientIndex + 1)) {
+        probedAddresses[probedCount] = clientUdpAddresses[clientIndex];
+        probedIndexes[probedCount]   = clientIndex;
+        probedCount++;
       }
+      pthread_rwlock_unlock(&directoryLock);
 
-      client->status = false; // Assume client is disconnected and will not respond
-      client->requestedStatus = true; // Requested a response from the client
-      sendUdpMessage(udpSocketDescriptor, clientUdpAddress, statusPacket, debugFlag);
-      if (debugFlag) {
-        printf("Status packet sent to client %d\n", clientIndex);
+      for (i = 0; i < probedCount; i++) {
+        sendUdpMessage(udpSocketDescriptor, probedAddresses[i], statusPacket, debugFlag);
+        if (debugFlag) {
+          printf("Status packet sent to client %d\n", probedIndexes[i]);
+        }
       }
     }
+    flushUdpMessages();
 
     // Give clients a chance to send responses
     usleep(STATUS_SEND_INTERVAL);
 
-    // If a response was requested and the client didn't send a response, remove
-    // them from the "user directory"
-    for (clientIndex = 0; clientIndex < 100; clientIndex++) {
-      client = &connectedClients[clientIndex];
-      if (client->requestedStatus == true && client->status == false) {
-        if (debugFlag) {
-          printf("Client %d disconnected\n", clientIndex);
-        }
-        headResource = removeUserResources(client->username, headResource, debugFlag);
-        memset(client, 0, sizeof(*client));
+    // Probed clients that didn't send a response are removed from the "user directory"
+    pthread_rwlock_wrlock(&directoryLock);
+    findExpiredClients();
+    for (clientIndex = nextExpiredClient(0); clientIndex != -1;
+         clientIndex = nextExpiredClient(clientIndex + 1)) {
+      if (debugFlag) {
+        printf("Client %d disconnected\n", clientIndex);
       }
+      statsAdd(STATS_HEARTBEAT_TIMEOUTS, 1);
+      TRACE(TRACE_CLIENT_EXPIRED, clientIndex,
+            TRACE_ADDRESS(clientUdpAddresses[clientIndex]));
+      statsSubtract(STATS_CONNECTED_CLIENTS, 1);
+      parkClientSession(clientIndex, debugFlag);
+      removeConnectedClient(clientIndex);
     }
+    expireParkedSessions(&parkedSessions, getMicroseconds());
+    pthread_rwlock_unlock(&directoryLock);
   }
   free(statusPacket);
 }
@@ -191,41 +791,16 @@ void* checkClientStatus(void* input) {
 void shutdownServer() {
   free(packet);
   close(udpSocketDescriptor);
+  closeStatsSocket(statsSocketDescriptor, SERVER_STATS_PATH);
+  closeCapture(&capture);
+  if (handoffSocketDescriptor != -1) {
+    close(handoffSocketDescriptor);
+    unlink(SERVER_HANDOFF_PATH);
+  }
   printf("\n");
   exit(0);
 }
 
-/*
- * Purpose: Loop through the connectedClients array until an empty spot is
- * found. Looks for unset UDP port.
- * Input: debugFlag
- * Output:
- * - -1: All spots in the connected client array are full
- * - Anything else: Index of the empty spot in the array
- */
-int findEmptyConnectedClient(bool debugFlag) {
-  int connectedClientsIndex;
-  for (connectedClientsIndex = 0; connectedClientsIndex < MAX_CONNECTED_CLIENTS;
-       connectedClientsIndex++) {
-    int port = ntohs(connectedClients[connectedClientsIndex].socketUdpAddress.sin_port);
-
-    // Port not set, empty spot
-    if (port == 0) {
-      return connectedClientsIndex;
-      if (debugFlag) {
-        printf("%d is empty\n", connectedClientsIndex);
-      }
-    } else {
-      if (debugFlag) {
-        printf("%d is not empty\n", connectedClientsIndex);
-      }
-    }
-  }
-
-  // All spots filled
-  return -1;
-}
-
 /*
  * Purpose: Print all the connected clients in a readable format
  * Input: None
@@ -240,13 +815,9 @@ void printAllConnectedClients() {
   char* username = calloc(1, MAX_USERNAME);
 
   int i;
-  for (i = 0; i < MAX_CONNECTED_CLIENTS; i++) {
-    udpAddress = ntohl(connectedClients[i].socketUdpAddress.sin_addr.s_addr);
-    udpPort    = ntohs(connectedClients[i].socketUdpAddress.sin_port);
-    if (udpAddress == 0 && udpPort == 0) {
-      i++;
-      continue;
-    }
+  for (i = nextConnectedClient(0); i != -1; i = nextConnectedClient(i + 1)) {
+    udpAddress = ntohl(clientUdpAddresses[i].sin_addr.s_addr);
+    udpPort    = ntohs(clientUdpAddresses[i].sin_port);
     tcpAddress = ntohl(connectedClients[i].socketTcpAddress.sin_addr.s_addr);
     tcpPort    = ntohs(connectedClients[i].socketTcpAddress.sin_port);
     strcpy(username, connectedClients[i].username);
@@ -272,29 +843,63 @@ void printAllConnectedClients() {
  * - How long the data field is
  * - Username of the client who sent the packet
  * - Debug flag
- * Output: None
+ * Output: Sum of hashResourceName() of the resources, whether or not the directory
+ * took them
  */
-void addResourcesToDirectory(char* dataField,
-                             long unsigned int dataFieldLength,
-                             char* username,
-                             bool debugFlag) {
+unsigned long addResourcesToDirectory(char* dataField,
+                                      long unsigned int dataFieldLength,
+                                      char* username,
+                                      bool debugFlag) {
   char* resource          = calloc(1, MAX_DATA);
   char* resourceBeginning = resource;
 
+  unsigned long resourceHash  = 0;
   long unsigned int bytesRead = 0;
-  while (bytesRead != dataFieldLength) {
-    dataField = readPacketSubfield(dataField, resource, debugFlag);
+  while (bytesRead < dataFieldLength) {
+    dataField = readPacketSubfield(dataField, resource, MAX_DATA, debugFlag);
     bytesRead += strlen(resource) + packetDelimiters.subfieldLength;
-    headResource = addResource(headResource, username, resource);
+    addResource(&resourceDirectory, username, resource);
+    resourceHash += hashResourceName(resource);
     memset(resource, 0, strlen(resource));
   }
   free(resourceBeginning);
+  return resourceHash;
+}
+
+/*
+ * Purpose: Send a client its session token, which it can resume its registration with
+ * after it stops hearing heartbeats, see handleSessionPacket()
+ * Input:
+ * - Address of the client
+ * - The token, 0 to tell the client its registration wasn't taken
+ * - Debug flag
+ * Output: None
+ */
+static void sendSessionPacket(struct sockaddr_in clientUdpAddress,
+                              unsigned long token,
+                              bool debugFlag) {
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "session");
+  snprintf(packetFields.data, MAX_DATA, "%lu%c", token, packetDelimiters.subfield[0]);
+
+  char* sessionPacket = calloc(1, MAX_PACKET);
+  buildPacket(sessionPacket, packetFields, debugFlag);
+  sendUdpMessage(udpSocketDescriptor, clientUdpAddress, sessionPacket, debugFlag);
+  free(sessionPacket);
 }
 
 /*
  * Purpose: When the server receives a connection packet, this function handles
  * the data in that packet. It finds an empty connected client and enters the
- * packet sender's information into that empty spot.
+ * packet sender's information into that empty spot. A client that connects again
+ * from the same address replaces its old entry. The packet holds the client's
+ * resources if they all fit, otherwise the number of register packets that will
+ * follow with them. A client can send a counting Bloom filter of its filenames in the
+ * register packets instead, the packet then says how many cells it has and what its
+ * filenames hash to. The client is sent a session token to resume the registration
+ * with later, or a token of 0 if its connection is rejected: its summary is invalid or
+ * doesn't fit, or its username has a summary and another client is connected with it.
  * Input:
  * - The connection packet that was sent
  * - The address of the client who sent the packet
@@ -303,103 +908,338 @@ void addResourcesToDirectory(char* dataField,
 void handleConnectionPacket(char* packetData,
                             struct sockaddr_in clientUDPAddress,
                             bool debugFlag) {
-  int emptyClientIndex                = findEmptyConnectedClient(debugFlag);
-  struct ConnectedClient* emptyClient = &connectedClients[emptyClientIndex];
-
-  // Connection info and status
-  emptyClient->socketUdpAddress.sin_addr.s_addr = clientUDPAddress.sin_addr.s_addr;
-  emptyClient->socketUdpAddress.sin_port        = clientUDPAddress.sin_port;
-  emptyClient->status                           = true;
+  int oldClientIndex = findConnectedClient(clientUDPAddress);
+  if (oldClientIndex != -1) {
+    removeUserResources(&resourceDirectory, connectedClients[oldClientIndex].username,
+                        debugFlag);
+    removeConnectedClient(oldClientIndex);
+    statsSubtract(STATS_CONNECTED_CLIENTS, 1);
+  }
 
   // Username
   char* username          = calloc(1, MAX_USERNAME);
   char* usernameBeginning = username;
-  packetData              = readPacketSubfield(packetData, username, debugFlag);
-  strcpy(emptyClient->username, username);
+  packetData = readPacketSubfield(packetData, username, MAX_USERNAME, debugFlag);
+  bool usernameTaken      = findConnectedClientByUsername(username) != -1;
+
+  // Connection info, the client starts out alive
+  int emptyClientIndex = addConnectedClient(clientUDPAddress, username);
+  if (emptyClientIndex == -1) {
+    if (debugFlag) {
+      printf("User directory full, connection rejected\n");
+    }
+    free(usernameBeginning);
+    return;
+  }
+  struct ConnectedClient* emptyClient = &connectedClients[emptyClientIndex];
+  statsAdd(STATS_CONNECTED_CLIENTS, 1);
+  TRACE(TRACE_CLIENT_CONNECTED, emptyClientIndex, TRACE_ADDRESS(clientUDPAddress));
 
   char* tcpInfo = calloc(1, 64);
   char* end;
 
-  packetData   = readPacketSubfield(packetData, tcpInfo, debugFlag);
+  packetData   = readPacketSubfield(packetData, tcpInfo, 64, debugFlag);
   long address = strtol(tcpInfo, &end, 10);
   emptyClient->socketTcpAddress.sin_addr.s_addr = (unsigned int)address;
 
   memset(tcpInfo, 0, 64);
 
-  packetData = readPacketSubfield(packetData, tcpInfo, debugFlag);
+  packetData = readPacketSubfield(packetData, tcpInfo, 64, debugFlag);
   long port  = strtol(tcpInfo, &end, 10);
   emptyClient->socketTcpAddress.sin_port = (unsigned short)port;
 
+  memset(tcpInfo, 0, 64);
+
+  packetData = readPacketSubfield(packetData, tcpInfo, 64, debugFlag);
+  emptyClient->registrationChunks = (unsigned int)strtoul(tcpInfo, &end, 10);
+
+  memset(tcpInfo, 0, 64);
+
+  packetData                = readPacketSubfield(packetData, tcpInfo, 64, debugFlag);
+  unsigned long summaryCells = strtoul(tcpInfo, &end, 10);
+
+  // A summary doesn't carry the filenames, so the client says what they hash to
+  if (summaryCells != 0) {
+    memset(tcpInfo, 0, 64);
+    packetData                = readPacketSubfield(packetData, tcpInfo, 64, debugFlag);
+    emptyClient->resourceHash = strtoul(tcpInfo, &end, 10);
+  }
+
   free(tcpInfo);
 
-  addResourcesToDirectory(packetData, strlen(packetData), username, debugFlag);
+  // A summary is kept under its username, so a summarized client can't share its
+  // username with another connected client
+  bool rejected =
+      usernameTaken &&
+      (summaryCells != 0 || findResourceSummary(&resourceDirectory, username) != NULL);
+  rejected = rejected || emptyClient->registrationChunks > MAX_REGISTRATION_CHUNKS;
+  if (!rejected && summaryCells != 0) {
+    bool added = addResourceSummary(&resourceDirectory, username, summaryCells);
+    emptyClient->summarized =
+        added && emptyClient->registrationChunks == summaryCells / BLOOM_CELLS_PER_CHUNK;
+    if (added && !emptyClient->summarized) {
+      removeResourceSummary(&resourceDirectory, username);
+    }
+    rejected = !emptyClient->summarized;
+  }
+  if (rejected) {
+    if (debugFlag) {
+      printf("Connection from %s rejected\n", username);
+    }
+    removeConnectedClient(emptyClientIndex);
+    statsSubtract(STATS_CONNECTED_CLIENTS, 1);
+    free(usernameBeginning);
+    sendSessionPacket(clientUDPAddress, 0, debugFlag);
+    return;
+  }
+
+  if (summaryCells == 0) {
+    emptyClient->resourceHash =
+        addResourcesToDirectory(packetData, strlen(packetData), username, debugFlag);
+  }
 
   free(usernameBeginning);
 
+  if (emptyClient->registrationChunks > 0) {
+    emptyClient->chunkBits =
+        calloc((emptyClient->registrationChunks + CHUNK_WORD_BITS - 1) / CHUNK_WORD_BITS,
+               sizeof(unsigned long));
+  }
+  emptyClient->sessionToken = newSessionToken();
+  sendSessionPacket(clientUDPAddress, emptyClient->sessionToken, debugFlag);
+
   if (debugFlag) {
     printAllConnectedClients();
-    printAllResources(headResource);
+    printAllResources(&resourceDirectory);
   }
 }
 
 /*
- * Purpose: When the server receives a status packet, this function handles the
- * data in that packet. It loops through all the connected clients and finds the
- * one who sent the status packet. The status of the client who sent the packet
- * is set to indicate that the client is still connected.
+ * Purpose: When the server receives a register packet, the resources in it are added
+ * to the directory under the client that sent it. Register packets carry the resources
+ * of clients with too many to fit in their connection packet, one chunk of them each,
+ * or BLOOM_CELLS_PER_CHUNK cells of a client's filter.
+ * They are only sent once the connection packet has been acked, so a chunk from an
+ * address that isn't connected or that wasn't promised is dropped.
  * Input:
- * - The address of the client who sent the status packet
+ * - Data field of the register packet, the index of the chunk then its resources
+ * - The address of the client who sent the packet
+ * - Debug flag
  * Output: None
  */
-void handleStatusPacket(struct sockaddr_in clientUdpAddress) {
-  int clientIndex;
-  struct ConnectedClient* currentClient;
+void handleRegisterPacket(char* packetData,
+                          struct sockaddr_in clientUdpAddress,
+                          bool debugFlag) {
+  int clientIndex = findConnectedClient(clientUdpAddress);
+  if (clientIndex == -1) {
+    if (debugFlag) {
+      printf("Register packet from a client that isn't connected, dropped\n");
+    }
+    return;
+  }
+  struct ConnectedClient* client = &connectedClients[clientIndex];
 
-  for (clientIndex = 0; clientIndex < MAX_CONNECTED_CLIENTS; clientIndex++) {
-    currentClient = &connectedClients[clientIndex];
+  char chunkInfo[MAX_DATA];
+  memset(chunkInfo, 0, sizeof(chunkInfo));
+  char* resources =
+      readPacketSubfield(packetData, chunkInfo, sizeof(chunkInfo), debugFlag);
+  char* end                = NULL;
+  unsigned long chunkIndex = strtoul(chunkInfo, &end, 10);
+  if (end == chunkInfo || chunkIndex >= client->registrationChunks ||
+      client->chunkBits == NULL) {
+    if (debugFlag) {
+      printf("Unexpected register packet from %s, dropped\n", client->username);
+    }
+    return;
+  }
+  // Retransmissions can outlive the reliable layer's memory of what it has handled,
+  // and a chunk counted or hashed twice would leave the registration wrong
+  unsigned long* chunkWord = &client->chunkBits[chunkIndex / CHUNK_WORD_BITS];
+  unsigned long chunkBit   = 1ul << (chunkIndex % CHUNK_WORD_BITS);
+  if (*chunkWord & chunkBit) {
+    if (debugFlag) {
+      printf("Register packet %lu from %s already received, dropped\n", chunkIndex + 1,
+             client->username);
+    }
+    return;
+  }
 
-    // Client
-    unsigned long currentClientAddress =
-        connectedClients[clientIndex].socketUdpAddress.sin_addr.s_addr;
-    unsigned short currentClientPort =
-        connectedClients[clientIndex].socketUdpAddress.sin_port;
+  if (client->summarized) {
+    struct ResourceSummary* summary =
+        findResourceSummary(&resourceDirectory, client->username);
+    if (summary == NULL) {
+      if (debugFlag) {
+        printf("Register packet for a summary %s no longer has, dropped\n",
+               client->username);
+      }
+      return;
+    }
+    char cells[MAX_DATA];
+    memset(cells, 0, sizeof(cells));
+    readPacketSubfield(resources, cells, sizeof(cells), debugFlag);
+    decodeBloomCells(&summary->filter, chunkIndex * BLOOM_CELLS_PER_CHUNK, cells);
+  } else {
+    client->resourceHash += addResourcesToDirectory(resources,
+                                                    strlen(resources),
+                                                    client->username,
+                                                    debugFlag);
+  }
+  *chunkWord |= chunkBit;
+  client->chunksReceived++;
+  if (debugFlag) {
+    printf("Register packet %lu of %u from %s\n", chunkIndex + 1,
+           client->registrationChunks, client->username);
+  }
+  if (client->chunksReceived == client->registrationChunks) {
+    free(client->chunkBits);
+    client->chunkBits = NULL;
+    if (debugFlag) {
+      printf("Registration of %s complete\n", client->username);
+    }
+  }
+}
 
-    // Packet sender
-    unsigned long incomingAddress = clientUdpAddress.sin_addr.s_addr;
-    unsigned short incomingPort   = clientUdpAddress.sin_port;
+/*
+ * Purpose: When the server receives a session packet, a client that stopped hearing
+ * heartbeats wants to resume its registration. It sends the session token it was given
+ * when it connected and the hash of the files it shares. If its session is parked and
+ * its files haven't changed since, the client and its resources are put back without
+ * it sending them again. A client that was never expired just has its token sent back.
+ * Anything else is sent a token of 0 and connects again in full.
+ * Input:
+ * - Data field of the session packet, the token then the hash
+ * - The address of the client who sent the packet, which can have changed
+ * - Debug flag
+ * Output: None
+ */
+void handleSessionPacket(char* packetData,
+                         struct sockaddr_in clientUdpAddress,
+                         bool debugFlag) {
+  char subfield[MAX_DATA];
+  memset(subfield, 0, sizeof(subfield));
+  packetData = readPacketSubfield(packetData, subfield, sizeof(subfield), debugFlag);
+  unsigned long token = strtoul(subfield, NULL, 10);
+  memset(subfield, 0, sizeof(subfield));
+  readPacketSubfield(packetData, subfield, sizeof(subfield), debugFlag);
+  unsigned long resourceHash = strtoul(subfield, NULL, 10);
 
-    // Empty client
-    if (currentClientAddress == 0 && currentClientPort == 0) {
-      continue;
+  // Heartbeats to the client were lost, but not enough of them to expire it
+  int clientIndex = findConnectedClient(clientUdpAddress);
+  if (clientIndex != -1 && token != 0 &&
+      connectedClients[clientIndex].sessionToken == token) {
+    bool current = connectedClients[clientIndex].resourceHash == resourceHash;
+    if (current) {
+      markClientAlive(clientIndex);
     }
+    sendSessionPacket(clientUdpAddress, current ? token : 0, debugFlag);
+    return;
+  }
 
-    // Packet sender is client. They sent a response and are still connected
-    if (currentClientAddress == incomingAddress && currentClientPort == incomingPort) {
-      currentClient->status = 1;
+  // A session whose files changed, or whose user has connected again since, is no use
+  struct ParkedSession* session = takeParkedSession(&parkedSessions, token);
+  if (session == NULL || session->resourceHash != resourceHash ||
+      findConnectedClientByUsername(session->username) != -1) {
+    if (debugFlag) {
+      printf("Session can't be resumed, the client has to connect again\n");
     }
+    if (session != NULL) {
+      freeParkedSession(session);
+    }
+    sendSessionPacket(clientUdpAddress, 0, debugFlag);
+    return;
+  }
+
+  // Replaces whichever client was at the address, as a connection packet would
+  if (clientIndex != -1) {
+    removeUserResources(&resourceDirectory, connectedClients[clientIndex].username,
+                        debugFlag);
+    removeConnectedClient(clientIndex);
+    statsSubtract(STATS_CONNECTED_CLIENTS, 1);
+  }
+  clientIndex = addConnectedClient(clientUdpAddress, session->username);
+  if (clientIndex == -1) {
+    if (debugFlag) {
+      printf("User directory full, session of %s dropped\n", session->username);
+    }
+    freeParkedSession(session);
+    sendSessionPacket(clientUdpAddress, 0, debugFlag);
+    return;
+  }
+  struct ConnectedClient* client = &connectedClients[clientIndex];
+  client->socketTcpAddress       = session->tcpAddress;
+  client->sessionToken           = session->token;
+  client->resourceHash           = session->resourceHash;
+  statsAdd(STATS_CONNECTED_CLIENTS, 1);
+  TRACE(TRACE_CLIENT_CONNECTED, clientIndex, TRACE_ADDRESS(clientUdpAddress));
+
+  // A summary that no longer fits leaves lookups unable to find the client until it
+  // connects again, as after a handoff
+  if (session->summary.cellCount != 0 &&
+      addResourceSummary(&resourceDirectory, session->username,
+                         session->summary.cellCount)) {
+    struct ResourceSummary* summary =
+        findResourceSummary(&resourceDirectory, session->username);
+    memcpy(summary->filter.counters, session->summary.counters,
+           getBloomBytes(&session->summary));
+    client->summarized = true;
+  }
+  char* filename = session->filenames;
+  unsigned long i;
+  for (i = 0; i < session->filenameCount; i++) {
+    addResource(&resourceDirectory, session->username, filename);
+    filename += strlen(filename) + 1;
+  }
+  statsAdd(STATS_SESSIONS_RESUMED, 1);
+  sendSessionPacket(clientUdpAddress, session->token, debugFlag);
+  if (debugFlag) {
+    printf("Session of %s resumed with %lu resources\n", session->username,
+           session->filenameCount);
+  }
+  freeParkedSession(session);
+}
+
+/*
+ * Purpose: When the server receives a status packet, this function handles the
+ * data in that packet. It finds the connected client who sent the status packet.
+ * The client is marked alive to indicate that it is still connected.
+ * Input:
+ * - The address of the client who sent the status packet
+ * Output: None
+ */
+void handleStatusPacket(struct sockaddr_in clientUdpAddress) {
+  int clientIndex = findConnectedClient(clientUdpAddress);
+
+  // Packet sender is client. They sent a response and are still connected
+  if (clientIndex != -1) {
+    markClientAlive(clientIndex);
   }
 }
 
 /*
  * Purpose: Servers actions upon receiving a resource packet. When a resource
  * packet is received, it means a client requested the available resources in
- * the network. This function gathers those available resources and sends them
- * to the client that requested them.
+ * the network. This function gathers one page of those available resources and
+ * sends it to the client that requested them, see makeCompressedResourceString().
  * Input:
+ * - Data field of the resource packet, the index of the first resource to send
  * - Client that inquired about the available resources
  * - Debug flag
  * Output: 0
  */
-int handleResourcePacket(struct sockaddr_in clientUdpAddress, bool debugFlag) {
+int handleResourcePacket(char* dataField,
+                         struct sockaddr_in clientUdpAddress,
+                         bool debugFlag) {
   struct PacketFields packetFields;
   memset(&packetFields, 0, sizeof(packetFields));
   strcpy(packetFields.type, "resource");
 
-  char* resourceString = calloc(1, MAX_DATA);
-  resourceString =
-      makeResourceString(resourceString, headResource, packetDelimiters.subfield);
-  strcpy(packetFields.data, resourceString);
-  free(resourceString);
+  // Anything that isn't an index asks for the first page
+  unsigned long startIndex = strtoul(dataField, NULL, 10);
+  makeCompressedResourceString(packetFields.data, &resourceDirectory, startIndex,
+                               packetDelimiters.subfield[0]);
+  if (debugFlag) {
+    printf("Sending resource page starting at %lu\n", startIndex);
+  }
 
   char* returnPacket = calloc(1, MAX_PACKET);
   buildPacket(returnPacket, packetFields, debugFlag);
@@ -408,3 +1248,281 @@ int handleResourcePacket(struct sockaddr_in clientUdpAddress, bool debugFlag) {
 
   return 0;
 }
+
+/*
+ * Purpose: Servers actions upon receiving a peers packet. The client is bootstrapping
+ * or refreshing its gossip peers, so it is sent a small random sample of the other
+ * connected clients. The sample is a fixed size so the cost to the server does not
+ * grow with the number of clients.
+ * Input:
+ * - Client that asked for peers
+ * - Debug flag
+ * Output: None
+ */
+void handlePeersPacket(struct sockaddr_in clientUdpAddress, bool debugFlag) {
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "peers");
+
+  int peerCount  = 0;
+  int startIndex = rand() % MAX_CONNECTED_CLIENTS;
+  char delimiter = packetDelimiters.subfield[0];
+
+  // Walk the connected clients from a random one, wrapping around once
+  int firstIndex = nextConnectedClient(startIndex);
+  if (firstIndex == -1) {
+    firstIndex = nextConnectedClient(0);
+  }
+  int clientIndex = firstIndex;
+  while (clientIndex != -1 && peerCount < PEERS_PER_PACKET) {
+    int peerIndex = clientIndex;
+    clientIndex   = nextConnectedClient(clientIndex + 1);
+    if (clientIndex == -1) {
+      clientIndex = nextConnectedClient(0);
+    }
+    if (clientIndex == firstIndex) {
+      clientIndex = -1; // Back where the walk started
+    }
+
+    struct ConnectedClient* client = &connectedClients[peerIndex];
+    struct sockaddr_in peerAddress = clientUdpAddresses[peerIndex];
+    // Don't tell a client about itself
+    if (peerAddress.sin_addr.s_addr == clientUdpAddress.sin_addr.s_addr &&
+        peerAddress.sin_port == clientUdpAddress.sin_port) {
+      continue;
+    }
+
+    char peer[MAX_DATA];
+    snprintf(peer, sizeof(peer), "%s%c%u%c%u%c", client->username, delimiter,
+             peerAddress.sin_addr.s_addr, delimiter, peerAddress.sin_port, delimiter);
+    if (strlen(packetFields.data) + strlen(peer) >= MAX_DATA) {
+      break;
+    }
+    strcat(packetFields.data, peer);
+    peerCount++;
+  }
+
+  if (debugFlag) {
+    printf("Sending %d peers\n", peerCount);
+  }
+  sendUdpPacket(udpSocketDescriptor, clientUdpAddress, packetFields, debugFlag);
+}
+
+/*
+ * Purpose: Servers actions upon receiving an announce packet. A connected client
+ * added or removed a single resource, so the resource directory is updated without
+ * the client having to reconnect. Clients that registered a filter have the filename
+ * counted in or out of it.
+ * Input:
+ * - Data field of the announce packet. + or - followed by the filename.
+ * - Client that sent the announce packet
+ * - Debug flag
+ * Output: None
+ */
+void handleAnnouncePacket(char* packetData,
+                          struct sockaddr_in clientUdpAddress,
+                          bool debugFlag) {
+  int clientIndex = findConnectedClient(clientUdpAddress);
+  if (clientIndex == -1) {
+    if (debugFlag) {
+      printf("Announce packet from unknown client\n");
+    }
+    return;
+  }
+  struct ConnectedClient* client = &connectedClients[clientIndex];
+
+  char* operation = calloc(1, MAX_DATA);
+  char* filename  = calloc(1, MAX_DATA);
+  packetData      = readPacketSubfield(packetData, operation, MAX_DATA, debugFlag);
+  readPacketSubfield(packetData, filename, MAX_DATA, debugFlag);
+
+  struct ResourceSummary* summary = NULL;
+  if (client->summarized) {
+    summary = findResourceSummary(&resourceDirectory, client->username);
+  }
+  // Follows the files the client has, whether or not the directory takes them
+  bool validFilename = strlen(filename) != 0 && strlen(filename) < MAX_FILENAME;
+  if (validFilename && strcmp(operation, "+") == 0) {
+    client->resourceHash += hashResourceName(filename);
+  } else if (validFilename && strcmp(operation, "-") == 0) {
+    client->resourceHash -= hashResourceName(filename);
+  }
+  if (!validFilename) {
+    if (debugFlag) {
+      printf("Invalid filename in announce packet\n");
+    }
+  } else if (summary != NULL && strcmp(operation, "+") == 0) {
+    addBloomKey(&summary->filter, filename);
+  } else if (summary != NULL && strcmp(operation, "-") == 0) {
+    removeBloomKey(&summary->filter, filename);
+  } else if (strcmp(operation, "+") == 0) {
+    addResource(&resourceDirectory, client->username, filename);
+  } else if (strcmp(operation, "-") == 0) {
+    removeResource(&resourceDirectory, client->username, filename, debugFlag);
+  }
+  free(operation);
+  free(filename);
+
+  if (debugFlag) {
+    printAllResources(&resourceDirectory);
+  }
+}
+
+/*
+ * Purpose: Add an owner of a file to a lookup packet being built
+ * Input:
+ * - Data field of the lookup packet
+ * - Index of the owner in the client table
+ * - Whether the owner is known to have the file, or only might have it
+ * Output: Whether the owner fit in the packet
+ */
+static bool addLookupOwner(char* data, int clientIndex, bool certain) {
+  char delimiter                      = packetDelimiters.subfield[0];
+  struct ConnectedClient* ownerClient = &connectedClients[clientIndex];
+  struct sockaddr_in ownerUdpAddress  = clientUdpAddresses[clientIndex];
+  char ownerInfo[MAX_DATA];
+  snprintf(ownerInfo, sizeof(ownerInfo), "%s%c%u%c%u%c%u%c%u%c%d%c",
+           ownerClient->username, delimiter, ownerUdpAddress.sin_addr.s_addr, delimiter,
+           ownerUdpAddress.sin_port, delimiter,
+           ownerClient->socketTcpAddress.sin_addr.s_addr, delimiter,
+           ownerClient->socketTcpAddress.sin_port, delimiter, certain, delimiter);
+  if (strlen(data) + strlen(ownerInfo) >= MAX_DATA) {
+    return false;
+  }
+  strcat(data, ownerInfo);
+  return true;
+}
+
+/*
+ * Purpose: Servers actions upon receiving a lookup packet. The client wants to know
+ * who has a single file. The filename is sent back followed by the username, UDP
+ * address and TCP address of every owner that fits in the packet, and whether the
+ * owner is known to have the file. Owners that registered a filter might not have it,
+ * the client asks them before downloading.
+ * Input:
+ * - Data field of the lookup packet. The filename.
+ * - Client that sent the lookup packet
+ * - Whether the lookup was sent reliably, if so the reply is too while there is room
+ *   for it in the reliable window
+ * - Debug flag
+ * Output: None
+ */
+void handleLookupPacket(char* packetData,
+                        struct sockaddr_in clientUdpAddress,
+                        bool reliable,
+                        bool debugFlag) {
+  char* filename = calloc(1, MAX_DATA);
+  readPacketSubfield(packetData, filename, MAX_DATA, debugFlag);
+  if (strlen(filename) == 0 || strlen(filename) >= MAX_FILENAME) {
+    free(filename);
+    return;
+  }
+
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "lookup");
+  strcpy(packetFields.data, filename);
+  strncat(packetFields.data, packetDelimiters.subfield, packetDelimiters.subfieldLength);
+
+  int ownerCount;
+  unsigned int* owners = findResourceOwners(&resourceDirectory, filename, &ownerCount);
+  bool full            = false;
+  int i;
+  for (i = 0; i < ownerCount && !full; i++) {
+    char* username  = getUsername(&resourceDirectory.usernames, owners[i]);
+    int clientIndex = findConnectedClientByUsername(username);
+    if (clientIndex != -1) {
+      full = !addLookupOwner(packetFields.data, clientIndex, true);
+    }
+  }
+  unsigned int summaryIndex = 0;
+  char* username;
+  while (!full && (username = nextPossibleOwner(&resourceDirectory, filename,
+                                                &summaryIndex)) != NULL) {
+    int clientIndex = findConnectedClientByUsername(username);
+    if (clientIndex != -1) {
+      full = !addLookupOwner(packetFields.data, clientIndex, false);
+    }
+  }
+  free(filename);
+
+  // The lookup has already been marked seen, so its retransmissions won't be answered.
+  // If too many replies are waiting for acks this one is sent once rather than dropped.
+  int sent = -1;
+  if (reliable) {
+    pthread_mutex_lock(&reliableMutex);
+    sent = sendReliablePacket(&reliableState, udpSocketDescriptor, clientUdpAddress,
+                              packetFields, debugFlag);
+    pthread_mutex_unlock(&reliableMutex);
+  }
+  if (sent == -1) {
+    sendUdpPacket(udpSocketDescriptor, clientUdpAddress, packetFields, debugFlag);
+  }
+}
+
+/*
+ * Purpose: Servers actions upon receiving a search packet. The client wants every file
+ * whose name starts with a prefix. As many of them as fit are sent back, see
+ * makeSearchString().
+ * Input:
+ * - Data field of the search packet. The prefix.
+ * - Client that sent the search packet
+ * - Debug flag
+ * Output: None
+ */
+void handleSearchPacket(char* packetData,
+                        struct sockaddr_in clientUdpAddress,
+                        bool debugFlag) {
+  char* prefix = calloc(1, MAX_DATA);
+  readPacketSubfield(packetData, prefix, MAX_DATA, debugFlag);
+  if (strlen(prefix) >= MAX_FILENAME) {
+    free(prefix);
+    return;
+  }
+
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "search");
+  makeSearchString(packetFields.data, &resourceDirectory, prefix,
+                   packetDelimiters.subfield[0]);
+  free(prefix);
+
+  sendUdpPacket(udpSocketDescriptor, clientUdpAddress, packetFields, debugFlag);
+}
+
+/*
+ * Purpose: Servers actions upon receiving a find packet. The client wants every file
+ * whose name contains a substring, ignoring case. As many of them as fit are sent
+ * back, see makeSubstringSearchString(). A substring too short for the trigram index
+ * is answered with no files and marked incomplete, one too long to be in a filename
+ * with no files.
+ * Input:
+ * - Data field of the find packet. The substring.
+ * - Client that sent the find packet
+ * - Debug flag
+ * Output: None
+ */
+void handleFindPacket(char* packetData,
+                      struct sockaddr_in clientUdpAddress,
+                      bool debugFlag) {
+  char* substring = calloc(1, MAX_DATA);
+  readPacketSubfield(packetData, substring, MAX_DATA, debugFlag);
+  unsigned long length = strlen(substring);
+
+  struct PacketFields packetFields;
+  memset(&packetFields, 0, sizeof(packetFields));
+  strcpy(packetFields.type, "find");
+  char delimiter = packetDelimiters.subfield[0];
+  if (length >= TRIGRAM_LENGTH && length < MAX_FILENAME) {
+    makeSubstringSearchString(packetFields.data, &resourceDirectory, substring,
+                              delimiter);
+  } else {
+    // The client still gets an answer to stop waiting for
+    substring[MAX_FILENAME - 1] = '\0';
+    snprintf(packetFields.data, MAX_DATA, "%s%c%d%c", substring, delimiter,
+             length < TRIGRAM_LENGTH, delimiter);
+  }
+  free(substring);
+
+  sendUdpPacket(udpSocketDescriptor, clientUdpAddress, packetFields, debugFlag);
+}
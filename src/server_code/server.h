@@ -4,29 +4,83 @@
 // Microseconds
 #define STATUS_SEND_INTERVAL 3000000
 
-// Maximum number of clients that can be connected to the server
-#define MAX_CONNECTED_CLIENTS 100
+// UNIX domain socket the stats can be read from
+#define SERVER_STATS_PATH "server.stats"
 
+// Maximum number of peers sent back in response to a peers packet
+#define PEERS_PER_PACKET 4
+
+// Memory the resource directory can use by default, see -m. 0 for no limit.
+#define DEFAULT_DIRECTORY_BUDGET_MB 1024
+
+// Most resources a single user can have in the directory by default, see -q. 0 for no
+// limit.
+#define DEFAULT_USER_QUOTA 100000
+
+// Workers that parse and handle packets by default, see -w
+#define DEFAULT_PIPELINE_WORKERS 4
+#define MAX_PIPELINE_WORKERS     8
+
+// Received packets waiting for each worker. Packets for a worker whose ring is full
+// are dropped.
+#define PIPELINE_RING_SIZE 1024
+
+// Packets waiting for the send stage. Workers wait for room when it is full.
+#define SEND_RING_SIZE 4096
+
+// Longest the receive stage sleeps waiting for a datagram in microseconds, so a reliable
+// reply a worker sends meanwhile is retransmitted at most this late
+#define RECEIVE_IDLE_TIMEOUT 20000
+
+#include <pthread.h>
 #include <stdbool.h>
 
-// Data about a client connected to the server
-// Could improve by changing to a linked list
-struct ConnectedClient {
-  char username[MAX_USERNAME];
-  struct sockaddr_in socketUdpAddress;
-  struct sockaddr_in socketTcpAddress;
-  bool status;          // If the client is connected or not
-  bool requestedStatus; // If the server has sent a request asking if the client
-                        // is still connnected
+#include "../common/capture.h"
+#include "../common/ring.h"
+#include "resource.h"
+
+// A packet on its way from the receive stage to a worker
+struct ReceivedPacket {
+  struct sockaddr_in address;
+  unsigned long receiveTime; // Nanoseconds
+  int packetType;            // See classifyPacket()
+  char packet[MAX_PACKET];
+};
+
+struct PipelineWorker {
+  struct SpscRing ring; // Filled by the receive stage, emptied by the worker
+  pthread_t thread;
+  int index;
+  bool debugFlag;
+  unsigned long pushed; // Packets given to the worker, only used by the receive stage
+  atomic_ulong handled; // Packets the worker has handled, see drainPipeline()
 };
 
+int checkLimitArguments(int, char**, struct ResourceDirectory*);
+int checkPipelineArguments(int, char**, int*);
+int checkHandoffArguments(int, char**, bool*);
+int checkCaptureArguments(int, char**, struct Capture*);
+bool receivePacket(bool);
+void startPipeline(bool);
+int pickWorker(struct sockaddr_in);
+void* runPipelineWorker(void*);
+void drainPipeline();
+void checkHandoffSocket(bool);
+void waitForActivity(bool);
+void handleReceivedPacket(struct ReceivedPacket*, bool);
 void* checkClientStatus(void*);
 void shutdownServer();
-int findEmptyConnectedClient(bool);
 void printAllConnectedClients();
-void addResourcesToDirectory(char*, long unsigned int, char*, bool);
+unsigned long addResourcesToDirectory(char*, long unsigned int, char*, bool);
 void handleConnectionPacket(char*, struct sockaddr_in, bool);
+void handleRegisterPacket(char*, struct sockaddr_in, bool);
+void handleSessionPacket(char*, struct sockaddr_in, bool);
 void handleStatusPacket(struct sockaddr_in);
-int handleResourcePacket(struct sockaddr_in, bool);
+int handleResourcePacket(char*, struct sockaddr_in, bool);
+void handlePeersPacket(struct sockaddr_in, bool);
+void handleAnnouncePacket(char*, struct sockaddr_in, bool);
+void handleLookupPacket(char*, struct sockaddr_in, bool, bool);
+void handleSearchPacket(char*, struct sockaddr_in, bool);
+void handleFindPacket(char*, struct sockaddr_in, bool);
 
 #endif
@@ -0,0 +1,282 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+
+#include "../common/stats.h"
+#include "session.h"
+
+/*
+ * Purpose: Set up an empty table of parked sessions
+ * Input: The table
+ * Output: None
+ */
+void initSessionTable(struct SessionTable* table) {
+  memset(table, 0, sizeof(*table));
+  table->slotCount = SESSION_INDEX_INITIAL_SLOTS;
+  table->slots     = calloc(table->slotCount, sizeof(*table->slots));
+}
+
+/*
+ * Purpose: Make a token for a new session. Tokens are random so that a client can only
+ * resume its own registration.
+ * Input: None
+ * Output: The token, never 0
+ */
+unsigned long newSessionToken() {
+  unsigned long token = 0;
+  while (token == 0) {
+    if (getrandom(&token, sizeof(token), 0) != (long)sizeof(token)) {
+      // Only before the kernel's entropy pool is ready, a guessable token still works
+      token = getNanoseconds() * 0x9e3779b97f4a7c15UL;
+    }
+  }
+  return token;
+}
+
+/*
+ * Purpose: Start parking the registration of a client. Its filenames are added with
+ * addParkedFilename() and its summary, if it has one, is copied in by the caller.
+ * Input:
+ * - Session token of the client
+ * - Hash of the client's resource set
+ * - Username of the client
+ * - TCP address other clients download from
+ * Output: The session, not in a table yet
+ */
+struct ParkedSession* createParkedSession(unsigned long token,
+                                          unsigned long resourceHash,
+                                          char* username,
+                                          struct sockaddr_in tcpAddress) {
+  struct ParkedSession* session = calloc(1, sizeof(*session));
+  session->token                = token;
+  session->resourceHash         = resourceHash;
+  strncpy(session->username, username, MAX_USERNAME - 1);
+  session->tcpAddress = tcpAddress;
+  return session;
+}
+
+/*
+ * Purpose: Add a filename to a parked session, for takeUserResources()
+ * Input:
+ * - The session
+ * - The filename
+ * Output: None
+ */
+void addParkedFilename(void* data, char* filename) {
+  struct ParkedSession* session = data;
+  unsigned long length          = strlen(filename) + 1;
+  if (session->filenamesLength + length > session->filenamesCapacity) {
+    unsigned long capacity =
+        session->filenamesCapacity == 0 ? 256 : session->filenamesCapacity * 2;
+    while (session->filenamesLength + length > capacity) {
+      capacity *= 2;
+    }
+    session->filenames         = realloc(session->filenames, capacity);
+    session->filenamesCapacity = capacity;
+  }
+  memcpy(session->filenames + session->filenamesLength, filename, length);
+  session->filenamesLength += length;
+  session->filenameCount++;
+}
+
+/*
+ * Purpose: Free a parked session that isn't in a table
+ * Input: The session
+ * Output: None
+ */
+void freeParkedSession(struct ParkedSession* session) {
+  free(session->filenames);
+  freeCountingBloom(&session->summary);
+  free(session);
+}
+
+/*
+ * Purpose: Get the memory a parked session takes
+ * Input: The session
+ * Output: Bytes
+ */
+static unsigned long getParkedSessionBytes(struct ParkedSession* session) {
+  return sizeof(*session) + session->filenamesCapacity +
+         getBloomBytes(&session->summary);
+}
+
+/*
+ * Purpose: Add a session to the index
+ * Input:
+ * - The table, with room in its index
+ * - The session
+ * Output: None
+ */
+static void insertSessionSlot(struct SessionTable* table,
+                              struct ParkedSession* session) {
+  unsigned long slot = session->token & (table->slotCount - 1);
+  while (table->slots[slot] != NULL) {
+    slot = (slot + 1) & (table->slotCount - 1);
+  }
+  table->slots[slot] = session;
+}
+
+/*
+ * Purpose: Double the slots of the index and put every session back in it
+ * Input: The table
+ * Output: None
+ */
+static void growSessionIndex(struct SessionTable* table) {
+  free(table->slots);
+  table->slotCount *= 2;
+  table->slots = calloc(table->slotCount, sizeof(*table->slots));
+  struct ParkedSession* session;
+  for (session = table->oldest; session != NULL; session = session->newer) {
+    insertSessionSlot(table, session);
+  }
+}
+
+/*
+ * Purpose: Take a session out of the table. Sessions after it in the probe sequence are
+ * shifted back so lookups don't stop early at the gap.
+ * Input:
+ * - The table
+ * - Slot of the session in the index
+ * Output: None
+ */
+static void unlinkParkedSession(struct SessionTable* table, unsigned long slot) {
+  struct ParkedSession* session = table->slots[slot];
+  unsigned long mask            = table->slotCount - 1;
+  unsigned long empty           = slot;
+  unsigned long next            = (slot + 1) & mask;
+  while (table->slots[next] != NULL) {
+    unsigned long home = table->slots[next]->token & mask;
+    // Move the session back unless its home slot is between the gap and where it is
+    if (((next - home) & mask) >= ((next - empty) & mask)) {
+      table->slots[empty] = table->slots[next];
+      empty               = next;
+    }
+    next = (next + 1) & mask;
+  }
+  table->slots[empty] = NULL;
+
+  if (session->older != NULL) {
+    session->older->newer = session->newer;
+  } else {
+    table->oldest = session->newer;
+  }
+  if (session->newer != NULL) {
+    session->newer->older = session->older;
+  } else {
+    table->newest = session->older;
+  }
+  session->older = NULL;
+  session->newer = NULL;
+  table->sessionCount--;
+  table->bytesUsed -= getParkedSessionBytes(session);
+  statsSet(STATS_PARKED_SESSIONS, table->sessionCount);
+}
+
+/*
+ * Purpose: Find the slot of a session in the index
+ * Input:
+ * - The table
+ * - Token of the session
+ * Output: The slot, -1 if no session has the token
+ */
+static long findSessionSlot(struct SessionTable* table, unsigned long token) {
+  unsigned long slot = token & (table->slotCount - 1);
+  while (table->slots[slot] != NULL) {
+    if (table->slots[slot]->token == token) {
+      return (long)slot;
+    }
+    slot = (slot + 1) & (table->slotCount - 1);
+  }
+  return -1;
+}
+
+/*
+ * Purpose: Take the oldest session out of the table and free it
+ * Input: The table, not empty
+ * Output: None
+ */
+static void dropOldestSession(struct SessionTable* table) {
+  struct ParkedSession* oldest = table->oldest;
+  unsigned long slot           = oldest->token & (table->slotCount - 1);
+  while (table->slots[slot] != oldest) {
+    slot = (slot + 1) & (table->slotCount - 1);
+  }
+  unlinkParkedSession(table, slot);
+  freeParkedSession(oldest);
+}
+
+/*
+ * Purpose: Keep a session until it is resumed or expires. The oldest sessions are
+ * dropped if it doesn't fit in PARKED_SESSION_BUDGET otherwise.
+ * Input:
+ * - The table
+ * - The session, from createParkedSession()
+ * - When it expires, in microseconds
+ * Output: Whether the session was parked. If it wasn't, it is bigger than the whole
+ * budget and the caller still owns it.
+ */
+bool parkSession(struct SessionTable* table,
+                 struct ParkedSession* session,
+                 unsigned long expiresAt) {
+  unsigned long bytes = getParkedSessionBytes(session);
+  if (bytes > PARKED_SESSION_BUDGET) {
+    return false;
+  }
+  while (table->bytesUsed + bytes > PARKED_SESSION_BUDGET) {
+    dropOldestSession(table);
+  }
+  if ((table->sessionCount + 1) * 2 > table->slotCount) {
+    growSessionIndex(table);
+  }
+
+  session->expiresAt = expiresAt;
+  insertSessionSlot(table, session);
+  session->older = table->newest;
+  if (table->newest != NULL) {
+    table->newest->newer = session;
+  } else {
+    table->oldest = session;
+  }
+  table->newest = session;
+  table->sessionCount++;
+  table->bytesUsed += bytes;
+  statsSet(STATS_PARKED_SESSIONS, table->sessionCount);
+  return true;
+}
+
+/*
+ * Purpose: Take a session out of the table to resume it
+ * Input:
+ * - The table
+ * - Token of the session
+ * Output: The session, which the caller frees with freeParkedSession(). NULL if no
+ * session has the token.
+ */
+struct ParkedSession* takeParkedSession(struct SessionTable* table,
+                                        unsigned long token) {
+  long slot = findSessionSlot(table, token);
+  if (slot == -1) {
+    return NULL;
+  }
+  struct ParkedSession* session = table->slots[slot];
+  unlinkParkedSession(table, (unsigned long)slot);
+  return session;
+}
+
+/*
+ * Purpose: Drop the sessions that were parked too long ago to be resumed. Sessions are
+ * kept in the order they were parked, so only the expired ones are looked at.
+ * Input:
+ * - The table
+ * - Current time in microseconds
+ * Output: Number of sessions dropped
+ */
+unsigned long expireParkedSessions(struct SessionTable* table,
+                                   unsigned long currentTime) {
+  unsigned long expired = 0;
+  while (table->oldest != NULL && table->oldest->expiresAt <= currentTime) {
+    dropOldestSession(table);
+    expired++;
+  }
+  return expired;
+}
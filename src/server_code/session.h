@@ -0,0 +1,62 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+// Microseconds a client that stopped answering heartbeats can resume its registration
+// with its session token before it has to register again in full
+#define SESSION_RETENTION 120000000
+
+// Bytes of filenames and filters kept for parked sessions. The oldest are dropped to
+// make room for new ones.
+#define PARKED_SESSION_BUDGET (256UL * 1024 * 1024)
+
+// Slots in the index of parked sessions to start with, a power of two. It doubles
+// whenever it is half full.
+#define SESSION_INDEX_INITIAL_SLOTS 1024
+
+#include <netinet/in.h>
+#include <stdbool.h>
+
+#include "../common/bloom.h"
+#include "../common/network_node.h"
+
+// The registration of a client that stopped answering heartbeats, taken out of the
+// resource directory and kept until the client resumes it or SESSION_RETENTION passes
+struct ParkedSession {
+  unsigned long token;
+  unsigned long resourceHash; // Sum of hashResourceName() of the client's filenames
+  char username[MAX_USERNAME];
+  struct sockaddr_in tcpAddress;
+  unsigned long expiresAt; // Microseconds
+  char* filenames;         // Each one NUL terminated, one after the other
+  unsigned long filenamesLength;
+  unsigned long filenamesCapacity;
+  unsigned long filenameCount;
+  struct CountingBloom summary; // Of a summarized client, no cells otherwise
+  struct ParkedSession* older;
+  struct ParkedSession* newer;
+};
+
+// Parked sessions by token, and in the order they were parked so that the oldest
+// expire first
+struct SessionTable {
+  struct ParkedSession** slots; // Open addressing, linear probing, NULL when empty
+  unsigned long slotCount;
+  unsigned long sessionCount;
+  struct ParkedSession* oldest;
+  struct ParkedSession* newest;
+  unsigned long bytesUsed;
+};
+
+void initSessionTable(struct SessionTable*);
+unsigned long newSessionToken();
+struct ParkedSession* createParkedSession(unsigned long,
+                                          unsigned long,
+                                          char*,
+                                          struct sockaddr_in);
+void addParkedFilename(void*, char*);
+void freeParkedSession(struct ParkedSession*);
+bool parkSession(struct SessionTable*, struct ParkedSession*, unsigned long);
+struct ParkedSession* takeParkedSession(struct SessionTable*, unsigned long);
+unsigned long expireParkedSessions(struct SessionTable*, unsigned long);
+
+#endif
@@ -0,0 +1,437 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trigram.h"
+
+/*
+ * Purpose: Hash a filename, FNV-1a
+ * Input: The filename
+ * Output: The hash
+ */
+static unsigned int hashFilename(const char* filename) {
+  unsigned int hash = 2166136261u;
+  while (*filename != '\0') {
+    hash ^= (unsigned char)*filename;
+    hash *= 16777619u;
+    filename++;
+  }
+  return hash;
+}
+
+/*
+ * Purpose: Pack the trigram starting at a character, lowercased
+ * Input: First of the three characters
+ * Output: The trigram
+ */
+static unsigned int getTrigram(const char* characters) {
+  return (unsigned int)tolower((unsigned char)characters[0]) << 16 |
+         (unsigned int)tolower((unsigned char)characters[1]) << 8 |
+         (unsigned int)tolower((unsigned char)characters[2]);
+}
+
+/*
+ * Purpose: Put every filename that hasn't been removed back into a number of buckets
+ * Input:
+ * - The index
+ * - Number of buckets, a power of two
+ * Output: None
+ */
+static void rehashFilenames(struct TrigramIndex* index, unsigned int bucketCount) {
+  index->bytesUsed -= index->bucketCount * sizeof(unsigned int);
+  index->bucketCount = bucketCount;
+  free(index->buckets);
+  index->buckets = malloc(index->bucketCount * sizeof(unsigned int));
+  index->bytesUsed += index->bucketCount * sizeof(unsigned int);
+  memset(index->buckets, 0xff, index->bucketCount * sizeof(unsigned int));
+
+  unsigned int id;
+  for (id = 0; id < index->filenameCount; id++) {
+    struct IndexedFilename* indexed = &index->filenames[id];
+    if (indexed->filename[0] == '\0') {
+      continue;
+    }
+    unsigned int bucket   = hashFilename(indexed->filename) & (index->bucketCount - 1);
+    indexed->nextInBucket = index->buckets[bucket];
+    index->buckets[bucket] = id;
+  }
+}
+
+/*
+ * Purpose: Find the slot of a trigram's posting list, or the empty slot it would go in
+ * Input:
+ * - The index
+ * - The trigram
+ * Output: The slot
+ */
+static struct TrigramPosting* findPostingSlot(struct TrigramIndex* index,
+                                              unsigned int trigram) {
+  unsigned int hash = trigram * 2654435761u;
+  hash ^= hash >> 16;
+  unsigned int slot = hash & (index->postingCapacity - 1);
+  while (index->postings[slot].trigram != TRIGRAM_NONE &&
+         index->postings[slot].trigram != trigram) {
+    slot = (slot + 1) & (index->postingCapacity - 1);
+  }
+  return &index->postings[slot];
+}
+
+/*
+ * Purpose: Move the posting lists into a new table. Lists left empty by compaction
+ * are freed instead.
+ * Input:
+ * - The index
+ * - Slots in the new table, a power of two
+ * Output: None
+ */
+static void rebuildPostings(struct TrigramIndex* index, unsigned int capacity) {
+  struct TrigramPosting* oldPostings = index->postings;
+  unsigned int oldCapacity           = index->postingCapacity;
+  index->bytesUsed -= oldCapacity * sizeof(struct TrigramPosting);
+  index->postingCapacity = capacity;
+  index->postingCount    = 0;
+  index->postings        = malloc(capacity * sizeof(struct TrigramPosting));
+  index->bytesUsed += capacity * sizeof(struct TrigramPosting);
+  unsigned int slot;
+  for (slot = 0; slot < capacity; slot++) {
+    index->postings[slot].trigram = TRIGRAM_NONE;
+  }
+
+  for (slot = 0; slot < oldCapacity; slot++) {
+    struct TrigramPosting* posting = &oldPostings[slot];
+    if (posting->trigram == TRIGRAM_NONE) {
+      continue;
+    }
+    if (posting->idCount == 0) {
+      index->bytesUsed -= posting->idCapacity * sizeof(unsigned int);
+      free(posting->ids);
+      continue;
+    }
+    *findPostingSlot(index, posting->trigram) = *posting;
+    index->postingCount++;
+  }
+  free(oldPostings);
+}
+
+/*
+ * Purpose: Set up an empty index
+ * Input: The index
+ * Output: None
+ */
+void initTrigramIndex(struct TrigramIndex* index) {
+  memset(index, 0, sizeof(*index));
+  rehashFilenames(index, 64);
+  rebuildPostings(index, 256);
+}
+
+/*
+ * Purpose: Free everything in an index
+ * Input: The index
+ * Output: None
+ */
+void freeTrigramIndex(struct TrigramIndex* index) {
+  unsigned int slot;
+  for (slot = 0; slot < index->postingCapacity; slot++) {
+    if (index->postings[slot].trigram != TRIGRAM_NONE) {
+      free(index->postings[slot].ids);
+    }
+  }
+  free(index->postings);
+  free(index->filenames);
+  free(index->buckets);
+  memset(index, 0, sizeof(*index));
+}
+
+/*
+ * Purpose: Find the id of a filename in the index
+ * Input:
+ * - The index
+ * - The filename
+ * Output: Id of the filename, TRIGRAM_NONE if it isn't in the index
+ */
+static unsigned int findIndexedFilename(struct TrigramIndex* index, char* filename) {
+  unsigned int id = index->buckets[hashFilename(filename) & (index->bucketCount - 1)];
+  while (id != TRIGRAM_NONE) {
+    if (strcmp(index->filenames[id].filename, filename) == 0) {
+      return id;
+    }
+    id = index->filenames[id].nextInBucket;
+  }
+  return TRIGRAM_NONE;
+}
+
+/*
+ * Purpose: Add a filename to a trigram's posting list. Ids are added in increasing
+ * order, so the list stays sorted.
+ * Input:
+ * - The index
+ * - The trigram
+ * - Id of the filename
+ * Output: None
+ */
+static void appendPosting(struct TrigramIndex* index,
+                          unsigned int trigram,
+                          unsigned int id) {
+  if ((index->postingCount + 1) * 2 > index->postingCapacity) {
+    rebuildPostings(index, index->postingCapacity * 2);
+  }
+  struct TrigramPosting* posting = findPostingSlot(index, trigram);
+  if (posting->trigram == TRIGRAM_NONE) {
+    posting->trigram    = trigram;
+    posting->idCount    = 0;
+    posting->idCapacity = 0;
+    posting->ids        = NULL;
+    index->postingCount++;
+  }
+  // A trigram that appears more than once in a filename is listed once
+  if (posting->idCount > 0 && posting->ids[posting->idCount - 1] == id) {
+    return;
+  }
+  if (posting->idCount == posting->idCapacity) {
+    index->bytesUsed -= posting->idCapacity * sizeof(unsigned int);
+    posting->idCapacity = posting->idCapacity == 0 ? 4 : posting->idCapacity * 2;
+    index->bytesUsed += posting->idCapacity * sizeof(unsigned int);
+    posting->ids = realloc(posting->ids, posting->idCapacity * sizeof(unsigned int));
+  }
+  posting->ids[posting->idCount++] = id;
+}
+
+/*
+ * Purpose: Add a filename to the index under every trigram in it
+ * Input:
+ * - The index
+ * - The filename, shorter than MAX_FILENAME
+ * Output: Whether the filename was added. It isn't if it is empty or already there.
+ */
+bool addIndexedFilename(struct TrigramIndex* index, char* filename) {
+  unsigned long length = strlen(filename);
+  if (length == 0 || length >= MAX_FILENAME ||
+      findIndexedFilename(index, filename) != TRIGRAM_NONE) {
+    return false;
+  }
+
+  if (index->filenameCount == index->filenameCapacity) {
+    index->bytesUsed -= index->filenameCapacity * sizeof(struct IndexedFilename);
+    index->filenameCapacity =
+        index->filenameCapacity == 0 ? 64 : index->filenameCapacity * 2;
+    index->bytesUsed += index->filenameCapacity * sizeof(struct IndexedFilename);
+    index->filenames = realloc(index->filenames, index->filenameCapacity *
+                                                     sizeof(struct IndexedFilename));
+  }
+  if (index->liveCount == index->bucketCount) {
+    rehashFilenames(index, index->bucketCount * 2);
+  }
+  unsigned int id = index->filenameCount++;
+  index->liveCount++;
+
+  struct IndexedFilename* indexed = &index->filenames[id];
+  strcpy(indexed->filename, filename);
+  unsigned int bucket    = hashFilename(filename) & (index->bucketCount - 1);
+  indexed->nextInBucket  = index->buckets[bucket];
+  index->buckets[bucket] = id;
+
+  unsigned long i;
+  for (i = 0; i + TRIGRAM_LENGTH <= length; i++) {
+    appendPosting(index, getTrigram(filename + i), id);
+  }
+  return true;
+}
+
+/*
+ * Purpose: Drop removed filenames from the posting lists and give the filenames left
+ * consecutive ids. Ids keep their order, so the lists stay sorted.
+ * Input: The index
+ * Output: None
+ */
+static void compactTrigramIndex(struct TrigramIndex* index) {
+  unsigned int* newIds = malloc(index->filenameCount * sizeof(unsigned int));
+  unsigned int nextId  = 0;
+  unsigned int id;
+  for (id = 0; id < index->filenameCount; id++) {
+    if (index->filenames[id].filename[0] == '\0') {
+      newIds[id] = TRIGRAM_NONE;
+      continue;
+    }
+    newIds[id]                = nextId;
+    index->filenames[nextId++] = index->filenames[id];
+  }
+  index->filenameCount = nextId;
+
+  unsigned int slot;
+  for (slot = 0; slot < index->postingCapacity; slot++) {
+    struct TrigramPosting* posting = &index->postings[slot];
+    if (posting->trigram == TRIGRAM_NONE) {
+      continue;
+    }
+    unsigned int kept = 0;
+    unsigned int i;
+    for (i = 0; i < posting->idCount; i++) {
+      if (newIds[posting->ids[i]] != TRIGRAM_NONE) {
+        posting->ids[kept++] = newIds[posting->ids[i]];
+      }
+    }
+    posting->idCount = kept;
+  }
+  free(newIds);
+  rebuildPostings(index, index->postingCapacity);
+  rehashFilenames(index, index->bucketCount);
+}
+
+/*
+ * Purpose: Take a filename out of the index. It stays in the posting lists, but is no
+ * longer matched, until enough filenames have been removed to compact the index.
+ * Input:
+ * - The index
+ * - The filename
+ * Output: Whether the filename was in the index
+ */
+bool removeIndexedFilename(struct TrigramIndex* index, char* filename) {
+  unsigned int* link =
+      &index->buckets[hashFilename(filename) & (index->bucketCount - 1)];
+  while (*link != TRIGRAM_NONE &&
+         strcmp(index->filenames[*link].filename, filename) != 0) {
+    link = &index->filenames[*link].nextInBucket;
+  }
+  if (*link == TRIGRAM_NONE) {
+    return false;
+  }
+  struct IndexedFilename* indexed = &index->filenames[*link];
+  *link                           = indexed->nextInBucket;
+  indexed->filename[0]            = '\0';
+  index->liveCount--;
+
+  unsigned int removed = index->filenameCount - index->liveCount;
+  if (removed >= TRIGRAM_MIN_COMPACTION && removed > index->liveCount) {
+    compactTrigramIndex(index);
+  }
+  return true;
+}
+
+/*
+ * Purpose: Find the first id in a posting list at or after a position that isn't less
+ * than an id. Gallops ahead, then binary searches the last step.
+ * Input:
+ * - The posting list
+ * - Position to start from
+ * - The id
+ * Output: Position of the id, or of the first larger id, idCount if there is none
+ */
+static unsigned int seekPosting(struct TrigramPosting* posting,
+                                unsigned int start,
+                                unsigned int id) {
+  unsigned int low  = start;
+  unsigned int high = start;
+  unsigned int step = 1;
+  while (high < posting->idCount && posting->ids[high] < id) {
+    low = high + 1;
+    high += step;
+    step *= 2;
+  }
+  if (high > posting->idCount) {
+    high = posting->idCount;
+  }
+  while (low < high) {
+    unsigned int middle = low + (high - low) / 2;
+    if (posting->ids[middle] < id) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+/*
+ * Purpose: Check whether a string contains a substring, ignoring case
+ * Input:
+ * - The string
+ * - The substring
+ * Output: Whether the substring is in the string
+ */
+static bool containsIgnoringCase(const char* string, const char* substring) {
+  for (; *string != '\0'; string++) {
+    unsigned long i = 0;
+    while (substring[i] != '\0' &&
+           tolower((unsigned char)string[i]) == tolower((unsigned char)substring[i])) {
+      i++;
+    }
+    if (substring[i] == '\0') {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Purpose: Find the filenames that contain a substring, ignoring case. The posting
+ * lists of the substring's trigrams are intersected starting from the shortest, so the
+ * work depends on how rare its rarest trigram is rather than on the size of the index.
+ * Filenames with every trigram are then checked for the substring itself.
+ * Input:
+ * - The index
+ * - The substring, at least TRIGRAM_LENGTH characters and shorter than MAX_FILENAME
+ * - Called with each match in the order the filenames were added, returns whether to
+ * keep going
+ * - Passed to it
+ * Output: Whether every match was passed to it
+ */
+bool findSubstringMatches(struct TrigramIndex* index,
+                          char* substring,
+                          bool (*onMatch)(void*, char*),
+                          void* data) {
+  unsigned long length = strlen(substring);
+  if (length < TRIGRAM_LENGTH || length >= MAX_FILENAME) {
+    return true;
+  }
+
+  // Posting lists of the distinct trigrams, shortest first
+  struct TrigramPosting* postings[MAX_FILENAME];
+  unsigned int cursors[MAX_FILENAME];
+  int postingCount = 0;
+  unsigned long i;
+  for (i = 0; i + TRIGRAM_LENGTH <= length; i++) {
+    struct TrigramPosting* posting = findPostingSlot(index, getTrigram(substring + i));
+    if (posting->trigram == TRIGRAM_NONE) {
+      return true;
+    }
+    bool duplicate = false;
+    int j;
+    for (j = 0; j < postingCount; j++) {
+      duplicate |= postings[j] == posting;
+    }
+    if (duplicate) {
+      continue;
+    }
+    j = postingCount++;
+    while (j > 0 && postings[j - 1]->idCount > posting->idCount) {
+      postings[j] = postings[j - 1];
+      j--;
+    }
+    postings[j] = posting;
+  }
+  memset(cursors, 0, sizeof(cursors));
+
+  struct TrigramPosting* shortest = postings[0];
+  unsigned int k;
+  for (k = 0; k < shortest->idCount; k++) {
+    unsigned int id = shortest->ids[k];
+    bool inAll      = true;
+    int j;
+    for (j = 1; j < postingCount && inAll; j++) {
+      cursors[j] = seekPosting(postings[j], cursors[j], id);
+      if (cursors[j] == postings[j]->idCount) {
+        return true;
+      }
+      inAll = postings[j]->ids[cursors[j]] == id;
+    }
+    // Removed filenames are empty and never match
+    char* filename = index->filenames[id].filename;
+    if (!inAll || !containsIgnoringCase(filename, substring)) {
+      continue;
+    }
+    if (!onMatch(data, filename)) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,52 @@
+#ifndef TRIGRAM_H
+#define TRIGRAM_H
+
+// Id that no indexed filename has, and trigram that no posting list has
+#define TRIGRAM_NONE ((unsigned int)-1)
+
+// Removed filenames stay in the posting lists until the index is compacted, once they
+// outnumber the filenames left and there are at least this many of them
+#define TRIGRAM_MIN_COMPACTION 1024
+
+#include <stdbool.h>
+
+#include "../common/network_node.h"
+#include "../common/packet.h"
+
+// A filename in the index, found by its id
+struct IndexedFilename {
+  char filename[MAX_FILENAME]; // Empty once removed
+  unsigned int nextInBucket;   // Next id in the same hash bucket
+};
+
+// Ids of the filenames a trigram appears in, in increasing order
+struct TrigramPosting {
+  unsigned int trigram; // Three lowercased characters, TRIGRAM_NONE for an empty slot
+  unsigned int idCount;
+  unsigned int idCapacity;
+  unsigned int* ids;
+};
+
+// Inverted index from every trigram, three characters in a row, to the filenames it
+// appears in. Letters are indexed without case. Each new filename gets the next id, so
+// posting lists stay sorted by appending to them and can be intersected in one pass.
+struct TrigramIndex {
+  struct IndexedFilename* filenames;
+  unsigned int filenameCount; // Ids given out, removed or not
+  unsigned int filenameCapacity;
+  unsigned int liveCount; // Filenames that haven't been removed
+  unsigned int* buckets; // First id in each bucket, a power of two of them
+  unsigned int bucketCount;
+  struct TrigramPosting* postings; // Open addressing, a power of two slots
+  unsigned int postingCount;
+  unsigned int postingCapacity;
+  unsigned long bytesUsed; // Allocated for all of the above
+};
+
+void initTrigramIndex(struct TrigramIndex*);
+void freeTrigramIndex(struct TrigramIndex*);
+bool addIndexedFilename(struct TrigramIndex*, char*);
+bool removeIndexedFilename(struct TrigramIndex*, char*);
+bool findSubstringMatches(struct TrigramIndex*, char*, bool (*)(void*, char*), void*);
+
+#endif
@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "username.h"
+
+/*
+ * Purpose: Hash a username, FNV-1a
+ * Input: The username
+ * Output: The hash
+ */
+static unsigned int hashUsername(const char* username) {
+  unsigned int hash = 2166136261u;
+  while (*username != '\0') {
+    hash ^= (unsigned char)*username;
+    hash *= 16777619u;
+    username++;
+  }
+  return hash;
+}
+
+/*
+ * Purpose: Double the number of buckets and put every interned username back into them
+ * Input: The username table
+ * Output: None
+ */
+static void growBuckets(struct UsernameTable* table) {
+  table->bytesUsed -= table->bucketCount * sizeof(unsigned int);
+  table->bucketCount = table->bucketCount == 0 ? 64 : table->bucketCount * 2;
+  free(table->buckets);
+  table->buckets = malloc(table->bucketCount * sizeof(unsigned int));
+  table->bytesUsed += table->bucketCount * sizeof(unsigned int);
+  memset(table->buckets, 0xff, table->bucketCount * sizeof(unsigned int));
+
+  unsigned int id;
+  for (id = 0; id < table->usernameCount; id++) {
+    struct InternedUsername* interned = &table->usernames[id];
+    if (interned->references == 0) {
+      continue;
+    }
+    unsigned int bucket =
+        hashUsername(interned->username) & (table->bucketCount - 1);
+    interned->nextInBucket = table->buckets[bucket];
+    table->buckets[bucket] = id;
+  }
+}
+
+/*
+ * Purpose: Set up an empty username table
+ * Input: The username table
+ * Output: None
+ */
+void initUsernameTable(struct UsernameTable* table) {
+  memset(table, 0, sizeof(*table));
+  table->freeUsername = USERNAME_NONE;
+  growBuckets(table);
+}
+
+/*
+ * Purpose: Free everything in a username table
+ * Input: The username table
+ * Output: None
+ */
+void freeUsernameTable(struct UsernameTable* table) {
+  free(table->usernames);
+  free(table->buckets);
+  memset(table, 0, sizeof(*table));
+}
+
+/*
+ * Purpose: Find the id of an interned username without taking a reference to it
+ * Input:
+ * - The username table
+ * - The username
+ * Output: Id of the username, USERNAME_NONE if it isn't interned
+ */
+unsigned int findUsername(struct UsernameTable* table, char* username) {
+  unsigned int id = table->buckets[hashUsername(username) & (table->bucketCount - 1)];
+  while (id != USERNAME_NONE) {
+    if (strcmp(table->usernames[id].username, username) == 0) {
+      return id;
+    }
+    id = table->usernames[id].nextInBucket;
+  }
+  return USERNAME_NONE;
+}
+
+/*
+ * Purpose: Take a reference to a username, interning it if this is the first one
+ * Input:
+ * - The username table
+ * - The username, shorter than MAX_USERNAME
+ * Output: Id of the username
+ */
+unsigned int internUsername(struct UsernameTable* table, char* username) {
+  unsigned int id = findUsername(table, username);
+  if (id != USERNAME_NONE) {
+    table->usernames[id].references++;
+    return id;
+  }
+
+  // Reuse a released slot before adding a new one
+  if (table->freeUsername != USERNAME_NONE) {
+    id                  = table->freeUsername;
+    table->freeUsername = table->usernames[id].nextInBucket;
+  } else {
+    if (table->usernameCount == table->usernameCapacity) {
+      table->bytesUsed -= table->usernameCapacity * sizeof(struct InternedUsername);
+      table->usernameCapacity =
+          table->usernameCapacity == 0 ? 64 : table->usernameCapacity * 2;
+      table->bytesUsed += table->usernameCapacity * sizeof(struct InternedUsername);
+      table->usernames = realloc(table->usernames, table->usernameCapacity *
+                                                       sizeof(struct InternedUsername));
+    }
+    id = table->usernameCount++;
+    if (table->usernameCount > table->bucketCount) {
+      growBuckets(table);
+    }
+  }
+
+  struct InternedUsername* interned = &table->usernames[id];
+  strcpy(interned->username, username);
+  interned->references   = 1;
+  unsigned int bucket    = hashUsername(username) & (table->bucketCount - 1);
+  interned->nextInBucket = table->buckets[bucket];
+  table->buckets[bucket] = id;
+  return id;
+}
+
+/*
+ * Purpose: Drop a reference to a username. The username is forgotten and its id can
+ * be reused once the last reference is dropped.
+ * Input:
+ * - The username table
+ * - Id of the username
+ * Output: None
+ */
+void releaseUsername(struct UsernameTable* table, unsigned int id) {
+  struct InternedUsername* interned = &table->usernames[id];
+  interned->references--;
+  if (interned->references > 0) {
+    return;
+  }
+
+  unsigned int* link =
+      &table->buckets[hashUsername(interned->username) & (table->bucketCount - 1)];
+  while (*link != id) {
+    link = &table->usernames[*link].nextInBucket;
+  }
+  *link                  = interned->nextInBucket;
+  interned->nextInBucket = table->freeUsername;
+  table->freeUsername    = id;
+}
+
+/*
+ * Purpose: Get the username an id refers to
+ * Input:
+ * - The username table
+ * - Id of the username
+ * Output: The username
+ */
+char* getUsername(struct UsernameTable* table, unsigned int id) {
+  return table->usernames[id].username;
+}
+
+/*
+ * Purpose: Get how many references an interned username has
+ * Input:
+ * - The username table
+ * - Id of the username
+ * Output: Number of references, 0 if the id is free
+ */
+unsigned int getUsernameReferences(struct UsernameTable* table, unsigned int id) {
+  return table->usernames[id].references;
+}
@@ -0,0 +1,36 @@
+#ifndef USERNAME_H
+#define USERNAME_H
+
+// Id that no interned username has
+#define USERNAME_NONE ((unsigned int)-1)
+
+#include "../common/network_node.h"
+
+// A username stored once however many resources refer to it
+struct InternedUsername {
+  char username[MAX_USERNAME];
+  unsigned int references;   // 0 when the slot is free
+  unsigned int nextInBucket; // Next id in the same hash bucket, or the next free id
+};
+
+// Usernames shared by the resource directory. Each one is referred to by a small id,
+// its index in usernames, that stays the same for as long as it has references.
+struct UsernameTable {
+  struct InternedUsername* usernames;
+  unsigned int usernameCount; // Slots used, free or not
+  unsigned int usernameCapacity;
+  unsigned int* buckets; // First id in each bucket, a power of two of them
+  unsigned int bucketCount;
+  unsigned int freeUsername; // First free slot
+  unsigned long bytesUsed;   // Allocated for the usernames and buckets
+};
+
+void initUsernameTable(struct UsernameTable*);
+void freeUsernameTable(struct UsernameTable*);
+unsigned int internUsername(struct UsernameTable*, char*);
+unsigned int findUsername(struct UsernameTable*, char*);
+void releaseUsername(struct UsernameTable*, unsigned int);
+char* getUsername(struct UsernameTable*, unsigned int);
+unsigned int getUsernameReferences(struct UsernameTable*, unsigned int);
+
+#endif
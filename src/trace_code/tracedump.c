@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/packet.h"
+#include "tracedump.h"
+
+// Main function
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    printf("Usage: %s <trace file>\n", argv[0]);
+    exit(1);
+  }
+
+  FILE* traceFile = fopen(argv[1], "rb");
+  if (traceFile == NULL) {
+    perror("Error opening trace file");
+    exit(1);
+  }
+
+  struct DecodedEvent* events = NULL;
+  unsigned long eventCount    = 0;
+  if (readTraceFile(traceFile, &events, &eventCount) == -1) {
+    fclose(traceFile);
+    exit(1);
+  }
+  fclose(traceFile);
+
+  // Rings are per thread, put every thread's events in one timeline
+  qsort(events, eventCount, sizeof(struct DecodedEvent), compareEvents);
+
+  printf("%14s %8s %-24s %s\n", "time_us", "thread", "event", "arguments");
+  unsigned long i;
+  for (i = 0; i < eventCount; i++) {
+    printEvent(&events[i], events[0].event.timestamp);
+  }
+  free(events);
+  return 0;
+}
+
+/*
+ * Purpose: Read every event out of a trace file written by dumpTrace()
+ * Input:
+ * - The open trace file
+ * - Where to put the events read, allocated here
+ * - Where to put the number of events read
+ * Output:
+ * - -1: Error
+ * - 0: Success
+ */
+int readTraceFile(FILE* traceFile,
+                  struct DecodedEvent** events,
+                  unsigned long* eventCount) {
+  struct TraceFileHeader header;
+  if (fread(&header, sizeof(header), 1, traceFile) != 1) {
+    printf("Trace file too short\n");
+    return -1;
+  }
+  if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != TRACE_VERSION || header.ringSize != TRACE_RING_SIZE) {
+    printf("Not a trace file, or written by a different version\n");
+    return -1;
+  }
+
+  *events = calloc((unsigned long)header.ringCount * TRACE_RING_SIZE + 1,
+                   sizeof(struct DecodedEvent));
+  *eventCount            = 0;
+  struct TraceRing* ring = malloc(sizeof(struct TraceRing));
+  unsigned int ringIndex;
+  for (ringIndex = 0; ringIndex < header.ringCount; ringIndex++) {
+    if (fread(ring, sizeof(*ring), 1, traceFile) != 1) {
+      printf("Trace file truncated in ring %u\n", ringIndex);
+      break;
+    }
+
+    // Once a ring wraps only the newest TRACE_RING_SIZE events are left
+    unsigned long head  = atomic_load(&ring->head);
+    unsigned long first = 0;
+    if (head > TRACE_RING_SIZE) {
+      first = head - TRACE_RING_SIZE;
+    }
+    unsigned long position;
+    for (position = first; position < head; position++) {
+      struct DecodedEvent* decoded = &(*events)[*eventCount];
+      decoded->event               = ring->events[position & (TRACE_RING_SIZE - 1)];
+      decoded->threadId            = ring->threadId;
+      (*eventCount)++;
+    }
+  }
+  free(ring);
+  return 0;
+}
+
+/*
+ * Purpose: Order events by when they happened, for qsort()
+ * Input: The two events
+ * Output: Negative, zero or positive as the first event is earlier, the same or later
+ */
+int compareEvents(const void* first, const void* second) {
+  const struct DecodedEvent* firstEvent  = first;
+  const struct DecodedEvent* secondEvent = second;
+  if (firstEvent->event.timestamp < secondEvent->event.timestamp) {
+    return -1;
+  }
+  return firstEvent->event.timestamp > secondEvent->event.timestamp;
+}
+
+/*
+ * Purpose: Print out an event with its arguments decoded
+ * Input:
+ * - The event
+ * - Timestamp of the first event, times are printed relative to it
+ * Output: None
+ */
+void printEvent(struct DecodedEvent* decoded, unsigned long startTime) {
+  struct TraceEvent* event = &decoded->event;
+  printf("%14.3f %8lu %-24s ", (double)(event->timestamp - startTime) / 1000.0,
+         decoded->threadId, getTraceEventName(event->event));
+
+  // Addresses were packed with TRACE_ADDRESS()
+  unsigned long address = event->arg1 >> 16;
+  unsigned long port    = event->arg1 & 0xffff;
+
+  switch (event->event) {
+  case TRACE_PACKET_RECEIVED:
+  case TRACE_PACKET_SENT:
+    printf("%lu bytes %lu.%lu.%lu.%lu:%lu\n", event->arg0, (address >> 24) & 0xff,
+           (address >> 16) & 0xff, (address >> 8) & 0xff, address & 0xff, port);
+    break;
+
+  case TRACE_CLIENT_CONNECTED:
+  case TRACE_CLIENT_EXPIRED:
+    printf("client %lu %lu.%lu.%lu.%lu:%lu\n", event->arg0, (address >> 24) & 0xff,
+           (address >> 16) & 0xff, (address >> 8) & 0xff, address & 0xff, port);
+    break;
+
+  case TRACE_PACKET_HANDLED:
+    printf("%s in %lu ns\n", getPacketTypeName((int)event->arg0), event->arg1);
+    break;
+
+  case TRACE_PACKET_RATE_LIMITED:
+  case TRACE_PACKET_DROPPED:
+    printf("%s from %lu.%lu.%lu.%lu:%lu\n", getPacketTypeName((int)event->arg0),
+           (address >> 24) & 0xff, (address >> 16) & 0xff, (address >> 8) & 0xff,
+           address & 0xff, port);
+    break;
+
+  case TRACE_SEND_FAILED:
+    printf("%s to %lu.%lu.%lu.%lu:%lu\n", strerror((int)event->arg0),
+           (address >> 24) & 0xff, (address >> 16) & 0xff, (address >> 8) & 0xff,
+           address & 0xff, port);
+    break;
+
+  default:
+    printf("%lu %lu\n", event->arg0, event->arg1);
+  }
+}
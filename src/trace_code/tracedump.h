@@ -0,0 +1,19 @@
+#ifndef TRACEDUMP_H
+#define TRACEDUMP_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "../common/trace.h"
+
+// An event along with the thread that recorded it, for merging the rings
+struct DecodedEvent {
+  struct TraceEvent event;
+  unsigned long threadId;
+};
+
+int readTraceFile(FILE*, struct DecodedEvent**, unsigned long*);
+int compareEvents(const void*, const void*);
+void printEvent(struct DecodedEvent*, unsigned long);
+
+#endif